@@ -268,6 +268,7 @@ static const char * details_keys[] = {
     "totalSize",
     "uploadedEver",
     "pieces",
+    "wastedEver",
     "webseeds",
     "webseedsSendingToUs"
 };
@@ -910,6 +911,11 @@ printDetails( tr_benc * top )
                 strlsize( buf, i, sizeof( buf ) );
                 printf( "  Corrupt DL: %s\n", buf );
             }
+            if( tr_bencDictFindInt( t, "wastedEver", &i ) )
+            {
+                strlsize( buf, i, sizeof( buf ) );
+                printf( "  Wasted DL: %s\n", buf );
+            }
             if( tr_bencDictFindStr( t, "errorString", &str ) && str && *str )
                 printf( "  Error: %s\n", str );
 
@@ -1221,12 +1227,48 @@ printTorrentList( tr_benc * top )
 }
 
 static void
+printResponse( const char * host,
+               int          port,
+               tr_benc    * top )
+{
+    int64_t      tag = -1;
+    const char * str;
+    tr_bencDictFindInt( top, "tag", &tag );
+
+    switch( tag )
+    {
+        case TAG_SESSION:
+            printSession( top ); break;
+
+        case TAG_FILES:
+            printFileList( top ); break;
+
+        case TAG_DETAILS:
+            printDetails( top ); break;
+
+        case TAG_LIST:
+            printTorrentList( top ); break;
+
+        case TAG_PEERS:
+            printPeers( top ); break;
+
+        default:
+            if( tr_bencDictFindStr( top, "result", &str ) )
+                printf( "%s:%d responded: \"%s\"\n", host, port, str );
+    }
+}
+
+/* @return FALSE if this was the answer to a batch from a server
+ *         too old to understand batches */
+static tr_bool
 processResponse( const char * host,
                  int          port,
                  const void * response,
-                 size_t       len )
+                 size_t       len,
+                 tr_bool      wasBatch )
 {
     tr_benc top;
+    tr_bool ok = TRUE;
 
     if( debug )
         fprintf( stderr, "got response:\n--------\n%*.*s\n--------\n",
@@ -1237,34 +1279,45 @@ processResponse( const char * host,
                  (int)len, (char*)response );
     else
     {
-        int64_t      tag = -1;
-        const char * str;
-        tr_bencDictFindInt( &top, "tag", &tag );
-
-        switch( tag )
+        if( tr_bencIsList( &top ) )
         {
-            case TAG_SESSION:
-                printSession( &top ); break;
-
-            case TAG_FILES:
-                printFileList( &top ); break;
+            size_t i;
+            for( i = 0; i < tr_bencListSize( &top ); ++i )
+                printResponse( host, port, tr_bencListChild( &top, i ) );
+        }
+        else if( wasBatch )
+        {
+            ok = FALSE;
+        }
+        else
+        {
+            printResponse( host, port, &top );
+        }
 
-            case TAG_DETAILS:
-                printDetails( &top ); break;
+        tr_bencFree( &top );
+    }
 
-            case TAG_LIST:
-                printTorrentList( &top ); break;
+    return ok;
+}
 
-            case TAG_PEERS:
-                printPeers( &top ); break;
+static tr_bool
+postRequest( CURL             * curl,
+             const char       * host,
+             int                port,
+             const char       * req,
+             struct evbuffer  * buf )
+{
+    CURLcode res;
 
-            default:
-                if( tr_bencDictFindStr( &top, "result", &str ) )
-                    printf( "%s:%d responded: \"%s\"\n", host, port, str );
-        }
+    evbuffer_drain( buf, EVBUFFER_LENGTH( buf ) );
+    curl_easy_setopt( curl, CURLOPT_POSTFIELDS, req );
+    if( debug )
+        fprintf( stderr, "posting:\n--------\n%s\n--------\n", req );
+    if( ( res = curl_easy_perform( curl ) ) )
+        tr_nerr( MY_NAME, "(%s:%d) %s", host, port,
+                curl_easy_strerror( res ) );
 
-        tr_bencFree( &top );
-    }
+    return res == CURLE_OK;
 }
 
 static void
@@ -1274,6 +1327,7 @@ processRequests( const char *  host,
                  int           reqCount )
 {
     int               i;
+    tr_bool           isDone = FALSE;
     CURL *            curl;
     struct evbuffer * buf = evbuffer_new( );
     char *            url = tr_strdup_printf(
@@ -1297,22 +1351,35 @@ processRequests( const char *  host,
     if( auth )
         curl_easy_setopt( curl, CURLOPT_USERPWD, auth );
 
-    for( i = 0; i < reqCount; ++i )
+    /* send all the requests in one batch if there's more than one.
+     * a server too old for batches won't have run any of them,
+     * so fall back to sending them one at a time */
+    if( reqCount > 1 )
     {
-        CURLcode res;
-        curl_easy_setopt( curl, CURLOPT_POSTFIELDS, reqs[i] );
-        if( debug )
-            fprintf( stderr, "posting:\n--------\n%s\n--------\n", reqs[i] );
-        if( ( res = curl_easy_perform( curl ) ) )
-            tr_nerr( MY_NAME, "(%s:%d) %s", host, port,
-                    curl_easy_strerror( res ) );
+        char * batch;
+        struct evbuffer * tmp = evbuffer_new( );
+
+        for( i = 0; i < reqCount; ++i )
+            evbuffer_add_printf( tmp, "%c%s", ( i ? ',' : '[' ), reqs[i] );
+        evbuffer_add_printf( tmp, "]" );
+        batch = tr_strndup( EVBUFFER_DATA( tmp ), EVBUFFER_LENGTH( tmp ) );
+        evbuffer_free( tmp );
+
+        if( !postRequest( curl, host, port, batch, buf ) )
+            isDone = TRUE;
         else
-            processResponse( host, port, EVBUFFER_DATA(
-                                buf ), EVBUFFER_LENGTH( buf ) );
+            isDone = processResponse( host, port, EVBUFFER_DATA( buf ),
+                                      EVBUFFER_LENGTH( buf ), TRUE );
 
-        evbuffer_drain( buf, EVBUFFER_LENGTH( buf ) );
+        tr_free( batch );
     }
 
+    /* curl keeps the connection open between these */
+    for( i = 0; !isDone && i < reqCount; ++i )
+        if( postRequest( curl, host, port, reqs[i], buf ) )
+            processResponse( host, port, EVBUFFER_DATA( buf ),
+                             EVBUFFER_LENGTH( buf ), FALSE );
+
     /* cleanup */
     tr_free( url );
     evbuffer_free( buf );
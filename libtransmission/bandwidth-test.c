@@ -0,0 +1,282 @@
+#include <assert.h>
+#include <stdio.h> /* fprintf */
+#include <string.h> /* memset */
+
+#include <sys/types.h>
+#include <sys/socket.h> /* socketpair */
+#include <sys/time.h> /* gettimeofday */
+#include <unistd.h> /* dup2 */
+
+#include <event.h>
+
+#include "transmission.h"
+#include "bandwidth.h"
+#include "bencode.h"
+#include "fdlimit.h"
+#include "peer-io.h"
+#include "trevent.h"
+#include "utils.h"
+
+#undef VERBOSE
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+ #define VERBOSE
+ #define BUSY_COUNT 200
+ #define IDLE_COUNT 800
+ #define PULSE_COUNT 50
+#else
+ #define BUSY_COUNT 40
+ #define IDLE_COUNT 160
+ #define PULSE_COUNT 20
+#endif
+
+#define PEER_COUNT ( BUSY_COUNT + IDLE_COUNT )
+#define PULSE_MSEC 100
+#define SPEED_LIMIT 1024 /* KiB/s shared by the busy peers */
+#define BLOCK_SIZE ( 16 * 1024 )
+#define SLOW_READ_SIZE 256
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+struct test_peer
+{
+    tr_peerIo  * io;
+    int          fd;      /* our end of the socketpair */
+    tr_bool      isSlow;  /* a small send buffer and a slow reader */
+    uint64_t     received;
+};
+
+static tr_session * session = NULL;
+static tr_bandwidth * top = NULL;
+static tr_bandwidth * limited = NULL;
+static struct test_peer peers[PEER_COUNT];
+static uint8_t block[BLOCK_SIZE];
+
+static volatile int state = 0;
+static int pulseCount = 0;
+static uint64_t allocateUsec = 0;
+
+static uint64_t
+usecNow( void )
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+
+static int
+pulse( void * unused UNUSED )
+{
+    int i;
+    uint64_t start;
+    const uint64_t now = tr_date( );
+
+    /* keep the busy peers' queues topped up, the way peer-msgs does */
+    for( i=0; i<BUSY_COUNT; ++i )
+        while( tr_peerIoGetWriteBufferSpace( peers[i].io, now ) >= BLOCK_SIZE )
+            tr_peerIoWrite( peers[i].io, block, BLOCK_SIZE, TRUE );
+
+    start = usecNow( );
+    tr_bandwidthAllocate( top, TR_UP, PULSE_MSEC );
+    allocateUsec += usecNow( ) - start;
+
+    if( ++pulseCount < PULSE_COUNT )
+        return TRUE;
+
+    state = 2;
+    return FALSE;
+}
+
+static void
+setup( void * unused UNUSED )
+{
+    int i;
+    tr_address addr;
+
+    tr_pton( "127.0.0.1", &addr );
+
+    top = tr_bandwidthNew( session, NULL );
+    limited = tr_bandwidthNew( session, top );
+    tr_bandwidthSetLimited( limited, TR_UP, TRUE );
+    tr_bandwidthSetDesiredSpeed( limited, TR_UP, SPEED_LIMIT );
+
+    for( i=0; i<PEER_COUNT; ++i )
+    {
+        int fds[2];
+        int s;
+        struct test_peer * p = &peers[i];
+
+        /* swap the socketpair into a socket from fdlimit,
+         * so that the peer-io's tr_netClose() balances out */
+        socketpair( AF_UNIX, SOCK_STREAM, 0, fds );
+        s = tr_fdSocketCreate( AF_INET, SOCK_STREAM );
+        dup2( fds[0], s );
+        close( fds[0] );
+        evutil_make_socket_nonblocking( s );
+        evutil_make_socket_nonblocking( fds[1] );
+
+        p->isSlow = ( i < BUSY_COUNT ) && !( i % 4 );
+        if( p->isSlow ) {
+            const int sndbuf = 4096;
+            setsockopt( s, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof( sndbuf ) );
+        }
+
+        p->fd = fds[1];
+        p->io = tr_peerIoNewIncoming( session, i < BUSY_COUNT ? limited : top, &addr, htons( 6881 ), s );
+        p->io->hasFinishedConnecting = TRUE;
+        tr_peerIoSetEncryption( p->io, PEER_ENCRYPTION_NONE );
+    }
+
+    tr_timerNew( session, pulse, NULL, PULSE_MSEC );
+    state = 1;
+}
+
+static void
+teardown( void * unused UNUSED )
+{
+    int i;
+
+    for( i=0; i<PEER_COUNT; ++i ) {
+        tr_peerIoUnref( peers[i].io );
+        close( peers[i].fd );
+    }
+
+    tr_bandwidthFree( limited );
+    tr_bandwidthFree( top );
+    state = 3;
+}
+
+static void
+readAll( void )
+{
+    int i;
+
+    for( i=0; i<PEER_COUNT; ++i )
+    {
+        uint8_t buf[64 * 1024];
+        struct test_peer * p = &peers[i];
+        const ssize_t n = read( p->fd, buf, p->isSlow ? SLOW_READ_SIZE : sizeof( buf ) );
+
+        if( n > 0 )
+            p->received += n;
+    }
+}
+
+static int
+testFairness( void )
+{
+    int i;
+    int fastCount = 0;
+    double fastSum = 0;
+    double fastSquares = 0;
+    uint64_t total = 0;
+    uint64_t slowTotal = 0;
+    double fairness;
+    const double budget = (double)SPEED_LIMIT * 1024 * PULSE_MSEC * PULSE_COUNT / 1000.0;
+
+    tr_runInEventThread( session, setup, NULL );
+    while( state < 1 )
+        tr_wait( 1 );
+    while( state < 2 ) {
+        readAll( );
+        tr_wait( 1 );
+    }
+    readAll( );
+
+    /* the idle peers haven't sent anything, and aren't polled */
+    for( i=BUSY_COUNT; i<PEER_COUNT; ++i ) {
+        check( peers[i].received == 0 );
+        check( !( peers[i].io->pendingEvents & EV_WRITE ) );
+    }
+
+    for( i=0; i<BUSY_COUNT; ++i )
+    {
+        const double x = peers[i].received;
+
+        total += peers[i].received;
+
+        if( peers[i].isSlow )
+            slowTotal += peers[i].received;
+        else {
+            ++fastCount;
+            fastSum += x;
+            fastSquares += x * x;
+        }
+    }
+
+    /* Jain's fairness index for the peers that could keep up */
+    fairness = ( fastSum * fastSum ) / ( fastCount * fastSquares );
+
+    fprintf( stderr, "%d busy peers, %d of them slow, %d idle peers\n",
+             BUSY_COUNT, BUSY_COUNT - fastCount, IDLE_COUNT );
+    fprintf( stderr, "sent %.1f KiB of a %.1f KiB budget; slow peers got %.1f KiB\n",
+             total / 1024.0, budget / 1024.0, slowTotal / 1024.0 );
+    fprintf( stderr, "fairness %.3f; %.1f usec per tr_bandwidthAllocate()\n",
+             fairness, (double)allocateUsec / PULSE_COUNT );
+
+    /* close to the limit, but not over it */
+    check( total <= budget );
+    check( total >= budget / 2 );
+    check( fairness > 0.9 );
+
+    /* the fast peers picked up the bandwidth the slow ones couldn't use */
+    check( slowTotal / (double)( BUSY_COUNT - fastCount ) < fastSum / fastCount );
+
+    tr_runInEventThread( session, teardown, NULL );
+    while( state < 3 )
+        tr_wait( 10 );
+
+    return 0;
+}
+
+int
+main( void )
+{
+    int          i;
+    char         dir[] = "/tmp/transmission-bandwidth-test-XXXXXX";
+    tr_benc      settings;
+
+    if( mkdtemp( dir ) == NULL )
+        return 1;
+
+    memset( block, 'x', sizeof( block ) );
+
+    tr_bencInitDict( &settings, 0 );
+    tr_sessionGetDefaultSettings( &settings );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PEER_LIMIT_GLOBAL, PEER_COUNT * 2 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PEER_PORT_RANDOM_ENABLED, 1 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PORT_FORWARDING, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_RPC_ENABLED, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_MSGLEVEL, 0 );
+    session = tr_sessionInit( "bandwidth-test", dir, FALSE, &settings );
+
+    i = testFairness( );
+
+    tr_sessionClose( session );
+    tr_bencFree( &settings );
+    rmdir( dir );
+    return i;
+}
@@ -12,6 +12,7 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <stdint.h> /* SIZE_MAX */
 
 #include "event.h"
 
@@ -80,6 +81,50 @@ comparePointers( const void * a, const void * b )
     return 0;
 }
 
+static tr_bandwidth*
+getRoot( tr_bandwidth * b )
+{
+    while( b->parent != NULL )
+        b = b->parent;
+
+    return b;
+}
+
+static tr_bool
+isInSubtree( const tr_bandwidth * b, const tr_bandwidth * top )
+{
+    for( ; b!=NULL; b=b->parent )
+        if( b == top )
+            return TRUE;
+
+    return FALSE;
+}
+
+static tr_bool
+isPeerLinked( const tr_bandwidth * b )
+{
+    return b->peerLink.next != NULL;
+}
+
+/* (re)file b's peer, and those in its subtree, in root's list */
+static void
+linkPeers( tr_bandwidth * b, tr_bandwidth * root )
+{
+    int i;
+    tr_bandwidth ** children = (tr_bandwidth**) tr_ptrArrayBase( &b->children );
+    const int n = tr_ptrArraySize( &b->children );
+
+    if( b->peer != NULL )
+    {
+        if( isPeerLinked( b ) )
+            __tr_list_remove( &b->peerLink );
+        __tr_list_append( &root->peers, &b->peerLink );
+    }
+
+    for( i=0; i<n; ++i )
+        linkPeers( children[i], root );
+}
+
 /***
 ****
 ***/
@@ -89,6 +134,9 @@ tr_bandwidthConstruct( tr_bandwidth * b, tr_session * session, tr_bandwidth * pa
 {
     b->session = session;
     b->children = TR_PTR_ARRAY_INIT;
+    b->peer = NULL;
+    __tr_list_init( &b->peers );
+    b->peerLink.next = b->peerLink.prev = NULL;
     b->magicNumber = MAGIC_NUMBER;
     b->band[TR_UP].honorParentLimits = TRUE;
     b->band[TR_DOWN].honorParentLimits = TRUE;
@@ -101,9 +149,14 @@ tr_bandwidthDestruct( tr_bandwidth * b )
 {
     assert( tr_isBandwidth( b ) );
 
+    tr_bandwidthSetPeer( b, NULL );
     tr_bandwidthSetParent( b, NULL );
     tr_ptrArrayDestruct( &b->children, NULL );
 
+    /* don't leave anyone pointing at our list */
+    while( b->peers.next != &b->peers )
+        __tr_list_remove( b->peers.next );
+
     memset( b, ~0, sizeof( tr_bandwidth ) );
     return b;
 }
@@ -135,6 +188,8 @@ tr_bandwidthSetParent( tr_bandwidth  * b,
         tr_ptrArrayInsertSorted( &parent->children, b, comparePointers );
         b->parent = parent;
     }
+
+    linkPeers( b, getRoot( b ) );
 }
 
 /***
@@ -149,8 +204,7 @@ tr_bandwidthSetParent( tr_bandwidth  * b,
 static void
 allocateBandwidth( tr_bandwidth  * b,
                    tr_direction    dir,
-                   int             period_msec,
-                   tr_ptrArray   * peer_pool )
+                   int             period_msec )
 {
     assert( tr_isBandwidth( b ) );
     assert( tr_isDirection( dir ) );
@@ -170,65 +224,117 @@ allocateBandwidth( tr_bandwidth  * b,
 #endif
     }
 
-    /* add this bandwidth's peer, if any, to the peer pool */
-    if( b->peer != NULL )
-        tr_ptrArrayAppend( peer_pool, b->peer );
-
-#ifdef DEBUG_DIRECTION
-if( ( dir == DEBUG_DIRECTION ) && ( n > 1 ) )
-fprintf( stderr, "bandwidth %p has %d peers\n", b, n );
-#endif
-
     /* traverse & repeat for the subtree */
     if( 1 ) {
         int i;
         struct tr_bandwidth ** children = (struct tr_bandwidth**) tr_ptrArrayBase( &b->children );
         const int n = tr_ptrArraySize( &b->children );
         for( i=0; i<n; ++i )
-            allocateBandwidth( children[i], dir, period_msec, peer_pool );
+            allocateBandwidth( children[i], dir, period_msec );
     }
 }
 
+enum
+{
+    /* the smallest and largest bites a peer-io takes in each round */
+    MIN_QUANTUM = 1024,
+    MAX_QUANTUM = 64 * 1024
+};
+
+struct busy_peer
+{
+    struct tr_peerIo * io;
+    size_t quantum;
+};
+
+/* how much a peer-io should ask for in each round: about what it moved
+ * over the last period, and no more than its socket can take right now */
+static size_t
+getQuantum( tr_bandwidth * b, tr_direction dir, int period_msec, uint64_t now )
+{
+    const double bytesPerPeriod = tr_bandwidthGetRawSpeed( b, now, dir ) * period_msec * 1024.0 / 1000.0;
+    size_t quantum = bytesPerPeriod < MAX_QUANTUM ? (size_t)bytesPerPeriod : MAX_QUANTUM;
+
+    quantum = MAX( quantum, MIN_QUANTUM );
+
+    if( dir == TR_UP )
+    {
+        const size_t space = tr_peerIoGetSendBufferSpace( b->peer );
+        quantum = MIN( quantum, space );
+    }
+
+    return quantum;
+}
+
 void
 tr_bandwidthAllocate( tr_bandwidth  * b,
                       tr_direction    dir,
                       int             period_msec )
 {
-    int i, n, peerCount;
-    tr_ptrArray tmp = TR_PTR_ARRAY_INIT;
-    struct tr_peerIo ** peers;
+    int i, n;
+    int peerCount = 0;
+    int peerAlloc = 0;
+    struct busy_peer * peers = NULL;
+    struct __tr_list * walk;
+    tr_bandwidth * root;
+    const uint64_t now = tr_date( );
 
-    /* allocateBandwidth() is a helper function with two purposes:
-     * 1. allocate bandwidth to b and its subtree
-     * 2. accumulate an array of all the peerIos from b and its subtree. */
-    allocateBandwidth( b, dir, period_msec, &tmp );
-    peers = (struct tr_peerIo**) tr_ptrArrayBase( &tmp );
-    peerCount = tr_ptrArraySize( &tmp );
+    assert( tr_isBandwidth( b ) );
+    assert( tr_isDirection( dir ) );
 
-    for( i=0; i<peerCount; ++i )
-        tr_peerIoRef( peers[i] );
+    allocateBandwidth( b, dir, period_msec );
+
+    /* Find the peer-ios that are waiting on a speed limit.  Unlimited
+     * peers don't need to share, so they're left to on-demand IO below. */
+    root = getRoot( b );
+    for( walk=root->peers.next; walk!=&root->peers; walk=walk->next )
+    {
+        tr_bandwidth * pb = __tr_list_entry( walk, tr_bandwidth, peerLink );
+        const size_t bytesLeft = tr_bandwidthClamp( pb, dir, SIZE_MAX );
+
+        if( ( bytesLeft > 0 ) && ( bytesLeft != SIZE_MAX )
+            && isInSubtree( pb, b )
+            && tr_peerIoWantsBandwidth( pb->peer, dir ) )
+        {
+            const size_t quantum = getQuantum( pb, dir, period_msec, now );
+
+            if( quantum > 0 )
+            {
+                if( peerCount == peerAlloc ) {
+                    peerAlloc = peerAlloc ? peerAlloc * 2 : 16;
+                    peers = tr_renew( struct busy_peer, peers, peerAlloc );
+                }
+                peers[peerCount].io = pb->peer;
+                peers[peerCount].quantum = quantum;
+                tr_peerIoRef( pb->peer );
+                ++peerCount;
+            }
+        }
+    }
 
     /* First phase of IO.  Tries to distribute bandwidth fairly to keep faster
      * peers from starving the others.  Loop through the peers, giving each a
-     * small chunk of bandwidth.  Keep looping until we run out of bandwidth
-     * and/or peers that can use it */
+     * bite of bandwidth no bigger than its fair share.  Keep looping until we
+     * run out of bandwidth and/or peers that can use it */
     n = peerCount;
     dbgmsg( "%d peers to go round-robin for %s", n, (dir==TR_UP?"upload":"download") );
     i = n ? tr_cryptoWeakRandInt( n ) : 0; /* pick a random starting point */
-    while( n > 1 )
+    while( n > 0 )
     {
-        const size_t increment = 1024;
-        const int bytesUsed = tr_peerIoFlush( peers[i], dir, increment );
+        struct busy_peer * p = &peers[i];
+        const size_t share = tr_bandwidthClamp( &p->io->bandwidth, dir, SIZE_MAX ) / n;
+        const size_t quantum = MIN( p->quantum, MAX( share, MIN_QUANTUM ) );
+        const int bytesUsed = tr_peerIoFlush( p->io, dir, quantum );
 
         dbgmsg( "peer #%d of %d used %d bytes in this pass", i, n, bytesUsed );
 
-        if( bytesUsed == (int)increment )
+        if( bytesUsed == (int)quantum )
             ++i;
         else {
-            /* peer is done writing for now; move it to the end of the list */
-            tr_peerIo * pio = peers[i];
-            peers[i] = peers[n-1];
-            peers[n-1] = pio;
+            /* peer is done for now; move it to the end of the list */
+            struct busy_peer tmp = *p;
+            *p = peers[n-1];
+            peers[n-1] = tmp;
             --n;
         }
 
@@ -240,14 +346,19 @@ tr_bandwidthAllocate( tr_bandwidth  * b,
      * enable on-demand IO for peers with bandwidth left to burn.
      * This on-demand IO is enabled until (1) the peer runs out of bandwidth,
      * or (2) the next tr_bandwidthAllocate() call, when we start over again. */
-    for( i=0; i<peerCount; ++i )
-        tr_peerIoSetEnabled( peers[i], dir, tr_peerIoHasBandwidthLeft( peers[i], dir ) );
+    for( walk=root->peers.next; walk!=&root->peers; walk=walk->next )
+    {
+        tr_bandwidth * pb = __tr_list_entry( walk, tr_bandwidth, peerLink );
+
+        if( isInSubtree( pb, b ) )
+            tr_peerIoSetEnabled( pb->peer, dir, tr_peerIoHasBandwidthLeft( pb->peer, dir ) );
+    }
 
     for( i=0; i<peerCount; ++i )
-        tr_peerIoUnref( peers[i] );
+        tr_peerIoUnref( peers[i].io );
 
     /* cleanup */
-    tr_ptrArrayDestruct( &tmp, NULL );
+    tr_free( peers );
 }
 
 void
@@ -256,7 +367,13 @@ tr_bandwidthSetPeer( tr_bandwidth * b, tr_peerIo * peer )
     assert( tr_isBandwidth( b ) );
     assert( ( peer == NULL ) || tr_isPeerIo( peer ) );
 
+    if( isPeerLinked( b ) )
+        __tr_list_remove( &b->peerLink );
+
     b->peer = peer;
+
+    if( peer != NULL )
+        __tr_list_append( &getRoot( b )->peers, &b->peerLink );
 }
 
 /***
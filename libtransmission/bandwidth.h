@@ -18,6 +18,7 @@
 #define TR_BANDWIDTH_H
 
 #include "transmission.h"
+#include "list.h" /* __tr_list */
 #include "ptrarray.h"
 #include "utils.h" /* tr_new(), tr_free() */
 
@@ -85,6 +86,11 @@ struct tr_band
  *   speed and will decide how many bytes to make available over the
  *   user-specified period to reach the user-specified desired speed.
  *   If appropriate, it notifies its peer-ios that new bandwidth is available.
+ *
+ *   Peer-ios that are waiting on a speed limit are given their share in
+ *   round-robin, each taking a bite sized to its recent speed and to the
+ *   room in its socket's send buffer.  Everyone else does I/O on demand
+ *   when libevent says the socket is ready, so idle peers cost nothing.
  * 
  *   tr_bandwidthAllocate() operates on the tr_bandwidth subtree, so usually 
  *   you'll only need to invoke it for the top-level tr_session bandwidth.
@@ -104,6 +110,11 @@ typedef struct tr_bandwidth
     tr_session * session;
     tr_ptrArray children; /* struct tr_bandwidth */
     struct tr_peerIo * peer;
+
+    /* the root of each tree keeps a list of the tree's bandwidths that
+     * have a peer, so tr_bandwidthAllocate() needn't rebuild it each time */
+    struct __tr_list peers;     /* roots only; struct tr_bandwidth's peerLink */
+    struct __tr_list peerLink;  /* our node in the root's `peers' list */
 }
 tr_bandwidth;
 
@@ -11,6 +11,18 @@
 #include "utils.h" /* tr_free */
 
 #undef VERBOSE
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+ #define VERBOSE
+ #define TORRENT_FILE_COUNT 1000000
+ #define RESUME_PIECE_COUNT 500000
+ #define LOOKUP_KEY_COUNT 100000
+#else
+ #define TORRENT_FILE_COUNT 100000
+ #define RESUME_PIECE_COUNT 50000
+ #define LOOKUP_KEY_COUNT 10000
+#endif
 
 static int test = 0;
 
@@ -452,6 +464,353 @@ testStackSmash( int depth )
     return 0;
 }
 
+static int
+testArena( void )
+{
+    int             len;
+    char *          saved;
+    tr_benc         top;
+    tr_benc *       info;
+    tr_benc *       list;
+    tr_benc_arena * arena;
+    const char *    str;
+    int64_t         i;
+    char            buf[128];
+    const char *    in = "d4:infod6:lengthi3e4:name3:fooe3:keyl1:a1:bee";
+
+    /* the tree's the same as tr_bencLoad()'s */
+    check( !tr_bencLoadArena( in, strlen( in ), &top, &arena ) );
+    check( arena != NULL );
+    check( tr_bencDictFindDict( &top, "info", &info ) );
+    check( tr_bencDictFindInt( info, "length", &i ) );
+    check( i == 3 );
+    check( tr_bencDictFindStr( info, "name", &str ) );
+    check( !strcmp( str, "foo" ) );
+    saved = tr_bencSave( &top, &len );
+    check( !strcmp( saved, in ) );
+    tr_free( saved );
+
+    /* and it can be changed, even where it's in the arena */
+    tr_bencDictAddStr( info, "name", "quux" );
+    check( tr_bencDictFindList( &top, "key", &list ) );
+    tr_bencListAddInt( list, 7 );
+    check( tr_bencDictRemove( info, "length" ) );
+    tr_bencDictAddInt( &top, "added", 1 );
+    saved = tr_bencSave( &top, &len );
+    check( !strcmp( saved, "d5:addedi1e4:infod4:name4:quuxe3:keyl1:a1:bi7eee" ) );
+    tr_free( saved );
+    tr_bencFree( &top );
+    tr_bencArenaFree( arena );
+
+    /* in place, the strings are left in the buffer */
+    tr_strlcpy( buf, in, sizeof( buf ) );
+    check( !tr_bencLoadInPlace( buf, strlen( buf ), &top, &arena ) );
+    check( tr_bencDictFindDict( &top, "info", &info ) );
+    check( tr_bencDictFindStr( info, "name", &str ) );
+    check( !strcmp( str, "foo" ) );
+    check( buf <= str && str < buf + sizeof( buf ) );
+    saved = tr_bencSave( &top, &len );
+    check( !strcmp( saved, in ) );
+    tr_free( saved );
+    tr_bencFree( &top );
+    tr_bencArenaFree( arena );
+
+    /* bad input leaves nothing to free */
+    arena = NULL;
+    check( tr_bencLoadArena( "d1:ai1e1:be", 11, &top, &arena ) );
+    check( arena == NULL );
+    check( tr_bencLoadArena( "di1e1:ae", 8, &top, &arena ) );
+    check( arena == NULL );
+
+    return 0;
+}
+
+static int
+testSortedDict( void )
+{
+    int          i;
+    int64_t      val;
+    tr_benc      top;
+    tr_benc      dict;
+    const int    n = 100;
+    char         key[32];
+    char *       saved;
+    int          len;
+
+    /* keys added in order keep the dict sorted... */
+    tr_bencInitDict( &dict, n );
+    for( i = 0; i < n; ++i ) {
+        tr_snprintf( key, sizeof( key ), "key-%03d", i );
+        tr_bencDictAddInt( &dict, key, i );
+    }
+    check( dict.flags & TR_BENC_SORTED );
+    for( i = 0; i < n; ++i ) {
+        tr_snprintf( key, sizeof( key ), "key-%03d", i );
+        check( tr_bencDictFindInt( &dict, key, &val ) );
+        check( val == i );
+    }
+    check( !tr_bencDictFind( &dict, "key-" ) );
+    check( !tr_bencDictFind( &dict, "key-0000" ) );
+    check( !tr_bencDictFind( &dict, "a" ) );
+    check( !tr_bencDictFind( &dict, "z" ) );
+
+    /* ...and bencoding it round-trips, sorted */
+    saved = tr_bencSave( &dict, &len );
+    check( !tr_bencLoad( saved, len, &top, NULL ) );
+    check( top.flags & TR_BENC_SORTED );
+    check( tr_bencDictFindInt( &top, "key-042", &val ) );
+    check( val == 42 );
+    tr_bencFree( &top );
+    tr_free( saved );
+
+    /* keys out of order, or a removal, make it unsorted again */
+    tr_bencDictAddInt( &dict, "aardvark", -1 );
+    check( !( dict.flags & TR_BENC_SORTED ) );
+    check( tr_bencDictFindInt( &dict, "aardvark", &val ) );
+    check( val == -1 );
+    check( tr_bencDictFindInt( &dict, "key-099", &val ) );
+    check( val == 99 );
+    tr_bencFree( &dict );
+
+    /* unsorted input is still found */
+    check( !tr_bencLoad( "d1:bi2e1:ai1ee", 14, &top, NULL ) );
+    check( !( top.flags & TR_BENC_SORTED ) );
+    check( tr_bencDictFindInt( &top, "a", &val ) );
+    check( val == 1 );
+    saved = tr_bencSave( &top, &len );
+    check( !strcmp( saved, "d1:ai1e1:bi2ee" ) );
+    tr_free( saved );
+    tr_bencFree( &top );
+
+    return 0;
+}
+
+/**
+***  Benchmarks
+**/
+
+/* a .torrent with one directory and `fileCount' files in it */
+static char*
+makeTorrent( int fileCount, int * len )
+{
+    int       i;
+    char *    ret;
+    char      name[32];
+    tr_benc   top;
+    tr_benc * info;
+    tr_benc * files;
+    uint8_t * pieces;
+    const int pieceCount = fileCount / 4 + 1;
+
+    tr_bencInitDict( &top, 4 );
+    tr_bencDictAddStr( &top, "announce", "http://127.0.0.1:1/announce" );
+    tr_bencDictAddStr( &top, "created by", "bencode-test" );
+    tr_bencDictAddInt( &top, "creation date", 1234567890 );
+    info = tr_bencDictAddDict( &top, "info", 4 );
+    files = tr_bencDictAddList( info, "files", fileCount );
+    for( i = 0; i < fileCount; ++i ) {
+        tr_benc * file = tr_bencListAddDict( files, 2 );
+        tr_benc * path;
+        tr_bencDictAddInt( file, "length", 65536 + i );
+        path = tr_bencDictAddList( file, "path", 2 );
+        tr_snprintf( name, sizeof( name ), "dir-%d", i / 100 );
+        tr_bencListAddStr( path, name );
+        tr_snprintf( name, sizeof( name ), "file-%d.dat", i );
+        tr_bencListAddStr( path, name );
+    }
+    tr_bencDictAddStr( info, "name", "bencode-test" );
+    tr_bencDictAddInt( info, "piece length", 262144 );
+    pieces = tr_new0( uint8_t, pieceCount * 20 );
+    tr_bencDictAddRaw( info, "pieces", pieces, pieceCount * 20 );
+
+    ret = tr_bencSave( &top, len );
+    tr_free( pieces );
+    tr_bencFree( &top );
+    return ret;
+}
+
+/* a resume file like resume.c writes, for a torrent with a file per piece */
+static char*
+makeResume( int pieceCount, int * len )
+{
+    int       i;
+    char *    ret;
+    tr_benc   top;
+    tr_benc * dnd;
+    tr_benc * priority;
+    tr_benc * progress;
+    tr_benc * mtimes;
+    uint8_t * bits;
+    const int fileCount = pieceCount;
+
+    tr_bencInitDict( &top, 12 );
+    tr_bencDictAddInt( &top, "activity-date", 1234567890 );
+    tr_bencDictAddInt( &top, "added-date", 1234567890 );
+    tr_bencDictAddInt( &top, "corrupt", 0 );
+    tr_bencDictAddStr( &top, "destination", "/tmp" );
+    dnd = tr_bencDictAddList( &top, "dnd", fileCount );
+    for( i = 0; i < fileCount; ++i )
+        tr_bencListAddInt( dnd, i % 7 == 0 );
+    tr_bencDictAddInt( &top, "downloaded", 1 << 30 );
+    tr_bencDictAddInt( &top, "max-peers", 60 );
+    tr_bencDictAddInt( &top, "paused", 0 );
+    priority = tr_bencDictAddList( &top, "priority", fileCount );
+    for( i = 0; i < fileCount; ++i )
+        tr_bencListAddInt( priority, ( i % 3 ) - 1 );
+    progress = tr_bencDictAddDict( &top, "progress", 2 );
+    bits = tr_new( uint8_t, ( pieceCount + 7 ) / 8 );
+    memset( bits, 0xaa, ( pieceCount + 7 ) / 8 );
+    tr_bencDictAddRaw( progress, "bitfield", bits, ( pieceCount + 7 ) / 8 );
+    mtimes = tr_bencDictAddList( progress, "mtimes", fileCount );
+    for( i = 0; i < fileCount; ++i )
+        tr_bencListAddInt( mtimes, 1234567890 + i );
+    tr_bencDictAddInt( &top, "uploaded", 1 << 30 );
+
+    ret = tr_bencSave( &top, len );
+    tr_free( bits );
+    tr_bencFree( &top );
+    return ret;
+}
+
+/* read what tr_metainfoParse() and resume.c would, to have something to time */
+static int64_t
+readTree( tr_benc * top )
+{
+    size_t    i;
+    int64_t   sum = 0;
+    int64_t   val;
+    tr_benc * dict;
+    tr_benc * list;
+
+    if( tr_bencDictFindDict( top, "info", &dict )
+      && tr_bencDictFindList( dict, "files", &list ) )
+    {
+        for( i = 0; i < tr_bencListSize( list ); ++i )
+        {
+            tr_benc * file = tr_bencListChild( list, i );
+            tr_benc * path;
+            const char * str;
+            if( tr_bencDictFindInt( file, "length", &val ) )
+                sum += val;
+            if( tr_bencDictFindList( file, "path", &path )
+              && tr_bencGetStr( tr_bencListChild( path, 1 ), &str ) )
+                sum += strlen( str );
+        }
+    }
+
+    if( tr_bencDictFindDict( top, "progress", &dict )
+      && tr_bencDictFindList( dict, "mtimes", &list ) )
+        for( i = 0; i < tr_bencListSize( list ); ++i )
+            if( tr_bencGetInt( tr_bencListChild( list, i ), &val ) )
+                sum += val;
+
+    if( tr_bencDictFindList( top, "priority", &list ) )
+        for( i = 0; i < tr_bencListSize( list ); ++i )
+            if( tr_bencGetInt( tr_bencListChild( list, i ), &val ) )
+                sum += val;
+
+    return sum;
+}
+
+static int
+benchmarkLoad( const char * what, const char * benc, int len )
+{
+    uint64_t        start;
+    int64_t         expected;
+    int64_t         sum;
+    tr_benc         top;
+    tr_benc_arena * arena;
+    char *          copy = tr_memdup( benc, len );
+
+    start = tr_date( );
+    check( !tr_bencLoad( benc, len, &top, NULL ) );
+    expected = readTree( &top );
+    tr_bencFree( &top );
+    fprintf( stderr, "%s, %d KiB: tr_bencLoad %"PRIu64" ms, ",
+             what, len / 1024, tr_date( ) - start );
+
+    start = tr_date( );
+    check( !tr_bencLoadArena( benc, len, &top, &arena ) );
+    sum = readTree( &top );
+    tr_bencFree( &top );
+    tr_bencArenaFree( arena );
+    fprintf( stderr, "tr_bencLoadArena %"PRIu64" ms, ", tr_date( ) - start );
+    check( sum == expected );
+
+    start = tr_date( );
+    check( !tr_bencLoadInPlace( copy, len, &top, &arena ) );
+    sum = readTree( &top );
+    tr_bencFree( &top );
+    tr_bencArenaFree( arena );
+    fprintf( stderr, "tr_bencLoadInPlace %"PRIu64" ms\n", tr_date( ) - start );
+    check( sum == expected );
+
+    tr_free( copy );
+    return 0;
+}
+
+static int
+benchmarkLookups( void )
+{
+    int       i;
+    int64_t   val;
+    uint64_t  start;
+    uint64_t  sortedMsec;
+    char      key[32];
+    tr_benc   dict;
+
+    tr_bencInitDict( &dict, LOOKUP_KEY_COUNT );
+    for( i = 0; i < LOOKUP_KEY_COUNT; ++i ) {
+        tr_snprintf( key, sizeof( key ), "%08d", i );
+        tr_bencDictAddInt( &dict, key, i );
+    }
+    check( dict.flags & TR_BENC_SORTED );
+
+    start = tr_date( );
+    for( i = 0; i < LOOKUP_KEY_COUNT; ++i ) {
+        tr_snprintf( key, sizeof( key ), "%08d", i );
+        check( tr_bencDictFindInt( &dict, key, &val ) && ( val == i ) );
+    }
+    sortedMsec = tr_date( ) - start;
+
+    dict.flags &= ~TR_BENC_SORTED;
+    start = tr_date( );
+    for( i = 0; i < LOOKUP_KEY_COUNT; ++i ) {
+        tr_snprintf( key, sizeof( key ), "%08d", i );
+        check( tr_bencDictFindInt( &dict, key, &val ) && ( val == i ) );
+    }
+    fprintf( stderr, "%d lookups in a %d-key dict: sorted %"PRIu64" ms, unsorted %"PRIu64" ms\n",
+             LOOKUP_KEY_COUNT, LOOKUP_KEY_COUNT, sortedMsec, tr_date( ) - start );
+
+    tr_bencFree( &dict );
+    return 0;
+}
+
+static int
+benchmark( void )
+{
+    int    i;
+    int    len;
+    char * benc;
+    char   what[64];
+
+    benc = makeTorrent( TORRENT_FILE_COUNT, &len );
+    tr_snprintf( what, sizeof( what ), "torrent with %d files", TORRENT_FILE_COUNT );
+    i = benchmarkLoad( what, benc, len );
+    tr_free( benc );
+    if( i )
+        return i;
+
+    benc = makeResume( RESUME_PIECE_COUNT, &len );
+    tr_snprintf( what, sizeof( what ), "resume with %d pieces", RESUME_PIECE_COUNT );
+    i = benchmarkLoad( what, benc, len );
+    tr_free( benc );
+    if( i )
+        return i;
+
+    return benchmarkLookups( );
+}
+
 int
 main( void )
 {
@@ -472,6 +831,12 @@ main( void )
     if(( i = testMerge( )))
         return i;
 
+    if(( i = testArena( )))
+        return i;
+
+    if(( i = testSortedDict( )))
+        return i;
+
 #ifndef WIN32
     i = testStackSmash( 1000000 );
 #else
@@ -480,6 +845,9 @@ main( void )
     if( i )
         return i;
 
+    if(( i = benchmark( )))
+        return i;
+
     return 0;
 }
 
@@ -159,6 +159,15 @@ makeroom( tr_benc * val,
 {
     assert( TYPE_LIST == val->type || TYPE_DICT == val->type );
 
+    if( val->flags & TR_BENC_BORROWED )
+    {
+        /* the children are in an arena, so copy them out before growing */
+        val->val.l.vals = tr_memdup( val->val.l.vals,
+                                     val->val.l.count * sizeof( tr_benc ) );
+        val->val.l.alloc = val->val.l.count;
+        val->flags &= ~TR_BENC_BORROWED;
+    }
+
     if( val->val.l.count + count > val->val.l.alloc )
     {
         /* We need a bigger boat */
@@ -176,30 +185,228 @@ makeroom( tr_benc * val,
     return 0;
 }
 
+/* the order bencoded dicts' keys are supposed to be in */
+static int
+keyCompare( const char * a, size_t alen, const char * b, size_t blen )
+{
+    const int i = memcmp( a, b, MIN( alen, blen ) );
+
+    if( i )
+        return i;
+    if( alen != blen )
+        return alen < blen ? -1 : 1;
+    return 0;
+}
+
+static tr_bool
+dictIsSorted( const tr_benc * dict )
+{
+    size_t i;
+
+    for( i = 2; i < dict->val.l.count; i += 2 )
+    {
+        const tr_benc * a = dict->val.l.vals + i - 2;
+        const tr_benc * b = dict->val.l.vals + i;
+
+        if( !tr_bencIsString( a ) || !tr_bencIsString( b ) )
+            return FALSE;
+        if( keyCompare( a->val.s.s, a->val.s.i, b->val.s.s, b->val.s.i ) >= 0 )
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/***
+****  Arenas
+***/
+
+struct tr_benc_arena
+{
+    char         * strings;     /* room for every string in the input */
+    size_t         stringsUsed;
+    tr_benc      * nodes;       /* the block nodes are being taken from */
+    size_t         nodesUsed;
+    size_t         nodesAlloc;
+    tr_ptrArray    blocks;      /* all of the above, to free */
+};
+
+static tr_benc_arena*
+arenaNew( size_t inputLen, tr_bool copyStrings )
+{
+    tr_benc_arena * arena = tr_new0( tr_benc_arena, 1 );
+
+    arena->blocks = TR_PTR_ARRAY_INIT;
+
+    /* every string costs at least its length plus a colon and
+     * a digit of input, so this leaves room for their NULs too */
+    if( copyStrings )
+    {
+        arena->strings = tr_new( char, inputLen );
+        tr_ptrArrayAppend( &arena->blocks, arena->strings );
+    }
+
+    /* a guess, just to size the first block of nodes */
+    arena->nodesAlloc = MAX( 64, inputLen / 16 );
+    arena->nodesUsed = arena->nodesAlloc;
+    return arena;
+}
+
+void
+tr_bencArenaFree( tr_benc_arena * arena )
+{
+    if( arena != NULL )
+    {
+        tr_ptrArrayDestruct( &arena->blocks, tr_free );
+        tr_free( arena );
+    }
+}
+
+static tr_benc*
+arenaNodes( tr_benc_arena * arena, size_t n )
+{
+    tr_benc * ret;
+
+    /* a list's children have to be contiguous, so if they don't fit
+     * in this block, what's left of it is wasted and a new one started */
+    if( arena->nodesUsed + n > arena->nodesAlloc )
+    {
+        arena->nodesAlloc = MAX( n, arena->nodes ? arena->nodesAlloc * 2
+                                                 : arena->nodesAlloc );
+        arena->nodes = tr_new( tr_benc, arena->nodesAlloc );
+        arena->nodesUsed = 0;
+        tr_ptrArrayAppend( &arena->blocks, arena->nodes );
+    }
+
+    ret = arena->nodes + arena->nodesUsed;
+    arena->nodesUsed += n;
+    return ret;
+}
+
+/***
+****
+***/
+
+struct parse_state
+{
+    tr_benc_arena  * arena;     /* if NULL, the tree is malloc()ed */
+    tr_bool          inPlace;   /* leave the arena's strings in the input */
+
+    /* the values that have been parsed but not yet given to their parent */
+    tr_benc        * stack;
+    size_t           stackCount;
+    size_t           stackAlloc;
+
+    /* the stack indices of the lists and dicts still being parsed */
+    size_t         * parents;
+    size_t           parentCount;
+    size_t           parentAlloc;
+};
+
+/* the returned node is only good until the next call */
 static tr_benc*
-getNode( tr_benc *     top,
-         tr_ptrArray * parentStack,
-         int           type )
+pushNode( struct parse_state * state,
+          int                  type )
 {
-    tr_benc * parent;
+    tr_benc * node;
 
-    assert( top );
-    assert( parentStack );
+    if( state->parentCount )
+    {
+        const size_t index = state->parents[state->parentCount - 1];
+        const tr_benc * parent = state->stack + index;
+
+        /* dictionary keys must be strings */
+        if( tr_bencIsDict( parent )
+          && ( type != TYPE_STR )
+          && !( ( state->stackCount - index - 1 ) % 2 ) )
+            return NULL;
+    }
 
-    if( tr_ptrArrayEmpty( parentStack ) )
-        return top;
+    if( state->stackCount == state->stackAlloc )
+    {
+        state->stackAlloc = MAX( 64, state->stackAlloc * 2 );
+        state->stack = tr_renew( tr_benc, state->stack, state->stackAlloc );
+    }
 
-    parent = tr_ptrArrayBack( parentStack );
-    assert( parent );
+    node = state->stack + state->stackCount++;
+    tr_bencInit( node, type );
+    return node;
+}
+
+static void
+pushParent( struct parse_state * state )
+{
+    if( state->parentCount == state->parentAlloc )
+    {
+        state->parentAlloc = MAX( 16, state->parentAlloc * 2 );
+        state->parents = tr_renew( size_t, state->parents, state->parentAlloc );
+    }
+
+    state->parents[state->parentCount++] = state->stackCount - 1;
+}
+
+/* move the innermost open list or dict's children off the stack,
+ * into an array of exactly the right size */
+static int
+popParent( struct parse_state * state )
+{
+    const size_t index = state->parents[--state->parentCount];
+    tr_benc * node = state->stack + index;
+    const size_t n = state->stackCount - index - 1;
+
+    if( tr_bencIsDict( node ) && ( n % 2 ) ) /* odd # of children in dict */
+        return EILSEQ;
+
+    if( n )
+    {
+        if( state->arena == NULL )
+            node->val.l.vals = tr_new( tr_benc, n );
+        else {
+            node->val.l.vals = arenaNodes( state->arena, n );
+            node->flags |= TR_BENC_BORROWED;
+        }
+        memcpy( node->val.l.vals, node + 1, n * sizeof( tr_benc ) );
+    }
+    node->val.l.count = node->val.l.alloc = n;
 
-    /* dictionary keys must be strings */
-    if( ( parent->type == TYPE_DICT )
-      && ( type != TYPE_STR )
-      && ( !( parent->val.l.count % 2 ) ) )
-        return NULL;
+    if( tr_bencIsDict( node ) && dictIsSorted( node ) )
+        node->flags |= TR_BENC_SORTED;
 
-    makeroom( parent, 1 );
-    return parent->val.l.vals + parent->val.l.count++;
+    state->stackCount = index + 1;
+    return 0;
+}
+
+static void
+initStr( struct parse_state * state,
+         tr_benc *            node,
+         const uint8_t *      str,
+         size_t               len )
+{
+    char * s;
+
+    if( state->arena == NULL )
+    {
+        tr_bencInitStr( node, str, len );
+        return;
+    }
+
+    if( state->inPlace )
+    {
+        /* slide the string back over its colon to make room for a NUL */
+        s = (char*)str - 1;
+        memmove( s, str, len );
+    }
+    else
+    {
+        s = state->arena->strings + state->arena->stringsUsed;
+        memcpy( s, str, len );
+        state->arena->stringsUsed += len + 1;
+    }
+
+    s[len] = '\0';
+    node->val.s.s = s;
+    node->val.s.i = len;
+    node->flags |= TR_BENC_BORROWED;
 }
 
 /**
@@ -208,77 +415,57 @@ getNode( tr_benc *     top,
  * attack via maliciously-crafted bencoded data. (#667)
  */
 static int
-tr_bencParseImpl( const void *     buf_in,
-                  const void *     bufend_in,
-                  tr_benc *        top,
-                  tr_ptrArray *    parentStack,
-                  const uint8_t ** setme_end )
+tr_bencParseImpl( const void *         buf_in,
+                  const void *         bufend_in,
+                  tr_benc *            top,
+                  struct parse_state * state,
+                  const uint8_t **     setme_end )
 {
-    int             err;
+    int             err = 0;
     const uint8_t * buf = buf_in;
     const uint8_t * bufend = bufend_in;
 
-    tr_bencInit( top, 0 );
-
-    while( buf != bufend )
+    while( buf < bufend )
     {
-        if( buf > bufend ) /* no more text to parse... */
-            return 1;
+        tr_benc * node;
 
         if( *buf == 'i' ) /* int */
         {
             int64_t         val;
             const uint8_t * end;
-            tr_benc *       node;
 
             if( ( err = tr_bencParseInt( buf, bufend, &end, &val ) ) )
-                return err;
+                break;
 
-            node = getNode( top, parentStack, TYPE_INT );
-            if( !node )
-                return EILSEQ;
+            if( !( node = pushNode( state, TYPE_INT ) ) ) {
+                err = EILSEQ;
+                break;
+            }
 
-            tr_bencInitInt( node, val );
+            node->val.i = val;
             buf = end;
-
-            if( tr_ptrArrayEmpty( parentStack ) )
-                break;
         }
-        else if( *buf == 'l' ) /* list */
+        else if( *buf == 'l' || *buf == 'd' ) /* list or dict */
         {
-            tr_benc * node = getNode( top, parentStack, TYPE_LIST );
-            if( !node )
-                return EILSEQ;
-            tr_bencInit( node, TYPE_LIST );
-            tr_ptrArrayAppend( parentStack, node );
-            ++buf;
-        }
-        else if( *buf == 'd' ) /* dict */
-        {
-            tr_benc * node = getNode( top, parentStack, TYPE_DICT );
-            if( !node )
-                return EILSEQ;
-            tr_bencInit( node, TYPE_DICT );
-            tr_ptrArrayAppend( parentStack, node );
+            if( !( node = pushNode( state, *buf == 'l' ? TYPE_LIST : TYPE_DICT ) ) ) {
+                err = EILSEQ;
+                break;
+            }
+
+            pushParent( state );
             ++buf;
+            continue;
         }
         else if( *buf == 'e' ) /* end of list or dict */
         {
-            tr_benc * node;
             ++buf;
-            if( tr_ptrArrayEmpty( parentStack ) )
-                return EILSEQ;
 
-            node = tr_ptrArrayBack( parentStack );
-            if( tr_bencIsDict( node ) && ( node->val.l.count % 2 ) )
-            {
-                /* odd # of children in dict */
-                tr_bencFree( &node->val.l.vals[--node->val.l.count] );
-                return EILSEQ;
+            if( !state->parentCount ) {
+                err = EILSEQ;
+                break;
             }
 
-            tr_ptrArrayPop( parentStack );
-            if( tr_ptrArrayEmpty( parentStack ) )
+            if( ( err = popParent( state ) ) )
                 break;
         }
         else if( isdigit( *buf ) ) /* string? */
@@ -286,51 +473,77 @@ tr_bencParseImpl( const void *     buf_in,
             const uint8_t * end;
             const uint8_t * str;
             size_t          str_len;
-            tr_benc *       node;
 
             if( ( err = tr_bencParseStr( buf, bufend, &end, &str, &str_len ) ) )
-                return err;
+                break;
 
-            node = getNode( top, parentStack, TYPE_STR );
-            if( !node )
-                return EILSEQ;
+            if( !( node = pushNode( state, TYPE_STR ) ) ) {
+                err = EILSEQ;
+                break;
+            }
 
-            tr_bencInitStr( node, str, str_len );
+            initStr( state, node, str, str_len );
             buf = end;
-
-            if( tr_ptrArrayEmpty( parentStack ) )
-                break;
         }
         else /* invalid bencoded text... march past it */
         {
             ++buf;
+            continue;
         }
+
+        /* we're done as soon as the top value is finished */
+        if( !state->parentCount )
+            break;
     }
 
-    err = !isSomething( top ) || !tr_ptrArrayEmpty( parentStack );
+    if( !err && ( state->parentCount || !state->stackCount ) )
+        err = 1;
 
-    if( !err && setme_end )
-        *setme_end = buf;
+    if( !err )
+    {
+        *top = state->stack[0];
+        state->stackCount = 0;
+
+        if( setme_end )
+            *setme_end = buf;
+    }
 
     return err;
 }
 
+static int
+bencParse( const void *     buf,
+           const void *     end,
+           tr_benc *        top,
+           const uint8_t ** setme_end,
+           tr_benc_arena *  arena,
+           tr_bool          inPlace )
+{
+    int                err;
+    size_t             i;
+    struct parse_state state;
+
+    memset( &state, 0, sizeof( state ) );
+    state.arena = arena;
+    state.inPlace = inPlace;
+
+    tr_bencInit( top, 0 ); /* set to `uninitialized' */
+    err = tr_bencParseImpl( buf, end, top, &state, setme_end );
+
+    for( i = 0; i < state.stackCount; ++i )
+        tr_bencFree( state.stack + i );
+    tr_free( state.stack );
+    tr_free( state.parents );
+    return err;
+}
+
 int
 tr_bencParse( const void *     buf,
               const void *     end,
               tr_benc *        top,
               const uint8_t ** setme_end )
 {
-    int           err;
-    tr_ptrArray   parentStack = TR_PTR_ARRAY_INIT;
-
-    top->type = 0; /* set to `uninitialized' */
-    err = tr_bencParseImpl( buf, end, top, &parentStack, setme_end );
-    if( err )
-        tr_bencFree( top );
-
-    tr_ptrArrayDestruct( &parentStack, NULL );
-    return err;
+    return bencParse( buf, end, top, setme_end, NULL, FALSE );
 }
 
 int
@@ -348,10 +561,53 @@ tr_bencLoad( const void * buf_in,
     return ret;
 }
 
+static int
+bencLoadArena( const void     * buf_in,
+               size_t           buflen,
+               tr_benc        * setme_benc,
+               tr_benc_arena ** setme_arena,
+               tr_bool          inPlace )
+{
+    int             err;
+    const uint8_t * buf = buf_in;
+    tr_benc_arena * arena = arenaNew( buflen, !inPlace );
+
+    err = bencParse( buf, buf + buflen, setme_benc, NULL, arena, inPlace );
+
+    if( err ) {
+        tr_bencArenaFree( arena );
+        arena = NULL;
+    }
+
+    *setme_arena = arena;
+    return err;
+}
+
+int
+tr_bencLoadArena( const void     * buf,
+                  size_t           buflen,
+                  tr_benc        * setme_benc,
+                  tr_benc_arena ** setme_arena )
+{
+    return bencLoadArena( buf, buflen, setme_benc, setme_arena, FALSE );
+}
+
+int
+tr_bencLoadInPlace( void           * buf,
+                    size_t           buflen,
+                    tr_benc        * setme_benc,
+                    tr_benc_arena ** setme_arena )
+{
+    return bencLoadArena( buf, buflen, setme_benc, setme_arena, TRUE );
+}
+
 /***
 ****
 ***/
 
+/* below this many entries, a linear search is as fast as a binary one */
+#define DICT_BSEARCH_MIN 16
+
 static int
 dictIndexOf( const tr_benc * val,
              const char *    key )
@@ -361,6 +617,29 @@ dictIndexOf( const tr_benc * val,
         size_t       i;
         const size_t len = strlen( key );
 
+        if( ( val->flags & TR_BENC_SORTED )
+          && ( val->val.l.count >= DICT_BSEARCH_MIN * 2 ) )
+        {
+            size_t lo = 0;
+            size_t hi = val->val.l.count / 2;
+
+            while( lo < hi )
+            {
+                const size_t mid = lo + ( hi - lo ) / 2;
+                const tr_benc * child = val->val.l.vals + mid * 2;
+                const int c = keyCompare( child->val.s.s, child->val.s.i, key, len );
+
+                if( !c )
+                    return mid * 2;
+                if( c < 0 )
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            return -1;
+        }
+
         for( i = 0; ( i + 1 ) < val->val.l.count; i += 2 )
         {
             const tr_benc * child = val->val.l.vals + i;
@@ -584,6 +863,7 @@ tr_bencInitDict( tr_benc * val,
                  size_t    reserveCount )
 {
     tr_bencInit( val, TYPE_DICT );
+    val->flags |= TR_BENC_SORTED; /* trivially */
     return tr_bencDictReserve( val, reserveCount );
 }
 
@@ -668,6 +948,12 @@ tr_bencDictAdd( tr_benc *    dict,
     keyval = dict->val.l.vals + dict->val.l.count++;
     tr_bencInitStr( keyval, key, -1 );
 
+    if( dict->val.l.count > 2 ) {
+        const tr_benc * prev = keyval - 2;
+        if( keyCompare( prev->val.s.s, prev->val.s.i, keyval->val.s.s, keyval->val.s.i ) >= 0 )
+            dict->flags &= ~TR_BENC_SORTED;
+    }
+
     itemval = dict->val.l.vals + dict->val.l.count++;
     tr_bencInit( itemval, TYPE_INT );
 
@@ -706,7 +992,7 @@ tr_bencDictAddStr( tr_benc * dict, const char * key, const char * val )
 
     /* see if it already exists, and if so, try to reuse it */
     if(( child = tr_bencDictFind( dict, key ))) {
-        if( tr_bencIsString( child ) )
+        if( tr_bencIsString( child ) && !( child->flags & TR_BENC_BORROWED ) )
             tr_free( child->val.s.s );
         else {
             tr_bencDictRemove( dict, key );
@@ -791,6 +1077,7 @@ tr_bencDictRemove( tr_benc *    dict,
         {
             dict->val.l.vals[i]   = dict->val.l.vals[n - 2];
             dict->val.l.vals[i + 1] = dict->val.l.vals[n - 1];
+            dict->flags &= ~TR_BENC_SORTED;
         }
         dict->val.l.count -= 2;
     }
@@ -867,7 +1154,7 @@ nodeNewList( const tr_benc * val )
     int               i, n;
     struct SaveNode * node;
 
-    assert( tr_bencIsList( val ) );
+    assert( isContainer( val ) );
 
     n = val->val.l.count;
     node = tr_new0( struct SaveNode, 1 );
@@ -893,11 +1180,12 @@ nodeNewLeaf( const tr_benc * val )
 }
 
 static struct SaveNode*
-nodeNew( const tr_benc * val )
+nodeNew( const tr_benc * val, tr_bool sortDicts )
 {
     struct SaveNode * node;
 
-    if( tr_bencIsList( val ) )
+    if( tr_bencIsList( val ) || ( tr_bencIsDict( val ) && !sortDicts )
+                             || ( tr_bencIsDict( val ) && ( val->flags & TR_BENC_SORTED ) ) )
         node = nodeNewList( val );
     else if( tr_bencIsDict( val ) )
         node = nodeNewDict( val );
@@ -922,15 +1210,19 @@ struct WalkFuncs
  * This function's previous recursive implementation was
  * easier to read, but was vulnerable to a smash-stacking
  * attack via maliciously-crafted bencoded data. (#667)
+ *
+ * Bencoded dicts must be written sorted by key; if sortDicts
+ * is false, their entries are walked in the order they were added.
  */
 static void
 bencWalk( const tr_benc *    top,
           struct WalkFuncs * walkFuncs,
-          void *             user_data )
+          void *             user_data,
+          tr_bool            sortDicts )
 {
     tr_ptrArray stack = TR_PTR_ARRAY_INIT;
 
-    tr_ptrArrayAppend( &stack, nodeNew( top ) );
+    tr_ptrArrayAppend( &stack, nodeNew( top, sortDicts ) );
 
     while( !tr_ptrArrayEmpty( &stack ) )
     {
@@ -969,14 +1261,14 @@ bencWalk( const tr_benc *    top,
 
                 case TYPE_LIST:
                     if( val != node->val )
-                        tr_ptrArrayAppend( &stack, nodeNew( val ) );
+                        tr_ptrArrayAppend( &stack, nodeNew( val, sortDicts ) );
                     else
                         walkFuncs->listBeginFunc( val, user_data );
                     break;
 
                 case TYPE_DICT:
                     if( val != node->val )
-                        tr_ptrArrayAppend( &stack, nodeNew( val ) );
+                        tr_ptrArrayAppend( &stack, nodeNew( val, sortDicts ) );
                     else
                         walkFuncs->dictBeginFunc( val, user_data );
                     break;
@@ -1046,7 +1338,7 @@ tr_bencSave( const tr_benc * top,
     walkFuncs.dictBeginFunc = saveDictBeginFunc;
     walkFuncs.listBeginFunc = saveListBeginFunc;
     walkFuncs.containerEndFunc = saveContainerEndFunc;
-    bencWalk( top, &walkFuncs, out );
+    bencWalk( top, &walkFuncs, out, TRUE );
 
     if( len )
         *len = EVBUFFER_LENGTH( out );
@@ -1060,41 +1352,66 @@ tr_bencSave( const tr_benc * top,
 ****
 ***/
 
-static void
-freeDummyFunc( const tr_benc * val UNUSED,
-               void * buf          UNUSED  )
-{}
-
-static void
-freeStringFunc( const tr_benc * val,
-                void *          freeme )
-{
-    tr_ptrArrayAppend( freeme, val->val.s.s );
-}
-
-static void
-freeContainerBeginFunc( const tr_benc * val,
-                        void *          freeme )
+struct free_node
 {
-    tr_ptrArrayAppend( freeme, val->val.l.vals );
-}
+    tr_benc  * vals;
+    size_t     count;
+    tr_bool    isBorrowed;
+};
 
+/* not recursive (see #667), and without bencWalk()'s allocations.
+ * a container's children are pushed by value, so its own array can
+ * be freed as soon as they've been read */
 void
 tr_bencFree( tr_benc * val )
 {
-    if( val && val->type )
+    if( isContainer( val ) )
     {
-        tr_ptrArray a = TR_PTR_ARRAY_INIT;
-        struct WalkFuncs walkFuncs;
+        size_t n = 0;
+        size_t alloc = 16;
+        struct free_node * stack = tr_new( struct free_node, alloc );
+
+        stack[n].vals = val->val.l.vals;
+        stack[n].count = val->val.l.count;
+        stack[n].isBorrowed = ( val->flags & TR_BENC_BORROWED ) != 0;
+        ++n;
+
+        while( n )
+        {
+            size_t i;
+            const struct free_node node = stack[--n];
 
-        walkFuncs.intFunc = freeDummyFunc;
-        walkFuncs.stringFunc = freeStringFunc;
-        walkFuncs.dictBeginFunc = freeContainerBeginFunc;
-        walkFuncs.listBeginFunc = freeContainerBeginFunc;
-        walkFuncs.containerEndFunc = freeDummyFunc;
-        bencWalk( val, &walkFuncs, &a );
+            for( i = 0; i < node.count; ++i )
+            {
+                tr_benc * child = node.vals + i;
+
+                if( tr_bencIsString( child ) )
+                {
+                    if( !( child->flags & TR_BENC_BORROWED ) )
+                        tr_free( child->val.s.s );
+                }
+                else if( isContainer( child ) && ( child->val.l.vals != NULL ) )
+                {
+                    if( n == alloc ) {
+                        alloc *= 2;
+                        stack = tr_renew( struct free_node, stack, alloc );
+                    }
+                    stack[n].vals = child->val.l.vals;
+                    stack[n].count = child->val.l.count;
+                    stack[n].isBorrowed = ( child->flags & TR_BENC_BORROWED ) != 0;
+                    ++n;
+                }
+            }
+
+            if( !node.isBorrowed )
+                tr_free( node.vals );
+        }
 
-        tr_ptrArrayDestruct( &a, tr_free );
+        tr_free( stack );
+    }
+    else if( tr_bencIsString( val ) && !( val->flags & TR_BENC_BORROWED ) )
+    {
+        tr_free( val->val.s.s );
     }
 }
 
@@ -1187,66 +1504,68 @@ jsonIntFunc( const tr_benc * val,
     jsonChildFunc( data );
 }
 
+/* append a JSON string, escaping it as needed.
+ * runs of characters that don't need escaping are added all at once */
 static void
-jsonStringFunc( const tr_benc * val,
-                void *          vdata )
+jsonAddString( struct evbuffer * out, const char * str, size_t len )
 {
-    struct jsonWalk *    data = vdata;
-    const unsigned char *it, *end;
+    const unsigned char * it = (const unsigned char*) str;
+    const unsigned char * end = it + len;
+    const unsigned char * run = it;
+
+    evbuffer_add( out, "\"", 1 );
 
-    evbuffer_add_printf( data->out, "\"" );
-    for( it = (const unsigned char*)val->val.s.s, end = it + val->val.s.i;
-         it != end; ++it )
+    for( ; it != end; ++it )
     {
+        const char * escaped = NULL;
+
         switch( *it )
         {
-            case '/':
-                evbuffer_add_printf( data->out, "\\/" ); break;
-
-            case '\b':
-                evbuffer_add_printf( data->out, "\\b" ); break;
-
-            case '\f':
-                evbuffer_add_printf( data->out, "\\f" ); break;
+            case '/':  escaped = "\\/"; break;
+            case '\b': escaped = "\\b"; break;
+            case '\f': escaped = "\\f"; break;
+            case '\n': escaped = "\\n"; break;
+            case '\r': escaped = "\\r"; break;
+            case '\t': escaped = "\\t"; break;
+            case '"':  escaped = "\\\""; break;
+            case '\\': escaped = "\\\\"; break;
+            default:   if( isascii( *it ) ) continue; break;
+        }
 
-            case '\n':
-                evbuffer_add_printf( data->out, "\\n" ); break;
+        evbuffer_add( out, run, it - run );
 
-            case '\r':
-                evbuffer_add_printf( data->out, "\\r" ); break;
+        if( escaped != NULL )
+        {
+            evbuffer_add( out, escaped, 2 );
+        }
+        else
+        {
+            const UTF8 * tmp = it;
+            UTF32        buf = 0;
+            UTF32 *      u32 = &buf;
+            ConversionResult result = ConvertUTF8toUTF32( &tmp, end, &u32, &buf + 1, 0 );
+            if( ( result != conversionOK ) && ( tmp == it ) )
+                ; /* it's beyond help; skip it */
+            else {
+                evbuffer_add_printf( out, "\\u%04x", (unsigned int)buf );
+                it = tmp - 1;
+            }
+        }
 
-            case '\t':
-                evbuffer_add_printf( data->out, "\\t" ); break;
+        run = it + 1;
+    }
 
-            case '"':
-                evbuffer_add_printf( data->out, "\\\"" ); break;
+    evbuffer_add( out, run, it - run );
+    evbuffer_add( out, "\"", 1 );
+}
 
-            case '\\':
-                evbuffer_add_printf( data->out, "\\\\" ); break;
+static void
+jsonStringFunc( const tr_benc * val,
+                void *          vdata )
+{
+    struct jsonWalk * data = vdata;
 
-            default:
-                if( isascii( *it ) )
-                {
-                    /*fprintf( stderr, "[%c]\n", *it );*/
-                    evbuffer_add_printf( data->out, "%c", *it );
-                }
-                else
-                {
-                    const UTF8 * tmp = it;
-                    UTF32        buf = 0;
-                    UTF32 *      u32 = &buf;
-                    ConversionResult result = ConvertUTF8toUTF32( &tmp, end, &u32, &buf + 1, 0 );
-                    if( ( result != conversionOK ) && ( tmp == it ) )
-                        ++it; /* it's beyond help; skip it */
-                    else {
-                        evbuffer_add_printf( data->out, "\\u%04x", (unsigned int)buf );
-                        it = tmp - 1;
-                    }
-                    /*fprintf( stderr, "[\\u%04x]\n", buf );*/
-                }
-        }
-    }
-    evbuffer_add_printf( data->out, "\"" );
+    jsonAddString( data->out, val->val.s.s, val->val.s.i );
     jsonChildFunc( data );
 }
 
@@ -1323,7 +1642,7 @@ tr_bencSaveAsJSON( const tr_benc * top, struct evbuffer * out )
     walkFuncs.listBeginFunc = jsonListBeginFunc;
     walkFuncs.containerEndFunc = jsonContainerEndFunc;
 
-    bencWalk( top, &walkFuncs, &data );
+    bencWalk( top, &walkFuncs, &data, TRUE );
 
     if( EVBUFFER_LENGTH( out ) )
         evbuffer_add_printf( out, "\n" );
@@ -1342,11 +1661,186 @@ tr_bencToJSON( const tr_benc * top )
     return ret;
 }
 
+/***
+****  STREAMING JSON
+***/
+
+/* how much output to collect before handing it to the flush func */
+#define JSON_CHUNK_SIZE ( 16 * 1024 )
+
+struct json_level
+{
+    tr_bool    isDict;
+    int        childCount;
+};
+
+struct tr_json_writer
+{
+    struct evbuffer *     out;
+    tr_json_flush_func    flushFunc;
+    void *                flushFuncUserData;
+    struct json_level *   levels;
+    int                   depth;
+    int                   depthAlloc;
+};
+
+tr_json_writer*
+tr_jsonWriterNew( tr_json_flush_func flushFunc, void * user_data )
+{
+    tr_json_writer * w = tr_new0( tr_json_writer, 1 );
+    w->out = evbuffer_new( );
+    w->flushFunc = flushFunc;
+    w->flushFuncUserData = user_data;
+    return w;
+}
+
+static void
+writerFlush( tr_json_writer * w, tr_bool isDone )
+{
+    w->flushFunc( w->out, isDone, w->flushFuncUserData );
+    evbuffer_drain( w->out, EVBUFFER_LENGTH( w->out ) );
+}
+
+void
+tr_jsonWriterFree( tr_json_writer * w )
+{
+    assert( w->depth == 0 );
+
+    writerFlush( w, TRUE );
+    evbuffer_free( w->out );
+    tr_free( w->levels );
+    tr_free( w );
+}
+
+static void
+writerMaybeFlush( tr_json_writer * w )
+{
+    if( EVBUFFER_LENGTH( w->out ) >= JSON_CHUNK_SIZE )
+        writerFlush( w, FALSE );
+}
+
+/* add the separator that goes before the next child.
+ * a dict's children alternate between keys and values */
+static void
+writerBeginChild( tr_json_writer * w )
+{
+    if( w->depth > 0 )
+    {
+        struct json_level * level = &w->levels[w->depth - 1];
+        const int i = level->childCount++;
+
+        if( level->isDict && ( i % 2 ) )
+            evbuffer_add( w->out, ":", 1 );
+        else if( i > 0 )
+            evbuffer_add( w->out, ",", 1 );
+    }
+}
+
+static void
+writerPush( tr_json_writer * w, tr_bool isDict )
+{
+    writerBeginChild( w );
+    evbuffer_add( w->out, isDict ? "{" : "[", 1 );
+
+    if( w->depth == w->depthAlloc ) {
+        w->depthAlloc = MAX( 8, w->depthAlloc * 2 );
+        w->levels = tr_renew( struct json_level, w->levels, w->depthAlloc );
+    }
+
+    w->levels[w->depth].isDict = isDict;
+    w->levels[w->depth].childCount = 0;
+    ++w->depth;
+}
+
+void
+tr_jsonWriteDictBegin( tr_json_writer * w )
+{
+    writerPush( w, TRUE );
+}
+
+void
+tr_jsonWriteListBegin( tr_json_writer * w )
+{
+    writerPush( w, FALSE );
+}
+
+void
+tr_jsonWriteEnd( tr_json_writer * w )
+{
+    assert( w->depth > 0 );
+
+    --w->depth;
+    evbuffer_add( w->out, w->levels[w->depth].isDict ? "}" : "]", 1 );
+    writerMaybeFlush( w );
+}
+
+void
+tr_jsonWriteInt( tr_json_writer * w, int64_t i )
+{
+    writerBeginChild( w );
+    evbuffer_add_printf( w->out, "%" PRId64, i );
+    writerMaybeFlush( w );
+}
+
+void
+tr_jsonWriteStr( tr_json_writer * w, const char * str )
+{
+    writerBeginChild( w );
+    jsonAddString( w->out, str, strlen( str ) );
+    writerMaybeFlush( w );
+}
+
+static void
+writerIntFunc( const tr_benc * val, void * w )
+{
+    tr_jsonWriteInt( w, val->val.i );
+}
+
+static void
+writerStringFunc( const tr_benc * val, void * w )
+{
+    writerBeginChild( w );
+    jsonAddString( ((tr_json_writer*)w)->out, val->val.s.s, val->val.s.i );
+    writerMaybeFlush( w );
+}
+
+static void
+writerDictBeginFunc( const tr_benc * val UNUSED, void * w )
+{
+    tr_jsonWriteDictBegin( w );
+}
+
+static void
+writerListBeginFunc( const tr_benc * val UNUSED, void * w )
+{
+    tr_jsonWriteListBegin( w );
+}
+
+static void
+writerContainerEndFunc( const tr_benc * val UNUSED, void * w )
+{
+    tr_jsonWriteEnd( w );
+}
+
+void
+tr_jsonWriteBenc( tr_json_writer * w, const tr_benc * val )
+{
+    struct WalkFuncs walkFuncs;
+
+    walkFuncs.intFunc = writerIntFunc;
+    walkFuncs.stringFunc = writerStringFunc;
+    walkFuncs.dictBeginFunc = writerDictBeginFunc;
+    walkFuncs.listBeginFunc = writerListBeginFunc;
+    walkFuncs.containerEndFunc = writerContainerEndFunc;
+
+    bencWalk( val, &walkFuncs, w, FALSE );
+}
+
 /***
 ****
 ***/
 
-static size_t
+size_t
 tr_bencDictSize( const tr_benc * dict )
 {
     size_t count = 0;
@@ -1357,7 +1851,7 @@ tr_bencDictSize( const tr_benc * dict )
     return count;
 }
 
-static tr_bool
+tr_bool
 tr_bencDictChild( const tr_benc * dict, size_t n, const char ** key, const tr_benc ** val )
 {
     tr_bool success = 0;
@@ -1498,6 +1992,33 @@ tr_bencLoadFile( const char * filename, tr_benc * b )
     return err;
 }
 
+int
+tr_bencLoadFileArena( const char     * filename,
+                      tr_benc        * b,
+                      tr_benc_arena ** setme_arena )
+{
+    int       err;
+    size_t    contentLen;
+    uint8_t * content;
+
+    *setme_arena = NULL;
+
+    content = tr_loadFile( filename, &contentLen );
+    if( !content && errno )
+        err = errno;
+    else if( !content )
+        err = ENODATA;
+    else
+        err = tr_bencLoadInPlace( content, contentLen, b, setme_arena );
+
+    if( !err )
+        tr_ptrArrayAppend( &(*setme_arena)->blocks, content );
+    else
+        tr_free( content );
+
+    return err;
+}
+
 int
 tr_bencLoadJSONFile( const char * filename, tr_benc * b )
 {
@@ -25,9 +25,21 @@ enum
     TYPE_DICT = 8
 };
 
+enum
+{
+    /* a dict whose keys are in bencoded (bytewise) order, so that
+     * tr_bencDictFind() can do a binary search */
+    TR_BENC_SORTED   = 1,
+
+    /* the str's bytes or the list or dict's children belong
+     * to a tr_benc_arena, so tr_bencFree() mustn't free them */
+    TR_BENC_BORROWED = 2
+};
+
 typedef struct tr_benc
 {
     char    type;
+    char    flags;
     union
     {
         int64_t i;
@@ -69,6 +81,37 @@ int       tr_bencLoadFile( const char * filename,
 int       tr_bencLoadJSONFile( const char * filename,
                                             tr_benc * );
 
+/**
+ * An arena holds a parsed tree's nodes and strings in a few big blocks
+ * instead of in a malloc() apiece.  The tree can be read and modified
+ * like any other, but mustn't outlive its arena: tr_bencFree() the tree
+ * first, then tr_bencArenaFree() the arena.
+ */
+typedef struct tr_benc_arena tr_benc_arena;
+
+/** @brief like tr_bencLoad(), but allocating the tree from a new arena */
+int       tr_bencLoadArena( const void     * buf,
+                            size_t           buflen,
+                            tr_benc        * setme_benc,
+                            tr_benc_arena ** setme_arena );
+
+/**
+ * @brief like tr_bencLoadArena(), but the strings aren't copied.
+ * They're left in `buf', which is rewritten in place to NUL-terminate
+ * them and which has to be kept until the arena is freed.
+ */
+int       tr_bencLoadInPlace( void           * buf,
+                              size_t           buflen,
+                              tr_benc        * setme_benc,
+                              tr_benc_arena ** setme_arena );
+
+/** @brief loads a file with tr_bencLoadInPlace(); the arena keeps its contents */
+int       tr_bencLoadFileArena( const char     * filename,
+                                tr_benc        * setme_benc,
+                                tr_benc_arena ** setme_arena );
+
+void      tr_bencArenaFree( tr_benc_arena * arena );
+
 #if 0
 void      tr_bencPrint( const tr_benc * );
 
@@ -141,6 +184,12 @@ tr_benc * tr_bencDictAddRaw( tr_benc *, const char * key,
 
 tr_benc*  tr_bencDictFind( tr_benc *, const char * key );
 
+size_t    tr_bencDictSize( const tr_benc * dict );
+
+/** @brief get the dict's nth key and value, in the order they were added */
+tr_bool   tr_bencDictChild( const tr_benc * dict, size_t n,
+                            const char ** setme_key, const tr_benc ** setme_val );
+
 tr_bool   tr_bencDictFindList( tr_benc *, const char * key, tr_benc ** setme );
 
 tr_bool   tr_bencDictFindDict( tr_benc *, const char * key, tr_benc ** setme );
@@ -190,6 +239,42 @@ int tr_bencParseStr( const uint8_t *  buf,
 
 void  tr_bencMergeDicts( tr_benc * target, const tr_benc * source );
 
+/***
+****  Streaming JSON
+***/
+
+/**
+ * Writes JSON a value at a time, handing it off in chunks as they fill up
+ * so that a big document never has to be built or held all at once.
+ * Unlike tr_bencSaveAsJSON(), dicts are written in the order their
+ * entries were added, and without any whitespace.
+ */
+typedef struct tr_json_writer tr_json_writer;
+
+/** @brief called with each chunk.  The writer drains `buf' afterwards. */
+typedef void ( *tr_json_flush_func )( struct evbuffer * buf,
+                                      tr_bool           isDone,
+                                      void            * user_data );
+
+tr_json_writer* tr_jsonWriterNew( tr_json_flush_func flushFunc, void * user_data );
+
+/** @brief flushes the last chunk, with isDone set, and frees the writer */
+void      tr_jsonWriterFree( tr_json_writer * );
+
+void      tr_jsonWriteDictBegin( tr_json_writer * );
+
+void      tr_jsonWriteListBegin( tr_json_writer * );
+
+/** @brief closes the innermost open dict or list */
+void      tr_jsonWriteEnd( tr_json_writer * );
+
+/** @brief inside a dict, the children alternate between keys and values */
+void      tr_jsonWriteStr( tr_json_writer *, const char * str );
+
+void      tr_jsonWriteInt( tr_json_writer *, int64_t i );
+
+void      tr_jsonWriteBenc( tr_json_writer *, const tr_benc * val );
+
 #ifdef __cplusplus
 }
 #endif
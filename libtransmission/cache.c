@@ -0,0 +1,466 @@
+/*
+ * This file Copyright (C) 2009 Charles Kerr <charles@transmissionbt.com>
+ *
+ * This file is licensed by the GPL version 2.  Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <string.h> /* memcpy */
+
+#include "transmission.h"
+#include "cache.h"
+#include "inout.h"
+#include "list.h"
+#include "platform.h" /* tr_lock */
+#include "ptrarray.h"
+#include "torrent.h"
+#include "utils.h"
+
+/****
+*****
+****/
+
+struct cache_block
+{
+    const tr_torrent  * tor;
+    tr_block_index_t    block;
+    tr_piece_index_t    piece;
+    uint32_t            offset;
+    uint32_t            length;
+    tr_bool             isDirty;
+    uint8_t           * buf;
+    struct __tr_list    lru;
+};
+
+struct tr_cache
+{
+    tr_lock           * lock;
+    tr_ptrArray         blocks; /* struct cache_block, sorted by compareBlocks() */
+    struct __tr_list    lru;    /* least recently used blocks come first */
+    size_t              maxBytes;
+    tr_cache_stats      stats;
+};
+
+static void
+cacheLock( const tr_cache * cache )
+{
+    tr_lockLock( cache->lock );
+}
+
+static void
+cacheUnlock( const tr_cache * cache )
+{
+    tr_lockUnlock( cache->lock );
+}
+
+/****
+*****
+****/
+
+static int
+compareBlocks( const void * va, const void * vb )
+{
+    const struct cache_block * a = va;
+    const struct cache_block * b = vb;
+
+    if( a->tor->uniqueId != b->tor->uniqueId )
+        return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
+
+    if( a->block != b->block )
+        return a->block < b->block ? -1 : 1;
+
+    return 0;
+}
+
+/* returns the position where the block is, or would be inserted */
+static int
+findBlock( const tr_cache     * cache,
+           const tr_torrent   * tor,
+           tr_block_index_t     block,
+           int                * exact_match )
+{
+    struct cache_block key;
+    key.tor = tor;
+    key.block = block;
+    return tr_ptrArrayLowerBound( &cache->blocks, &key, compareBlocks, exact_match );
+}
+
+static TR_INLINE struct cache_block*
+blockAt( const tr_cache * cache, int pos )
+{
+    return tr_ptrArrayBase( &cache->blocks )[pos];
+}
+
+static void
+removeBlockAt( tr_cache * cache, int pos )
+{
+    struct cache_block * b = blockAt( cache, pos );
+
+    tr_ptrArrayErase( &cache->blocks, pos, pos + 1 );
+    __tr_list_remove( &b->lru );
+    cache->stats.cachedBytes -= b->length;
+    tr_free( b->buf );
+    tr_free( b );
+}
+
+static void
+touchBlock( tr_cache * cache, struct cache_block * b )
+{
+    __tr_list_remove( &b->lru );
+    __tr_list_append( &cache->lru, &b->lru );
+}
+
+/* only whole blocks are cached, so we never have to merge partial writes */
+static tr_bool
+isCacheable( const tr_cache   * cache,
+             const tr_torrent * tor,
+             tr_block_index_t   block,
+             uint32_t           offset,
+             uint32_t           len )
+{
+    return ( len <= cache->maxBytes )
+        && ( offset % tor->blockSize == 0 )
+        && ( len == tr_torBlockCountBytes( tor, block ) );
+}
+
+/****
+*****
+****/
+
+/* true if `b' immediately follows `a' on disk and both need to be written */
+static tr_bool
+isNextInRun( const struct cache_block * a, const struct cache_block * b )
+{
+    return ( a->tor == b->tor )
+        && ( a->piece == b->piece )
+        && ( a->block + 1 == b->block )
+        && ( a->isDirty )
+        && ( b->isDirty );
+}
+
+/* write the run of adjacent dirty blocks that starts at `pos' to disk
+ * in a single write.  The blocks are marked clean even if the write
+ * fails, since there's nothing better we can do with them. */
+static int
+flushRun( tr_cache * cache, int pos, int * setme_blockCount )
+{
+    int i, n;
+    int err;
+    uint32_t len;
+    const int size = tr_ptrArraySize( &cache->blocks );
+    struct cache_block ** blocks = (struct cache_block**) tr_ptrArrayBase( &cache->blocks );
+    const struct cache_block * first = blocks[pos];
+
+    assert( first->isDirty );
+
+    len = first->length;
+    for( n=1; pos+n<size && isNextInRun( blocks[pos+n-1], blocks[pos+n] ); ++n )
+        len += blocks[pos+n]->length;
+
+    if( n == 1 )
+        err = tr_ioWrite( first->tor, first->piece, first->offset, len, first->buf );
+    else {
+        tr_iovec * iov = tr_new( tr_iovec, n );
+        for( i=0; i<n; ++i ) {
+            iov[i].base = blocks[pos+i]->buf;
+            iov[i].len = blocks[pos+i]->length;
+        }
+        err = tr_ioWritev( first->tor, first->piece, first->offset, iov, n );
+        tr_free( iov );
+    }
+
+    for( i=0; i<n; ++i )
+        blocks[pos+i]->isDirty = FALSE;
+
+    cache->stats.flushes++;
+    cache->stats.flushedBytes += len;
+
+    if( err )
+        tr_torerr( first->tor, "Couldn't save piece %lu: %s",
+                   (unsigned long)first->piece, tr_strerror( err ) );
+
+    if( setme_blockCount )
+        *setme_blockCount = n;
+    return err;
+}
+
+/* evict the least recently used blocks until we're within budget.
+ * @return the first write error that happened to one of `tor's blocks */
+static int
+cacheTrim( tr_cache * cache, const tr_torrent * tor )
+{
+    int err = 0;
+
+    while( ( cache->stats.cachedBytes > cache->maxBytes )
+        && ( cache->lru.next != &cache->lru ) )
+    {
+        struct cache_block * b = __tr_list_entry( cache->lru.next, struct cache_block, lru );
+        const int pos = findBlock( cache, b->tor, b->block, NULL );
+
+        if( b->isDirty )
+        {
+            /* back up to the start of the run so it's all written at once */
+            int start = pos;
+            int e;
+            while( start > 0 && isNextInRun( blockAt( cache, start-1 ), blockAt( cache, start ) ) )
+                --start;
+            e = flushRun( cache, start, NULL );
+            if( e && ( b->tor == tor ) && !err )
+                err = e;
+        }
+
+        removeBlockAt( cache, pos );
+    }
+
+    return err;
+}
+
+/****
+*****
+****/
+
+tr_cache *
+tr_cacheNew( size_t maxBytes )
+{
+    tr_cache * cache = tr_new0( tr_cache, 1 );
+    cache->lock = tr_lockNew( );
+    cache->blocks = TR_PTR_ARRAY_INIT;
+    cache->maxBytes = maxBytes;
+    __tr_list_init( &cache->lru );
+    return cache;
+}
+
+void
+tr_cacheFree( tr_cache * cache )
+{
+    int i;
+
+    for( i=0; i<tr_ptrArraySize( &cache->blocks ); ++i )
+        if( blockAt( cache, i )->isDirty )
+            flushRun( cache, i, NULL );
+
+    while( !tr_ptrArrayEmpty( &cache->blocks ) )
+        removeBlockAt( cache, tr_ptrArraySize( &cache->blocks ) - 1 );
+
+    tr_ptrArrayDestruct( &cache->blocks, NULL );
+    tr_lockFree( cache->lock );
+    tr_free( cache );
+}
+
+void
+tr_cacheSetLimit( tr_cache * cache, size_t maxBytes )
+{
+    cacheLock( cache );
+    cache->maxBytes = maxBytes;
+    cacheTrim( cache, NULL );
+    cacheUnlock( cache );
+}
+
+size_t
+tr_cacheGetLimit( const tr_cache * cache )
+{
+    return cache->maxBytes;
+}
+
+void
+tr_cacheGetStats( const tr_cache * cache, tr_cache_stats * setme )
+{
+    cacheLock( cache );
+    *setme = cache->stats;
+    cacheUnlock( cache );
+}
+
+/****
+*****
+****/
+
+int
+tr_cacheWriteBlock( tr_cache         * cache,
+                    const tr_torrent * tor,
+                    tr_piece_index_t   piece,
+                    uint32_t           offset,
+                    uint32_t           len,
+                    const uint8_t    * writeme )
+{
+    int err = 0;
+    int match;
+    int pos;
+    const tr_block_index_t block = _tr_block( tor, piece, offset );
+
+    cacheLock( cache );
+
+    pos = findBlock( cache, tor, block, &match );
+
+    if( !isCacheable( cache, tor, block, offset, len ) )
+    {
+        /* write it straight to disk, making sure an older
+         * copy of the block doesn't get flushed on top of it */
+        if( match ) {
+            if( blockAt( cache, pos )->isDirty )
+                err = flushRun( cache, pos, NULL );
+            removeBlockAt( cache, pos );
+        }
+        if( !err )
+            err = tr_ioWrite( tor, piece, offset, len, writeme );
+    }
+    else
+    {
+        struct cache_block * b;
+
+        if( match ) {
+            b = blockAt( cache, pos );
+            touchBlock( cache, b );
+        } else {
+            b = tr_new0( struct cache_block, 1 );
+            b->tor = tor;
+            b->block = block;
+            b->piece = piece;
+            b->offset = offset;
+            b->length = len;
+            b->buf = tr_new( uint8_t, len );
+            tr_ptrArrayInsert( &cache->blocks, b, pos );
+            __tr_list_append( &cache->lru, &b->lru );
+            cache->stats.cachedBytes += len;
+        }
+
+        memcpy( b->buf, writeme, len );
+        b->isDirty = TRUE;
+
+        err = cacheTrim( cache, tor );
+    }
+
+    cacheUnlock( cache );
+    return err;
+}
+
+int
+tr_cacheReadBlock( tr_cache         * cache,
+                   const tr_torrent * tor,
+                   tr_piece_index_t   piece,
+                   uint32_t           offset,
+                   uint32_t           len,
+                   uint8_t          * setme )
+{
+    int err = 0;
+    int match;
+    int pos;
+    const tr_block_index_t block = _tr_block( tor, piece, offset );
+    const tr_bool cacheable = isCacheable( cache, tor, block, offset, len );
+
+    cacheLock( cache );
+
+    pos = findBlock( cache, tor, block, &match );
+
+    if( match && cacheable )
+    {
+        struct cache_block * b = blockAt( cache, pos );
+        memcpy( setme, b->buf, len );
+        touchBlock( cache, b );
+        cache->stats.hits++;
+    }
+    else
+    {
+        cache->stats.misses++;
+
+        if( match && blockAt( cache, pos )->isDirty )
+            err = flushRun( cache, pos, NULL );
+
+        if( !err )
+            err = tr_ioRead( tor, piece, offset, len, setme );
+
+        /* keep a copy for the next peer who asks for it */
+        if( !err && !match && cacheable )
+        {
+            struct cache_block * b = tr_new0( struct cache_block, 1 );
+            b->tor = tor;
+            b->block = block;
+            b->piece = piece;
+            b->offset = offset;
+            b->length = len;
+            b->buf = tr_memdup( setme, len );
+            tr_ptrArrayInsert( &cache->blocks, b, pos );
+            __tr_list_append( &cache->lru, &b->lru );
+            cache->stats.cachedBytes += len;
+
+            err = cacheTrim( cache, tor );
+        }
+    }
+
+    cacheUnlock( cache );
+    return err;
+}
+
+int
+tr_cacheFlushPiece( tr_cache         * cache,
+                    const tr_torrent * tor,
+                    tr_piece_index_t   piece )
+{
+    int err = 0;
+    int pos;
+    const tr_block_index_t end = tr_torPieceFirstBlock( tor, piece )
+                               + tr_torPieceCountBlocks( tor, piece );
+
+    cacheLock( cache );
+
+    pos = findBlock( cache, tor, tr_torPieceFirstBlock( tor, piece ), NULL );
+    while( pos < tr_ptrArraySize( &cache->blocks ) )
+    {
+        const struct cache_block * b = blockAt( cache, pos );
+
+        if( ( b->tor != tor ) || ( b->block >= end ) )
+            break;
+
+        if( !b->isDirty )
+            ++pos;
+        else {
+            int n;
+            const int e = flushRun( cache, pos, &n );
+            if( !err )
+                err = e;
+            pos += n;
+        }
+    }
+
+    cacheUnlock( cache );
+    return err;
+}
+
+int
+tr_cacheFlushTorrent( tr_cache * cache, const tr_torrent * tor )
+{
+    int err = 0;
+    int begin, end;
+
+    cacheLock( cache );
+
+    begin = end = findBlock( cache, tor, 0, NULL );
+    while( end < tr_ptrArraySize( &cache->blocks ) )
+    {
+        const struct cache_block * b = blockAt( cache, end );
+
+        if( b->tor != tor )
+            break;
+
+        if( !b->isDirty )
+            ++end;
+        else {
+            int n;
+            const int e = flushRun( cache, end, &n );
+            if( !err )
+                err = e;
+            end += n;
+        }
+    }
+
+    while( end > begin )
+        removeBlockAt( cache, --end );
+
+    cacheUnlock( cache );
+    return err;
+}
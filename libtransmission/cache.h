@@ -0,0 +1,92 @@
+/*
+ * This file Copyright (C) 2009 Charles Kerr <charles@transmissionbt.com>
+ *
+ * This file is licensed by the GPL version 2.  Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_CACHE_H
+#define TR_CACHE_H 1
+
+struct tr_torrent;
+
+/**
+ * A session-wide write-back cache of torrent blocks.
+ *
+ * Blocks we download are held in memory until their piece is complete,
+ * then written out in as few writes as possible.  Blocks we read to
+ * serve peers are kept around too, so popular pieces don't have to be
+ * reread from disk for every request.  When the cache outgrows its
+ * budget, the least recently used blocks are flushed and discarded.
+ */
+typedef struct tr_cache tr_cache;
+
+typedef struct tr_cache_stats
+{
+    uint64_t    hits;         /* block reads served from memory */
+    uint64_t    misses;       /* block reads that had to go to disk */
+    uint64_t    flushes;      /* number of writes made to disk */
+    uint64_t    flushedBytes; /* bytes written to disk */
+    uint64_t    cachedBytes;  /* bytes currently held in memory */
+}
+tr_cache_stats;
+
+tr_cache * tr_cacheNew( size_t maxBytes );
+
+/** @brief flushes all dirty blocks and frees the cache */
+void       tr_cacheFree( tr_cache * cache );
+
+void       tr_cacheSetLimit( tr_cache * cache, size_t maxBytes );
+
+size_t     tr_cacheGetLimit( const tr_cache * cache );
+
+void       tr_cacheGetStats( const tr_cache * cache, tr_cache_stats * setme );
+
+/**
+ * Like tr_ioWrite(), but the block is kept in memory until
+ * its piece is flushed or it's pushed out of the cache.
+ * @return 0 on success, or an errno value on failure.
+ */
+int        tr_cacheWriteBlock( tr_cache                * cache,
+                               const struct tr_torrent * tor,
+                               tr_piece_index_t          pieceIndex,
+                               uint32_t                  offset,
+                               uint32_t                  len,
+                               const uint8_t           * writeme );
+
+/**
+ * Like tr_ioRead(), but checks the cache first.
+ * @return 0 on success, or an errno value on failure.
+ */
+int        tr_cacheReadBlock( tr_cache                * cache,
+                              const struct tr_torrent * tor,
+                              tr_piece_index_t          pieceIndex,
+                              uint32_t                  offset,
+                              uint32_t                  len,
+                              uint8_t                 * setme );
+
+/**
+ * Write the piece's dirty blocks to disk.  The blocks stay cached.
+ * @return 0 on success, or an errno value on failure.
+ */
+int        tr_cacheFlushPiece( tr_cache                * cache,
+                               const struct tr_torrent * tor,
+                               tr_piece_index_t          pieceIndex );
+
+/**
+ * Write the torrent's dirty blocks to disk and drop all its blocks.
+ * @return 0 on success, or an errno value on failure.
+ */
+int        tr_cacheFlushTorrent( tr_cache                * cache,
+                                 const struct tr_torrent * tor );
+
+#endif
@@ -29,6 +29,7 @@
 #include <event.h>
 
 #include "crypto.h"
+#include "sha1.h"
 #include "utils.h"
 
 #define MY_NAME "tr_crypto"
@@ -44,10 +45,10 @@ tr_sha1( uint8_t *    setme,
          ... )
 {
     va_list vl;
-    SHA_CTX sha;
+    tr_sha1_ctx sha;
 
-    SHA1_Init( &sha );
-    SHA1_Update( &sha, content1, content1_len );
+    tr_sha1Init( &sha );
+    tr_sha1Update( &sha, content1, content1_len );
 
     va_start( vl, content1_len );
     for( ; ; )
@@ -56,10 +57,10 @@ tr_sha1( uint8_t *    setme,
         const int    content_len = content ? (int) va_arg( vl, int ) : -1;
         if( content == NULL || content_len < 1 )
             break;
-        SHA1_Update( &sha, content, content_len );
+        tr_sha1Update( &sha, content, content_len );
     }
     va_end( vl );
-    SHA1_Final( setme, &sha );
+    tr_sha1Final( &sha, setme );
 }
 
 /**
@@ -0,0 +1,338 @@
+#include <errno.h> /* ECANCELED */
+#include <stdio.h> /* fprintf */
+#include <stdlib.h> /* mkdtemp */
+
+#include <unistd.h> /* rmdir */
+
+#include "transmission.h"
+#include "bencode.h"
+#include "disk-pool.h"
+#include "platform.h"
+#include "session.h"
+#include "trevent.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+#define JOB_COUNT 1000
+#define SLOW_JOB_COUNT 8
+#define SLOW_JOB_MSEC 50
+#define BLOCKER_COUNT 4 /* as many as the pool has threads */
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+static tr_session * session = NULL;
+static char * sessionDir = NULL;
+
+/* run func in the event thread and wait for it to finish */
+static volatile tr_bool isDone;
+
+struct run_data
+{
+    void ( *func )( void * );
+    void * arg;
+};
+
+static void
+runAndSignal( void * vdata )
+{
+    struct run_data * data = vdata;
+    ( *data->func )( data->arg );
+    isDone = TRUE;
+}
+
+static void
+runInEventThread( void func( void * ), void * arg )
+{
+    struct run_data data;
+    data.func = func;
+    data.arg = arg;
+    isDone = FALSE;
+    tr_runInEventThread( session, runAndSignal, &data );
+    while( !isDone )
+        tr_wait( 1 );
+}
+
+/***
+****  Jobs
+***/
+
+static volatile int jobsRun;
+static volatile int jobsDone;
+static volatile int jobsCancelled;
+static volatile int wrongThread;
+static volatile int wrongResult;
+static volatile tr_bool isBlocked;
+
+static const char * owner = "owner";
+static const char * otherOwner = "other owner";
+
+static void
+resetJobs( void )
+{
+    jobsRun = 0;
+    jobsDone = 0;
+    jobsCancelled = 0;
+    wrongThread = 0;
+    wrongResult = 0;
+}
+
+/* fails every third job, so we can see the errors get through */
+static int
+quickJob( void * vi )
+{
+    const int i = (intptr_t) vi;
+    ++jobsRun;
+    return i % 3 ? 0 : EIO;
+}
+
+static int
+slowJob( void * vi UNUSED )
+{
+    tr_wait( SLOW_JOB_MSEC );
+    ++jobsRun;
+    return 0;
+}
+
+static int
+blockerJob( void * vi UNUSED )
+{
+    while( isBlocked )
+        tr_wait( 1 );
+    return 0;
+}
+
+static void
+onJobDone( int err, void * vi )
+{
+    const int i = (intptr_t) vi;
+
+    if( !tr_amInEventThread( session ) )
+        ++wrongThread;
+
+    if( err == ECANCELED )
+        ++jobsCancelled;
+    else if( err != ( i % 3 ? 0 : EIO ) )
+        ++wrongResult;
+
+    ++jobsDone;
+}
+
+static void
+addQuickJobs( void * unused UNUSED )
+{
+    int i;
+    for( i=0; i<JOB_COUNT; ++i )
+        tr_diskPoolAdd( session->diskPool, sessionDir, owner, quickJob, onJobDone, (void*)(intptr_t) i );
+}
+
+static void
+addSlowJobs( void * unused UNUSED )
+{
+    int i;
+    for( i=0; i<SLOW_JOB_COUNT; ++i )
+        tr_diskPoolAdd( session->diskPool, sessionDir, owner, slowJob, onJobDone, (void*)(intptr_t) 1 );
+}
+
+/* keep all the threads busy until isBlocked is cleared */
+static void
+addBlockers( void * unused UNUSED )
+{
+    int i;
+    isBlocked = TRUE;
+    for( i=0; i<BLOCKER_COUNT; ++i )
+        tr_diskPoolAdd( session->diskPool, sessionDir, otherOwner, blockerJob, NULL, NULL );
+}
+
+static void
+cancelJobs( void * unused UNUSED )
+{
+    tr_diskPoolCancel( session->diskPool, owner );
+}
+
+static void
+finishJobs( void * unused UNUSED )
+{
+    tr_diskPoolFinish( session->diskPool, owner );
+}
+
+static void
+finishBlockers( void * unused UNUSED )
+{
+    tr_diskPoolFinish( session->diskPool, otherOwner );
+}
+
+static tr_bool isBusy;
+
+static void
+checkBusy( void * unused UNUSED )
+{
+    isBusy = tr_diskPoolIsBusy( session->diskPool, sessionDir );
+}
+
+/***
+****
+***/
+
+static int
+testCompletion( void )
+{
+    int i;
+    int n;
+    uint64_t sum = 0;
+    tr_disk_stats stats[TR_DISK_MAX_DEVICES];
+
+    resetJobs( );
+    runInEventThread( addQuickJobs, NULL );
+    while( jobsDone < JOB_COUNT )
+        tr_wait( 1 );
+
+    check( jobsRun == JOB_COUNT );
+    check( wrongThread == 0 );
+    check( wrongResult == 0 );
+    check( jobsCancelled == 0 );
+
+    n = tr_diskPoolGetStats( session->diskPool, stats, TR_DISK_MAX_DEVICES );
+    check( n == 1 );
+    check( stats[0].queued == 0 );
+    check( stats[0].running == 0 );
+    check( stats[0].completed == JOB_COUNT );
+    for( i=0; i<TR_DISK_LATENCY_BUCKETS; ++i )
+        sum += stats[0].latency[i];
+    check( sum == JOB_COUNT );
+    return 0;
+}
+
+static int
+testConcurrency( void )
+{
+    uint64_t elapsed;
+    const uint64_t start = tr_date( );
+
+    resetJobs( );
+    runInEventThread( addSlowJobs, NULL );
+    while( jobsDone < SLOW_JOB_COUNT )
+        tr_wait( 1 );
+    elapsed = tr_date( ) - start;
+
+#ifdef VERBOSE
+    fprintf( stderr, "%d jobs of %d msec took %d msec\n",
+             SLOW_JOB_COUNT, SLOW_JOB_MSEC, (int)elapsed );
+#endif
+
+    /* one thread would take SLOW_JOB_COUNT * SLOW_JOB_MSEC */
+    check( jobsRun == SLOW_JOB_COUNT );
+    check( elapsed < ( SLOW_JOB_COUNT * SLOW_JOB_MSEC ) / 2 );
+    return 0;
+}
+
+static int
+testCancel( void )
+{
+    resetJobs( );
+    runInEventThread( addBlockers, NULL );
+    runInEventThread( addQuickJobs, NULL );
+
+    /* the jobs are all still queued behind the blockers,
+     * so they're dropped without being run */
+    runInEventThread( cancelJobs, NULL );
+    check( jobsDone == JOB_COUNT );
+    check( jobsCancelled == JOB_COUNT );
+    check( jobsRun == 0 );
+    check( wrongThread == 0 );
+
+    isBlocked = FALSE;
+    runInEventThread( finishBlockers, NULL );
+    check( jobsRun == 0 );
+    return 0;
+}
+
+static int
+testFinish( void )
+{
+    resetJobs( );
+    runInEventThread( addSlowJobs, NULL );
+    runInEventThread( finishJobs, NULL );
+
+    /* the callbacks were all called before tr_diskPoolFinish() returned */
+    check( jobsRun == SLOW_JOB_COUNT );
+    check( jobsDone == SLOW_JOB_COUNT );
+    check( jobsCancelled == 0 );
+    check( wrongResult == 0 );
+    return 0;
+}
+
+static int
+testBusy( void )
+{
+    resetJobs( );
+    runInEventThread( checkBusy, NULL );
+    check( !isBusy );
+
+    runInEventThread( addBlockers, NULL );
+    runInEventThread( addQuickJobs, NULL );
+    runInEventThread( checkBusy, NULL );
+    check( isBusy );
+
+    isBlocked = FALSE;
+    while( jobsDone < JOB_COUNT )
+        tr_wait( 1 );
+    runInEventThread( finishBlockers, NULL );
+    runInEventThread( checkBusy, NULL );
+    check( !isBusy );
+    check( jobsCancelled == 0 );
+    return 0;
+}
+
+int
+main( void )
+{
+    int          i;
+    char         dir[] = "/tmp/transmission-disk-pool-test-XXXXXX";
+    tr_benc      settings;
+
+    if( mkdtemp( dir ) == NULL )
+        return 1;
+    sessionDir = dir;
+
+    tr_bencInitDict( &settings, 0 );
+    tr_sessionGetDefaultSettings( &settings );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PEER_PORT_RANDOM_ENABLED, 1 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PORT_FORWARDING, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_RPC_ENABLED, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_MSGLEVEL, 0 );
+    session = tr_sessionInit( "disk-pool-test", dir, FALSE, &settings );
+
+    if( !( i = testCompletion( ) ) )
+        if( !( i = testConcurrency( ) ) )
+            if( !( i = testCancel( ) ) )
+                if( !( i = testFinish( ) ) )
+                    i = testBusy( );
+
+    tr_sessionClose( session );
+    tr_bencFree( &settings );
+    rmdir( dir );
+    return i;
+}
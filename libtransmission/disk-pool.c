@@ -0,0 +1,555 @@
+/*
+ * This file Copyright (C) 2009 Charles Kerr <charles@transmissionbt.com>
+ *
+ * This file is licensed by the GPL version 2.  Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <errno.h> /* ECANCELED */
+#include <string.h> /* strcmp */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "transmission.h"
+#include "platform.h" /* tr_lock, tr_cond, tr_thread */
+#include "disk-pool.h"
+#include "list.h"
+#include "session.h"
+#include "trevent.h" /* tr_runInEventThread */
+#include "utils.h"
+
+enum
+{
+    /* how many threads do disk I/O */
+    THREAD_COUNT = 4,
+
+    /* a device with more jobs than this waiting is busy */
+    BUSY_QUEUE_DEPTH = 32,
+
+    /* how many done callbacks to call before yielding the event thread */
+    MAX_DELIVERIES_PER_PASS = 64
+};
+
+struct disk_job
+{
+    const void        * owner;
+    tr_disk_job_func    func;
+    tr_disk_done_func   done;
+    void              * user_data;
+    int                 device;
+    int                 err;
+    uint64_t            queuedAt;
+    struct __tr_list    head; /* in its device's queue, `running', or `done' */
+};
+
+struct disk_device
+{
+    dev_t               id;
+    char              * path;
+    struct __tr_list    queue;
+    int                 queued;
+    int                 running;
+    uint64_t            completed;
+    uint64_t            stolen;
+    uint64_t            latency[TR_DISK_LATENCY_BUCKETS];
+};
+
+/* which device a directory is on.  only the event thread uses these */
+struct known_dir
+{
+    char              * path;
+    int                 device;
+};
+
+struct disk_worker
+{
+    tr_disk_pool      * pool;
+    int                 index;
+};
+
+struct tr_disk_pool
+{
+    tr_session          * session;
+    tr_lock             * lock;
+    tr_cond             * workAdded;  /* signalled when a job is queued */
+    tr_cond             * jobDone;    /* broadcast when a job is done */
+
+    struct disk_device ** devices;
+    int                   deviceCount;
+    struct known_dir    * dirs;
+    int                   dirCount;
+
+    struct __tr_list      running;
+    struct __tr_list      done;       /* waiting for deliverDone() */
+    tr_bool               isDeliveryPending;
+
+    tr_bool               isClosing;
+    int                   threadCount;
+};
+
+/***
+****
+***/
+
+static void
+poolLock( tr_disk_pool * pool )
+{
+    tr_lockLock( pool->lock );
+}
+
+static void
+poolUnlock( tr_disk_pool * pool )
+{
+    tr_lockUnlock( pool->lock );
+}
+
+static tr_bool
+listIsEmpty( const struct __tr_list * list )
+{
+    return list->next == list;
+}
+
+static struct disk_job*
+jobAt( struct __tr_list * node )
+{
+    return __tr_list_entry( node, struct disk_job, head );
+}
+
+/* call the done callbacks of the jobs in `list', and free them */
+static void
+callDoneFuncs( struct __tr_list * list )
+{
+    while( !listIsEmpty( list ) )
+    {
+        struct disk_job * job = jobAt( list->next );
+        __tr_list_remove( &job->head );
+        if( job->done != NULL )
+            ( job->done )( job->err, job->user_data );
+        tr_free( job );
+    }
+}
+
+/* move the owner's jobs from `from' to the end of `to'.
+ * the pool must be locked */
+static int
+moveOwnersJobs( struct __tr_list * from,
+                struct __tr_list * to,
+                const void       * owner )
+{
+    int count = 0;
+    struct __tr_list * walk;
+    struct __tr_list * next;
+
+    for( walk=from->next; walk!=from; walk=next )
+    {
+        next = walk->next;
+        if( jobAt( walk )->owner == owner ) {
+            __tr_list_remove( walk );
+            __tr_list_append( to, walk );
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+static tr_bool
+hasOwnersJobs( const struct __tr_list * list, const void * owner )
+{
+    const struct __tr_list * walk;
+
+    for( walk=list->next; walk!=list; walk=walk->next )
+        if( __tr_list_entry( walk, struct disk_job, head )->owner == owner )
+            return TRUE;
+
+    return FALSE;
+}
+
+/***
+****  Devices
+***/
+
+/* the device that holds `path'.  only called from the event thread */
+static int
+findDevice( tr_disk_pool * pool, const char * path )
+{
+    int i;
+    struct stat sb;
+    dev_t id = 0;
+    struct known_dir * dir;
+
+    for( i=0; i<pool->dirCount; ++i )
+        if( !strcmp( pool->dirs[i].path, path ) )
+            return pool->dirs[i].device;
+
+    /* if we can't stat it, lump it in with the others we couldn't */
+    if( !stat( path, &sb ) )
+        id = sb.st_dev;
+
+    poolLock( pool );
+
+    for( i=0; i<pool->deviceCount; ++i )
+        if( pool->devices[i]->id == id )
+            break;
+
+    if( i == pool->deviceCount )
+    {
+        struct disk_device * device = tr_new0( struct disk_device, 1 );
+        device->id = id;
+        device->path = tr_strdup( path );
+        __tr_list_init( &device->queue );
+        pool->devices = tr_renew( struct disk_device *, pool->devices, pool->deviceCount + 1 );
+        pool->devices[pool->deviceCount++] = device;
+    }
+
+    poolUnlock( pool );
+
+    pool->dirs = tr_renew( struct known_dir, pool->dirs, pool->dirCount + 1 );
+    dir = &pool->dirs[pool->dirCount++];
+    dir->path = tr_strdup( path );
+    dir->device = i;
+    return i;
+}
+
+/* the next job for a thread whose own device is `home', or NULL.
+ * the pool must be locked */
+static struct disk_job*
+takeJob( tr_disk_pool * pool, int home )
+{
+    int i;
+    struct disk_device * device;
+    struct disk_job * job;
+
+    if( !pool->deviceCount )
+        return NULL;
+
+    device = pool->devices[home % pool->deviceCount];
+
+    /* steal from the device with the longest queue */
+    if( listIsEmpty( &device->queue ) )
+    {
+        struct disk_device * busiest = NULL;
+
+        for( i=0; i<pool->deviceCount; ++i )
+            if( !busiest || ( pool->devices[i]->queued > busiest->queued ) )
+                busiest = pool->devices[i];
+
+        if( !busiest->queued )
+            return NULL;
+
+        device = busiest;
+        device->stolen++;
+    }
+
+    job = jobAt( device->queue.next );
+    __tr_list_remove( &job->head );
+    __tr_list_append( &pool->running, &job->head );
+    device->queued--;
+    device->running++;
+    return job;
+}
+
+/***
+****  The threads
+***/
+
+static void
+deliverDone( void * vsession )
+{
+    int i;
+    tr_session * session = vsession;
+    tr_disk_pool * pool = session->diskPool;
+
+    if( pool == NULL ) /* it's been freed */
+        return;
+
+    /* take the jobs one at a time, since a callback can cancel the
+     * jobs that are behind it.  if there are a lot of them, let the
+     * event thread do other work between batches */
+    for( i=0; i<MAX_DELIVERIES_PER_PASS; ++i )
+    {
+        struct disk_job * job = NULL;
+
+        poolLock( pool );
+        if( !listIsEmpty( &pool->done ) ) {
+            job = jobAt( pool->done.next );
+            __tr_list_remove( &job->head );
+        }
+        poolUnlock( pool );
+
+        if( job == NULL )
+            break;
+
+        if( job->done != NULL )
+            ( job->done )( job->err, job->user_data );
+        tr_free( job );
+    }
+
+    poolLock( pool );
+    if( listIsEmpty( &pool->done ) )
+        pool->isDeliveryPending = FALSE;
+    else
+        tr_runInEventThread( pool->session, deliverDone, pool->session );
+    poolUnlock( pool );
+}
+
+/* the pool must be locked */
+static void
+jobIsDone( tr_disk_pool * pool, struct disk_job * job, int err )
+{
+    int bucket;
+    struct disk_device * device = pool->devices[job->device];
+    const uint64_t msec = tr_date( ) - job->queuedAt;
+
+    for( bucket=0; bucket<TR_DISK_LATENCY_BUCKETS-1; ++bucket )
+        if( msec < ( (uint64_t)1 << bucket ) )
+            break;
+
+    device->running--;
+    device->completed++;
+    device->latency[bucket]++;
+
+    job->err = err;
+    __tr_list_remove( &job->head );
+    __tr_list_append( &pool->done, &job->head );
+    tr_condBroadcast( pool->jobDone );
+
+    if( !pool->isDeliveryPending ) {
+        pool->isDeliveryPending = TRUE;
+        tr_runInEventThread( pool->session, deliverDone, pool->session );
+    }
+}
+
+static void
+workerFunc( void * vworker )
+{
+    struct disk_worker * worker = vworker;
+    tr_disk_pool * pool = worker->pool;
+
+    poolLock( pool );
+
+    for( ;; )
+    {
+        struct disk_job * job = takeJob( pool, worker->index );
+
+        if( job != NULL )
+        {
+            int err;
+            poolUnlock( pool );
+            err = ( job->func )( job->user_data );
+            poolLock( pool );
+            jobIsDone( pool, job, err );
+        }
+        else if( pool->isClosing )
+        {
+            break;
+        }
+        else
+        {
+            tr_condWait( pool->workAdded, pool->lock );
+        }
+    }
+
+    pool->threadCount--;
+    tr_condBroadcast( pool->jobDone );
+    poolUnlock( pool );
+    tr_free( worker );
+}
+
+/***
+****
+***/
+
+tr_disk_pool *
+tr_diskPoolNew( tr_session * session )
+{
+    int i;
+    tr_disk_pool * pool = tr_new0( tr_disk_pool, 1 );
+
+    pool->session = session;
+    pool->lock = tr_lockNew( );
+    pool->workAdded = tr_condNew( );
+    pool->jobDone = tr_condNew( );
+    __tr_list_init( &pool->running );
+    __tr_list_init( &pool->done );
+
+    for( i=0; i<THREAD_COUNT; ++i )
+    {
+        struct disk_worker * worker = tr_new( struct disk_worker, 1 );
+        worker->pool = pool;
+        worker->index = i;
+        pool->threadCount++;
+        tr_threadNew( workerFunc, worker );
+    }
+
+    return pool;
+}
+
+void
+tr_diskPoolFree( tr_disk_pool * pool )
+{
+    int i;
+    struct __tr_list done;
+
+    /* the threads don't leave while there's work queued */
+    poolLock( pool );
+    pool->isClosing = TRUE;
+    tr_condBroadcast( pool->workAdded );
+    while( pool->threadCount > 0 )
+        tr_condWait( pool->jobDone, pool->lock );
+    __tr_list_init( &done );
+    if( !listIsEmpty( &pool->done ) ) {
+        __tr_list_insert( &done, pool->done.prev, pool->done.next );
+        __tr_list_init( &pool->done );
+    }
+    poolUnlock( pool );
+
+    callDoneFuncs( &done );
+
+    for( i=0; i<pool->deviceCount; ++i ) {
+        tr_free( pool->devices[i]->path );
+        tr_free( pool->devices[i] );
+    }
+    for( i=0; i<pool->dirCount; ++i )
+        tr_free( pool->dirs[i].path );
+    tr_free( pool->devices );
+    tr_free( pool->dirs );
+    tr_condFree( pool->jobDone );
+    tr_condFree( pool->workAdded );
+    tr_lockFree( pool->lock );
+    tr_free( pool );
+}
+
+void
+tr_diskPoolAdd( tr_disk_pool      * pool,
+                const char        * path,
+                const void        * owner,
+                tr_disk_job_func    func,
+                tr_disk_done_func   done,
+                void              * user_data )
+{
+    struct disk_job * job;
+
+    assert( pool != NULL );
+    assert( func != NULL );
+    assert( tr_amInEventThread( pool->session ) );
+
+    job = tr_new0( struct disk_job, 1 );
+    job->owner = owner;
+    job->func = func;
+    job->done = done;
+    job->user_data = user_data;
+    job->device = findDevice( pool, path );
+    job->queuedAt = tr_date( );
+
+    poolLock( pool );
+    __tr_list_append( &pool->devices[job->device]->queue, &job->head );
+    pool->devices[job->device]->queued++;
+    tr_condSignal( pool->workAdded );
+    poolUnlock( pool );
+}
+
+tr_bool
+tr_diskPoolIsBusy( tr_disk_pool * pool, const char * path )
+{
+    int queued;
+    const int device = findDevice( pool, path );
+
+    poolLock( pool );
+    queued = pool->devices[device]->queued;
+    poolUnlock( pool );
+
+    return queued > BUSY_QUEUE_DEPTH;
+}
+
+void
+tr_diskPoolCancel( tr_disk_pool * pool, const void * owner )
+{
+    int i;
+    struct __tr_list * walk;
+    struct __tr_list cancelled;
+
+    assert( tr_amInEventThread( pool->session ) );
+
+    __tr_list_init( &cancelled );
+
+    poolLock( pool );
+
+    for( i=0; i<pool->deviceCount; ++i )
+        pool->devices[i]->queued -= moveOwnersJobs( &pool->devices[i]->queue, &cancelled, owner );
+
+    while( hasOwnersJobs( &pool->running, owner ) )
+        tr_condWait( pool->jobDone, pool->lock );
+
+    moveOwnersJobs( &pool->done, &cancelled, owner );
+
+    poolUnlock( pool );
+
+    for( walk=cancelled.next; walk!=&cancelled; walk=walk->next )
+        jobAt( walk )->err = ECANCELED;
+    callDoneFuncs( &cancelled );
+}
+
+void
+tr_diskPoolFinish( tr_disk_pool * pool, const void * owner )
+{
+    int i;
+    struct __tr_list finished;
+
+    assert( tr_amInEventThread( pool->session ) );
+
+    __tr_list_init( &finished );
+
+    poolLock( pool );
+
+    for( ;; )
+    {
+        tr_bool isWaiting = hasOwnersJobs( &pool->running, owner );
+        for( i=0; !isWaiting && i<pool->deviceCount; ++i )
+            isWaiting = hasOwnersJobs( &pool->devices[i]->queue, owner );
+        if( !isWaiting )
+            break;
+        tr_condWait( pool->jobDone, pool->lock );
+    }
+
+    moveOwnersJobs( &pool->done, &finished, owner );
+
+    poolUnlock( pool );
+
+    callDoneFuncs( &finished );
+}
+
+int
+tr_diskPoolGetStats( tr_disk_pool  * pool,
+                     tr_disk_stats * setme,
+                     int             maxCount )
+{
+    int i;
+    int n;
+
+    poolLock( pool );
+
+    n = MIN( pool->deviceCount, maxCount );
+    for( i=0; i<n; ++i )
+    {
+        const struct disk_device * device = pool->devices[i];
+        tr_disk_stats * stats = &setme[i];
+
+        tr_strlcpy( stats->path, device->path, sizeof( stats->path ) );
+        stats->queued = device->queued;
+        stats->running = device->running;
+        stats->completed = device->completed;
+        stats->stolen = device->stolen;
+        memcpy( stats->latency, device->latency, sizeof( stats->latency ) );
+    }
+
+    poolUnlock( pool );
+    return n;
+}
@@ -0,0 +1,106 @@
+/*
+ * This file Copyright (C) 2009 Charles Kerr <charles@transmissionbt.com>
+ *
+ * This file is licensed by the GPL version 2.  Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_DISK_POOL_H
+#define TR_DISK_POOL_H 1
+
+#include "platform.h" /* MAX_PATH_LENGTH */
+
+/**
+ * A session-wide pool of threads that do disk I/O, so that the event
+ * thread never has to wait on storage.
+ *
+ * Jobs are queued by the device their files are on.  Each thread
+ * prefers the jobs of one device, so that a slow disk can't take
+ * every thread, but steals from the busiest queue when its own is
+ * empty.  When a job is done, its `done' callback is called in the
+ * event thread.
+ */
+typedef struct tr_disk_pool tr_disk_pool;
+
+/** @brief does a job's work in one of the pool's threads.
+    @return 0 on success, or an errno value on failure */
+typedef int  ( *tr_disk_job_func )( void * user_data );
+
+/** @brief called in the event thread when a job is done, with the
+           job's return value.  `err' is ECANCELED if the job was
+           cancelled with tr_diskPoolCancel() */
+typedef void ( *tr_disk_done_func )( int err, void * user_data );
+
+enum
+{
+    /* bucket 0 counts the jobs that were done within 1 msec of being
+       queued, bucket 1 within 2 msec, bucket 2 within 4 msec, and so
+       on.  the last bucket counts everything slower than that */
+    TR_DISK_LATENCY_BUCKETS = 12,
+
+    /* the most devices tr_diskPoolGetStats() reports on */
+    TR_DISK_MAX_DEVICES = 16
+};
+
+typedef struct tr_disk_stats
+{
+    char        path[MAX_PATH_LENGTH]; /* the first directory seen on this device */
+    int         queued;                /* jobs waiting for a thread */
+    int         running;               /* jobs being done right now */
+    uint64_t    completed;
+    uint64_t    stolen;                /* jobs done by another device's thread */
+    uint64_t    latency[TR_DISK_LATENCY_BUCKETS];
+}
+tr_disk_stats;
+
+tr_disk_pool * tr_diskPoolNew( tr_session * session );
+
+/** @brief finishes any jobs that are left, and stops the threads */
+void           tr_diskPoolFree( tr_disk_pool * pool );
+
+/**
+ * Queue a job on the device that holds `path'.
+ * `owner' is only used to find the job again in tr_diskPoolCancel()
+ * and tr_diskPoolFinish().
+ */
+void           tr_diskPoolAdd( tr_disk_pool      * pool,
+                               const char        * path,
+                               const void        * owner,
+                               tr_disk_job_func    job,
+                               tr_disk_done_func   done,
+                               void              * user_data );
+
+/** @return true if the device that holds `path' has a backlog,
+            so new work for it should wait */
+tr_bool        tr_diskPoolIsBusy( tr_disk_pool * pool,
+                                  const char   * path );
+
+/**
+ * Drop the owner's jobs.  Any that are running are waited for.
+ * Their done callbacks are called before this returns, with ECANCELED.
+ */
+void           tr_diskPoolCancel( tr_disk_pool * pool,
+                                  const void   * owner );
+
+/**
+ * Wait for all of the owner's jobs to be done.  Their done callbacks
+ * are called before this returns.
+ */
+void           tr_diskPoolFinish( tr_disk_pool * pool,
+                                  const void   * owner );
+
+/** @return the number of devices whose stats were put in `setme' */
+int            tr_diskPoolGetStats( tr_disk_pool  * pool,
+                                    tr_disk_stats * setme,
+                                    int             maxCount );
+
+#endif
@@ -26,6 +26,12 @@
  #define HAVE_GETRLIMIT
 #endif
 
+#ifdef HAVE_SYNC_FILE_RANGE
+ #ifndef _GNU_SOURCE
+  #define _GNU_SOURCE /* sync_file_range */
+ #endif
+#endif
+
 #ifdef HAVE_POSIX_FADVISE
  #ifdef _XOPEN_SOURCE
   #undef _XOPEN_SOURCE
@@ -49,12 +55,12 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h> /* gettimeofday */
 #ifdef HAVE_GETRLIMIT
- #include <sys/time.h> /* getrlimit */
  #include <sys/resource.h> /* getrlimit */
 #endif
 #include <unistd.h>
-#include <fcntl.h> /* O_LARGEFILE posix_fadvise */
+#include <fcntl.h> /* O_LARGEFILE posix_fadvise sync_file_range */
 
 #include <evutil.h>
 
@@ -77,22 +83,36 @@
 
 enum
 {
-    NOFILE_BUFFER = 512, /* the process' number of open files is
-                            globalMaxPeers + NOFILE_BUFFER */
+    NOFILE_BUFFER = 512,    /* the process' number of open files is
+                               globalMaxPeers + NOFILE_BUFFER */
 
-    SYNC_INTERVAL = 15   /* (arbitrary number) how many seconds to go
-                            between fsync calls for files in heavy use */
+    WRITEBACK_BYTES = 4194304 /* in TR_SYNC_WRITEBACK mode, how much can be
+                                 written to a file before we ask the OS to
+                                 start writing it out */
 };
 
+#if defined( HAVE_PREAD ) && defined( HAVE_PWRITE )
+ /* inout.c uses pread() and pwrite(), which don't touch the fd's file
+  * position, so any number of callers can share a checked-out file */
+ #define SHARE_OPEN_FILES 1
+#endif
+
 struct tr_openfile
 {
-    tr_bool    isCheckedOut;
-    tr_bool    isWritable;
-    tr_bool    closeWhenDone;
-    char       filename[MAX_PATH_LENGTH];
-    int        fd;
-    uint64_t   date;
-    time_t     syncAt;
+    int                  torrentId;
+    tr_file_index_t      fileNum;
+    int                  fd;
+    int                  refCount;
+    tr_bool              isWritable;
+    tr_bool              closeWhenDone;
+
+    uint64_t             dirtyBegin;    /* the span written since the last writeback */
+    uint64_t             dirtyEnd;
+    uint64_t             dirtyBytes;
+    uint64_t             unsyncedBytes; /* bytes written since the last sync */
+
+    struct tr_openfile * hashNext; /* next file in the same bucket */
+    struct __tr_list     lru;      /* gFd->lru if idle, gFd->unused if closed */
 };
 
 struct tr_fd_s
@@ -103,9 +123,23 @@ struct tr_fd_s
     struct tr_openfile  * openFiles;
     int                   openFileLimit;
 
+    /* open files, hashed by torrent id and file number */
+    struct tr_openfile ** buckets;
+    unsigned int          bucketMask;
+
+    /* open files, indexed by their fd, for tr_fdFileReturn() */
+    struct tr_openfile ** fds;
+    int                   fdsSize;
+
+    struct __tr_list      lru;    /* open but idle files; oldest first */
+    struct __tr_list      unused; /* slots that don't have an open file */
+
+    tr_sync_mode          syncMode;
+    tr_sync_stats         syncStats;
+
     tr_lock             * lock;
+    tr_cond             * fileReleased; /* broadcast when a file's refCount drops to 0 */
 };
-
 static struct tr_fd_s * gFd = NULL;
 
 /***
@@ -198,14 +232,13 @@ preallocateFileFull( const char * filename, uint64_t length )
  * plus the errno values set by tr_mkdirp() and open().
  */
 static int
-TrOpenFile( int                      i,
+TrOpenFile( struct tr_openfile     * file,
             const char             * folder,
             const char             * torrentFile,
             tr_bool                  doWrite,
             tr_preallocation_mode    preallocationMode,
             uint64_t                 desiredFileSize )
 {
-    struct tr_openfile * file = &gFd->openFiles[i];
     int                  flags;
     char               * filename;
     struct stat          sb;
@@ -269,224 +302,479 @@ TrOpenFile( int                      i,
     posix_fadvise( file->fd, 0, 0, POSIX_FADV_RANDOM );
 #endif
 
+    dbgmsg( "opened '%s' as fd %d, doWrite %c", filename, file->fd, doWrite ? 'y' : 'n' );
     tr_free( filename );
     return 0;
 }
 
-static int
-fileIsOpen( const struct tr_openfile * o )
+/**
+***
+**/
+
+static unsigned int
+getBucket( int torrentId, tr_file_index_t fileNum )
 {
-    return o->fd >= 0;
+    const unsigned int hash = ( (unsigned int)torrentId * 2654435761u ) ^ fileNum;
+    return hash & gFd->bucketMask;
+}
+
+static struct tr_openfile*
+findOpenFile( int torrentId, tr_file_index_t fileNum )
+{
+    struct tr_openfile * o;
+
+    for( o=gFd->buckets[getBucket( torrentId, fileNum )]; o!=NULL; o=o->hashNext )
+        if( ( o->torrentId == torrentId ) && ( o->fileNum == fileNum ) )
+            break;
+
+    return o;
 }
 
 static void
-TrCloseFile( int i )
+hashAdd( struct tr_openfile * o )
 {
-    struct tr_openfile * o = &gFd->openFiles[i];
+    struct tr_openfile ** bucket = &gFd->buckets[getBucket( o->torrentId, o->fileNum )];
+    o->hashNext = *bucket;
+    *bucket = o;
+}
 
-    assert( i >= 0 );
-    assert( i < gFd->openFileLimit );
-    assert( fileIsOpen( o ) );
+/* this is a no-op if the file isn't in the table */
+static void
+hashRemove( struct tr_openfile * o )
+{
+    struct tr_openfile ** walk = &gFd->buckets[getBucket( o->torrentId, o->fileNum )];
 
+    while( *walk && ( *walk != o ) )
+        walk = &(*walk)->hashNext;
+    if( *walk )
+        *walk = o->hashNext;
+    o->hashNext = NULL;
+}
+
+static void
+fdsSet( int fd, struct tr_openfile * o )
+{
+    assert( fd >= 0 );
+
+    if( fd >= gFd->fdsSize )
+    {
+        const int n = MAX( fd + 1, gFd->fdsSize * 2 );
+        gFd->fds = tr_renew( struct tr_openfile*, gFd->fds, n );
+        memset( gFd->fds + gFd->fdsSize, 0, sizeof( struct tr_openfile* ) * ( n - gFd->fdsSize ) );
+        gFd->fdsSize = n;
+    }
+
+    gFd->fds[fd] = o;
+}
+
+static void
+TrCloseFile( struct tr_openfile * o )
+{
+    assert( o->fd >= 0 );
+    assert( o->refCount == 0 );
+
+    dbgmsg( "closing fd %d", o->fd );
     close( o->fd );
+    fdsSet( o->fd, NULL );
+    hashRemove( o );
     o->fd = -1;
-    o->isCheckedOut = 0;
+    o->closeWhenDone = 0;
+
+    /* move it from the idle list to the unused list */
+    __tr_list_remove( &o->lru );
+    __tr_list_append( &gFd->unused, &o->lru );
 }
 
-static int
-fileIsCheckedOut( const struct tr_openfile * o )
+/* the caller must hold the lock.
+ * returns a slot to open a file in, or NULL if all are in use */
+static struct tr_openfile*
+getUnusedSlot( void )
+{
+    struct tr_openfile * o = NULL;
+
+    if( gFd->unused.next == &gFd->unused )
+    {
+        /* close the file that's been idle the longest */
+        if( gFd->lru.next != &gFd->lru )
+            TrCloseFile( __tr_list_entry( gFd->lru.next, struct tr_openfile, lru ) );
+    }
+
+    if( gFd->unused.next != &gFd->unused )
+    {
+        o = __tr_list_entry( gFd->unused.next, struct tr_openfile, lru );
+        __tr_list_remove( &o->lru );
+    }
+
+    return o;
+}
+
+/* the caller must hold the lock */
+static struct tr_openfile*
+findFd( int fd )
 {
-    return fileIsOpen( o ) && o->isCheckedOut;
+    struct tr_openfile * o = ( 0 <= fd ) && ( fd < gFd->fdsSize ) ? gFd->fds[fd] : NULL;
+    assert( o != NULL );
+    assert( o->refCount > 0 );
+    return o;
+}
+
+/* the caller must hold the lock.
+ * the file is in use now, so it's no longer a candidate for closing */
+static void
+holdFile( struct tr_openfile * o )
+{
+    if( !o->refCount++ )
+        __tr_list_remove( &o->lru );
+}
+
+/* the caller must hold the lock */
+static void
+releaseFile( struct tr_openfile * o )
+{
+    if( o && !--o->refCount )
+    {
+        __tr_list_append( &gFd->lru, &o->lru );
+
+        if( o->closeWhenDone )
+            TrCloseFile( o );
+
+        /* wake up anyone in tr_fdFileCheckout() waiting for this
+         * file or for a free slot */
+        tr_condBroadcast( gFd->fileReleased );
+    }
 }
 
 /* returns an fd on success, or a -1 on failure and sets errno */
 int
-tr_fdFileCheckout( const char             * folder,
+tr_fdFileCheckout( int                      torrentId,
+                   tr_file_index_t          fileNum,
+                   const char             * folder,
                    const char             * torrentFile,
                    tr_bool                  doWrite,
                    tr_preallocation_mode    preallocationMode,
                    uint64_t                 desiredFileSize )
 {
-    int i, winner = -1;
     struct tr_openfile * o;
-    char filename[MAX_PATH_LENGTH];
 
     assert( folder && *folder );
     assert( torrentFile && *torrentFile );
     assert( doWrite == 0 || doWrite == 1 );
 
-    tr_snprintf( filename, sizeof( filename ), "%s%c%s", folder, TR_PATH_DELIMITER, torrentFile );
-    dbgmsg( "looking for file '%s', writable %c", filename, doWrite ? 'y' : 'n' );
+    dbgmsg( "looking for torrent %d file %lu, writable %c",
+            torrentId, (unsigned long)fileNum, doWrite ? 'y' : 'n' );
 
     tr_lockLock( gFd->lock );
 
-    /* Is it already open? */
-    for( i = 0; i < gFd->openFileLimit; ++i )
+    for( ;; )
     {
-        o = &gFd->openFiles[i];
-
-        if( !fileIsOpen( o ) )
-            continue;
+        tr_bool mustWait = FALSE;
 
-        if( strcmp( filename, o->filename ) )
-            continue;
-
-        if( fileIsCheckedOut( o ) )
+        if(( o = findOpenFile( torrentId, fileNum )))
         {
-            dbgmsg( "found it!  it's open, but checked out.  waiting..." );
-            tr_lockUnlock( gFd->lock );
-            tr_wait( 200 );
-            tr_lockLock( gFd->lock );
-            i = -1; /* reloop */
-            continue;
+            if( doWrite && !o->isWritable )
+            {
+                /* reopen it read-write once nobody's using it */
+                if( o->refCount )
+                    mustWait = TRUE;
+                else {
+                    TrCloseFile( o );
+                    o = NULL;
+                }
+            }
+#ifndef SHARE_OPEN_FILES
+            else if( o->refCount )
+            {
+                mustWait = TRUE;
+            }
+#endif
         }
 
-        if( doWrite && !o->isWritable )
+        if( !mustWait && ( o == NULL ) )
         {
-            dbgmsg(
-                "found it!  it's open and available, but isn't writable. closing..." );
-            TrCloseFile( i );
-            break;
+            if(( o = getUnusedSlot( )))
+            {
+                const int err = TrOpenFile( o, folder, torrentFile, doWrite, preallocationMode, desiredFileSize );
+                if( err ) {
+                    __tr_list_append( &gFd->unused, &o->lru );
+                    tr_lockUnlock( gFd->lock );
+                    errno = err;
+                    return -1;
+                }
+
+                o->torrentId = torrentId;
+                o->fileNum = fileNum;
+                o->isWritable = doWrite;
+                o->dirtyBytes = 0;
+                o->unsyncedBytes = 0;
+                hashAdd( o );
+                fdsSet( o->fd, o );
+                __tr_list_append( &gFd->lru, &o->lru );
+            }
+            else
+            {
+                dbgmsg( "everything's full!  waiting for someone else to finish something" );
+                mustWait = TRUE;
+            }
         }
 
-        dbgmsg( "found it!  it's ready for use!" );
-        winner = i;
-        break;
+        if( !mustWait )
+            break;
+
+        tr_condWait( gFd->fileReleased, gFd->lock );
     }
 
-    dbgmsg(
-        "it's not already open.  looking for an open slot or an old file." );
-    while( winner < 0 )
-    {
-        uint64_t date = tr_date( ) + 1;
+    holdFile( o );
 
-        /* look for the file that's been open longest */
-        for( i = 0; i < gFd->openFileLimit; ++i )
-        {
-            o = &gFd->openFiles[i];
+    tr_lockUnlock( gFd->lock );
+    return o->fd;
+}
 
-            if( !fileIsOpen( o ) )
-            {
-                winner = i;
-                dbgmsg( "found an empty slot in %d", winner );
-                break;
-            }
+void
+tr_fdFileReturn( int fd )
+{
+    tr_lockLock( gFd->lock );
 
-            if( date > o->date )
-            {
-                date = o->date;
-                winner = i;
-            }
-        }
+    releaseFile( findFd( fd ) );
+
+    tr_lockUnlock( gFd->lock );
+}
+
+void
+tr_fdFileClose( int torrentId, tr_file_index_t fileNum )
+{
+    struct tr_openfile * o;
+
+    tr_lockLock( gFd->lock );
 
-        if( winner >= 0 )
+    if(( o = findOpenFile( torrentId, fileNum )))
+    {
+        if( !o->refCount )
         {
-            if( fileIsOpen( &gFd->openFiles[winner] ) )
-            {
-                dbgmsg( "closing file '%s', slot #%d",
-                        gFd->openFiles[winner].filename,
-                        winner );
-                TrCloseFile( winner );
-            }
+            TrCloseFile( o );
         }
         else
         {
-            dbgmsg( "everything's full!  waiting for someone else to finish something" );
-            tr_lockUnlock( gFd->lock );
-            tr_wait( 200 );
-            tr_lockLock( gFd->lock );
+            /* take it out of the table so that nobody else gets it,
+             * and close it when the last user returns it */
+            dbgmsg( "flagging fd %d to be closed when checked in", o->fd );
+            hashRemove( o );
+            o->closeWhenDone = 1;
         }
     }
 
-    assert( winner >= 0 );
-    o = &gFd->openFiles[winner];
-    if( !fileIsOpen( o ) )
+    tr_lockUnlock( gFd->lock );
+}
+
+/***
+****
+****  Getting written data out to disk
+****
+***/
+
+static uint64_t
+usecNow( void )
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+
+static int
+syncFd( int fd )
+{
+#ifdef HAVE_FDATASYNC
+    return fdatasync( fd );
+#else
+    return fsync( fd );
+#endif
+}
+
+void
+tr_fdSetSyncMode( tr_sync_mode mode )
+{
+    assert( tr_isSyncMode( mode ) );
+
+    tr_lockLock( gFd->lock );
+    gFd->syncMode = mode;
+    tr_lockUnlock( gFd->lock );
+}
+
+tr_sync_mode
+tr_fdGetSyncMode( void )
+{
+    return gFd->syncMode;
+}
+
+void
+tr_fdGetSyncStats( tr_sync_stats * setme )
+{
+    tr_lockLock( gFd->lock );
+    *setme = gFd->syncStats;
+    tr_lockUnlock( gFd->lock );
+}
+
+/* this only starts the writes, so it doesn't wait on the disk */
+static void
+startWriteback( int       fd UNUSED,
+                uint64_t  begin UNUSED,
+                uint64_t  end UNUSED,
+                uint64_t  bytes UNUSED )
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+    const uint64_t start = usecNow( );
+
+    dbgmsg( "writing back %"PRIu64" bytes of fd %d", bytes, fd );
+    sync_file_range( fd, (off_t)begin, (off_t)( end - begin ), SYNC_FILE_RANGE_WRITE );
+
+    tr_lockLock( gFd->lock );
+    gFd->syncStats.writebacks++;
+    gFd->syncStats.flushedBytes += bytes;
+    gFd->syncStats.usec += usecNow( ) - start;
+    tr_lockUnlock( gFd->lock );
+#endif
+}
+
+void
+tr_fdFileWritten( int fd, uint64_t offset, uint64_t len )
+{
+    struct tr_openfile * o;
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    uint64_t bytes = 0;
+
+    tr_lockLock( gFd->lock );
+
+    o = findFd( fd );
+    o->unsyncedBytes += len;
+
+    if( gFd->syncMode != TR_SYNC_NONE )
     {
-        const int err = TrOpenFile( winner, folder, torrentFile, doWrite, preallocationMode, desiredFileSize );
-        if( err ) {
-            tr_lockUnlock( gFd->lock );
-            errno = err;
-            return -1;
+        if( !o->dirtyBytes ) {
+            o->dirtyBegin = offset;
+            o->dirtyEnd = offset + len;
+        } else {
+            o->dirtyBegin = MIN( o->dirtyBegin, offset );
+            o->dirtyEnd = MAX( o->dirtyEnd, offset + len );
         }
+        o->dirtyBytes += len;
 
-        dbgmsg( "opened '%s' in slot %d, doWrite %c", filename, winner,
-                doWrite ? 'y' : 'n' );
-        tr_strlcpy( o->filename, filename, sizeof( o->filename ) );
-        o->isWritable = doWrite;
-        o->syncAt = time( NULL ) + SYNC_INTERVAL;
+        if( o->dirtyBytes >= WRITEBACK_BYTES ) {
+            begin = o->dirtyBegin;
+            end = o->dirtyEnd;
+            bytes = o->dirtyBytes;
+            o->dirtyBytes = 0;
+        }
     }
 
-    dbgmsg( "checking out '%s' in slot %d", filename, winner );
-    o->isCheckedOut = 1;
-    o->closeWhenDone = 0;
-    o->date = tr_date( );
     tr_lockUnlock( gFd->lock );
-    return o->fd;
+
+    /* the caller still has the file checked out,
+     * so it's safe to use without the lock */
+    if( bytes )
+        startWriteback( fd, begin, end, bytes );
 }
 
-void
-tr_fdFileReturn( int fd )
+/* the caller must hold the lock.  the lock is released while the file's
+ * being synced, so other threads can keep using the other files */
+static int
+syncFile( struct tr_openfile * o )
+{
+    int err = 0;
+    const uint64_t bytes = o->unsyncedBytes;
+
+    if( o->isWritable && bytes )
+    {
+        uint64_t start;
+        const int fd = o->fd;
+
+        o->unsyncedBytes = 0;
+        o->dirtyBytes = 0;
+        holdFile( o );
+        tr_lockUnlock( gFd->lock );
+
+        dbgmsg( "syncing %"PRIu64" bytes of fd %d", bytes, fd );
+        start = usecNow( );
+        if( syncFd( fd ) )
+            err = errno;
+
+        tr_lockLock( gFd->lock );
+        gFd->syncStats.syncs++;
+        gFd->syncStats.flushedBytes += bytes;
+        gFd->syncStats.usec += usecNow( ) - start;
+        releaseFile( o );
+    }
+
+    return err;
+}
+
+int
+tr_fdFileSync( int torrentId, tr_file_index_t fileNum )
+{
+    int err = 0;
+    struct tr_openfile * o;
+
+    tr_lockLock( gFd->lock );
+
+    if(( o = findOpenFile( torrentId, fileNum )))
+        err = syncFile( o );
+
+    tr_lockUnlock( gFd->lock );
+    return err;
+}
+
+int
+tr_fdTorrentSync( int torrentId )
 {
     int i;
+    int err = 0;
 
     tr_lockLock( gFd->lock );
 
-    for( i = 0; i < gFd->openFileLimit; ++i )
+    for( i=0; i<gFd->openFileLimit; ++i )
     {
         struct tr_openfile * o = &gFd->openFiles[i];
-        if( o->fd != fd )
-            continue;
-
-        dbgmsg( "releasing file '%s' in slot #%d", o->filename, i );
-        o->isCheckedOut = 0;
-        if( o->closeWhenDone )
-            TrCloseFile( i );
-        else if( o->syncAt <= time( NULL ) ) {
-            dbgmsg( "fsync()ing file '%s' in slot #%d", o->filename, i );
-            fsync( o->fd );
-#ifdef HAVE_POSIX_FADVISE
-            /* TODO: test performance with and without this */
-            posix_fadvise( o->fd, 0, 0, POSIX_FADV_DONTNEED );
-#endif
-            o->syncAt = time( NULL ) + SYNC_INTERVAL;
+        if( ( o->fd >= 0 ) && ( o->torrentId == torrentId ) && !o->closeWhenDone )
+        {
+            const int e = syncFile( o );
+            if( !err )
+                err = e;
         }
-
-        break;
     }
 
     tr_lockUnlock( gFd->lock );
+    return err;
 }
 
 void
-tr_fdFileClose( const char * filename )
+tr_fdFileDropCache( int              torrentId UNUSED,
+                    tr_file_index_t  fileNum UNUSED,
+                    uint64_t         offset UNUSED,
+                    uint64_t         len UNUSED )
 {
-    int i;
+#ifdef HAVE_POSIX_FADVISE
+    struct tr_openfile * o;
 
     tr_lockLock( gFd->lock );
 
-    for( i = 0; i < gFd->openFileLimit; ++i )
+    if(( o = findOpenFile( torrentId, fileNum )))
     {
-        struct tr_openfile * o = &gFd->openFiles[i];
-        if( !fileIsOpen( o ) || strcmp( filename, o->filename ) )
-            continue;
+        const int fd = o->fd;
+        const uint64_t start = usecNow( );
 
-        dbgmsg( "tr_fdFileClose closing '%s'", filename );
+        holdFile( o );
+        tr_lockUnlock( gFd->lock );
 
-        if( !o->isCheckedOut )
-        {
-            dbgmsg( "not checked out, so closing it now... '%s'", filename );
-            TrCloseFile( i );
-        }
-        else
-        {
-            dbgmsg(
-                "flagging file '%s', slot #%d to be closed when checked in",
-                gFd->openFiles[i].filename, i );
-            o->closeWhenDone = 1;
-        }
+        dbgmsg( "dropping %"PRIu64" bytes of fd %d from the page cache", len, fd );
+        posix_fadvise( fd, (off_t)offset, (off_t)len, POSIX_FADV_DONTNEED );
+
+        tr_lockLock( gFd->lock );
+        gFd->syncStats.droppedBytes += len;
+        gFd->syncStats.usec += usecNow( ) - start;
+        releaseFile( o );
     }
 
     tr_lockUnlock( gFd->lock );
+#endif
 }
 
 /***
@@ -609,6 +897,16 @@ tr_fdInit( size_t openFileLimit, size_t socketLimit )
     gFd->openFiles = tr_new0( struct tr_openfile, openFileLimit );
     gFd->openFileLimit = openFileLimit;
     gFd->lock = tr_lockNew( );
+    gFd->fileReleased = tr_condNew( );
+    gFd->syncMode = TR_SYNC_WRITEBACK;
+    __tr_list_init( &gFd->lru );
+    __tr_list_init( &gFd->unused );
+
+    /* keep the hash table at least half empty */
+    gFd->bucketMask = 15;
+    while( gFd->bucketMask < openFileLimit * 2 )
+        gFd->bucketMask = ( gFd->bucketMask << 1 ) | 1;
+    gFd->buckets = tr_new0( struct tr_openfile*, gFd->bucketMask + 1 );
 
 #ifdef HAVE_GETRLIMIT
     {
@@ -625,8 +923,10 @@ tr_fdInit( size_t openFileLimit, size_t socketLimit )
 #endif
     tr_dbg( "%zu usable file descriptors", socketLimit );
 
-    for( i = 0; i < gFd->openFileLimit; ++i )
+    for( i = 0; i < gFd->openFileLimit; ++i ) {
         gFd->openFiles[i].fd = -1;
+        __tr_list_append( &gFd->unused, &gFd->openFiles[i].lru );
+    }
 }
 
 void
@@ -635,11 +935,14 @@ tr_fdClose( void )
     int i = 0;
 
     for( i = 0; i < gFd->openFileLimit; ++i )
-        if( fileIsOpen( &gFd->openFiles[i] ) )
-            TrCloseFile( i );
+        if( gFd->openFiles[i].fd >= 0 )
+            TrCloseFile( &gFd->openFiles[i] );
 
+    tr_condFree( gFd->fileReleased );
     tr_lockFree( gFd->lock );
 
+    tr_free( gFd->fds );
+    tr_free( gFd->buckets );
     tr_free( gFd->openFiles );
     tr_free( gFd );
     gFd = NULL;
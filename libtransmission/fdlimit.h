@@ -33,13 +33,16 @@ void tr_fdInit( size_t openFileLimit,
                 size_t globalPeerLimit );
 
 /**
- * Returns an fd to the specified filename.
+ * Returns an fd to the specified torrent file.
  *
  * A small pool of open files is kept to avoid the overhead of
  * continually opening and closing the same files when downloading
- * piece data.    It's also used to ensure only one caller can
- * write to the file at a time.  Callers check out a file, use it,
- * and then check it back in via tr_fdFileReturn() when done.
+ * piece data.  Files are looked up by torrent id and file number,
+ * and the least recently used idle file is closed when the pool is full.
+ * Where pread() and pwrite() are available, several callers can check
+ * out the same file at once; otherwise it's one caller at a time.
+ * Callers check out a file, use it, and then check it back in via
+ * tr_fdFileReturn() when done.
  *
  * - if `folder' doesn't exist, errno is set to ENOENT.
  * - if doWrite is true, subfolders in torrentFile are created if necessary.
@@ -51,7 +54,9 @@ void tr_fdInit( size_t openFileLimit,
  * @see tr_fdFileReturn
  * @see tr_fdFileClose
  */
-int  tr_fdFileCheckout( const char             * folder,
+int  tr_fdFileCheckout( int                      torrentId,
+                        tr_file_index_t          fileNum,
+                        const char             * folder,
                         const char             * torrentFile,
                         tr_bool                  doWrite,
                         tr_preallocation_mode    preallocationMode,
@@ -69,13 +74,60 @@ void tr_fdFileReturn( int file );
  * Closes a file that's being held by our file repository.
  *
  * If the file isn't checked out, it's closed immediately.
- * If the file is currently checked out, it will be closed upon its return.
+ * If the file is currently checked out, it will be closed upon its return,
+ * and later checkouts will get a newly-opened fd.
  *
  * @see tr_fdFileCheckout
  * @see tr_fdFileReturn
  */
-void     tr_fdFileClose( const char * filename );
+void     tr_fdFileClose( int torrentId, tr_file_index_t fileNum );
 
+/***********************************************************************
+ * Getting written data out to disk
+ **********************************************************************/
+
+typedef struct tr_sync_stats
+{
+    uint64_t    writebacks;   /* background writebacks started */
+    uint64_t    syncs;        /* files synced to disk */
+    uint64_t    flushedBytes; /* bytes handed to either of those */
+    uint64_t    droppedBytes; /* bytes dropped from the OS' page cache */
+    uint64_t    usec;         /* time spent doing all of the above */
+}
+tr_sync_stats;
+
+void         tr_fdSetSyncMode( tr_sync_mode mode );
+
+tr_sync_mode tr_fdGetSyncMode( void );
+
+void         tr_fdGetSyncStats( tr_sync_stats * setme );
+
+/**
+ * Tells the file repository that part of a checked-out file was just
+ * written.  Unless the sync mode is TR_SYNC_NONE, the OS is asked to
+ * start writing the file out once enough of it has piled up.
+ */
+void         tr_fdFileWritten( int file, uint64_t offset, uint64_t len );
+
+/**
+ * Waits for everything written to an open file to reach the disk.
+ * Files that aren't open, or haven't been written to, are skipped.
+ * @return 0 on success, or an errno value on failure.
+ */
+int          tr_fdFileSync( int torrentId, tr_file_index_t fileNum );
+
+/** @brief like tr_fdFileSync(), for every open file of a torrent */
+int          tr_fdTorrentSync( int torrentId );
+
+/**
+ * Tells the OS that part of an open file won't be needed again soon,
+ * so that its pages can be dropped from the page cache.  Pages that
+ * haven't been written out yet stay.
+ */
+void         tr_fdFileDropCache( int              torrentId,
+                                 tr_file_index_t  fileNum,
+                                 uint64_t         offset,
+                                 uint64_t         len );
 
 /***********************************************************************
  * Sockets
@@ -109,7 +109,7 @@ struct tr_handshake
     uint8_t               peer_id[PEER_ID_LEN];
     handshakeDoneCB       doneCB;
     void *                doneUserData;
-    tr_timer *            timeout;
+    tr_timer              timeout;
 };
 
 /**
@@ -1103,7 +1103,7 @@ tr_handshakeFree( tr_handshake * handshake )
     if( handshake->io )
         tr_peerIoUnref( handshake->io ); /* balanced by the ref in tr_handshakeNew */
 
-    tr_timerFree( &handshake->timeout );
+    tr_timerStop( &handshake->timeout );
 
     tr_free( handshake );
 }
@@ -1188,7 +1188,8 @@ tr_handshakeNew( tr_peerIo *        io,
     handshake->doneCB = doneCB;
     handshake->doneUserData = doneUserData;
     handshake->session = tr_peerIoGetSession( io );
-    handshake->timeout = tr_timerNew( handshake->session, handshakeTimeout, handshake, HANDSHAKE_TIMEOUT_MSEC );
+    tr_timerInit( &handshake->timeout, handshake->session, handshakeTimeout, handshake );
+    tr_timerStart( &handshake->timeout, HANDSHAKE_TIMEOUT_MSEC );
 
     tr_peerIoRef( io ); /* balanced by the unref in tr_handshakeFree */
     tr_peerIoSetIOFuncs( handshake->io, canRead, NULL, gotError, handshake );
@@ -0,0 +1,427 @@
+#include <errno.h> /* EINVAL */
+#include <stdio.h> /* fprintf */
+#include <stdlib.h> /* mkdtemp */
+#include <string.h> /* memcmp */
+
+#include <sys/types.h>
+#include <sys/socket.h> /* socketpair */
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h> /* rmdir */
+
+#include "event.h"
+
+#include "transmission.h"
+#include "bencode.h"
+#include "crypto.h"
+#include "fdlimit.h"
+#include "inout.h"
+#include "torrent.h"
+#include "utils.h"
+
+#undef VERBOSE
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+ #define VERBOSE
+ #define TOTAL_SIZE ( 256 * 1024 * 1024 )
+#else
+ #define TOTAL_SIZE ( 4 * 1024 * 1024 )
+#endif
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+enum
+{
+    PIECE_SIZE = 256 * 1024,
+    BLOCK_SIZE = 16 * 1024
+};
+
+/* odd sizes, so that most pieces and many blocks span several files */
+static const int fileWeights[] = { 1, 5000, 0, 49159, 3, 700001, 16384, 2, 333333, 0, 7 };
+#define FILE_COUNT ( sizeof( fileWeights ) / sizeof( fileWeights[0] ) )
+
+/* the number of read and write syscalls this process has made,
+ * or -1 if we can't tell.  linux only. */
+static int64_t
+getSyscallCount( void )
+{
+    int64_t total = -1;
+    FILE * fp = fopen( "/proc/self/io", "r" );
+
+    if( fp != NULL )
+    {
+        char line[128];
+        long long n;
+        total = 0;
+        while( fgets( line, sizeof( line ), fp ) )
+            if( ( sscanf( line, "syscr: %lld", &n ) == 1 )
+             || ( sscanf( line, "syscw: %lld", &n ) == 1 ) )
+                total += n;
+        fclose( fp );
+    }
+
+    return total;
+}
+
+static void
+report( const char * name, uint64_t bytes, uint64_t startMsec, int64_t startSyscalls )
+{
+    const uint64_t msec = MAX( tr_date( ) - startMsec, 1 );
+    const int64_t syscalls = getSyscallCount( );
+
+    fprintf( stderr, "%-6s %.1f MiB in %"PRIu64" ms: %.1f MiB/s, %"PRId64" syscalls\n",
+             name, bytes / 1048576.0, msec, ( bytes / 1048576.0 ) / ( msec / 1000.0 ),
+             startSyscalls >= 0 ? syscalls - startSyscalls : -1 );
+}
+
+static tr_torrent*
+createTorrent( tr_session * session, const char * downloadDir )
+{
+    int          i;
+    int          len;
+    int          err;
+    char       * str;
+    char       * pieces;
+    uint64_t     totalSize = 0;
+    uint64_t     weightSum = 0;
+    tr_benc      top, * info, * files;
+    tr_ctor    * ctor;
+    tr_torrent * tor;
+
+    for( i=0; i<(int)FILE_COUNT; ++i )
+        weightSum += fileWeights[i];
+
+    tr_bencInitDict( &top, 2 );
+    tr_bencDictAddStr( &top, "announce", "http://127.0.0.1:1/announce" );
+    info = tr_bencDictAddDict( &top, "info", 4 );
+    tr_bencDictAddStr( info, "name", "inout-test" );
+    tr_bencDictAddInt( info, "piece length", PIECE_SIZE );
+    files = tr_bencDictAddList( info, "files", FILE_COUNT );
+    for( i=0; i<(int)FILE_COUNT; ++i )
+    {
+        char name[32];
+        tr_benc * file = tr_bencListAddDict( files, 2 );
+        const uint64_t length = ( (uint64_t)TOTAL_SIZE * fileWeights[i] ) / weightSum;
+        tr_snprintf( name, sizeof( name ), "file-%d", i );
+        tr_bencDictAddInt( file, "length", length );
+        tr_bencListAddStr( tr_bencDictAddList( file, "path", 1 ), name );
+        totalSize += length;
+    }
+
+    /* the checksums don't matter here; we never test the pieces */
+    len = SHA_DIGEST_LENGTH * ( ( totalSize + PIECE_SIZE - 1 ) / PIECE_SIZE );
+    pieces = tr_new0( char, len );
+    tr_bencDictAddRaw( info, "pieces", pieces, len );
+    tr_free( pieces );
+
+    str = tr_bencSave( &top, &len );
+    ctor = tr_ctorNew( session );
+    tr_ctorSetMetainfo( ctor, (const uint8_t*)str, len );
+    tr_ctorSetPaused( ctor, TR_FORCE, TRUE );
+    tr_ctorSetDownloadDir( ctor, TR_FORCE, downloadDir );
+    tor = tr_torrentNew( session, ctor, &err );
+
+    tr_ctorFree( ctor );
+    tr_free( str );
+    tr_bencFree( &top );
+    return tor;
+}
+
+static void
+removeTree( const char * path )
+{
+    DIR * odir = opendir( path );
+
+    if( odir != NULL )
+    {
+        struct dirent * d;
+        while(( d = readdir( odir ))) {
+            if( strcmp( d->d_name, "." ) && strcmp( d->d_name, ".." ) ) {
+                char * child = tr_buildPath( path, d->d_name, NULL );
+                removeTree( child );
+                tr_free( child );
+            }
+        }
+        closedir( odir );
+        rmdir( path );
+    }
+    else
+    {
+        remove( path );
+    }
+}
+
+static int
+testIO( tr_torrent * tor )
+{
+    uint64_t         i;
+    uint64_t         start;
+    int64_t          syscalls;
+    uint8_t        * data;
+    uint8_t        * buf;
+    tr_piece_index_t p;
+    const uint64_t   totalSize = tor->info.totalSize;
+
+    data = tr_new( uint8_t, totalSize );
+    buf = tr_new0( uint8_t, totalSize );
+    for( i=0; i<totalSize; ++i )
+        data[i] = (uint8_t) tr_cryptoWeakRandInt( 256 );
+
+    /* write it one block at a time, the way peers send it to us */
+    start = tr_date( );
+    syscalls = getSyscallCount( );
+    for( p=0; p<tor->info.pieceCount; ++p ) {
+        const uint32_t pieceSize = tr_torPieceCountBytes( tor, p );
+        uint32_t offset;
+        for( offset=0; offset<pieceSize; offset+=BLOCK_SIZE ) {
+            const uint32_t len = MIN( BLOCK_SIZE, pieceSize - offset );
+            check( !tr_ioWrite( tor, p, offset, len, data + (uint64_t)p * PIECE_SIZE + offset ) );
+        }
+    }
+    report( "write", totalSize, start, syscalls );
+
+    for( i=0; i<tor->info.fileCount; ++i )
+        check( tor->info.files[i].exists || !tor->info.files[i].length );
+
+    /* read it back a piece at a time, the way verify does */
+    start = tr_date( );
+    syscalls = getSyscallCount( );
+    for( p=0; p<tor->info.pieceCount; ++p )
+        check( !tr_ioRead( tor, p, 0, tr_torPieceCountBytes( tor, p ), buf + (uint64_t)p * PIECE_SIZE ) );
+    report( "read", totalSize, start, syscalls );
+    check( !memcmp( data, buf, totalSize ) );
+
+    /* rewrite each piece as a run of blocks, the way the cache flushes them */
+    for( i=0; i<totalSize; ++i )
+        data[i] = ~data[i];
+    start = tr_date( );
+    syscalls = getSyscallCount( );
+    for( p=0; p<tor->info.pieceCount; ++p ) {
+        tr_iovec iov[PIECE_SIZE / BLOCK_SIZE];
+        const uint32_t pieceSize = tr_torPieceCountBytes( tor, p );
+        uint32_t offset;
+        int n = 0;
+        for( offset=0; offset<pieceSize; offset+=BLOCK_SIZE, ++n ) {
+            iov[n].base = data + (uint64_t)p * PIECE_SIZE + offset;
+            iov[n].len = MIN( BLOCK_SIZE, pieceSize - offset );
+        }
+        check( !tr_ioWritev( tor, p, 0, iov, n ) );
+    }
+    report( "writev", totalSize, start, syscalls );
+
+    for( p=0; p<tor->info.pieceCount; ++p )
+        check( !tr_ioRead( tor, p, 0, tr_torPieceCountBytes( tor, p ), buf + (uint64_t)p * PIECE_SIZE ) );
+    check( !memcmp( data, buf, totalSize ) );
+
+    /* a read past the end of the piece is an error */
+    check( tr_ioRead( tor, 0, PIECE_SIZE - 1, 2, buf ) == EINVAL );
+
+    tr_free( buf );
+    tr_free( data );
+    return 0;
+}
+
+static int
+testSync( tr_torrent * tor )
+{
+    tr_piece_index_t p;
+    tr_sync_stats    before;
+    tr_sync_stats    after;
+
+    /* testIO() left data in the files that hasn't been synced */
+    tr_fdSetSyncMode( TR_SYNC_PIECE );
+    tr_fdGetSyncStats( &before );
+    for( p=0; p<tor->info.pieceCount; ++p )
+        check( !tr_ioSyncPiece( tor, p, TRUE ) );
+    tr_fdGetSyncStats( &after );
+    check( after.syncs > before.syncs );
+    check( after.flushedBytes >= before.flushedBytes + tor->info.totalSize );
+#ifdef HAVE_POSIX_FADVISE
+    check( after.droppedBytes == before.droppedBytes + tor->info.totalSize );
+#endif
+
+    /* there's nothing left to sync */
+    before = after;
+    for( p=0; p<tor->info.pieceCount; ++p )
+        check( !tr_ioSyncPiece( tor, p, FALSE ) );
+    tr_fdGetSyncStats( &after );
+    check( after.syncs == before.syncs );
+
+    /* and in the other modes, pieces aren't synced at all */
+    check( !tr_ioWrite( tor, 0, 0, 1, (const uint8_t*)"x" ) );
+    tr_fdSetSyncMode( TR_SYNC_WRITEBACK );
+    check( !tr_ioSyncPiece( tor, 0, FALSE ) );
+    tr_fdGetSyncStats( &after );
+    check( after.syncs == before.syncs );
+
+    check( tr_ioSyncPiece( tor, tor->info.pieceCount, FALSE ) == EINVAL );
+    return 0;
+}
+
+/* read exactly `len' bytes from the socket */
+static int
+recvAll( int fd, uint8_t * buf, size_t len )
+{
+    while( len )
+    {
+        const ssize_t n = recv( fd, buf, len, 0 );
+        if( n <= 0 )
+            return -1;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* upload every block to a peer, first the way it was done before
+ * tr_ioSendBlock() -- read into a buffer, then copied through the
+ * message buffer and the peer-io's output buffer -- and then straight
+ * from disk.  they should send the same bytes. */
+static int
+testSend( tr_torrent * tor )
+{
+    int              err;
+    int              sockets[2];
+    uint64_t         start;
+    int64_t          syscalls;
+    tr_bool          isLocalError;
+    tr_piece_index_t p;
+    uint8_t          block[BLOCK_SIZE];
+    struct evbuffer * msgBuf;
+    struct evbuffer * outBuf;
+    const uint64_t   totalSize = tor->info.totalSize;
+    uint8_t        * copied = tr_new( uint8_t, totalSize );
+    uint8_t        * sent = tr_new( uint8_t, totalSize );
+    const tr_file  * file = &tor->info.files[1];
+    char           * path;
+
+    check( !socketpair( AF_UNIX, SOCK_STREAM, 0, sockets ) );
+    msgBuf = evbuffer_new( );
+    outBuf = evbuffer_new( );
+
+    start = tr_date( );
+    syscalls = getSyscallCount( );
+    for( p=0; p<tor->info.pieceCount; ++p ) {
+        const uint32_t pieceSize = tr_torPieceCountBytes( tor, p );
+        uint32_t offset;
+        for( offset=0; offset<pieceSize; offset+=BLOCK_SIZE ) {
+            const uint32_t len = MIN( BLOCK_SIZE, pieceSize - offset );
+            check( !tr_ioRead( tor, p, offset, len, block ) );
+            evbuffer_add( msgBuf, block, len );
+            evbuffer_add_buffer( outBuf, msgBuf );
+            while( EVBUFFER_LENGTH( outBuf ) )
+                check( evbuffer_write( outBuf, sockets[0] ) > 0 );
+            check( !recvAll( sockets[1], copied + (uint64_t)p * PIECE_SIZE + offset, len ) );
+        }
+    }
+    report( "copy", totalSize, start, syscalls );
+
+    start = tr_date( );
+    syscalls = getSyscallCount( );
+    for( p=0; p<tor->info.pieceCount; ++p ) {
+        const uint32_t pieceSize = tr_torPieceCountBytes( tor, p );
+        uint32_t offset;
+        for( offset=0; offset<pieceSize; offset+=BLOCK_SIZE ) {
+            const uint32_t len = MIN( BLOCK_SIZE, pieceSize - offset );
+            uint32_t done = 0;
+            while( done < len ) {
+                const int n = tr_ioSendBlock( tor, p, offset + done, len - done, sockets[0], &isLocalError );
+                check( n > 0 );
+                done += n;
+            }
+            check( !recvAll( sockets[1], sent + (uint64_t)p * PIECE_SIZE + offset, len ) );
+        }
+    }
+    report( "send", totalSize, start, syscalls );
+    check( !memcmp( copied, sent, totalSize ) );
+
+    /* a bad request is the peer's problem... */
+    errno = 0;
+    check( tr_ioSendBlock( tor, tor->info.pieceCount, 0, 1, sockets[0], &isLocalError ) == -1 );
+    check( errno == EINVAL );
+    check( !isLocalError );
+
+    /* ...but a missing file is ours */
+    tr_fdFileClose( tor->uniqueId, 1 );
+    path = tr_buildPath( tor->downloadDir, file->name, NULL );
+    check( !unlink( path ) );
+    tr_free( path );
+    p = file->offset / PIECE_SIZE;
+    err = tr_ioSendBlock( tor, p, file->offset % PIECE_SIZE, 1, sockets[0], &isLocalError );
+    check( err == -1 );
+    check( errno == ENOENT );
+    check( isLocalError );
+
+    evbuffer_free( outBuf );
+    evbuffer_free( msgBuf );
+    close( sockets[1] );
+    close( sockets[0] );
+    tr_free( sent );
+    tr_free( copied );
+    return 0;
+}
+
+int
+main( void )
+{
+    int          i;
+    char         dir[] = "/tmp/transmission-inout-test-XXXXXX";
+    char       * downloadDir;
+    tr_benc      settings;
+    tr_session * session;
+    tr_torrent * tor;
+
+    if( mkdtemp( dir ) == NULL )
+        return 1;
+    downloadDir = tr_buildPath( dir, "Downloads", NULL );
+    tr_mkdirp( downloadDir, 0777 );
+
+    tr_bencInitDict( &settings, 0 );
+    tr_sessionGetDefaultSettings( &settings );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PEER_PORT_RANDOM_ENABLED, 1 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PORT_FORWARDING, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_RPC_ENABLED, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_MSGLEVEL, 0 );
+    session = tr_sessionInit( "inout-test", dir, FALSE, &settings );
+
+    tor = createTorrent( session, downloadDir );
+    if( tor == NULL )
+        i = ++test;
+    else {
+        if( !( i = testIO( tor ) ) )
+            if( !( i = testSync( tor ) ) )
+                i = testSend( tor );
+        tr_torrentDeleteLocalData( tor, NULL );
+        tr_torrentRemove( tor );
+    }
+
+    tr_sessionClose( session );
+    tr_bencFree( &settings );
+    removeTree( dir );
+    tr_free( downloadDir );
+    return i;
+}
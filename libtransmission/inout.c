@@ -17,15 +17,25 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h> /* posix_fadvise */
+#if defined( HAVE_PREADV ) && defined( HAVE_PWRITEV )
+ #include <sys/uio.h> /* preadv, pwritev */
+#endif
+#if defined( HAVE_SENDFILE ) && defined( HAVE_SYS_SENDFILE_H )
+ #include <sys/sendfile.h>
+#elif defined( WIN32 )
+ #include <winsock2.h> /* send */
+#else
+ #include <sys/socket.h> /* send */
+#endif
 #include <unistd.h>
 
-#include <openssl/sha.h>
-
 #include "transmission.h"
 #include "crypto.h"
 #include "fdlimit.h"
 #include "inout.h"
 #include "platform.h"
+#include "sha1.h"
 #include "stats.h"
 #include "torrent.h"
 #include "utils.h"
@@ -48,6 +58,7 @@
 
 enum { TR_IO_READ, TR_IO_WRITE };
 
+#if !defined( HAVE_PREAD ) || !defined( HAVE_PWRITE )
 static int64_t
 tr_lseek( int fd, int64_t offset, int whence )
 {
@@ -59,6 +70,104 @@ tr_lseek( int fd, int64_t offset, int whence )
     return lseek( fd, (off_t)offset, whence );
 #endif
 }
+#endif
+
+/* pread() and pwrite() leave the file position alone,
+ * which lets fdlimit hand the same fd to several callers */
+
+static ssize_t
+tr_pread( int fd, void * buf, size_t buflen, int64_t offset )
+{
+#ifdef HAVE_PREAD
+    return pread( fd, buf, buflen, (off_t)offset );
+#else
+    if( tr_lseek( fd, offset, SEEK_SET ) == -1 )
+        return -1;
+    return read( fd, buf, buflen );
+#endif
+}
+
+static ssize_t
+tr_pwrite( int fd, const void * buf, size_t buflen, int64_t offset )
+{
+#ifdef HAVE_PWRITE
+    return pwrite( fd, buf, buflen, (off_t)offset );
+#else
+    if( tr_lseek( fd, offset, SEEK_SET ) == -1 )
+        return -1;
+    return write( fd, buf, buflen );
+#endif
+}
+
+#if defined( HAVE_PREADV ) && defined( HAVE_PWRITEV )
+enum { MAX_IOVEC = 64 }; /* the most buffers to pass to one preadv() or pwritev() */
+#endif
+
+/* returns the number of bytes transferred, or -1 and sets errno */
+static ssize_t
+readOrWriteVec( int               fd,
+                int               ioMode,
+                const tr_iovec  * iov,
+                int               iovCount,
+                int64_t           offset )
+{
+    ssize_t total = 0;
+
+    while( iovCount > 0 )
+    {
+        int     count;
+        ssize_t n;
+        size_t  want;
+
+        if( iovCount == 1 )
+        {
+            count = 1;
+            want = iov->len;
+            if( ioMode == TR_IO_READ )
+                n = tr_pread( fd, iov->base, iov->len, offset );
+            else
+                n = tr_pwrite( fd, iov->base, iov->len, offset );
+        }
+        else
+        {
+#if defined( HAVE_PREADV ) && defined( HAVE_PWRITEV )
+            int i;
+            struct iovec vec[MAX_IOVEC];
+
+            count = MIN( iovCount, MAX_IOVEC );
+            for( i=0, want=0; i<count; ++i ) {
+                vec[i].iov_base = iov[i].base;
+                vec[i].iov_len = iov[i].len;
+                want += iov[i].len;
+            }
+            if( ioMode == TR_IO_READ )
+                n = preadv( fd, vec, count, (off_t)offset );
+            else
+                n = pwritev( fd, vec, count, (off_t)offset );
+#else
+            count = 1;
+            want = iov->len;
+            if( ioMode == TR_IO_READ )
+                n = tr_pread( fd, iov->base, iov->len, offset );
+            else
+                n = tr_pwrite( fd, iov->base, iov->len, offset );
+#endif
+        }
+
+        if( n < 0 )
+            return -1;
+
+        total += n;
+        if( (size_t)n != want ) /* short read or write */
+            break;
+
+        offset += n;
+        iov += count;
+        iovCount -= count;
+    }
+
+    return total;
+}
 
 /* returns 0 on success, or an errno on failure */
 static int
@@ -66,34 +175,36 @@ readOrWriteBytes( const tr_torrent * tor,
                   int                ioMode,
                   tr_file_index_t    fileIndex,
                   uint64_t           fileOffset,
-                  void *             buf,
+                  const tr_iovec   * iov,
+                  int                iovCount,
                   size_t             buflen )
 {
     const tr_info * info = &tor->info;
-    const tr_file * file = &info->files[fileIndex];
+    tr_file       * file = &info->files[fileIndex];
     tr_preallocation_mode preallocationMode;
 
-    typedef size_t ( *iofunc )( int, void *, size_t );
-    iofunc          func = ioMode == TR_IO_READ ? (iofunc)read : (iofunc)write;
-    struct stat     sb;
     int             fd = -1;
     int             err;
-    int             fileExists;
+    tr_bool         fileExists;
 
     assert( tor->downloadDir && *tor->downloadDir );
     assert( fileIndex < info->fileCount );
     assert( !file->length || ( fileOffset < file->length ) );
     assert( fileOffset + buflen <= file->length );
 
-    {
+    if( !file->length )
+        return 0;
+
+    /* only stat() the file until we've seen it on disk */
+    if( file->exists )
+        fileExists = TRUE;
+    else {
+        struct stat sb;
         char path[MAX_PATH_LENGTH];
         tr_snprintf( path, sizeof( path ), "%s%c%s", tor->downloadDir, TR_PATH_DELIMITER, file->name );
         fileExists = !stat( path, &sb );
     }
 
-    if( !file->length )
-        return 0;
-
     if( ( file->dnd ) || ( ioMode != TR_IO_WRITE ) )
         preallocationMode = TR_PREALLOCATE_NONE;
     else
@@ -101,18 +212,24 @@ readOrWriteBytes( const tr_torrent * tor,
 
     if( ( ioMode == TR_IO_READ ) && !fileExists ) /* does file exist? */
         err = errno;
-    else if( ( fd = tr_fdFileCheckout ( tor->downloadDir, file->name, ioMode == TR_IO_WRITE, preallocationMode, file->length ) ) < 0 )
+    else if( ( fd = tr_fdFileCheckout ( tor->uniqueId, fileIndex, tor->downloadDir, file->name, ioMode == TR_IO_WRITE, preallocationMode, file->length ) ) < 0 )
         err = errno;
-    else if( tr_lseek( fd, (int64_t)fileOffset, SEEK_SET ) == -1 )
-        err = errno;
-    else if( func( fd, buf, buflen ) != buflen )
+    else if( readOrWriteVec( fd, ioMode, iov, iovCount, (int64_t)fileOffset ) != (ssize_t)buflen )
         err = errno;
     else
         err = 0;
 
+    if( ( !err ) && ( ioMode == TR_IO_WRITE ) )
+        tr_fdFileWritten( fd, fileOffset, buflen );
+
     if( ( !err ) && ( !fileExists ) && ( ioMode == TR_IO_WRITE ) )
         tr_statsFileCreated( tor->session );
 
+    if( fd >= 0 )
+        file->exists = TRUE;
+    else if( err == ENOENT )
+        file->exists = FALSE;
+
     if( fd >= 0 )
         tr_fdFileReturn( fd );
 
@@ -159,34 +276,67 @@ readOrWritePiece( const tr_torrent * tor,
                   int                ioMode,
                   tr_piece_index_t   pieceIndex,
                   uint32_t           pieceOffset,
-                  uint8_t *          buf,
-                  size_t             buflen )
+                  const tr_iovec   * iov,
+                  int                iovCount )
 {
+    int             i;
     int             err = 0;
+    size_t          used = 0;
+    size_t          buflen = 0;
+    tr_iovec        stackvec[8];
+    tr_iovec      * vec;
     tr_file_index_t fileIndex;
     uint64_t        fileOffset;
     const tr_info * info = &tor->info;
 
+    for( i=0; i<iovCount; ++i )
+        buflen += iov[i].len;
+
     if( pieceIndex >= tor->info.pieceCount )
         return EINVAL;
     if( pieceOffset + buflen > tr_torPieceCountBytes( tor, pieceIndex ) )
         return EINVAL;
 
+    if( iovCount <= (int)( sizeof( stackvec ) / sizeof( stackvec[0] ) ) )
+        vec = stackvec;
+    else
+        vec = tr_new( tr_iovec, iovCount );
+
     tr_ioFindFileLocation( tor, pieceIndex, pieceOffset,
                            &fileIndex, &fileOffset );
 
+    /* hand each file the part of iov that belongs to it */
+    i = 0;
     while( buflen && !err )
     {
+        int             n = 0;
         const tr_file * file = &info->files[fileIndex];
         const uint64_t  bytesThisPass = MIN( buflen, file->length - fileOffset );
-
-        err = readOrWriteBytes( tor, ioMode, fileIndex, fileOffset, buf, bytesThisPass );
-        buf += bytesThisPass;
+        uint64_t        left = bytesThisPass;
+
+        while( left )
+        {
+            const size_t len = MIN( left, iov[i].len - used );
+            vec[n].base = (uint8_t*)iov[i].base + used;
+            vec[n].len = len;
+            ++n;
+            left -= len;
+            used += len;
+            if( used == iov[i].len ) {
+                ++i;
+                used = 0;
+            }
+        }
+
+        err = readOrWriteBytes( tor, ioMode, fileIndex, fileOffset, vec, n, bytesThisPass );
         buflen -= bytesThisPass;
         ++fileIndex;
         fileOffset = 0;
     }
 
+    if( vec != stackvec )
+        tr_free( vec );
+
     return err;
 }
 
@@ -197,7 +347,10 @@ tr_ioRead( const tr_torrent * tor,
            uint32_t           len,
            uint8_t *          buf )
 {
-    return readOrWritePiece( tor, TR_IO_READ, pieceIndex, begin, buf, len );
+    tr_iovec iov;
+    iov.base = buf;
+    iov.len = len;
+    return readOrWritePiece( tor, TR_IO_READ, pieceIndex, begin, &iov, 1 );
 }
 
 int
@@ -207,9 +360,238 @@ tr_ioWrite( const tr_torrent * tor,
             uint32_t           len,
             const uint8_t *    buf )
 {
-    return readOrWritePiece( tor, TR_IO_WRITE, pieceIndex, begin,
-                             (uint8_t*)buf,
-                             len );
+    tr_iovec iov;
+    iov.base = (uint8_t*)buf;
+    iov.len = len;
+    return readOrWritePiece( tor, TR_IO_WRITE, pieceIndex, begin, &iov, 1 );
+}
+
+int
+tr_ioWritev( const tr_torrent * tor,
+             tr_piece_index_t   pieceIndex,
+             uint32_t           begin,
+             const tr_iovec   * iov,
+             int                iovCount )
+{
+    return readOrWritePiece( tor, TR_IO_WRITE, pieceIndex, begin, iov, iovCount );
+}
+
+/****
+*****  Readahead
+****/
+
+#ifdef HAVE_POSIX_FADVISE
+static void
+prefetchBytes( const tr_torrent * tor,
+               tr_file_index_t    fileIndex,
+               uint64_t           fileOffset,
+               size_t             buflen )
+{
+    int fd;
+    const tr_file * file = &tor->info.files[fileIndex];
+
+    if( !file->length )
+        return;
+
+    fd = tr_fdFileCheckout( tor->uniqueId, fileIndex, tor->downloadDir,
+                            file->name, FALSE, TR_PREALLOCATE_NONE, file->length );
+    if( fd >= 0 )
+    {
+        posix_fadvise( fd, fileOffset, buflen, POSIX_FADV_WILLNEED );
+        tr_fdFileReturn( fd );
+    }
+}
+#endif
+
+void
+tr_ioPrefetch( const tr_torrent * tor,
+               tr_piece_index_t   pieceIndex,
+               uint32_t           begin,
+               uint32_t           len )
+{
+    tr_file_index_t fileIndex;
+    uint64_t        fileOffset;
+    const tr_info * info = &tor->info;
+
+    if( pieceIndex >= info->pieceCount )
+        return;
+    if( begin + len > tr_torPieceCountBytes( tor, pieceIndex ) )
+        return;
+
+    tr_ioFindFileLocation( tor, pieceIndex, begin, &fileIndex, &fileOffset );
+
+    while( len )
+    {
+        const tr_file * file = &info->files[fileIndex];
+        const uint64_t  bytesThisPass = MIN( len, file->length - fileOffset );
+
+#ifdef HAVE_POSIX_FADVISE
+        prefetchBytes( tor, fileIndex, fileOffset, bytesThisPass );
+#endif
+        len -= bytesThisPass;
+        ++fileIndex;
+        fileOffset = 0;
+    }
+}
+
+/****
+*****  Getting pieces out to disk
+****/
+
+int
+tr_ioSyncPiece( const tr_torrent * tor,
+                tr_piece_index_t   pieceIndex,
+                tr_bool            dropCache )
+{
+    int             err = 0;
+    uint32_t        len;
+    tr_file_index_t fileIndex;
+    uint64_t        fileOffset;
+    const tr_info * info = &tor->info;
+    const tr_bool   doSync = tr_fdGetSyncMode( ) == TR_SYNC_PIECE;
+
+    if( pieceIndex >= info->pieceCount )
+        return EINVAL;
+
+    tr_ioFindFileLocation( tor, pieceIndex, 0, &fileIndex, &fileOffset );
+    len = tr_torPieceCountBytes( tor, pieceIndex );
+
+    while( len && !err )
+    {
+        const tr_file * file = &info->files[fileIndex];
+        const uint64_t  bytesThisPass = MIN( len, file->length - fileOffset );
+
+        if( doSync )
+            err = tr_fdFileSync( tor->uniqueId, fileIndex );
+        if( !err && dropCache )
+            tr_fdFileDropCache( tor->uniqueId, fileIndex, fileOffset, bytesThisPass );
+
+        len -= bytesThisPass;
+        ++fileIndex;
+        fileOffset = 0;
+    }
+
+    return err;
+}
+
+/****
+*****  Sending blocks straight from disk to a peer's socket
+****/
+
+/* returns the number of bytes sent, or -1 and sets errno.
+ * `isLocalError' is set if it was the file, not the socket, that failed */
+static int
+sendFileBytes( const tr_torrent * tor,
+               tr_file_index_t    fileIndex,
+               uint64_t           fileOffset,
+               size_t             buflen,
+               int                socket,
+               tr_bool          * isLocalError )
+{
+    int n;
+    int fd;
+    int err;
+    const tr_file * file = &tor->info.files[fileIndex];
+
+    fd = tr_fdFileCheckout( tor->uniqueId, fileIndex, tor->downloadDir,
+                            file->name, FALSE, TR_PREALLOCATE_NONE, file->length );
+    if( fd < 0 ) {
+        *isLocalError = TRUE;
+        return -1;
+    }
+
+#if defined( HAVE_SENDFILE ) && defined( HAVE_SYS_SENDFILE_H )
+    {
+        off_t offset = (off_t)fileOffset;
+        n = sendfile( socket, fd, &offset, buflen );
+
+        /* sendfile() doesn't say which side failed, but these
+         * only come from reading the file */
+        if( ( n < 0 ) && ( ( errno == EIO ) || ( errno == EOVERFLOW ) ) )
+            *isLocalError = TRUE;
+    }
+#else
+    {
+        /* no sendfile() here, so bounce it through a small stack buffer.
+         * that's still one copy fewer than going through the evbuffers */
+        uint8_t buf[MAX_STACK_ARRAY_SIZE];
+        buflen = MIN( buflen, sizeof( buf ) );
+        errno = 0;
+        if( tr_pread( fd, buf, buflen, (int64_t)fileOffset ) != (ssize_t)buflen ) {
+            if( !errno )
+                errno = EIO;
+            *isLocalError = TRUE;
+            n = -1;
+        } else
+            n = send( socket, buf, buflen, 0 );
+    }
+#endif
+
+    err = errno;
+    tr_fdFileReturn( fd );
+    errno = err;
+    return n;
+}
+
+int
+tr_ioSendBlock( const tr_torrent * tor,
+                tr_piece_index_t   pieceIndex,
+                uint32_t           pieceOffset,
+                uint32_t           len,
+                int                socket,
+                tr_bool          * setme_isLocalError )
+{
+    int             sent = 0;
+    tr_file_index_t fileIndex;
+    uint64_t        fileOffset;
+    const tr_info * info = &tor->info;
+
+    *setme_isLocalError = FALSE;
+
+    if( ( pieceIndex >= info->pieceCount )
+        || ( pieceOffset + len > tr_torPieceCountBytes( tor, pieceIndex ) ) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    tr_ioFindFileLocation( tor, pieceIndex, pieceOffset,
+                           &fileIndex, &fileOffset );
+
+    while( len )
+    {
+        const tr_file * file = &info->files[fileIndex];
+        const size_t    bytesThisPass = MIN( len, file->length - fileOffset );
+
+        if( bytesThisPass )
+        {
+            const int n = sendFileBytes( tor, fileIndex, fileOffset, bytesThisPass,
+                                         socket, setme_isLocalError );
+
+            if( n < 0 )
+                return sent ? sent : -1;
+
+            /* the file's shorter than it should be */
+            if( !n && !sent ) {
+                *setme_isLocalError = TRUE;
+                errno = EIO;
+                return -1;
+            }
+
+            sent += n;
+            len -= n;
+
+            /* the socket's full, or the file's shorter than it should be.
+             * if it's the file, the next call will say so */
+            if( (size_t)n < bytesThisPass )
+                break;
+        }
+
+        ++fileIndex;
+        fileOffset = 0;
+    }
+
+    return sent;
 }
 
 /****
@@ -227,7 +609,8 @@ recalculateHash( const tr_torrent * tor,
     uint32_t offset = 0;
     tr_bool  success = TRUE;
     uint8_t  stackbuf[MAX_STACK_ARRAY_SIZE];
-    SHA_CTX  sha;
+    uint8_t  hash[SHA_DIGEST_LENGTH];
+    tr_sha1_ctx sha;
 
     /* fallback buffer */
     if( ( buffer == NULL ) || ( buflen < 1 ) )
@@ -242,7 +625,7 @@ recalculateHash( const tr_torrent * tor,
     assert( buflen > 0 );
     assert( setme != NULL );
 
-    SHA1_Init( &sha );
+    tr_sha1Init( &sha );
     bytesLeft = tr_torPieceCountBytes( tor, pieceIndex );
 
     while( bytesLeft )
@@ -251,13 +634,15 @@ recalculateHash( const tr_torrent * tor,
         success = !tr_ioRead( tor, pieceIndex, offset, len, buffer );
         if( !success )
             break;
-        SHA1_Update( &sha, buffer, len );
+        tr_sha1Update( &sha, buffer, len );
         offset += len;
         bytesLeft -= len;
     }
 
+    /* finish it even on failure, to free OpenSSL's context */
+    tr_sha1Final( &sha, hash );
     if( success )
-        SHA1_Final( setme, &sha );
+        memcpy( setme, hash, SHA_DIGEST_LENGTH );
 
     return success;
 }
@@ -39,6 +39,64 @@ int tr_ioWrite( const struct tr_torrent * tor,
                 uint32_t                  len,
                 const uint8_t *           writeme );
 
+/** @brief one of the buffers passed to tr_ioWritev() */
+typedef struct tr_iovec
+{
+    void    * base;
+    size_t    len;
+}
+tr_iovec;
+
+/**
+ * Like tr_ioWrite(), but gathers the data from several buffers.
+ * pwritev() is used where available, so adjacent blocks can be
+ * written with one call without first copying them together.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioWritev( const struct tr_torrent * tor,
+                 tr_piece_index_t          pieceIndex,
+                 uint32_t                  offset,
+                 const tr_iovec          * iov,
+                 int                       iovCount );
+
+/**
+ * Tells the OS that the specified part of a piece is going to be
+ * read soon, so that it can start reading it in the background.
+ * This is only a hint, so it's safe to ignore failure.
+ */
+void tr_ioPrefetch( const struct tr_torrent * tor,
+                    tr_piece_index_t          pieceIndex,
+                    uint32_t                  begin,
+                    uint32_t                  len );
+
+/**
+ * Gets a complete piece out to disk.  In TR_SYNC_PIECE mode, this waits
+ * for the piece's files to be synced.  If `dropCache' is true, the piece
+ * is dropped from the OS' page cache afterwards.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioSyncPiece( const struct tr_torrent * tor,
+                    tr_piece_index_t          pieceIndex,
+                    tr_bool                   dropCache );
+
+/**
+ * Sends the block specified by the piece index, offset, and length
+ * from the torrent's local files straight into a socket.  sendfile()
+ * is used where available so the data never passes through userspace.
+ *
+ * The socket is nonblocking, so fewer than `len' bytes may be sent.
+ * @param setme_isLocalError set to true if it failed because the local
+ *                           files couldn't be read, rather than because
+ *                           of the socket
+ * @return the number of bytes sent, or -1 on failure and errno is set.
+ */
+int tr_ioSendBlock( const struct tr_torrent * tor,
+                    tr_piece_index_t          pieceIndex,
+                    uint32_t                  offset,
+                    uint32_t                  len,
+                    int                       socket,
+                    tr_bool                 * setme_isLocalError );
+
 /**
  * @brief Test to see if the piece matches its metainfo's SHA1 checksum.
  *
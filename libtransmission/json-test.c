@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <string.h>
+
+#include <event.h> /* evbuffer */
+
 #include "transmission.h"
 #include "bencode.h"
 #include "json.h"
@@ -152,6 +155,91 @@ test2( void )
     return 0;
 }
 
+static struct evbuffer * written = NULL;
+static int flushCount = 0;
+static tr_bool wasDone = FALSE;
+
+static void
+onFlush( struct evbuffer * buf, tr_bool isDone, void * unused UNUSED )
+{
+    evbuffer_add( written, EVBUFFER_DATA( buf ), EVBUFFER_LENGTH( buf ) );
+    ++flushCount;
+    wasDone = isDone;
+}
+
+static int
+test_writer( void )
+{
+    int i, err;
+    char name[32];
+    tr_json_writer * w;
+    tr_benc top, * list, * tor;
+    const char * str;
+    int64_t val;
+    const int torrentCount = 5000;
+    const char * expected = "{\"zebra\":-1,\"apple\":[\"a\\/b\\\"c\\n\",[],{}]}";
+
+    /* keys are written in the order they're added, with no whitespace */
+    written = evbuffer_new( );
+    w = tr_jsonWriterNew( onFlush, NULL );
+    tr_jsonWriteDictBegin( w );
+    tr_jsonWriteStr( w, "zebra" );
+    tr_jsonWriteInt( w, -1 );
+    tr_jsonWriteStr( w, "apple" );
+    tr_jsonWriteListBegin( w );
+    tr_jsonWriteStr( w, "a/b\"c\n" );
+    tr_jsonWriteListBegin( w );
+    tr_jsonWriteEnd( w );
+    tr_jsonWriteDictBegin( w );
+    tr_jsonWriteEnd( w );
+    tr_jsonWriteEnd( w );
+    tr_jsonWriteEnd( w );
+    tr_jsonWriterFree( w );
+    check( flushCount == 1 );
+    check( wasDone );
+    check( EVBUFFER_LENGTH( written ) == strlen( expected ) );
+    check( !memcmp( EVBUFFER_DATA( written ), expected, strlen( expected ) ) );
+    evbuffer_free( written );
+
+    /* a big document is handed over in chunks, and parses back the same */
+    tr_bencInitDict( &top, 1 );
+    list = tr_bencDictAddList( &top, "torrents", torrentCount );
+    for( i=0; i<torrentCount; ++i ) {
+        tor = tr_bencListAddDict( list, 3 );
+        tr_snprintf( name, sizeof( name ), "torrent-%d", i );
+        tr_bencDictAddInt( tor, "id", i );
+        tr_bencDictAddStr( tor, "name", name );
+        tr_bencDictAddStr( tor, "downloadDir", "/home/user/Letöltések" );
+    }
+    written = evbuffer_new( );
+    flushCount = 0;
+    w = tr_jsonWriterNew( onFlush, NULL );
+    tr_jsonWriteBenc( w, &top );
+    tr_jsonWriterFree( w );
+    tr_bencFree( &top );
+    check( flushCount > 1 );
+    check( wasDone );
+
+    err = tr_jsonParse( EVBUFFER_DATA( written ), EVBUFFER_LENGTH( written ), &top, NULL );
+    check( !err );
+    check( tr_bencDictFindList( &top, "torrents", &list ) );
+    check( (int)tr_bencListSize( list ) == torrentCount );
+    for( i=0; i<torrentCount; ++i ) {
+        tor = tr_bencListChild( list, i );
+        tr_snprintf( name, sizeof( name ), "torrent-%d", i );
+        check( tr_bencDictFindInt( tor, "id", &val ) );
+        check( val == i );
+        check( tr_bencDictFindStr( tor, "name", &str ) );
+        check( !strcmp( str, name ) );
+        check( tr_bencDictFindStr( tor, "downloadDir", &str ) );
+        check( !strcmp( str, "/home/user/Letöltések" ) );
+    }
+    tr_bencFree( &top );
+    evbuffer_free( written );
+
+    return 0;
+}
+
 int
 main( void )
 {
@@ -166,6 +254,9 @@ main( void )
     if( ( i = test2( ) ) )
         return i;
 
+    if( ( i = test_writer( ) ) )
+        return i;
+
     return 0;
 }
 
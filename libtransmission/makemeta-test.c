@@ -0,0 +1,291 @@
+#include <stdio.h> /* fprintf */
+#include <stdlib.h> /* mkdtemp */
+#include <string.h> /* memcmp */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h> /* rmdir */
+
+#include "transmission.h"
+#include "bencode.h"
+#include "completion.h"
+#include "crypto.h"
+#include "makemeta.h"
+#include "torrent.h"
+#include "utils.h"
+
+#undef VERBOSE
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+ #define VERBOSE
+ #define TOTAL_SIZE ( 512 * 1024 * 1024 )
+#else
+ #define TOTAL_SIZE ( 6 * 1024 * 1024 )
+#endif
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+/* odd sizes, so that pieces span files.  the names sort in this order */
+static const int fileWeights[] = { 3, 5000, 49159, 1, 700001, 16384, 333333 };
+#define FILE_COUNT ( sizeof( fileWeights ) / sizeof( fileWeights[0] ) )
+
+static uint8_t * content = NULL;
+static uint64_t contentLen = 0;
+
+static void
+removeTree( const char * path )
+{
+    DIR * odir = opendir( path );
+
+    if( odir != NULL )
+    {
+        struct dirent * d;
+        while(( d = readdir( odir ))) {
+            if( strcmp( d->d_name, "." ) && strcmp( d->d_name, ".." ) ) {
+                char * child = tr_buildPath( path, d->d_name, NULL );
+                removeTree( child );
+                tr_free( child );
+            }
+        }
+        closedir( odir );
+        rmdir( path );
+    }
+    else
+    {
+        remove( path );
+    }
+}
+
+/* write the files, keeping a copy of their contents back to back */
+static int
+createFiles( const char * dataDir )
+{
+    size_t i;
+    uint64_t weightSum = 0;
+
+    for( i=0; i<FILE_COUNT; ++i )
+        weightSum += fileWeights[i];
+
+    content = tr_new( uint8_t, TOTAL_SIZE );
+    for( i=0; i<FILE_COUNT; ++i )
+    {
+        FILE * fp;
+        char name[32];
+        char * path;
+        uint64_t j;
+        const uint64_t len = ( (uint64_t)TOTAL_SIZE * fileWeights[i] ) / weightSum;
+
+        for( j=0; j<len; ++j )
+            content[contentLen + j] = (uint8_t) tr_cryptoWeakRandInt( 256 );
+
+        tr_snprintf( name, sizeof( name ), "file-%d", (int)i );
+        path = tr_buildPath( dataDir, name, NULL );
+        fp = fopen( path, "wb" );
+        check( fp != NULL );
+        check( fwrite( content + contentLen, 1, len, fp ) == len );
+        fclose( fp );
+        tr_free( path );
+
+        contentLen += len;
+    }
+
+    return 0;
+}
+
+static tr_metainfo_builder_err
+build( tr_metainfo_builder * b, const char * outputFile )
+{
+    tr_tracker_info tracker;
+    const uint64_t start = tr_date( );
+
+    memset( &tracker, 0, sizeof( tracker ) );
+    tracker.announce = (char*) "http://127.0.0.1:1/announce";
+    tr_makeMetaInfo( b, outputFile, &tracker, 1, NULL, FALSE );
+    while( !b->isDone )
+        tr_wait( 10 );
+
+    fprintf( stderr, "%.1f MiB in %u pieces: %"PRIu64" ms\n",
+             b->totalSize / 1048576.0, b->pieceCount, tr_date( ) - start );
+    return b->result;
+}
+
+/* empty files in toDir with the same names and sizes as fromDir's */
+static int
+createLookalikes( const char * fromDir, const char * toDir )
+{
+    size_t i;
+
+    tr_mkdirp( toDir, 0777 );
+    for( i=0; i<FILE_COUNT; ++i )
+    {
+        FILE * fp;
+        struct stat sb;
+        char name[32];
+        char * from;
+        char * to;
+
+        tr_snprintf( name, sizeof( name ), "file-%d", (int)i );
+        from = tr_buildPath( fromDir, name, NULL );
+        to = tr_buildPath( toDir, name, NULL );
+        check( !stat( from, &sb ) );
+        fp = fopen( to, "wb" );
+        check( fp != NULL );
+        fclose( fp );
+        check( !truncate( to, sb.st_size ) );
+        tr_free( to );
+        tr_free( from );
+    }
+
+    return 0;
+}
+
+static int
+checkPieces( tr_session * session, const char * torrentFile, int expectedErr, tr_info * setme )
+{
+    tr_piece_index_t i;
+    tr_ctor * ctor = tr_ctorNew( session );
+
+    check( !tr_ctorSetMetainfoFromFile( ctor, torrentFile ) );
+    check( tr_torrentParse( session, ctor, setme ) == expectedErr );
+    tr_ctorFree( ctor );
+
+    check( setme->totalSize == contentLen );
+    check( setme->fileCount == FILE_COUNT );
+    for( i=0; i<setme->pieceCount; ++i )
+    {
+        uint8_t hash[SHA_DIGEST_LENGTH];
+        const uint64_t begin = (uint64_t)i * setme->pieceSize;
+        const uint64_t len = MIN( (uint64_t)setme->pieceSize, contentLen - begin );
+        tr_sha1( hash, content + begin, (int)len, NULL );
+        check( !memcmp( hash, setme->pieces[i].hash, SHA_DIGEST_LENGTH ) );
+    }
+
+    return 0;
+}
+
+static int
+testMakeMeta( tr_session * session, const char * dir )
+{
+    int err;
+    tr_info info;
+    tr_info reused;
+    tr_ctor * ctor;
+    tr_torrent * tor;
+    tr_metainfo_builder * b;
+    char * dataDir = tr_buildPath( dir, "data", NULL );
+    char * torrentFile = tr_buildPath( dir, "data.torrent", NULL );
+    char * reusedFile = tr_buildPath( dir, "reused.torrent", NULL );
+    char * singleFile = tr_buildPath( dataDir, "file-2", NULL );
+    char * otherDir = tr_buildPath( dir, "other", "data", NULL );
+
+    tr_mkdirp( dataDir, 0777 );
+    if(( err = createFiles( dataDir )))
+        return err;
+
+    /* hash everything */
+    b = tr_metaInfoBuilderCreate( session, dataDir );
+    check( b->fileCount == FILE_COUNT );
+    check( build( b, torrentFile ) == TR_MAKEMETA_OK );
+    check( b->pieceIndex == b->pieceCount );
+    tr_metaInfoBuilderFree( b );
+    if(( err = checkPieces( session, torrentFile, TR_OK, &info )))
+        return err;
+
+    /* load it and check the data */
+    ctor = tr_ctorNew( session );
+    tr_ctorSetMetainfoFromFile( ctor, torrentFile );
+    tr_ctorSetPaused( ctor, TR_FORCE, TRUE );
+    tr_ctorSetDownloadDir( ctor, TR_FORCE, dir );
+    tor = tr_torrentNew( session, ctor, NULL );
+    tr_ctorFree( ctor );
+    check( tor != NULL );
+    tr_torrentVerify( tor );
+    while( tor->verifyState != TR_VERIFY_NONE || tr_cpGetStatus( &tor->completion ) != TR_SEED )
+        tr_wait( 10 );
+
+    /* a different layout can't borrow its hashes */
+    b = tr_metaInfoBuilderCreate( session, singleFile );
+    check( !tr_metaInfoBuilderReuseHashes( b, tor ) );
+    tr_metaInfoBuilderFree( b );
+
+    /* neither can other files with the same names and sizes */
+    if(( err = createLookalikes( dataDir, otherDir )))
+        return err;
+    b = tr_metaInfoBuilderCreate( session, otherDir );
+    check( b->fileCount == FILE_COUNT );
+    check( !tr_metaInfoBuilderReuseHashes( b, tor ) );
+    tr_metaInfoBuilderFree( b );
+
+    /* the same layout can, and gets the same info dict --
+     * so it's a duplicate of the torrent we just loaded */
+    b = tr_metaInfoBuilderCreate( session, dataDir );
+    check( tr_metaInfoBuilderReuseHashes( b, tor ) );
+    check( build( b, reusedFile ) == TR_MAKEMETA_OK );
+    check( b->pieceIndex == b->pieceCount );
+    tr_metaInfoBuilderFree( b );
+    if(( err = checkPieces( session, reusedFile, TR_EDUPLICATE, &reused )))
+        return err;
+    check( !memcmp( info.hash, reused.hash, SHA_DIGEST_LENGTH ) );
+
+    tr_torrentRemove( tor );
+    tr_metainfoFree( &reused );
+    tr_metainfoFree( &info );
+    tr_free( otherDir );
+    tr_free( singleFile );
+    tr_free( reusedFile );
+    tr_free( torrentFile );
+    tr_free( dataDir );
+    return 0;
+}
+
+int
+main( void )
+{
+    int          i;
+    char         dir[] = "/tmp/transmission-makemeta-test-XXXXXX";
+    tr_benc      settings;
+    tr_session * session;
+
+    if( mkdtemp( dir ) == NULL )
+        return 1;
+
+    tr_bencInitDict( &settings, 0 );
+    tr_sessionGetDefaultSettings( &settings );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PEER_PORT_RANDOM_ENABLED, 1 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PORT_FORWARDING, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_RPC_ENABLED, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_MSGLEVEL, 0 );
+    session = tr_sessionInit( "makemeta-test", dir, FALSE, &settings );
+
+    i = testMakeMeta( session, dir );
+
+    tr_sessionClose( session );
+    tr_bencFree( &settings );
+    removeTree( dir );
+    tr_free( content );
+    return i;
+}
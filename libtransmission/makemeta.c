@@ -21,12 +21,15 @@
 #include <unistd.h>
 #include <dirent.h>
 
-#include "crypto.h" /* tr_sha1 */
 #include "transmission.h"
 #include "session.h"
 #include "bencode.h"
+#include "completion.h"
+#include "list.h"
 #include "makemeta.h"
 #include "platform.h" /* threads, locks */
+#include "sha1.h"
+#include "torrent.h"
 #include "utils.h" /* buildpath */
 #include "version.h"
 
@@ -187,107 +190,406 @@ tr_metaInfoBuilderFree( tr_metainfo_builder * builder )
             tr_free( builder->trackers[i].announce );
         tr_free( builder->trackers );
         tr_free( builder->outputFile );
+        tr_free( builder->knownHashes );
+        tr_bitfieldFree( builder->knownPieces );
         tr_free( builder );
     }
 }
 
+/* true if both paths lead to the same file on disk,
+ * however they're spelled */
+static tr_bool
+isSameFile( const char * a, const char * b )
+{
+    struct stat sa, sb;
+
+    if( stat( a, &sa ) || stat( b, &sb ) )
+        return FALSE;
+
+#ifdef WIN32
+    /* no inode numbers here */
+    return !strcmp( a, b );
+#else
+    return ( sa.st_dev == sb.st_dev ) && ( sa.st_ino == sb.st_ino );
+#endif
+}
+
+/* tor's hashes only describe the builder's files
+ * if they're the very same files, not lookalikes elsewhere */
+static tr_bool
+hasSameFiles( const tr_metainfo_builder * builder,
+              const tr_torrent          * tor )
+{
+    tr_file_index_t i;
+    const tr_info * inf = &tor->info;
+
+    if( inf->fileCount != builder->fileCount )
+        return FALSE;
+
+    for( i=0; i<inf->fileCount; ++i )
+    {
+        tr_bool same;
+        char * path;
+
+        if( inf->files[i].length != builder->files[i].size )
+            return FALSE;
+
+        path = tr_buildPath( tor->downloadDir, inf->files[i].name, NULL );
+        same = isSameFile( path, builder->files[i].filename );
+        tr_free( path );
+        if( !same )
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+tr_bool
+tr_metaInfoBuilderReuseHashes( tr_metainfo_builder * builder,
+                               const tr_torrent    * tor )
+{
+    tr_piece_index_t piece;
+    const tr_info * inf = &tor->info;
+
+    tr_globalLock( tor->session );
+
+    if( !hasSameFiles( builder, tor ) )
+    {
+        tr_globalUnlock( tor->session );
+        return FALSE;
+    }
+
+    builder->pieceSize = inf->pieceSize;
+    builder->pieceCount = inf->pieceCount;
+
+    tr_free( builder->knownHashes );
+    tr_bitfieldFree( builder->knownPieces );
+    builder->knownHashes = tr_new( uint8_t, SHA_DIGEST_LENGTH * inf->pieceCount );
+    builder->knownPieces = tr_bitfieldNew( inf->pieceCount );
+
+    for( piece=0; piece<inf->pieceCount; ++piece )
+    {
+        memcpy( builder->knownHashes + SHA_DIGEST_LENGTH * piece,
+                inf->pieces[piece].hash, SHA_DIGEST_LENGTH );
+
+        if( tr_cpPieceIsComplete( &tor->completion, piece )
+            && tr_torrentIsPieceChecked( tor, piece ) )
+            tr_bitfieldAdd( builder->knownPieces, piece );
+    }
+    tr_globalUnlock( tor->session );
+
+    return TRUE;
+}
+
 /****
 *****
 ****/
 
-static uint8_t*
-getHashInfo( tr_metainfo_builder * b )
+/**
+*** Pieces are hashed in a pipeline: the builder's worker thread reads
+*** runs of pieces from disk in large sequential chunks and queues them,
+*** while a pool of hashing threads hashes them and fills in the
+*** results by piece index.
+**/
+
+enum
 {
-    uint32_t fileIndex = 0;
-    uint8_t *ret = tr_new0( uint8_t, SHA_DIGEST_LENGTH * b->pieceCount );
-    uint8_t *walk = ret;
-    uint8_t *buf;
-    uint64_t totalRemain;
-    uint64_t off = 0;
-    FILE *   fp;
+    /* how much the reader tries to read at once */
+    READ_CHUNK_BYTES = ( 4 * 1024 * 1024 ),
 
-    if( !b->totalSize )
-        return ret;
+    /* how far ahead of the hashing threads the reader can get */
+    MAX_READ_AHEAD_BYTES = ( 64 * 1024 * 1024 ),
 
-    buf = tr_new( uint8_t, b->pieceSize );
-    b->pieceIndex = 0;
-    totalRemain = b->totalSize;
-    fp = fopen( b->files[fileIndex].filename, "rb" );
-    if( !fp )
-    {
-        b->my_errno = errno;
-        tr_strlcpy( b->errfile,
-                    b->files[fileIndex].filename,
-                    sizeof( b->errfile ) );
-        b->result = TR_MAKEMETA_IO_READ;
-        tr_free( buf );
-        tr_free( ret );
-        return NULL;
-    }
-    while( totalRemain )
+    /* upper bound on the hashing pool's size */
+    MAX_HASH_THREADS = 32,
+
+    /* the most pieces tr_sha1Multi() is handed at once */
+    MAX_HASH_BATCH = 8
+};
+
+/* a run of pieces that's been read and is waiting to be hashed */
+struct hash_job
+{
+    tr_piece_index_t    firstPiece;
+    tr_piece_index_t    pieceCount;
+    uint8_t           * buf;
+    size_t              buflen;
+    struct __tr_list    head;
+};
+
+/* what the reader and the hashing threads share.
+   everything past `lock' is only touched while holding it */
+struct hash_state
+{
+    tr_metainfo_builder  * builder;
+    uint8_t              * hashes;
+    tr_lock              * lock;
+    tr_cond              * jobQueued;   /* signalled when `queue' or `readerDone' changes */
+    tr_cond              * jobDone;     /* signalled when `bytesInFlight' or `threadCount' drops */
+    struct __tr_list       queue;
+    size_t                 bytesInFlight;
+    int                    threadCount;
+    tr_bool                readerDone;
+};
+
+/* where the reader is */
+struct hash_reader
+{
+    tr_metainfo_builder  * builder;
+    FILE                 * fp;
+    tr_file_index_t        fileIndex;
+    uint64_t               fileBegin;   /* the file's offset in the torrent */
+    uint64_t               fileOffset;  /* fp's offset in the file */
+};
+
+static uint32_t
+getPieceSize( const tr_metainfo_builder * b, tr_piece_index_t piece )
+{
+    const uint64_t begin = (uint64_t)piece * b->pieceSize;
+
+    return (uint32_t) MIN( (uint64_t)b->pieceSize, b->totalSize - begin );
+}
+
+static void
+hashThreadFunc( void * vstate )
+{
+    struct hash_state * state = vstate;
+    tr_metainfo_builder * b = state->builder;
+
+    for( ;; )
     {
-        uint8_t *      bufptr = buf;
-        const uint64_t thisPieceSize =
-            MIN( (uint32_t)b->pieceSize, totalRemain );
-        uint64_t       pieceRemain = thisPieceSize;
+        struct hash_job * job;
 
-        assert( b->pieceIndex < b->pieceCount );
+        tr_lockLock( state->lock );
+        while( ( state->queue.next == &state->queue ) && !state->readerDone )
+            tr_condWait( state->jobQueued, state->lock );
+        if( state->queue.next == &state->queue )
+        {
+            /* getHashInfo() frees `state' once threadCount is zero,
+               so don't touch it after unlocking */
+            --state->threadCount;
+            tr_condSignal( state->jobDone );
+            tr_lockUnlock( state->lock );
+            break;
+        }
+        job = __tr_list_entry( state->queue.next, struct hash_job, head );
+        __tr_list_remove( &job->head );
+        tr_lockUnlock( state->lock );
 
-        while( pieceRemain )
+        if( !b->abortFlag )
         {
-            const uint64_t n_this_pass =
-                MIN( ( b->files[fileIndex].size - off ), pieceRemain );
-            fread( bufptr, 1, n_this_pass, fp );
-            bufptr += n_this_pass;
-            off += n_this_pass;
-            pieceRemain -= n_this_pass;
-            if( off == b->files[fileIndex].size )
+            tr_piece_index_t i = 0;
+            const uint8_t * walk = job->buf;
+
+            while( i < job->pieceCount )
             {
-                off = 0;
-                fclose( fp );
-                fp = NULL;
-                if( ++fileIndex < b->fileCount )
-                {
-                    fp = fopen( b->files[fileIndex].filename, "rb" );
-                    if( !fp )
-                    {
-                        b->my_errno = errno;
-                        tr_strlcpy( b->errfile,
-                                    b->files[fileIndex].filename,
-                                    sizeof( b->errfile ) );
-                        b->result = TR_MAKEMETA_IO_READ;
-                        tr_free( buf );
-                        tr_free( ret );
-                        return NULL;
-                    }
+                int n;
+                const void * bufs[MAX_HASH_BATCH];
+                size_t lens[MAX_HASH_BATCH];
+
+                for( n=0; n<MAX_HASH_BATCH && i+n<job->pieceCount; ++n ) {
+                    bufs[n] = walk;
+                    lens[n] = getPieceSize( b, job->firstPiece + i + n );
+                    walk += lens[n];
                 }
+
+                tr_sha1Multi( (uint8_t(*)[SHA_DIGEST_LENGTH])( state->hashes + SHA_DIGEST_LENGTH * ( job->firstPiece + i ) ),
+                              bufs, lens, n );
+                i += n;
             }
         }
 
-        assert( bufptr - buf == (int)thisPieceSize );
-        assert( pieceRemain == 0 );
-        tr_sha1( walk, buf, thisPieceSize, NULL );
-        walk += SHA_DIGEST_LENGTH;
+        tr_lockLock( state->lock );
+        state->bytesInFlight -= job->buflen;
+        b->pieceIndex += job->pieceCount;
+        tr_condSignal( state->jobDone );
+        tr_lockUnlock( state->lock );
 
-        if( b->abortFlag )
+        tr_free( job->buf );
+        tr_free( job );
+    }
+}
+
+static void
+setReadError( tr_metainfo_builder * b, const char * filename, int err )
+{
+    b->my_errno = err;
+    tr_strlcpy( b->errfile, filename, sizeof( b->errfile ) );
+    b->result = TR_MAKEMETA_IO_READ;
+}
+
+/* read `len' bytes from the torrent's data, starting at `offset' */
+static int
+readBytes( struct hash_reader * r, uint64_t offset, uint8_t * buf, uint64_t len )
+{
+    tr_metainfo_builder * b = r->builder;
+
+    while( len )
+    {
+        const tr_metainfo_builder_file * file;
+        uint64_t n;
+
+        /* find the file that has `offset' in it */
+        while( offset >= r->fileBegin + b->files[r->fileIndex].size )
+        {
+            if( r->fp != NULL ) {
+                fclose( r->fp );
+                r->fp = NULL;
+            }
+            r->fileBegin += b->files[r->fileIndex].size;
+            ++r->fileIndex;
+            assert( r->fileIndex < b->fileCount );
+        }
+
+        file = &b->files[r->fileIndex];
+
+        if( r->fp == NULL )
+        {
+            if(( r->fp = fopen( file->filename, "rb" )) == NULL ) {
+                setReadError( b, file->filename, errno );
+                return -1;
+            }
+            r->fileOffset = 0;
+        }
+
+        /* skip over the pieces whose hashes we already have */
+        if( r->fileOffset != offset - r->fileBegin )
+        {
+            r->fileOffset = offset - r->fileBegin;
+            if( fseeko( r->fp, r->fileOffset, SEEK_SET ) ) {
+                setReadError( b, file->filename, errno );
+                return -1;
+            }
+        }
+
+        n = MIN( len, file->size - r->fileOffset );
+        if( fread( buf, 1, n, r->fp ) != n ) {
+            setReadError( b, file->filename, ferror( r->fp ) ? errno : EIO );
+            return -1;
+        }
+
+        r->fileOffset += n;
+        offset += n;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static tr_bool
+isPieceKnown( const tr_metainfo_builder * b, tr_piece_index_t piece )
+{
+    return ( b->knownPieces != NULL ) && tr_bitfieldHas( b->knownPieces, piece );
+}
+
+static uint8_t*
+getHashInfo( tr_metainfo_builder * b )
+{
+    int i;
+    tr_piece_index_t piece;
+    struct hash_state state;
+    struct hash_reader reader;
+    const tr_piece_index_t piecesPerChunk = MAX( 1u, READ_CHUNK_BYTES / b->pieceSize );
+
+    b->pieceIndex = 0;
+    if( !b->totalSize )
+        return tr_new0( uint8_t, SHA_DIGEST_LENGTH * b->pieceCount );
+
+    memset( &state, 0, sizeof( state ) );
+    state.builder = b;
+    state.hashes = tr_new0( uint8_t, SHA_DIGEST_LENGTH * b->pieceCount );
+    state.lock = tr_lockNew( );
+    state.jobQueued = tr_condNew( );
+    state.jobDone = tr_condNew( );
+    __tr_list_init( &state.queue );
+
+    memset( &reader, 0, sizeof( reader ) );
+    reader.builder = b;
+
+    state.threadCount = MIN( tr_getProcessorCount( ), MAX_HASH_THREADS );
+    for( i=0; i<state.threadCount; ++i )
+        tr_threadNew( hashThreadFunc, &state );
+
+    for( piece=0; piece<b->pieceCount && !b->abortFlag && !b->result; )
+    {
+        tr_piece_index_t n;
+        uint64_t len = 0;
+        uint8_t * buf;
+        struct hash_job * job;
+
+        if( isPieceKnown( b, piece ) )
         {
-            b->result = TR_MAKEMETA_CANCELLED;
+            memcpy( state.hashes + SHA_DIGEST_LENGTH * piece,
+                    b->knownHashes + SHA_DIGEST_LENGTH * piece, SHA_DIGEST_LENGTH );
+            tr_lockLock( state.lock );
+            ++b->pieceIndex;
+            tr_lockUnlock( state.lock );
+            ++piece;
+            continue;
+        }
+
+        /* read a run of pieces that need hashing */
+        for( n=0; n<piecesPerChunk && piece+n<b->pieceCount && !isPieceKnown( b, piece+n ); ++n )
+            len += getPieceSize( b, piece + n );
+
+        /* wait for the hashing threads to catch up.  they skip the
+           hashing once abortFlag is set, so this doesn't wait long then */
+        tr_lockLock( state.lock );
+        while( !b->abortFlag && state.bytesInFlight
+               && ( state.bytesInFlight + len > MAX_READ_AHEAD_BYTES ) )
+            tr_condWait( state.jobDone, state.lock );
+        tr_lockUnlock( state.lock );
+        if( b->abortFlag )
+            break;
+
+        buf = tr_new( uint8_t, len );
+        if( readBytes( &reader, (uint64_t)piece * b->pieceSize, buf, len ) ) {
+            tr_free( buf );
             break;
         }
 
-        totalRemain -= thisPieceSize;
-        ++b->pieceIndex;
+        job = tr_new0( struct hash_job, 1 );
+        job->firstPiece = piece;
+        job->pieceCount = n;
+        job->buf = buf;
+        job->buflen = len;
+
+        tr_lockLock( state.lock );
+        state.bytesInFlight += len;
+        __tr_list_append( &state.queue, &job->head );
+        tr_condSignal( state.jobQueued );
+        tr_lockUnlock( state.lock );
+
+        piece += n;
     }
 
-    assert( b->abortFlag
-          || ( walk - ret == (int)( SHA_DIGEST_LENGTH * b->pieceCount ) ) );
-    assert( b->abortFlag || !totalRemain );
+    if( reader.fp != NULL )
+        fclose( reader.fp );
+
+    /* wait for the hashing threads to finish */
+    tr_lockLock( state.lock );
+    state.readerDone = TRUE;
+    tr_condBroadcast( state.jobQueued );
+    while( state.threadCount )
+        tr_condWait( state.jobDone, state.lock );
+    tr_lockUnlock( state.lock );
+    tr_condFree( state.jobDone );
+    tr_condFree( state.jobQueued );
+    tr_lockFree( state.lock );
+
+    if( b->result )
+    {
+        tr_free( state.hashes );
+        return NULL;
+    }
 
-    if( fp )
-        fclose( fp );
+    if( b->abortFlag )
+        b->result = TR_MAKEMETA_CANCELLED;
+    else
+        assert( b->pieceIndex == b->pieceCount );
 
-    tr_free( buf );
-    return ret;
+    return state.hashes;
 }
 
 static void
@@ -13,6 +13,8 @@
 #ifndef TR_MAKEMETA_H
 #define TR_MAKEMETA_H 1
 
+struct tr_bitfield;
+
 typedef struct tr_metainfo_builder_file
 {
     char *      filename;
@@ -83,6 +85,10 @@ typedef struct tr_metainfo_builder
     **/
 
     struct tr_metainfo_builder * nextBuilder;
+
+    /* piece hashes borrowed by tr_metaInfoBuilderReuseHashes() */
+    uint8_t *                    knownHashes;
+    struct tr_bitfield *         knownPieces;
 }
 tr_metainfo_builder;
 
@@ -92,6 +98,20 @@ tr_metainfo_builder*tr_metaInfoBuilderCreate( tr_session * session,
 
 void                tr_metaInfoBuilderFree( tr_metainfo_builder* );
 
+/**
+ * @brief reuse the piece hashes of a torrent that has the same files
+ *
+ * If the builder's files are the very files `tor' downloaded, in the
+ * same order -- not just files of the same sizes somewhere else -- the
+ * builder switches to tor's piece size and copies the hashes of the
+ * pieces tor has downloaded and checked, so that only the other pieces
+ * need to be read and hashed.
+ *
+ * @return true if the files match and the hashes will be reused
+ */
+tr_bool             tr_metaInfoBuilderReuseHashes( tr_metainfo_builder * builder,
+                                                   const tr_torrent    * tor );
+
 /**
  * @brief create a new .torrent file
  *
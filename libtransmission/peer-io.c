@@ -13,6 +13,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h> /* INT_MAX */
+#include <stdint.h> /* SIZE_MAX */
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -21,6 +22,11 @@
  #include <winsock2.h>
 #else
  #include <arpa/inet.h> /* inet_ntoa */
+ #include <sys/ioctl.h>
+ #include <sys/socket.h> /* getsockopt */
+ #ifdef __linux__
+  #include <linux/sockios.h> /* SIOCOUTQ */
+ #endif
 #endif
 
 #include <event.h>
@@ -29,10 +35,12 @@
 #include "session.h"
 #include "bandwidth.h"
 #include "crypto.h"
+#include "inout.h" /* tr_ioSendBlock */
 #include "list.h"
 #include "net.h"
 #include "peer-io.h"
 #include "platform.h" /* MAX_STACK_ARRAY_SIZE */
+#include "torrent.h" /* tr_torrentFindFromId */
 #include "trevent.h"
 #include "utils.h"
 
@@ -76,6 +84,14 @@ struct tr_datatype
 {
     tr_bool  isPieceData;
     size_t   length;
+
+    /* if true, this chunk isn't in io->outbuf.  It's a block that
+     * tr_peerIoWriteBlock() queued to be sent straight from disk */
+    tr_bool            isFileData;
+    int                torrentId;
+    tr_piece_index_t   pieceIndex;
+    uint32_t           pieceOffset;
+
     struct __tr_list head;
 };
 
@@ -104,6 +120,8 @@ didWriteWrapper( tr_peerIo * io, size_t bytes_transferred )
         {
             bytes_transferred -= payload;
             next->length -= payload;
+            if( next->isFileData )
+                next->pieceOffset += payload;
             if( !next->length ) {
                 __tr_list_remove( io->outbuf_datatypes.next );
                 tr_free( next );
@@ -202,12 +220,15 @@ event_read_cb( int fd, short event UNUSED, void * vio )
 
     dbgmsg( io, "libevent says this peer is ready to read" );
 
-    /* if we don't have any bandwidth left, stop reading */
+    /* if we don't have any bandwidth left, stop reading
+     * until tr_bandwidthAllocate() gives us some more */
     if( howmuch < 1 ) {
+        io->isReadPending = TRUE;
         tr_peerIoSetEnabled( io, dir, FALSE );
         return;
     }
 
+    io->isReadPending = FALSE;
     errno = 0;
     res = evbuffer_read( io->inbuf, fd, howmuch );
     e = errno;
@@ -240,30 +261,115 @@ event_read_cb( int fd, short event UNUSED, void * vio )
     }
 }
 
+static TR_INLINE size_t
+getOutputLength( const tr_peerIo * io )
+{
+    return EVBUFFER_LENGTH( io->outbuf ) + io->outbufFileLength;
+}
+
+/* how many bytes at the front of the output queue are in io->outbuf,
+ * i.e. how much we can write before reaching a block queued by
+ * tr_peerIoWriteBlock() */
+static size_t
+getBufferedRunLength( const tr_peerIo * io )
+{
+    size_t len = 0;
+    const struct __tr_list * walk;
+
+    for( walk=io->outbuf_datatypes.next; walk!=&io->outbuf_datatypes; walk=walk->next )
+    {
+        const struct tr_datatype * dt = __tr_list_entry( walk, struct tr_datatype, head );
+        if( dt->isFileData )
+            break;
+        len += dt->length;
+    }
+
+    return len;
+}
+
+/* write the chunk at the front of the output queue.
+ * returns the number of bytes written, or -1 and sets errno */
 static int
-tr_evbuffer_write( tr_peerIo * io, int fd, size_t howmuch )
+tr_evbuffer_write( tr_peerIo * io, int fd, size_t howmuch, size_t * setme_wanted )
 {
     int e;
     int n;
-    struct evbuffer * buffer = io->outbuf;
-
-    howmuch = MIN( EVBUFFER_LENGTH( buffer ), howmuch );
+    struct tr_datatype * next = __tr_list_entry( io->outbuf_datatypes.next, struct tr_datatype, head );
 
     errno = 0;
+
+    if( next->isFileData )
+    {
+        const tr_torrent * tor = tr_torrentFindFromId( io->session, next->torrentId );
+
+        howmuch = MIN( next->length, howmuch );
+
+        if( tor == NULL ) {
+            errno = EINVAL;
+            n = -1;
+        } else {
+            tr_bool isLocalError;
+            n = tr_ioSendBlock( tor, next->pieceIndex, next->pieceOffset, howmuch, fd, &isLocalError );
+            if( ( n < 0 ) && isLocalError )
+                io->localError = errno;
+        }
+
+        if( n > 0 )
+            io->outbufFileLength -= n;
+    }
+    else
+    {
+        struct evbuffer * buffer = io->outbuf;
+
+        howmuch = MIN( getBufferedRunLength( io ), howmuch );
+        howmuch = MIN( EVBUFFER_LENGTH( buffer ), howmuch );
+
 #ifdef WIN32
-    n = (int) send(fd, buffer->buffer, howmuch,  0 );
+        n = (int) send(fd, buffer->buffer, howmuch,  0 );
 #else
-    n = (int) write(fd, buffer->buffer, howmuch );
+        n = (int) write(fd, buffer->buffer, howmuch );
 #endif
+
+        if( n > 0 )
+            evbuffer_drain( buffer, n );
+    }
+
     e = errno;
     dbgmsg( io, "wrote %d to peer (%s)", n, (n==-1?strerror(e):"") );
 
-    if( n > 0 )
-        evbuffer_drain( buffer, n );
-
+    *setme_wanted = howmuch;
+    errno = e;
     return n;
 }
 
+/* write up to `howmuch' bytes from the output queue, one chunk at a time,
+ * and account for each chunk's bandwidth as soon as it's been written.
+ * returns the number of bytes written, or -1/0 and sets errno */
+static int
+tr_peerIoWriteOutput( tr_peerIo * io, int fd, size_t howmuch )
+{
+    int total = 0;
+
+    while( howmuch && ( io->outbuf_datatypes.next != &io->outbuf_datatypes ) )
+    {
+        size_t wanted;
+        const int n = tr_evbuffer_write( io, fd, howmuch, &wanted );
+
+        if( n <= 0 )
+            return total ? total : n;
+
+        total += n;
+        howmuch -= n;
+        didWriteWrapper( io, n );
+
+        /* stop if the socket is full */
+        if( ( (size_t)n < wanted ) || !tr_isPeerIo( io ) )
+            break;
+    }
+
+    return total;
+}
+
 static void
 event_write_cb( int fd, short event UNUSED, void * vio )
 {
@@ -283,7 +389,7 @@ event_write_cb( int fd, short event UNUSED, void * vio )
 
     /* Write as much as possible, since the socket is non-blocking, write() will
      * return if it can't write any more data without blocking */
-    howmuch = tr_bandwidthClamp( &io->bandwidth, dir, EVBUFFER_LENGTH( io->outbuf ) );
+    howmuch = tr_bandwidthClamp( &io->bandwidth, dir, getOutputLength( io ) );
 
     /* if we don't have any bandwidth left, stop writing */
     if( howmuch < 1 ) {
@@ -292,7 +398,7 @@ event_write_cb( int fd, short event UNUSED, void * vio )
     }
 
     errno = 0;
-    res = tr_evbuffer_write( io, fd, howmuch );
+    res = tr_peerIoWriteOutput( io, fd, howmuch );
     e = errno;
 
     if (res == -1) {
@@ -315,14 +421,13 @@ event_write_cb( int fd, short event UNUSED, void * vio )
     if (res <= 0)
         goto error;
 
-    if( EVBUFFER_LENGTH( io->outbuf ) )
+    if( getOutputLength( io ) )
         tr_peerIoSetEnabled( io, dir, TRUE );
 
-    didWriteWrapper( io, res );
     return;
 
  reschedule:
-    if( EVBUFFER_LENGTH( io->outbuf ) )
+    if( getOutputLength( io ) )
         tr_peerIoSetEnabled( io, dir, TRUE );
     return;
 
@@ -535,6 +640,7 @@ tr_peerIoReconnect( tr_peerIo * io )
         tr_netClose( io->socket );
 
     io->socket = tr_netOpenTCP( io->session, &io->addr, io->port ); 
+    io->sendBufferSize = 0;
     if( io->socket >= 0 )
     {
         tr_netSetTOS( io->socket, io->session->peerSocketTOS );
@@ -639,7 +745,7 @@ size_t
 tr_peerIoGetWriteBufferSpace( const tr_peerIo * io, uint64_t now )
 {
     const size_t desiredLen = getDesiredOutputBufferSize( io, now );
-    const size_t currentLen = EVBUFFER_LENGTH( io->outbuf );
+    const size_t currentLen = getOutputLength( io );
     size_t freeSpace = 0;
 
     if( desiredLen > currentLen )
@@ -667,23 +773,42 @@ tr_peerIoSetEncryption( tr_peerIo * io,
 ***
 **/
 
+static struct tr_datatype*
+addDatatype( tr_peerIo * io, size_t byteCount, tr_bool isPieceData )
+{
+    struct tr_datatype * datatype = tr_new0( struct tr_datatype, 1 );
+
+    datatype->isPieceData = isPieceData != 0;
+    datatype->length = byteCount;
+
+    __tr_list_init( &datatype->head );
+    __tr_list_append( &io->outbuf_datatypes, &datatype->head );
+
+    return datatype;
+}
+
+/* we only poll for writability when there's something to write,
+ * so when something's been queued is the time to start */
+static void
+didQueueOutput( tr_peerIo * io )
+{
+    if( tr_peerIoHasBandwidthLeft( io, TR_UP ) )
+        tr_peerIoSetEnabled( io, TR_UP, TRUE );
+}
+
 void
 tr_peerIoWrite( tr_peerIo   * io,
                 const void  * bytes,
                 size_t        byteCount,
                 tr_bool       isPieceData )
 {
-    struct tr_datatype * datatype;
-
     assert( tr_amInEventThread( io->session ) );
     dbgmsg( io, "adding %zu bytes into io->output", byteCount );
 
-    datatype = tr_new( struct tr_datatype, 1 );
-    datatype->isPieceData = isPieceData != 0;
-    datatype->length = byteCount;
+    if( !byteCount )
+        return;
 
-    __tr_list_init( &datatype->head );
-    __tr_list_append( &io->outbuf_datatypes, &datatype->head );
+    addDatatype( io, byteCount, isPieceData );
 
     switch( io->encryptionMode )
     {
@@ -711,6 +836,8 @@ tr_peerIoWrite( tr_peerIo   * io,
             assert( 0 );
             break;
     }
+
+    didQueueOutput( io );
 }
 
 void
@@ -723,6 +850,32 @@ tr_peerIoWriteBuf( tr_peerIo         * io,
     evbuffer_drain( buf, n );
 }
 
+void
+tr_peerIoWriteBlock( tr_peerIo         * io,
+                     const tr_torrent  * tor,
+                     tr_piece_index_t    pieceIndex,
+                     uint32_t            pieceOffset,
+                     uint32_t            length )
+{
+    struct tr_datatype * datatype;
+
+    assert( tr_isPeerIo( io ) );
+    assert( tr_isTorrent( tor ) );
+    assert( tr_amInEventThread( io->session ) );
+    assert( !tr_peerIoIsEncrypted( io ) );
+    dbgmsg( io, "queueing block %u:%u->%u to be sent from disk", pieceIndex, pieceOffset, length );
+
+    datatype = addDatatype( io, length, TRUE );
+    datatype->isFileData = TRUE;
+    datatype->torrentId = tr_torrentId( tor );
+    datatype->pieceIndex = pieceIndex;
+    datatype->pieceOffset = pieceOffset;
+
+    io->outbufFileLength += length;
+
+    didQueueOutput( io );
+}
+
 /***
 ****
 ***/
@@ -783,6 +936,9 @@ tr_peerIoTryRead( tr_peerIo * io, size_t howmuch )
         res = evbuffer_read( io->inbuf, io->socket, howmuch );
         e = errno;
 
+        /* if we filled the whole request, there may be more waiting */
+        io->isReadPending = res == (int)howmuch;
+
         dbgmsg( io, "read %d from peer (%s)", res, (res==-1?strerror(e):"") );
 
         if( EVBUFFER_LENGTH( io->inbuf ) )
@@ -810,12 +966,9 @@ tr_peerIoTryWrite( tr_peerIo * io, size_t howmuch )
     {
         int e;
         errno = 0;
-        n = tr_evbuffer_write( io, io->socket, howmuch );
+        n = tr_peerIoWriteOutput( io, io->socket, howmuch );
         e = errno;
 
-        if( n > 0 )
-            didWriteWrapper( io, n );
-
         if( ( n < 0 ) && ( io->gotError ) && ( e != EPIPE ) && ( e != EAGAIN ) && ( e != EINTR ) && ( e != EINPROGRESS ) )
         {
             const short what = EVBUFFER_WRITE | EVBUFFER_ERROR;
@@ -847,6 +1000,53 @@ tr_peerIoFlush( tr_peerIo  * io, tr_direction dir, size_t limit )
     return bytesUsed;
 }
 
+tr_bool
+tr_peerIoWantsBandwidth( const tr_peerIo * io, tr_direction dir )
+{
+    assert( tr_isPeerIo( io ) );
+    assert( tr_isDirection( dir ) );
+
+    if( !io->hasFinishedConnecting )
+        return FALSE;
+
+    if( dir == TR_UP )
+        return getOutputLength( io ) > 0;
+
+    return io->isReadPending;
+}
+
+#if defined( SIOCOUTQ )
+ #define SEND_QUEUE_IOCTL SIOCOUTQ
+#elif defined( FIONWRITE )
+ #define SEND_QUEUE_IOCTL FIONWRITE
+#endif
+
+size_t
+tr_peerIoGetSendBufferSpace( tr_peerIo * io )
+{
+    size_t space = SIZE_MAX;
+
+    assert( tr_isPeerIo( io ) );
+
+#ifdef SEND_QUEUE_IOCTL
+    if( !io->sendBufferSize )
+    {
+        socklen_t len = sizeof( io->sendBufferSize );
+        if( getsockopt( io->socket, SOL_SOCKET, SO_SNDBUF, &io->sendBufferSize, &len ) || ( io->sendBufferSize <= 0 ) )
+            io->sendBufferSize = -1;
+    }
+
+    if( io->sendBufferSize > 0 )
+    {
+        int queued;
+        if( !ioctl( io->socket, SEND_QUEUE_IOCTL, &queued ) )
+            space = queued < io->sendBufferSize ? (size_t)( io->sendBufferSize - queued ) : 0;
+    }
+#endif
+
+    return space;
+}
+
 /***
 ****
 ****/
@@ -912,6 +1112,12 @@ tr_peerIoSetEnabled( tr_peerIo    * io,
     assert( tr_amInEventThread( io->session ) );
     assert( io->session->events != NULL );
 
+    /* libevent's polling is level-triggered, so a writable socket with
+     * nothing to write would wake us up every time through the loop.
+     * Wait for tr_peerIoWrite() to give us something to send. */
+    if( ( dir == TR_UP ) && io->hasFinishedConnecting && !getOutputLength( io ) )
+        isEnabled = FALSE;
+
     if( isEnabled )
         event_enable( io, event );
     else
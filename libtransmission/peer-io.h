@@ -71,6 +71,17 @@ typedef struct tr_peerIo
 
     int                   pendingEvents;
 
+    /* set when the socket was readable but we were out of bandwidth,
+     * so that tr_bandwidthAllocate() knows to give us a turn */
+    tr_bool               isReadPending;
+
+    /* SO_SNDBUF, or 0 if we haven't asked yet, or -1 if we can't */
+    int                   sendBufferSize;
+
+    /* an errno set when a tr_peerIoWriteBlock() block couldn't be
+     * read from the local files, as opposed to a socket error */
+    int                   localError;
+
     int                   magicNumber;
 
     uint8_t               encryptionMode;
@@ -98,6 +109,7 @@ typedef struct tr_peerIo
     struct evbuffer     * inbuf;
     struct evbuffer     * outbuf;
     struct __tr_list      outbuf_datatypes; /* struct tr_datatype */
+    size_t                outbufFileLength; /* tr_peerIoWriteBlock() bytes */
 
     struct event          event_read;
     struct event          event_write;
@@ -240,6 +252,20 @@ void    tr_peerIoWriteBuf       ( tr_peerIo         * io,
                                   struct evbuffer   * buf,
                                   tr_bool             isPieceData );
 
+/**
+ * Queue a block to be sent straight from the torrent's local files
+ * when the socket's ready, instead of copying it into io->outbuf.
+ * Since there's no chance to encrypt the data, this is only for
+ * unencrypted peers.
+ *
+ * @see tr_ioSendBlock
+ */
+void    tr_peerIoWriteBlock     ( tr_peerIo         * io,
+                                  const tr_torrent  * tor,
+                                  tr_piece_index_t    pieceIndex,
+                                  uint32_t            pieceOffset,
+                                  uint32_t            length );
+
 /**
 ***
 **/
@@ -249,6 +275,14 @@ static TR_INLINE struct tr_crypto * tr_peerIoGetCrypto( tr_peerIo * io )
     return io->crypto;
 }
 
+/** @return the errno from reading a tr_peerIoWriteBlock() block, or 0.
+            this lets gotError callbacks tell a bad local file from a
+            bad connection */
+static TR_INLINE int tr_peerIoGetLocalError( const tr_peerIo * io )
+{
+    return io->localError;
+}
+
 typedef enum
 {
     /* these match the values in MSE's crypto_select */
@@ -358,6 +392,15 @@ static TR_INLINE tr_bool tr_peerIoHasBandwidthLeft( const tr_peerIo  * io,
         || ( tr_bandwidthClamp( &io->bandwidth, dir, 1024 ) > 0 );
 }
 
+/** @return true if the peer-io has queued output to send, or unread input
+            that it stopped reading for lack of bandwidth */
+tr_bool   tr_peerIoWantsBandwidth( const tr_peerIo * io,
+                                   tr_direction      dir );
+
+/** @return how many more bytes the socket's send buffer can take,
+            or SIZE_MAX if this platform can't tell us */
+size_t    tr_peerIoGetSendBufferSpace( tr_peerIo * io );
+
 static TR_INLINE double tr_peerIoGetPieceSpeed( const tr_peerIo * io, uint64_t now, tr_direction dir )
 {
     assert( tr_isPeerIo( io ) );
@@ -24,9 +24,11 @@
 #include "bandwidth.h"
 #include "bencode.h"
 #include "blocklist.h"
+#include "cache.h" /* tr_cacheFlushPiece */
 #include "clients.h"
 #include "completion.h"
 #include "crypto.h"
+#include "disk-pool.h"
 #include "fdlimit.h"
 #include "handshake.h"
 #include "inout.h" /* tr_ioTestPiece */
@@ -34,6 +36,7 @@
 #include "peer-io.h"
 #include "peer-mgr.h"
 #include "peer-msgs.h"
+#include "picker.h"
 #include "ptrarray.h"
 #include "stats.h" /* tr_statsAddUploaded, tr_statsAddDownloaded */
 #include "torrent.h"
@@ -87,7 +90,10 @@ enum
     MYFLAG_UNREACHABLE = 2,
 
     /* the minimum we'll wait before attempting to reconnect to a peer */
-    MINIMUM_RECONNECT_INTERVAL_SECS = 5
+    MINIMUM_RECONNECT_INTERVAL_SECS = 5,
+
+    /* in endgame, the most peers that we ask for the same block */
+    MAX_ENDGAME_REQUESTS_PER_BLOCK = 3
 };
 
 
@@ -129,7 +135,7 @@ struct tr_blockIterator
     time_t expirationDate;
     struct tr_torrent_peers * t;
     tr_block_index_t blockIndex, blockCount, *blocks;
-    tr_piece_index_t pieceIndex, pieceCount, *pieces;
+    tr_piece_index_t deferredIndex, deferredCount, deferredAlloc, *deferred;
 };
 
 typedef struct tr_torrent_peers
@@ -138,14 +144,19 @@ typedef struct tr_torrent_peers
 
     uint8_t                    hash[SHA_DIGEST_LENGTH];
     int                      * pendingRequestCount;
+    int                        requestCount; /* the sum of pendingRequestCount */
+    tr_bool                    isEndgame; /* every block we need has been asked for */
+    uint64_t                   endgameDuplicateBytes; /* asked of a second peer in this endgame */
     tr_ptrArray                outgoingHandshakes; /* tr_handshake */
     tr_ptrArray                pool; /* struct peer_atom */
     tr_ptrArray                peers; /* tr_peer */
     tr_ptrArray                webseeds; /* tr_webseed */
-    tr_timer                 * refillTimer;
+    tr_timer                   refillTimer;
     tr_torrent               * tor;
     tr_peer                  * optimistic; /* the optimistic peer, or NULL if none */
     struct tr_blockIterator  * refillQueue; /* used in refillPulse() */
+    tr_picker                * picker; /* which pieces to ask for next */
+    tr_bool                    pickerIsStale; /* rebuild it before the next refill */
 
     struct tr_peerMgr        * manager;
 }
@@ -155,10 +166,10 @@ struct tr_peerMgr
 {
     tr_session      * session;
     tr_ptrArray       incomingHandshakes; /* tr_handshake */
-    tr_timer        * bandwidthTimer;
-    tr_timer        * rechokeTimer;
-    tr_timer        * reconnectTimer;
-    tr_timer        * refillUpkeepTimer;
+    tr_timer          bandwidthTimer;
+    tr_timer          rechokeTimer;
+    tr_timer          reconnectTimer;
+    tr_timer          refillUpkeepTimer;
 };
 
 #define tordbg( t, ... ) \
@@ -333,6 +344,7 @@ getPeer( Torrent          * torrent,
     {
         peer = peerConstructor( addr );
         tr_ptrArrayInsertSorted( &torrent->peers, peer, peerCompare );
+        tr_torrentMarkChanged( torrent->tor );
     }
 
     return peer;
@@ -374,7 +386,9 @@ removePeer( Torrent * t,
 
     removed = tr_ptrArrayRemoveSorted( &t->peers, peer, peerCompare );
     assert( removed == peer );
+    tr_pickerRemoveBitfield( t->picker, removed->have );
     peerDestructor( removed );
+    tr_torrentMarkChanged( t->tor );
 }
 
 static void
@@ -400,9 +414,10 @@ torrentDestructor( void * vt )
 
     memcpy( hash, t->hash, SHA_DIGEST_LENGTH );
 
-    tr_timerFree( &t->refillTimer );
+    tr_timerStop( &t->refillTimer );
 
     blockIteratorFree( &t->refillQueue );
+    tr_pickerFree( t->picker );
     tr_ptrArrayDestruct( &t->webseeds, (PtrArrayForeachFunc)tr_webseedFree );
     tr_ptrArrayDestruct( &t->pool, (PtrArrayForeachFunc)tr_free );
     tr_ptrArrayDestruct( &t->outgoingHandshakes, NULL );
@@ -416,6 +431,8 @@ static void peerCallbackFunc( void * vpeer,
                               void * vevent,
                               void * vt );
 
+static int refillPulse( void * vtorrent );
+
 static Torrent*
 torrentConstructor( tr_peerMgr * manager,
                     tr_torrent * tor )
@@ -430,6 +447,9 @@ torrentConstructor( tr_peerMgr * manager,
     t->peers = TR_PTR_ARRAY_INIT;
     t->webseeds = TR_PTR_ARRAY_INIT;
     t->outgoingHandshakes = TR_PTR_ARRAY_INIT;
+    t->picker = tr_pickerNew( tor->info.pieceCount );
+    t->pickerIsStale = TRUE;
+    tr_timerInit( &t->refillTimer, manager->session, refillPulse, t );
     memcpy( t->hash, tor->info.hash, SHA_DIGEST_LENGTH );
 
     for( i = 0; i < tor->info.webseedCount; ++i )
@@ -455,10 +475,14 @@ tr_peerMgrNew( tr_session * session )
 
     m->session = session;
     m->incomingHandshakes = TR_PTR_ARRAY_INIT;
-    m->bandwidthTimer    = tr_timerNew( session, bandwidthPulse, m, BANDWIDTH_PERIOD_MSEC );
-    m->rechokeTimer      = tr_timerNew( session, rechokePulse,   m, RECHOKE_PERIOD_MSEC );
-    m->reconnectTimer    = tr_timerNew( session, reconnectPulse, m, RECONNECT_PERIOD_MSEC );
-    m->refillUpkeepTimer = tr_timerNew( session, refillUpkeep,   m, REFILL_UPKEEP_PERIOD_MSEC );
+    tr_timerInit( &m->bandwidthTimer,    session, bandwidthPulse, m );
+    tr_timerInit( &m->rechokeTimer,      session, rechokePulse,   m );
+    tr_timerInit( &m->reconnectTimer,    session, reconnectPulse, m );
+    tr_timerInit( &m->refillUpkeepTimer, session, refillUpkeep,   m );
+    tr_timerStart( &m->bandwidthTimer,    BANDWIDTH_PERIOD_MSEC );
+    tr_timerStart( &m->rechokeTimer,      RECHOKE_PERIOD_MSEC );
+    tr_timerStart( &m->reconnectTimer,    RECONNECT_PERIOD_MSEC );
+    tr_timerStart( &m->refillUpkeepTimer, REFILL_UPKEEP_PERIOD_MSEC );
 
     rechokePulse( m );
 
@@ -470,10 +494,10 @@ tr_peerMgrFree( tr_peerMgr * manager )
 {
     managerLock( manager );
 
-    tr_timerFree( &manager->refillUpkeepTimer );
-    tr_timerFree( &manager->reconnectTimer );
-    tr_timerFree( &manager->rechokeTimer );
-    tr_timerFree( &manager->bandwidthTimer );
+    tr_timerStop( &manager->refillUpkeepTimer );
+    tr_timerStop( &manager->reconnectTimer );
+    tr_timerStop( &manager->rechokeTimer );
+    tr_timerStop( &manager->bandwidthTimer );
 
     /* free the handshakes.  Abort invokes handshakeDoneCB(), which removes
      * the item from manager->handshakes, so this is a little roundabout... */
@@ -546,6 +570,7 @@ incrementPieceRequests( Torrent * t, tr_piece_index_t piece )
     if( t->pendingRequestCount == NULL )
         t->pendingRequestCount = tr_new0( int, t->tor->info.pieceCount );
     t->pendingRequestCount[piece]++;
+    t->requestCount++;
 }
 
 static void
@@ -553,112 +578,53 @@ decrementPieceRequests( Torrent * t, tr_piece_index_t piece )
 {
     assertValidPiece( t, piece );
 
-    if( t->pendingRequestCount )
+    if( t->pendingRequestCount ) {
         t->pendingRequestCount[piece]--;
+        t->requestCount--;
+    }
 }
 
-struct tr_refill_piece
-{
-    tr_priority_t    priority;
-    uint32_t         piece;
-    uint32_t         peerCount;
-    int              random;
-    int              pendingRequestCount;
-    int              missingBlockCount;
-};
-
-static int
-compareRefillPiece( const void * aIn, const void * bIn )
+/* file the piece in the picker according to its current state */
+static void
+pickerUpdatePiece( Torrent * t, tr_piece_index_t piece )
 {
-    const struct tr_refill_piece * a = aIn;
-    const struct tr_refill_piece * b = bIn;
-
-    /* if one piece has a higher priority, it goes first */
-    if( a->priority != b->priority )
-        return a->priority > b->priority ? -1 : 1;
-
-    /* have a per-priority endgame */
-    if( a->pendingRequestCount != b->pendingRequestCount )
-        return a->pendingRequestCount < b->pendingRequestCount ? -1 : 1;
-
-    /* fewer missing pieces goes first */
-    if( a->missingBlockCount != b->missingBlockCount )
-        return a->missingBlockCount < b->missingBlockCount ? -1 : 1;
+    const tr_torrent * tor = t->tor;
+    const tr_piece * p = &tor->info.pieces[piece];
+    const int missing = tr_cpMissingBlocksInPiece( &tor->completion, piece );
 
-    /* otherwise if one has fewer peers, it goes first */
-    if( a->peerCount != b->peerCount )
-        return a->peerCount < b->peerCount ? -1 : 1;
-
-    /* otherwise go with our random seed */
-    if( a->random != b->random )
-        return a->random < b->random ? -1 : 1;
-
-    return 0;
+    tr_pickerSetPiece( t->picker, piece,
+                       !p->dnd && ( missing > 0 ),
+                       p->priority,
+                       missing < (int)tr_torPieceCountBlocks( tor, piece ) );
 }
 
-static tr_piece_index_t *
-getPreferredPieces( Torrent * t, tr_piece_index_t * pieceCount )
+/* refile every piece from scratch.  this is only needed when
+ * the torrent's wanted pieces or their priorities change. */
+static void
+pickerRebuild( Torrent * t )
 {
-    const tr_torrent  * tor = t->tor;
-    const tr_info     * inf = &tor->info;
-    tr_piece_index_t    i;
-    tr_piece_index_t    poolSize = 0;
-    tr_piece_index_t  * pool = tr_new( tr_piece_index_t , inf->pieceCount );
-    int                 peerCount;
-    const tr_peer    ** peers;
+    tr_piece_index_t i;
+    const tr_piece_index_t n = t->tor->info.pieceCount;
+    tr_piece_index_t * order = tr_new( tr_piece_index_t, n );
 
     assert( torrentIsLocked( t ) );
 
-    peers = (const tr_peer**) tr_ptrArrayBase( &t->peers );
-    peerCount = tr_ptrArraySize( &t->peers );
-
-    /* make a list of the pieces that we want but don't have */
-    for( i = 0; i < inf->pieceCount; ++i )
-        if( !tor->info.pieces[i].dnd
-                && !tr_cpPieceIsComplete( &tor->completion, i ) )
-            pool[poolSize++] = i;
-
-    /* sort the pool by which to request next */
-    if( poolSize > 1 )
-    {
-        tr_piece_index_t j;
-        struct tr_refill_piece * p = tr_new( struct tr_refill_piece, poolSize );
-
-        for( j = 0; j < poolSize; ++j )
-        {
-            int k;
-            const tr_piece_index_t piece = pool[j];
-            struct tr_refill_piece * setme = p + j;
-
-            setme->piece = piece;
-            setme->priority = inf->pieces[piece].priority;
-            setme->peerCount = 0;
-            setme->random = tr_cryptoWeakRandInt( INT_MAX );
-            setme->pendingRequestCount = getPieceRequests( t, piece );
-            setme->missingBlockCount
-                         = tr_cpMissingBlocksInPiece( &tor->completion, piece );
-
-            for( k = 0; k < peerCount; ++k )
-            {
-                const tr_peer * peer = peers[k];
-                if( peer->peerIsInterested
-                        && !peer->clientIsChoked
-                        && tr_bitfieldHas( peer->have, piece ) )
-                    ++setme->peerCount;
-            }
-        }
-
-        qsort( p, poolSize, sizeof( struct tr_refill_piece ),
-               compareRefillPiece );
-
-        for( j = 0; j < poolSize; ++j )
-            pool[j] = p[j].piece;
-
-        tr_free( p );
+    /* file the pieces in random order so the buckets start out shuffled */
+    for( i=0; i<n; ++i )
+        order[i] = i;
+    for( i=n; i>1; --i ) {
+        const tr_piece_index_t j = tr_cryptoWeakRandInt( i );
+        const tr_piece_index_t tmp = order[i-1];
+        order[i-1] = order[j];
+        order[j] = tmp;
     }
 
-    *pieceCount = poolSize;
-    return pool;
+    tr_pickerClearPieces( t->picker );
+    for( i=0; i<n; ++i )
+        pickerUpdatePiece( t, order[i] );
+
+    tr_free( order );
+    t->pickerIsStale = FALSE;
 }
 
 static struct tr_blockIterator*
@@ -667,9 +633,11 @@ blockIteratorNew( Torrent * t )
     struct tr_blockIterator * i = tr_new0( struct tr_blockIterator, 1 );
     i->expirationDate = time( NULL ) + PIECE_LIST_SHELF_LIFE_SECS;
     i->t = t;
-    i->pieces = getPreferredPieces( t, &i->pieceCount );
     i->blocks = tr_new0( tr_block_index_t, t->tor->blockCountInPiece );
-    tordbg( t, "creating new refill queue.. it contains %"PRIu32" pieces", i->pieceCount );
+    if( t->pickerIsStale )
+        pickerRebuild( t );
+    tr_pickerRewind( t->picker );
+    tordbg( t, "creating new refill queue" );
     return i;
 }
 
@@ -680,16 +648,39 @@ blockIteratorNext( struct tr_blockIterator * i, tr_block_index_t * setme )
     Torrent * t = i->t;
     tr_torrent * tor = t->tor;
 
-    while( ( i->blockIndex == i->blockCount )
-        && ( i->pieceIndex < i->pieceCount ) )
+    while( i->blockIndex == i->blockCount )
     {
-        const tr_piece_index_t index = i->pieces[i->pieceIndex++];
-        const tr_block_index_t b = tr_torPieceFirstBlock( tor, index );
-        const tr_block_index_t e = b + tr_torPieceCountBlocks( tor, index );
-        tr_block_index_t block;
+        tr_piece_index_t index;
+        tr_block_index_t b, e, block;
+
+        if( tr_pickerNext( t->picker, &index ) )
+        {
+            /* pieces we've already asked for go after all the others */
+            if( getPieceRequests( t, index ) > 0 ) {
+                if( i->deferredCount == i->deferredAlloc ) {
+                    i->deferredAlloc = MAX( 16u, i->deferredAlloc * 2 );
+                    i->deferred = tr_renew( tr_piece_index_t, i->deferred, i->deferredAlloc );
+                }
+                i->deferred[i->deferredCount++] = index;
+                continue;
+            }
+        }
+        else if( i->deferredIndex < i->deferredCount )
+            index = i->deferred[i->deferredIndex++];
+        else
+            break;
 
         assert( index < tor->info.pieceCount );
 
+        /* the picker isn't told when a piece is finished by some
+         * other means, such as a verify, so double-check it */
+        if( tor->info.pieces[index].dnd || tr_cpPieceIsComplete( &tor->completion, index ) ) {
+            pickerUpdatePiece( t, index );
+            continue;
+        }
+
+        b = tr_torPieceFirstBlock( tor, index );
+        e = b + tr_torPieceCountBlocks( tor, index );
         i->blockCount = 0;
         i->blockIndex = 0;
         for( block=b; block!=e; ++block )
@@ -719,7 +710,7 @@ blockIteratorFree( struct tr_blockIterator ** inout )
     if( it != NULL )
     {
         tr_free( it->blocks );
-        tr_free( it->pieces );
+        tr_free( it->deferred );
         tr_free( it );
     }
 
@@ -786,6 +777,47 @@ refillUpkeep( void * vmgr )
     return TRUE;
 }
 
+/* endgame starts when there are more requests out than blocks left
+ * to get, and each of the last blocks is asked of more than one peer
+ * so that the slowest peer can't hold up the whole torrent */
+static void
+updateEndgame( Torrent * t )
+{
+    const tr_torrent * tor = t->tor;
+    const uint64_t left = tr_cpLeftUntilDone( &tor->completion );
+    const uint64_t blocksLeft = ( left + tor->blockSize - 1 ) / tor->blockSize;
+    const tr_bool isEndgame = ( blocksLeft > 0 ) && ( blocksLeft <= (uint64_t)MAX( 0, t->requestCount ) );
+
+    if( isEndgame && !t->isEndgame ) {
+        tordbg( t, "entering endgame with %"PRIu64" blocks left", blocksLeft );
+        t->endgameDuplicateBytes = 0;
+    }
+
+    t->isEndgame = isEndgame;
+}
+
+/* how many of the torrent's peers and webseeds we've asked for this block */
+static int
+countBlockRequests( Torrent * t, uint32_t index, uint32_t offset, uint32_t length )
+{
+    int i;
+    int count = 0;
+    const int peerCount = tr_ptrArraySize( &t->peers );
+    tr_peer ** peers = (tr_peer**) tr_ptrArrayBase( &t->peers );
+    const int webseedCount = tr_ptrArraySize( &t->webseeds );
+    tr_webseed ** webseeds = (tr_webseed**) tr_ptrArrayBase( &t->webseeds );
+
+    for( i=0; i<peerCount; ++i )
+        if( peers[i]->msgs && tr_peerMsgsIsRequested( peers[i]->msgs, index, offset, length ) )
+            ++count;
+
+    for( i=0; i<webseedCount; ++i )
+        if( tr_webseedIsRequested( webseeds[i], index, offset, length ) )
+            ++count;
+
+    return count;
+}
+
 static int
 refillPulse( void * vtorrent )
 {
@@ -797,6 +829,7 @@ refillPulse( void * vtorrent )
     Torrent * t = vtorrent;
     tr_torrent * tor = t->tor;
     tr_bool hasNext = TRUE;
+    uint64_t budget;
 
     if( !t->isRunning )
         return TRUE;
@@ -809,6 +842,9 @@ refillPulse( void * vtorrent )
     if( t->refillQueue == NULL )
         t->refillQueue = blockIteratorNew( t );
 
+    updateEndgame( t );
+    budget = (uint64_t)MAX( 0, tor->session->endgameBudgetMB ) * 1024 * 1024;
+
     peers = getPeersUploadingToClient( t, &peerCount );
     webseedCount = tr_ptrArraySize( &t->webseeds );
     webseeds = tr_memdup( tr_ptrArrayBase( &t->webseeds ),
@@ -818,7 +854,9 @@ refillPulse( void * vtorrent )
         && (( hasNext = blockIteratorNext( t->refillQueue, &block ))) )
     {
         int j;
-        tr_bool handled = FALSE;
+        int requestCount = 0;
+        int maxRequests = 1;
+        tr_bool handled;
 
         const tr_piece_index_t index = tr_torBlockPiece( tor, block );
         const uint32_t offset = getBlockOffsetInPiece( tor, block );
@@ -826,8 +864,16 @@ refillPulse( void * vtorrent )
 
         assert( block < tor->blockCount );
 
+        /* only endgame asks more than one peer for a block, and only
+         * while there's budget left for the duplicates */
+        if( getPieceRequests( t, index ) > 0 )
+            requestCount = countBlockRequests( t, index, offset, length );
+        if( t->isEndgame && ( t->endgameDuplicateBytes < budget ) )
+            maxRequests = MAX_ENDGAME_REQUESTS_PER_BLOCK;
+        handled = requestCount > 0;
+
         /* find a peer who can ask for this block */
-        for( j=0; !handled && j<peerCount; )
+        for( j=0; requestCount<maxRequests && j<peerCount; )
         {
             const tr_addreq_t val = tr_peerMsgsAddRequest( peers[j]->msgs, index, offset, length );
             switch( val )
@@ -844,7 +890,13 @@ refillPulse( void * vtorrent )
 
                 case TR_ADDREQ_OK:
                     incrementPieceRequests( t, index );
+                    if( requestCount++ > 0 ) {
+                        t->endgameDuplicateBytes += length;
+                        if( t->endgameDuplicateBytes >= budget )
+                            maxRequests = requestCount;
+                    }
                     handled = TRUE;
+                    ++j;
                     break;
 
                 default:
@@ -887,7 +939,6 @@ refillPulse( void * vtorrent )
         blockIteratorFree( &t->refillQueue );
     }
 
-    t->refillTimer = NULL;
     torrentUnlock( t );
     return FALSE;
 }
@@ -941,10 +992,107 @@ gotBadPiece( Torrent *        t,
 static void
 refillSoon( Torrent * t )
 {
-    if( t->refillTimer == NULL )
-        t->refillTimer = tr_timerNew( t->manager->session,
-                                      refillPulse, t,
-                                      REFILL_PERIOD_MSEC );
+    if( !tr_timerIsPending( &t->refillTimer ) )
+        tr_timerStart( &t->refillTimer, REFILL_PERIOD_MSEC );
+}
+
+/**
+***  Once a piece's last block arrives, it's saved and checked in one
+***  of the disk pool's threads.  Its fate is decided when that's done.
+**/
+
+struct piece_check
+{
+    tr_torrent        * tor;
+    tr_piece_index_t    piece;
+    tr_bool             isGood;
+};
+
+/* runs in a disk thread */
+static int
+checkPiece( void * vcheck )
+{
+    int err;
+    struct piece_check * check = vcheck;
+    tr_torrent * tor = check->tor;
+
+    if(( err = tr_cacheFlushPiece( tor->session->cache, tor, check->piece )))
+        return err;
+
+    check->isGood = tr_ioTestPiece( tor, check->piece, NULL, 0 );
+
+    /* seeds' pieces are read back all the time, so only a leech's
+     * pieces are dropped from the page cache once they're verified */
+    return tr_ioSyncPiece( tor, check->piece,
+                           check->isGood
+                           && tor->session->isSyncDropCacheEnabled
+                           && ( tor->completeness == TR_LEECH ) );
+}
+
+static void
+pieceChecked( int err, void * vcheck )
+{
+    struct piece_check * check = vcheck;
+    tr_torrent * tor = check->tor;
+    Torrent * t = tor->torrentPeers;
+    const tr_piece_index_t p = check->piece;
+    const tr_bool ok = !err && check->isGood;
+
+    tr_free( check );
+    torrentLock( t );
+
+    if( err ) /* couldn't save the piece; don't blame the peers */
+    {
+        tr_torrentSetHasPiece( tor, p, FALSE );
+        pickerUpdatePiece( t, p );
+        tor->error = err;
+        tr_strlcpy( tor->errorString, tr_strerror( err ),
+                    sizeof( tor->errorString ) );
+        tr_torrentStop( tor );
+        torrentUnlock( t );
+        return;
+    }
+
+    if( !ok )
+    {
+        tr_torerr( tor, _( "Piece %lu, which was just downloaded, failed its checksum test" ),
+                   (unsigned long)p );
+    }
+
+    tr_torrentSetHasPiece( tor, p, ok );
+    tr_torrentSetPieceChecked( tor, p, TRUE );
+    pickerUpdatePiece( t, p );
+    tr_peerMgrSetBlame( tor, p, ok );
+
+    if( !ok )
+    {
+        gotBadPiece( t, p );
+    }
+    else
+    {
+        int i;
+        int peerCount;
+        tr_peer ** peers;
+        tr_file_index_t fileIndex;
+
+        peerCount = tr_ptrArraySize( &t->peers );
+        peers = (tr_peer**) tr_ptrArrayBase( &t->peers );
+        for( i=0; i<peerCount; ++i )
+            tr_peerMsgsHave( peers[i]->msgs, p );
+
+        for( fileIndex=0; fileIndex<tor->info.fileCount; ++fileIndex )
+        {
+            const tr_file * file = &tor->info.files[fileIndex];
+            if( ( file->firstPiece <= p ) && ( p <= file->lastPiece ) && tr_cpFileIsComplete( &tor->completion, fileIndex ) )
+            {
+                tordbg( t, "closing recently-completed file \"%s\"", file->name );
+                tr_fdFileClose( tor->uniqueId, fileIndex );
+            }
+        }
+    }
+
+    tr_torrentRecheckCompleteness( tor );
+    torrentUnlock( t );
 }
 
 static void
@@ -1087,6 +1235,21 @@ peerCallbackFunc( void * vpeer, void * vevent, void * vt )
             break;
         }
 
+        case TR_PEER_PEER_GOT_HAVE:
+            if( peer )
+                tr_pickerIncrement( t->picker, e->pieceIndex );
+            break;
+
+        case TR_PEER_PEER_BITFIELD_CHANGING:
+            if( peer )
+                tr_pickerRemoveBitfield( t->picker, peer->have );
+            break;
+
+        case TR_PEER_PEER_GOT_BITFIELD:
+            if( peer )
+                tr_pickerAddBitfield( t->picker, peer->have );
+            break;
+
         case TR_PEER_PEER_PROGRESS:
         {
             if( peer )
@@ -1112,54 +1275,17 @@ peerCallbackFunc( void * vpeer, void * vevent, void * vt )
 
             tr_cpBlockAdd( &tor->completion, block );
             decrementPieceRequests( t, e->pieceIndex );
+            pickerUpdatePiece( t, e->pieceIndex );
 
             broadcastGotBlock( t, e->pieceIndex, e->offset, e->length );
 
             if( tr_cpPieceIsComplete( &tor->completion, e->pieceIndex ) )
             {
-                const tr_piece_index_t p = e->pieceIndex;
-                const tr_bool ok = tr_ioTestPiece( tor, p, NULL, 0 );
-
-                if( !ok )
-                {
-                    tr_torerr( tor, _( "Piece %lu, which was just downloaded, failed its checksum test" ),
-                               (unsigned long)p );
-                }
-
-                tr_torrentSetHasPiece( tor, p, ok );
-                tr_torrentSetPieceChecked( tor, p, TRUE );
-                tr_peerMgrSetBlame( tor, p, ok );
-
-                if( !ok )
-                {
-                    gotBadPiece( t, p );
-                }
-                else
-                {
-                    int i;
-                    int peerCount;
-                    tr_peer ** peers;
-                    tr_file_index_t fileIndex;
-
-                    peerCount = tr_ptrArraySize( &t->peers );
-                    peers = (tr_peer**) tr_ptrArrayBase( &t->peers );
-                    for( i=0; i<peerCount; ++i )
-                        tr_peerMsgsHave( peers[i]->msgs, p );
-
-                    for( fileIndex=0; fileIndex<tor->info.fileCount; ++fileIndex )
-                    {
-                        const tr_file * file = &tor->info.files[fileIndex];
-                        if( ( file->firstPiece <= p ) && ( p <= file->lastPiece ) && tr_cpFileIsComplete( &tor->completion, fileIndex ) )
-                        {
-                            char * path = tr_buildPath( tor->downloadDir, file->name, NULL );
-                            tordbg( t, "closing recently-completed file \"%s\"", path );
-                            tr_fdFileClose( path );
-                            tr_free( path );
-                        }
-                    }
-                }
-
-                tr_torrentRecheckCompleteness( tor );
+                struct piece_check * check = tr_new0( struct piece_check, 1 );
+                check->tor = tor;
+                check->piece = e->pieceIndex;
+                tr_diskPoolAdd( tor->session->diskPool, tor->downloadDir, tor,
+                                checkPiece, pieceChecked, check );
             }
             break;
         }
@@ -1603,11 +1729,15 @@ stopTorrent( Torrent * t )
 {
     assert( torrentIsLocked( t ) );
 
+    /* settle the pieces that are still being checked */
+    tr_diskPoolFinish( t->tor->session->diskPool, t->tor );
+
     t->isRunning = FALSE;
 
     /* disconnect the peers. */
     tr_ptrArrayForeach( &t->peers, (PtrArrayForeachFunc)peerDestructor );
     tr_ptrArrayClear( &t->peers );
+    tr_pickerClearAvailability( t->picker );
 
     /* disconnect the handshakes.  handshakeAbort calls handshakeDoneCB(),
      * which removes the handshake from t->outgoingHandshakes... */
@@ -1615,6 +1745,19 @@ stopTorrent( Torrent * t )
         tr_handshakeAbort( tr_ptrArrayNth( &t->outgoingHandshakes, 0 ) );
 }
 
+void
+tr_peerMgrRebuildRequests( tr_torrent * tor )
+{
+    Torrent * t = tor->torrentPeers;
+
+    managerLock( t->manager );
+
+    t->pickerIsStale = TRUE;
+    blockIteratorFree( &t->refillQueue );
+
+    managerUnlock( t->manager );
+}
+
 void
 tr_peerMgrStopTorrent( tr_torrent * tor )
 {
@@ -1661,52 +1804,56 @@ tr_peerMgrTorrentAvailability( const tr_torrent * tor,
     const Torrent *    t;
     float              interval;
     tr_bool            isSeed;
-    int                peerCount;
-    const tr_peer **   peers;
     tr_torrentLock( tor );
 
     t = tor->torrentPeers;
     tor = t->tor;
     interval = tor->info.pieceCount / (float)tabCount;
     isSeed = tor && ( tr_cpGetStatus ( &tor->completion ) == TR_SEED );
-    peers = (const tr_peer **) tr_ptrArrayBase( &t->peers );
-    peerCount = tr_ptrArraySize( &t->peers );
 
     memset( tab, 0, tabCount );
 
     for( i = 0; tor && i < tabCount; ++i )
     {
-        const int piece = i * interval;
+        const tr_piece_index_t piece = i * interval;
 
         if( isSeed || tr_cpPieceIsComplete( &tor->completion, piece ) )
             tab[i] = -1;
-        else if( peerCount ) {
-            int j;
-            for( j = 0; j < peerCount; ++j )
-                if( tr_bitfieldHas( peers[j]->have, i ) )
-                    ++tab[i];
-        }
+        else
+            tab[i] = MIN( INT8_MAX, tr_pickerGetAvailability( t->picker, piece ) );
     }
 
     tr_torrentUnlock( tor );
 }
 
+int
+tr_peerMgrTorrentAvailabilityHistogram( const tr_torrent * tor,
+                                        uint32_t         * setme,
+                                        int                size )
+{
+    int used;
+    const Torrent * t = tor->torrentPeers;
+
+    managerLock( t->manager );
+    used = tr_pickerGetHistogram( t->picker, setme, size );
+    managerUnlock( t->manager );
+
+    return used;
+}
+
 /* Returns the pieces that are available from peers */
 tr_bitfield*
 tr_peerMgrGetAvailable( const tr_torrent * tor )
 {
-    int i;
-    int peerCount;
+    tr_piece_index_t i;
     Torrent * t = tor->torrentPeers;
-    const tr_peer ** peers;
     tr_bitfield * pieces;
     managerLock( t->manager );
 
     pieces = tr_bitfieldNew( t->tor->info.pieceCount );
-    peerCount = tr_ptrArraySize( &t->peers );
-    peers = (const tr_peer**) tr_ptrArrayBase( &t->peers );
-    for( i=0; i<peerCount; ++i )
-        tr_bitfieldOr( pieces, peers[i]->have );
+    for( i=0; i<t->tor->info.pieceCount; ++i )
+        if( tr_pickerGetAvailability( t->picker, i ) > 0 )
+            tr_bitfieldAdd( pieces, i );
 
     managerUnlock( t->manager );
     return pieces;
@@ -1844,6 +1991,7 @@ tr_peerMgrPeerStats( const tr_torrent    * tor,
         stat->isEncrypted        = tr_peerIoIsEncrypted( peer->io ) ? 1 : 0;
         stat->rateToPeer         = tr_peerGetPieceSpeed( peer, now, TR_CLIENT_TO_PEER );
         stat->rateToClient       = tr_peerGetPieceSpeed( peer, now, TR_PEER_TO_CLIENT );
+        stat->pipelineDepth      = peer->msgs ? tr_peerMsgsGetPipelineDepth( peer->msgs ) : 0;
         stat->peerIsChoked       = peer->peerIsChoked;
         stat->peerIsInterested   = peer->peerIsInterested;
         stat->clientIsChoked     = peer->clientIsChoked;
@@ -2069,16 +2217,14 @@ shouldPeerBeClosed( const Torrent    * t,
     if( tr_torrentIsSeed( tor ) )
     {
         int peerHasEverything;
+        size_t piece;
         if( atom->flags & ADDED_F_SEED_FLAG )
             peerHasEverything = TRUE;
         else if( peer->progress < tr_cpPercentDone( &tor->completion ) )
             peerHasEverything = FALSE;
-        else {
-            tr_bitfield * tmp = tr_bitfieldDup( tr_cpPieceBitfield( &tor->completion ) );
-            tr_bitfieldDifference( tmp, peer->have );
-            peerHasEverything = tr_bitfieldCountTrueBits( tmp ) == 0;
-            tr_bitfieldFree( tmp );
-        }
+        else
+            peerHasEverything = !tr_bitfieldFindAndNot( tr_cpPieceBitfield( &tor->completion ),
+                                                        peer->have, 0, &piece );
 
         if( peerHasEverything && ( !tr_torrentAllowsPex(tor) || (now-atom->time>=30 )))
         {
@@ -2423,7 +2569,9 @@ pumpAllPeers( tr_peerMgr * mgr )
 static int
 bandwidthPulse( void * vmgr )
 {
+    tr_torrent * tor = NULL;
     tr_peerMgr * mgr = vmgr;
+    const uint64_t now = tr_date( );
     managerLock( mgr );
 
     /* FIXME: this next line probably isn't necessary... */
@@ -2433,6 +2581,10 @@ bandwidthPulse( void * vmgr )
     tr_bandwidthAllocate( mgr->session->bandwidth, TR_UP, BANDWIDTH_PERIOD_MSEC );
     tr_bandwidthAllocate( mgr->session->bandwidth, TR_DOWN, BANDWIDTH_PERIOD_MSEC );
 
+    /* let RPC clients know which torrents' speeds and progress have moved */
+    while(( tor = tr_torrentNext( mgr->session, tor )))
+        tr_torrentMarkChangedIfActive( tor, now );
+
     managerUnlock( mgr );
     return TRUE;
 }
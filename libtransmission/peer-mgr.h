@@ -137,6 +137,9 @@ void tr_peerMgrSetBlame( tr_torrent        * tor,
                          tr_piece_index_t    pieceIndex,
                          int                 success );
 
+/** @brief call this when the torrent's wanted pieces or their priorities change */
+void tr_peerMgrRebuildRequests( tr_torrent * tor );
+
 int  tr_peerMgrGetPeers( tr_torrent      * tor,
                          tr_pex         ** setme_pex,
                          uint8_t           af);
@@ -154,6 +157,10 @@ void tr_peerMgrTorrentAvailability( const tr_torrent * tor,
                                     int8_t           * tab,
                                     unsigned int       tabCount );
 
+int tr_peerMgrTorrentAvailabilityHistogram( const tr_torrent * tor,
+                                            uint32_t         * setme,
+                                            int                size );
+
 struct tr_bitfield* tr_peerMgrGetAvailable( const tr_torrent * tor );
 
 void tr_peerMgrTorrentStats( tr_torrent * tor,
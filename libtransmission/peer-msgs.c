@@ -22,8 +22,10 @@
 #include "transmission.h"
 #include "session.h"
 #include "bencode.h"
+#include "cache.h"
 #include "completion.h"
 #include "crypto.h"
+#include "disk-pool.h"
 #include "inout.h"
 #ifdef WIN32
 #include "net.h" /* for ECONN */
@@ -80,6 +82,13 @@ enum
 
     MAX_BLOCK_SIZE          = ( 1024 * 16 ),
 
+    /* how many of a peer's requests can be read from disk at once */
+    MAX_DISK_READS          = 4,
+
+    /* the most requests we queue for a peer.  when our disk is
+       falling behind, the ones past this are rejected */
+    MAX_PEER_REQUESTS       = 256,
+
 
     /* how long an unsent request can stay queued before it's returned
        back to the peer-mgr's pool of requests */
@@ -99,7 +108,22 @@ enum
     LAZY_PIECE_COUNT = 26,
 
     /* number of pieces we'll allow in our fast set */
-    MAX_FAST_SET_SIZE = 3
+    MAX_FAST_SET_SIZE = 3,
+
+    /* bounds on how many block requests we keep sent to a peer */
+    MIN_PIPELINE_DEPTH = 4,
+    MAX_PIPELINE_DEPTH = 500,
+
+    /* how many times over the peer's bandwidth-delay product we ask for,
+       so that the peer has room to show us it can go faster */
+    PIPELINE_HEADROOM = 2,
+
+    /* what we take a peer's round trip to be until it's sent us a block */
+    DEFAULT_RTT_MSEC = 500,
+
+    /* a peer's round trip is the quickest any of its blocks came back
+       in this period or the last one */
+    RTT_PERIOD_MSEC = ( 10 * 1000 )
 };
 
 enum
@@ -149,7 +173,7 @@ struct tr_peermsgs
     uint8_t         ut_pex_id;
     uint16_t        pexCount;
     uint16_t        pexCount6;
-    uint16_t        maxActiveRequests;
+    uint16_t        pipelineDepth;
 
     size_t                 fastsetSize;
     tr_piece_index_t       fastset[MAX_FAST_SET_SIZE];
@@ -168,11 +192,18 @@ struct tr_peermsgs
 
     struct evbuffer *      outMessages; /* all the non-piece messages */
 
+    /* HAVEs that go out with the next outMessages batch */
+    tr_piece_index_t     * pendingHaves;
+    int                    pendingHaveCount;
+    int                    pendingHaveAlloc;
+
     struct request_list    peerAskedFor;
+    int                    diskReads; /* blocks being read for the peer */
     struct request_list    clientAskedFor;
     struct request_list    clientWillAskFor;
+    struct request_list    clientIsWriting; /* blocks we got that are being saved */
 
-    tr_timer             * pexTimer;
+    tr_timer               pexTimer;
     tr_pex               * pex;
     tr_pex               * pex6;
 
@@ -188,6 +219,13 @@ struct tr_peermsgs
        supplied a reqq argument, it's stored here.  otherwise the
        value is zero and should be ignored. */
     int64_t               reqq;
+
+    /* the quickest a requested block has come back, in msec, in this
+       RTT_PERIOD_MSEC and the last one.  zero if none came back.  blocks
+       that took longer were waiting behind others in the peer's queue */
+    uint32_t              rttMsec;
+    uint32_t              prevRttMsec;
+    uint64_t              rttPeriodStartedAt;
 };
 
 /**
@@ -234,6 +272,20 @@ myDebug( const char * file, int line,
 ***
 **/
 
+/* HAVE messages are only sent from the event thread,
+ * so these don't need a lock */
+static tr_have_stats haveStats;
+
+void
+tr_peerMsgsGetHaveStats( tr_have_stats * setme )
+{
+    *setme = haveStats;
+}
+
+/**
+***
+**/
+
 static void
 pokeBatchPeriod( tr_peermsgs * msgs,
                  int           interval )
@@ -436,6 +488,33 @@ firePeerProgress( tr_peermsgs * msgs )
     publish( msgs, &e );
 }
 
+static void
+firePeerGotHave( tr_peermsgs * msgs, uint32_t pieceIndex )
+{
+    tr_peer_event e = blankEvent;
+    e.eventType = TR_PEER_PEER_GOT_HAVE;
+    e.pieceIndex = pieceIndex;
+    publish( msgs, &e );
+}
+
+/* the peer's bitfield is changed in place, so these
+ * go on either side of the change */
+static void
+firePeerBitfieldChanging( tr_peermsgs * msgs )
+{
+    tr_peer_event e = blankEvent;
+    e.eventType = TR_PEER_PEER_BITFIELD_CHANGING;
+    publish( msgs, &e );
+}
+
+static void
+firePeerGotBitfield( tr_peermsgs * msgs )
+{
+    tr_peer_event e = blankEvent;
+    e.eventType = TR_PEER_PEER_GOT_BITFIELD;
+    publish( msgs, &e );
+}
+
 static void
 fireGotBlock( tr_peermsgs * msgs, const struct peer_request * req )
 {
@@ -587,22 +666,11 @@ updateFastSet( tr_peermsgs * msgs UNUSED )
 ***  INTEREST
 **/
 
-static tr_bool
-isPieceInteresting( const tr_peermsgs * msgs,
-                    tr_piece_index_t    piece )
-{
-    const tr_torrent * torrent = msgs->torrent;
-
-    return ( !torrent->info.pieces[piece].dnd )                 /* we want it */
-          && ( !tr_cpPieceIsComplete( &torrent->completion, piece ) ) /* !have */
-          && ( tr_bitfieldHas( msgs->peer->have, piece ) );    /* peer has it */
-}
-
 /* "interested" means we'll ask for piece data if they unchoke us */
 static tr_bool
 isPeerInteresting( const tr_peermsgs * msgs )
 {
-    tr_piece_index_t    i;
+    size_t              i;
     const tr_torrent *  torrent;
     const tr_bitfield * bitfield;
     const int           clientIsSeed = tr_torrentIsSeed( msgs->torrent );
@@ -621,8 +689,9 @@ isPeerInteresting( const tr_peermsgs * msgs )
 
     assert( bitfield->byteCount == msgs->peer->have->byteCount );
 
-    for( i = 0; i < torrent->info.pieceCount; ++i )
-        if( isPieceInteresting( msgs, i ) )
+    /* skip straight to the pieces that they have and we don't */
+    for( i = 0; tr_bitfieldFindAndNot( msgs->peer->have, bitfield, i, &i ); ++i )
+        if( !torrent->info.pieces[i].dnd )
             return TRUE;
 
     return FALSE;
@@ -704,11 +773,36 @@ tr_peerMsgsSetChoke( tr_peermsgs * msgs,
 ***
 **/
 
+static tr_bool
+peerHasPiece( const tr_peermsgs * msgs, tr_piece_index_t piece )
+{
+    return ( msgs->peer->have != NULL )
+        && tr_bitfieldHas( msgs->peer->have, piece );
+}
+
 void
 tr_peerMsgsHave( tr_peermsgs * msgs,
                  uint32_t      index )
 {
-    protocolSendHave( msgs, index );
+    ++haveStats.queued;
+
+    /* a peer that has the piece already doesn't need to hear about it */
+    if( peerHasPiece( msgs, index ) )
+    {
+        ++haveStats.suppressed;
+    }
+    else
+    {
+        /* hold it until the next batch is flushed, so that
+         * a burst of finished pieces goes out in one write */
+        if( msgs->pendingHaveCount == msgs->pendingHaveAlloc ) {
+            msgs->pendingHaveAlloc = MAX( 16, msgs->pendingHaveAlloc * 2 );
+            msgs->pendingHaves = tr_renew( tr_piece_index_t, msgs->pendingHaves, msgs->pendingHaveAlloc );
+        }
+        msgs->pendingHaves[msgs->pendingHaveCount++] = index;
+        dbgmsg( msgs, "queueing Have %u", index );
+        pokeBatchPeriod( msgs, LOW_PRIORITY_INTERVAL_SECS );
+    }
 
     /* since we have more pieces now, we might not be interested in this peer */
     updateInterest( msgs );
@@ -736,41 +830,40 @@ requestIsValid( const tr_peermsgs * msgs, const struct peer_request * req )
 static void
 expireFromList( tr_peermsgs          * msgs,
                 struct request_list  * list,
-                const time_t           oldestAllowed )
+                const uint64_t         oldestAllowed )
 {
-    size_t i;
+    struct peer_request req;
     struct request_list tmp = REQUEST_LIST_INIT;
 
     /* since the fifo list is sorted by time, the oldest will be first */
-    if( !list->len || ( list->fifo[0].time_requested >= oldestAllowed ) )
+    if( !reqListPeek( list, &req ) || ( req.time_requested >= oldestAllowed ) )
         return;
 
     /* if we found one too old, start pruning them */
     reqListCopy( &tmp, list );
-    for( i=0; i<tmp.len; ++i ) {
-        const struct peer_request * req = &tmp.fifo[i];
-        if( req->time_requested >= oldestAllowed )
+    while( reqListPop( &tmp, &req ) ) {
+        if( req.time_requested >= oldestAllowed )
             break;
-        tr_peerMsgsCancel( msgs, req->index, req->offset, req->length );
+        tr_peerMsgsCancel( msgs, req.index, req.offset, req.length );
     }
     reqListClear( &tmp );
 }
 
 static void
-expireOldRequests( tr_peermsgs * msgs, const time_t now  )
+expireOldRequests( tr_peermsgs * msgs, const uint64_t now )
 {
-    time_t oldestAllowed;
+    uint64_t oldestAllowed;
     const tr_bool fext = tr_peerIoSupportsFEXT( msgs->peer->io );
     dbgmsg( msgs, "entering `expire old requests' block" );
 
     /* cancel requests that have been queued for too long */
-    oldestAllowed = now - QUEUED_REQUEST_TTL_SECS;
+    oldestAllowed = now - QUEUED_REQUEST_TTL_SECS * 1000;
     expireFromList( msgs, &msgs->clientWillAskFor, oldestAllowed );
 
     /* if the peer doesn't support "Reject Request",
      * cancel requests that were sent too long ago. */
     if( !fext ) {
-        oldestAllowed = now - SENT_REQUEST_TTL_SECS;
+        oldestAllowed = now - SENT_REQUEST_TTL_SECS * 1000;
         expireFromList( msgs, &msgs->clientAskedFor, oldestAllowed );
     }
 
@@ -778,11 +871,11 @@ expireOldRequests( tr_peermsgs * msgs, const time_t now  )
 }
 
 static void
-pumpRequestQueue( tr_peermsgs * msgs, const time_t now )
+pumpRequestQueue( tr_peermsgs * msgs, const uint64_t now )
 {
-    const int           max = msgs->maxActiveRequests;
+    const int           max = msgs->pipelineDepth;
     int                 sent = 0;
-    int                 len = msgs->clientAskedFor.len;
+    int                 len = msgs->clientAskedFor.len + msgs->clientIsWriting.len;
     struct peer_request req;
 
     dbgmsg( msgs, "clientIsChoked %d, download allowed %d, len %d, max %d, msgs->clientWillAskFor.len %d",
@@ -795,6 +888,11 @@ pumpRequestQueue( tr_peermsgs * msgs, const time_t now )
     if( !tr_torrentIsPieceTransferAllowed( msgs->torrent, TR_PEER_TO_CLIENT ) )
         return;
 
+    /* don't ask for more while the disk is behind on saving what we've got.
+     * wroteBlock() pumps again as the writes finish */
+    if( tr_diskPoolIsBusy( msgs->session->diskPool, msgs->torrent->downloadDir ) )
+        return;
+
     while( ( len < max ) && reqListPop( &msgs->clientWillAskFor, &req ) )
     {
         const tr_block_index_t block = _tr_block( msgs->torrent, req.index, req.offset );
@@ -827,7 +925,7 @@ pumpRequestQueue( tr_peermsgs * msgs, const time_t now )
 static TR_INLINE tr_bool
 requestQueueIsFull( const tr_peermsgs * msgs )
 {
-    const int req_max = msgs->maxActiveRequests;
+    const int req_max = msgs->pipelineDepth;
     return msgs->clientWillAskFor.len >= (size_t)req_max;
 }
 
@@ -881,7 +979,7 @@ tr_peerMsgsAddRequest( tr_peermsgs *    msgs,
 
     dbgmsg( msgs, "adding req for %"PRIu32":%"PRIu32"->%"PRIu32" to our `will request' list",
             index, offset, length );
-    req.time_requested = time( NULL );
+    req.time_requested = tr_date( );
     reqListAppend( &msgs->clientWillAskFor, &req );
     return TR_ADDREQ_OK;
 }
@@ -889,7 +987,7 @@ tr_peerMsgsAddRequest( tr_peermsgs *    msgs,
 static void
 cancelAllRequestsToPeer( tr_peermsgs * msgs, tr_bool sendCancel )
 {
-    size_t i;
+    struct peer_request req;
     struct request_list a = msgs->clientWillAskFor;
     struct request_list b = msgs->clientAskedFor;
     dbgmsg( msgs, "cancelling all requests to peer" );
@@ -897,19 +995,38 @@ cancelAllRequestsToPeer( tr_peermsgs * msgs, tr_bool sendCancel )
     msgs->clientAskedFor = REQUEST_LIST_INIT;
     msgs->clientWillAskFor = REQUEST_LIST_INIT;
 
-    for( i=0; i<a.len; ++i )
-        fireCancelledReq( msgs, &a.fifo[i] );
+    while( reqListPop( &a, &req ) )
+        fireCancelledReq( msgs, &req );
 
-    for( i = 0; i < b.len; ++i ) {
-        fireCancelledReq( msgs, &b.fifo[i] );
+    while( reqListPop( &b, &req ) ) {
+        fireCancelledReq( msgs, &req );
         if( sendCancel )
-            protocolSendCancel( msgs, &b.fifo[i] );
+            protocolSendCancel( msgs, &req );
     }
 
     reqListClear( &a );
     reqListClear( &b );
 }
 
+static size_t flushOutMessages( tr_peermsgs * msgs, time_t now );
+
+tr_bool
+tr_peerMsgsIsRequested( const tr_peermsgs * msgs,
+                        uint32_t            pieceIndex,
+                        uint32_t            offset,
+                        uint32_t            length )
+{
+    struct peer_request req;
+
+    req.index = pieceIndex;
+    req.offset = offset;
+    req.length = length;
+
+    return reqListHas( &msgs->clientAskedFor, &req )
+        || reqListHas( &msgs->clientWillAskFor, &req )
+        || reqListHas( &msgs->clientIsWriting, &req );
+}
+
 void
 tr_peerMsgsCancel( tr_peermsgs * msgs,
                    uint32_t      pieceIndex,
@@ -933,10 +1050,13 @@ tr_peerMsgsCancel( tr_peermsgs * msgs,
         fireCancelledReq( msgs, &req );
     }
 
-    /* if it's already been sent, send a cancel message too */
+    /* if it's already been sent, send a cancel message too.
+     * the block may already be on its way, so don't wait for the
+     * next batch -- every msec we wait is more of it wasted */
     if( reqListRemove( &msgs->clientAskedFor, &req ) ) {
         dbgmsg( msgs, "cancelling %"PRIu32":%"PRIu32"->%"PRIu32, pieceIndex, offset, length );
         protocolSendCancel( msgs, &req );
+        flushOutMessages( msgs, time( NULL ) );
         fireCancelledReq( msgs, &req );
     }
 }
@@ -969,9 +1089,10 @@ sendLtepHandshake( tr_peermsgs * msgs )
     else
         pex = 1;
 
-    tr_bencInitDict( &val, 5 );
+    tr_bencInitDict( &val, 6 );
     tr_bencDictAddInt( &val, "e", msgs->session->encryptionMode != TR_CLEAR_PREFERRED );
     tr_bencDictAddInt( &val, "p", tr_sessionGetPeerPort( msgs->session ) );
+    tr_bencDictAddInt( &val, "reqq", MAX_PEER_REQUESTS );
     tr_bencDictAddInt( &val, "upload_only", tr_torrentIsSeed( msgs->torrent ) );
     tr_bencDictAddStr( &val, "v", TR_NAME " " USERAGENT_PREFIX );
     m  = tr_bencDictAddDict( &val, "m", 1 );
@@ -1213,6 +1334,8 @@ peerMadeRequest( tr_peermsgs *               msgs,
         dbgmsg( msgs, "rejecting request for a piece we don't have." );
     else if( peerIsChoked )
         dbgmsg( msgs, "rejecting request from choked peer" );
+    else if( msgs->peerAskedFor.len >= MAX_PEER_REQUESTS )
+        dbgmsg( msgs, "rejecting request; we've got too many queued" );
     else
         allow = TRUE;
 
@@ -1266,6 +1389,10 @@ static int clientGotBlock( tr_peermsgs *               msgs,
                            const uint8_t *             block,
                            const struct peer_request * req );
 
+static void addRttSample( tr_peermsgs *               msgs,
+                          const struct peer_request * req,
+                          uint64_t                    now );
+
 static int
 readBtPiece( tr_peermsgs      * msgs,
              struct evbuffer  * inbuf,
@@ -1379,21 +1506,29 @@ readBtMessage( tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen )
             break;
 
         case BT_HAVE:
+        {
+            tr_bool isNew;
             tr_peerIoReadUint32( msgs->peer->io, inbuf, &ui32 );
             dbgmsg( msgs, "got Have: %u", ui32 );
+            isNew = !tr_bitfieldHas( msgs->peer->have, ui32 );
             if( tr_bitfieldAdd( msgs->peer->have, ui32 ) ) {
                 fireError( msgs, ERANGE );
                 return READ_ERR;
             }
+            if( isNew )
+                firePeerGotHave( msgs, ui32 );
             updatePeerProgress( msgs );
             tr_rcTransferred( &msgs->torrent->swarmSpeed,
                               msgs->torrent->info.pieceSize );
             break;
+        }
 
         case BT_BITFIELD:
         {
             dbgmsg( msgs, "got a bitfield" );
+            firePeerBitfieldChanging( msgs );
             tr_peerIoReadBytes( msgs->peer->io, inbuf, msgs->peer->have->bits, msglen );
+            firePeerGotBitfield( msgs );
             updatePeerProgress( msgs );
             fireNeedReq( msgs );
             break;
@@ -1456,7 +1591,9 @@ readBtMessage( tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen )
         case BT_FEXT_HAVE_ALL:
             dbgmsg( msgs, "Got a BT_FEXT_HAVE_ALL" );
             if( fext ) {
+                firePeerBitfieldChanging( msgs );
                 tr_bitfieldAddRange( msgs->peer->have, 0, msgs->torrent->info.pieceCount );
+                firePeerGotBitfield( msgs );
                 updatePeerProgress( msgs );
             } else {
                 fireError( msgs, EMSGSIZE );
@@ -1467,7 +1604,9 @@ readBtMessage( tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen )
         case BT_FEXT_HAVE_NONE:
             dbgmsg( msgs, "Got a BT_FEXT_HAVE_NONE" );
             if( fext ) {
+                firePeerBitfieldChanging( msgs );
                 tr_bitfieldClear( msgs->peer->have );
+                firePeerGotBitfield( msgs );
                 updatePeerProgress( msgs );
             } else {
                 fireError( msgs, EMSGSIZE );
@@ -1521,6 +1660,7 @@ static TR_INLINE void
 clientGotUnwantedBlock( tr_peermsgs * msgs, const struct peer_request * req )
 {
     decrementDownloadedCount( msgs, req->length );
+    msgs->torrent->wastedCur += req->length;
 }
 
 static void
@@ -1531,13 +1671,73 @@ addPeerToBlamefield( tr_peermsgs * msgs, uint32_t index )
     tr_bitfieldAdd( msgs->peer->blame, index );
 }
 
+static int peerPulse( void * vmsgs );
+
+/**
+***  Blocks we get are saved in the disk pool's threads, so the event
+***  thread doesn't wait on the cache or the disk.  They're only marked
+***  as complete once they're saved.
+**/
+
+struct peer_write
+{
+    tr_peermsgs         * msgs;
+    tr_torrent          * torrent;
+    struct peer_request   req;
+    uint8_t             * buf;
+};
+
+/* runs in a disk thread */
+static int
+writeBlock( void * vwrite )
+{
+    struct peer_write * w = vwrite;
+    const struct peer_request * req = &w->req;
+
+    return tr_cacheWriteBlock( w->torrent->session->cache, w->torrent, req->index, req->offset, req->length, w->buf );
+}
+
+static void
+wroteBlock( int err, void * vwrite )
+{
+    struct peer_write * w = vwrite;
+    tr_peermsgs * msgs = w->msgs;
+    const struct peer_request * req = &w->req;
+
+    if( err == ECANCELED ) /* the peer's being freed */
+    {
+    }
+    else
+    {
+        reqListRemove( &msgs->clientIsWriting, req );
+
+        if( err )
+            fireError( msgs, err );
+        else if( tr_cpBlockIsComplete( &msgs->torrent->completion, _tr_block( msgs->torrent, req->index, req->offset ) ) ) {
+            /* another peer's copy got saved first */
+            dbgmsg( msgs, "we have this block already..." );
+            clientGotUnwantedBlock( msgs, req );
+        } else {
+            addPeerToBlamefield( msgs, req->index );
+            fireGotBlock( msgs, req );
+        }
+
+        if( !err )
+            peerPulse( msgs );
+    }
+
+    tr_free( w->buf );
+    tr_free( w );
+}
+
 /* returns 0 on success, or an errno on failure */
 static int
 clientGotBlock( tr_peermsgs *               msgs,
                 const uint8_t *             data,
                 const struct peer_request * req )
 {
-    int err;
+    struct peer_write * w;
+    struct peer_request sent;
     tr_torrent * tor = msgs->torrent;
     const tr_block_index_t block = _tr_block( tor, req->index, req->offset );
 
@@ -1557,12 +1757,15 @@ clientGotBlock( tr_peermsgs *               msgs,
     *** Remove the block from our `we asked for this' list
     **/
 
-    if( !reqListRemove( &msgs->clientAskedFor, req ) ) {
+    if( !reqListGet( &msgs->clientAskedFor, req, &sent ) ) {
         clientGotUnwantedBlock( msgs, req );
         dbgmsg( msgs, "we didn't ask for this message..." );
         return 0;
     }
 
+    reqListRemove( &msgs->clientAskedFor, req );
+    addRttSample( msgs, &sent, tr_date( ) );
+
     dbgmsg( msgs, "peer has %d more blocks we've asked for",
             msgs->clientAskedFor.len );
 
@@ -1580,16 +1783,18 @@ clientGotBlock( tr_peermsgs *               msgs,
     ***  Save the block
     **/
 
-    if(( err = tr_ioWrite( tor, req->index, req->offset, req->length, data )))
-        return err;
+    w = tr_new( struct peer_write, 1 );
+    w->msgs = msgs;
+    w->torrent = tor;
+    w->req = *req;
+    w->buf = tr_memdup( data, req->length );
 
-    addPeerToBlamefield( msgs, req->index );
-    fireGotBlock( msgs, req );
+    reqListAppend( &msgs->clientIsWriting, req );
+    tr_diskPoolAdd( msgs->session->diskPool, tor->downloadDir,
+                    msgs, writeBlock, wroteBlock, w );
     return 0;
 }
 
-static int peerPulse( void * vmsgs );
-
 static void
 didWrite( tr_peerIo * io UNUSED, size_t bytesWritten, int wasPieceData, void * vmsgs )
 {
@@ -1647,20 +1852,175 @@ canRead( tr_peerIo * io, void * vmsgs, size_t * piece )
 ***
 **/
 
-static int
-ratePulse( tr_peermsgs * msgs, uint64_t now )
+static void
+addRttSample( tr_peermsgs * msgs, const struct peer_request * req, uint64_t now )
+{
+    const uint32_t msec = now > req->time_requested ? now - req->time_requested : 1;
+
+    if( now >= msgs->rttPeriodStartedAt + RTT_PERIOD_MSEC )
+    {
+        msgs->prevRttMsec = msgs->rttMsec;
+        msgs->rttMsec = 0;
+        msgs->rttPeriodStartedAt = now;
+    }
+
+    if( !msgs->rttMsec || ( msec < msgs->rttMsec ) )
+        msgs->rttMsec = msec;
+}
+
+static uint32_t
+getRttMsec( const tr_peermsgs * msgs )
+{
+    if( msgs->rttMsec && msgs->prevRttMsec )
+        return MIN( msgs->rttMsec, msgs->prevRttMsec );
+    if( msgs->rttMsec || msgs->prevRttMsec )
+        return MAX( msgs->rttMsec, msgs->prevRttMsec );
+    return DEFAULT_RTT_MSEC;
+}
+
+/* keep enough requests sent to cover the peer's rate times its round
+ * trip, so that a fast peer far away never waits on us, and a slow
+ * peer doesn't sit on blocks that other peers could be sending */
+static void
+updatePipelineDepth( tr_peermsgs * msgs, uint64_t now )
 {
     const double rateToClient = tr_peerGetPieceSpeed( msgs->peer, now, TR_PEER_TO_CLIENT );
-    const int seconds = 10;
-    const int floor = 8;
-    const int estimatedBlocksInPeriod = ( rateToClient * seconds * 1024 ) / msgs->torrent->blockSize;
+    const double bytesInFlight = rateToClient * 1024.0 * getRttMsec( msgs ) / 1000.0;
+    const double blocks = PIPELINE_HEADROOM * bytesInFlight / msgs->torrent->blockSize;
+    int depth = MIN_PIPELINE_DEPTH + (int)MIN( blocks, MAX_PIPELINE_DEPTH );
 
-    msgs->maxActiveRequests = floor + estimatedBlocksInPeriod;
+    depth = MIN( depth, MAX_PIPELINE_DEPTH );
 
     if( msgs->reqq > 0 )
-        msgs->maxActiveRequests = MIN( msgs->maxActiveRequests, msgs->reqq );
+        depth = MIN( depth, msgs->reqq );
 
-    return TRUE;
+    msgs->pipelineDepth = depth;
+}
+
+int
+tr_peerMsgsGetPipelineDepth( const tr_peermsgs * msgs )
+{
+    return msgs->pipelineDepth;
+}
+
+/**
+***  Blocks are read in the disk pool's threads, and sent to the
+***  peer once they're in memory.
+**/
+
+struct peer_read
+{
+    tr_peermsgs         * msgs;
+    tr_torrent          * torrent;
+    struct peer_request   req;
+    tr_bool               isEncrypted;
+    uint8_t             * buf; /* only for encrypted peers */
+};
+
+/* runs in a disk thread */
+static int
+readBlock( void * vread )
+{
+    struct peer_read * r = vread;
+    const struct peer_request * req = &r->req;
+
+    /* encrypted blocks have to pass through memory to be encrypted,
+     * so read them through the cache.  unencrypted ones get sent
+     * straight from disk, so just ask the OS to start reading them
+     * now, so that sendfile() is less likely to wait on the disk
+     * in the event thread */
+    if( r->isEncrypted )
+        return tr_cacheReadBlock( r->torrent->session->cache, r->torrent, req->index, req->offset, req->length, r->buf );
+
+    tr_ioPrefetch( r->torrent, req->index, req->offset, req->length );
+    return 0;
+}
+
+static void
+sendBlock( int err, void * vread )
+{
+    struct peer_read * r = vread;
+    tr_peermsgs * msgs = r->msgs;
+    const struct peer_request * req = &r->req;
+
+    if( err == ECANCELED ) /* the peer's being freed */
+    {
+    }
+    else if( err )
+    {
+        --msgs->diskReads;
+        fireError( msgs, err );
+    }
+    else
+    {
+        tr_peerIo * io = msgs->peer->io;
+        struct evbuffer * out = tr_getBuffer( );
+
+        --msgs->diskReads;
+        dbgmsg( msgs, "sending block %u:%u->%u", req->index, req->offset, req->length );
+        tr_peerIoWriteUint32( io, out, sizeof( uint8_t ) + 2 * sizeof( uint32_t ) + req->length );
+        tr_peerIoWriteUint8 ( io, out, BT_PIECE );
+        tr_peerIoWriteUint32( io, out, req->index );
+        tr_peerIoWriteUint32( io, out, req->offset );
+        if( r->isEncrypted ) {
+            tr_peerIoWriteBytes ( io, out, r->buf, req->length );
+            tr_peerIoWriteBuf( io, out, TRUE );
+        } else {
+            tr_peerIoWriteBuf( io, out, TRUE );
+            tr_peerIoWriteBlock( io, msgs->torrent, req->index, req->offset, req->length );
+        }
+        msgs->clientSentAnythingAt = time( NULL );
+        tr_releaseBuffer( out );
+
+        peerPulse( msgs );
+    }
+
+    tr_free( r->buf );
+    tr_free( r );
+}
+
+/* move the pending HAVEs into outMessages, minus the ones for
+ * pieces that the peer has picked up since they were queued */
+static void
+writePendingHaves( tr_peermsgs * msgs )
+{
+    int i;
+    int sent = 0;
+
+    for( i=0; i<msgs->pendingHaveCount; ++i )
+    {
+        const tr_piece_index_t piece = msgs->pendingHaves[i];
+
+        if( peerHasPiece( msgs, piece ) )
+            ++haveStats.suppressed;
+        else {
+            protocolSendHave( msgs, piece );
+            ++sent;
+        }
+    }
+
+    msgs->pendingHaveCount = 0;
+
+    if( sent ) {
+        haveStats.sent += sent;
+        ++haveStats.batches;
+    }
+}
+
+/* send the protocol messages that have been batched up */
+static size_t
+flushOutMessages( tr_peermsgs * msgs, time_t now )
+{
+    size_t len;
+
+    writePendingHaves( msgs );
+    len = EVBUFFER_LENGTH( msgs->outMessages );
+    dbgmsg( msgs, "flushing outMessages... to %p (length is %zu)", msgs->peer->io, len );
+    tr_peerIoWriteBuf( msgs->peer->io, msgs->outMessages, FALSE );
+    msgs->clientSentAnythingAt = now;
+    msgs->outMessagesBatchedAt = 0;
+    msgs->outMessagesBatchPeriod = LOW_PRIORITY_INTERVAL_SECS;
+    return len;
 }
 
 static size_t
@@ -1668,7 +2028,8 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
 {
     size_t bytesWritten = 0;
     struct peer_request req;
-    const tr_bool haveMessages = EVBUFFER_LENGTH( msgs->outMessages ) != 0;
+    const tr_bool haveMessages = ( EVBUFFER_LENGTH( msgs->outMessages ) != 0 )
+                              || ( msgs->pendingHaveCount != 0 );
     const tr_bool fext = tr_peerIoSupportsFEXT( msgs->peer->io );
 
     /**
@@ -1682,48 +2043,32 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
     }
     else if( haveMessages && ( ( now - msgs->outMessagesBatchedAt ) >= msgs->outMessagesBatchPeriod ) )
     {
-        const size_t len = EVBUFFER_LENGTH( msgs->outMessages );
-        /* flush the protocol messages */
-        dbgmsg( msgs, "flushing outMessages... to %p (length is %zu)", msgs->peer->io, len );
-        tr_peerIoWriteBuf( msgs->peer->io, msgs->outMessages, FALSE );
-        msgs->clientSentAnythingAt = now;
-        msgs->outMessagesBatchedAt = 0;
-        msgs->outMessagesBatchPeriod = LOW_PRIORITY_INTERVAL_SECS;
-        bytesWritten +=  len;
+        bytesWritten += flushOutMessages( msgs, now );
     }
 
     /**
     ***  Blocks
     **/
 
-    if( ( tr_peerIoGetWriteBufferSpace( msgs->peer->io, now ) >= msgs->torrent->blockSize )
+    while( ( msgs->diskReads < MAX_DISK_READS )
+        && ( tr_peerIoGetWriteBufferSpace( msgs->peer->io, now ) >= ( msgs->diskReads + 1u ) * msgs->torrent->blockSize )
+        && !tr_diskPoolIsBusy( msgs->session->diskPool, msgs->torrent->downloadDir )
         && popNextRequest( msgs, &req ) )
     {
         if( requestIsValid( msgs, &req )
             && tr_cpPieceIsComplete( &msgs->torrent->completion, req.index ) )
         {
-            int err;
-            static uint8_t buf[MAX_BLOCK_SIZE];
-
-            /* send a block */
-            if(( err = tr_ioRead( msgs->torrent, req.index, req.offset, req.length, buf ))) {
-                fireError( msgs, err );
-                bytesWritten = 0;
-                msgs = NULL;
-            } else {
-                tr_peerIo * io = msgs->peer->io;
-                struct evbuffer * out = tr_getBuffer( );
-                dbgmsg( msgs, "sending block %u:%u->%u", req.index, req.offset, req.length );
-                tr_peerIoWriteUint32( io, out, sizeof( uint8_t ) + 2 * sizeof( uint32_t ) + req.length );
-                tr_peerIoWriteUint8 ( io, out, BT_PIECE );
-                tr_peerIoWriteUint32( io, out, req.index );
-                tr_peerIoWriteUint32( io, out, req.offset );
-                tr_peerIoWriteBytes ( io, out, buf, req.length );
-                tr_peerIoWriteBuf( io, out, TRUE );
-                bytesWritten += EVBUFFER_LENGTH( out );
-                msgs->clientSentAnythingAt = now;
-                tr_releaseBuffer( out );
-            }
+            struct peer_read * r = tr_new( struct peer_read, 1 );
+            r->msgs = msgs;
+            r->torrent = msgs->torrent;
+            r->req = req;
+            r->isEncrypted = tr_peerIoIsEncrypted( msgs->peer->io );
+            r->buf = r->isEncrypted ? tr_new( uint8_t, req.length ) : NULL;
+
+            dbgmsg( msgs, "reading block %u:%u->%u", req.index, req.offset, req.length );
+            ++msgs->diskReads;
+            tr_diskPoolAdd( msgs->session->diskPool, msgs->torrent->downloadDir,
+                            msgs, readBlock, sendBlock, r );
         }
         else if( fext ) /* peer needs a reject message */
         {
@@ -1735,8 +2080,7 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
     ***  Keepalive
     **/
 
-    if( ( msgs != NULL )
-        && ( msgs->clientSentAnythingAt != 0 )
+    if( ( msgs->clientSentAnythingAt != 0 )
         && ( ( now - msgs->clientSentAnythingAt ) > KEEPALIVE_INTERVAL_SECS ) )
     {
         dbgmsg( msgs, "sending a keepalive message" );
@@ -1752,11 +2096,12 @@ peerPulse( void * vmsgs )
 {
     tr_peermsgs * msgs = vmsgs;
     const time_t  now = time( NULL );
+    const uint64_t nowMsec = tr_date( );
 
-    ratePulse( msgs, now );
+    updatePipelineDepth( msgs, nowMsec );
 
-    pumpRequestQueue( msgs, now );
-    expireOldRequests( msgs, now );
+    pumpRequestQueue( msgs, nowMsec );
+    expireOldRequests( msgs, nowMsec );
 
     for( ;; )
         if( fillOutputBuffer( msgs, now ) < 1 )
@@ -1773,16 +2118,21 @@ tr_peerMsgsPulse( tr_peermsgs * msgs )
 }
 
 static void
-gotError( tr_peerIo  * io UNUSED,
+gotError( tr_peerIo  * io,
           short        what,
           void       * vmsgs )
 {
+    const int localError = tr_peerIoGetLocalError( io );
+
     if( what & EVBUFFER_TIMEOUT )
         dbgmsg( vmsgs, "libevent got a timeout, what=%hd", what );
     if( what & ( EVBUFFER_EOF | EVBUFFER_ERROR ) )
         dbgmsg( vmsgs, "libevent got an error! what=%hd, errno=%d (%s)",
                what, errno, tr_strerror( errno ) );
-    fireError( vmsgs, ENOTCONN );
+
+    /* if we couldn't read a block we were sending,
+     * it's the torrent that has the problem, not the peer */
+    fireError( vmsgs, localError ? localError : ENOTCONN );
 }
 
 static void
@@ -2109,7 +2459,8 @@ tr_peerMsgsNew( struct tr_torrent * torrent,
     m->peer->peerIsInterested = 0;
     m->peer->have = tr_bitfieldNew( torrent->info.pieceCount );
     m->state = AWAITING_BT_LENGTH;
-    m->pexTimer = tr_timerNew( m->session, pexPulse, m, PEX_INTERVAL );
+    tr_timerInit( &m->pexTimer, m->session, pexPulse, m );
+    tr_timerStart( &m->pexTimer, PEX_INTERVAL );
     m->outMessages = evbuffer_new( );
     m->outMessagesBatchedAt = 0;
     m->outMessagesBatchPeriod = LOW_PRIORITY_INTERVAL_SECS;
@@ -2117,6 +2468,7 @@ tr_peerMsgsNew( struct tr_torrent * torrent,
     m->peerAskedFor = REQUEST_LIST_INIT;
     m->clientAskedFor = REQUEST_LIST_INIT;
     m->clientWillAskFor = REQUEST_LIST_INIT;
+    m->clientIsWriting = REQUEST_LIST_INIT;
     peer->msgs = m;
 
     *setme = tr_publisherSubscribe( &m->publisher, func, userData );
@@ -2127,7 +2479,7 @@ tr_peerMsgsNew( struct tr_torrent * torrent,
     tellPeerWhatWeHave( m );
 
     tr_peerIoSetIOFuncs( m->peer->io, canRead, didWrite, gotError, m );
-    ratePulse( m, tr_date() );
+    updatePipelineDepth( m, tr_date( ) );
 
     return m;
 }
@@ -2137,14 +2489,17 @@ tr_peerMsgsFree( tr_peermsgs* msgs )
 {
     if( msgs )
     {
-        tr_timerFree( &msgs->pexTimer );
+        tr_diskPoolCancel( msgs->session->diskPool, msgs );
+        tr_timerStop( &msgs->pexTimer );
         tr_publisherDestruct( &msgs->publisher );
         reqListClear( &msgs->clientWillAskFor );
         reqListClear( &msgs->clientAskedFor );
+        reqListClear( &msgs->clientIsWriting );
         reqListClear( &msgs->peerAskedFor );
 
         evbuffer_free( msgs->incoming.block );
         evbuffer_free( msgs->outMessages );
+        tr_free( msgs->pendingHaves );
         tr_free( msgs->pex6 );
         tr_free( msgs->pex );
 
@@ -47,6 +47,13 @@ void         tr_peerMsgsCancel( tr_peermsgs * msgs,
                                 uint32_t      offset,
                                 uint32_t      length );
 
+/** @return true if we've asked the peer for this block,
+            or are about to */
+tr_bool      tr_peerMsgsIsRequested( const tr_peermsgs * msgs,
+                                     uint32_t            pieceIndex,
+                                     uint32_t            offset,
+                                     uint32_t            length );
+
 
 void         tr_peerMsgsFree( tr_peermsgs* );
 
@@ -58,6 +65,21 @@ tr_addreq_t  tr_peerMsgsAddRequest( tr_peermsgs * peer,
 void         tr_peerMsgsUnsubscribe( tr_peermsgs      * peer,
                                      tr_publisher_tag   tag );
 
+/** @brief counts of the HAVE messages sent to peers */
+typedef struct tr_have_stats
+{
+    uint64_t    queued;     /* pieces we've told peers about */
+    uint64_t    sent;       /* HAVE messages sent */
+    uint64_t    suppressed; /* ones not sent because the peer had the piece */
+    uint64_t    batches;    /* writes that the sent ones were batched into */
+}
+tr_have_stats;
+
+void         tr_peerMsgsGetHaveStats( tr_have_stats * setme );
+
+/** @return how many block requests we keep sent to this peer */
+int          tr_peerMsgsGetPipelineDepth( const tr_peermsgs * msgs );
+
 size_t       tr_generateAllowedSet( tr_piece_index_t  * setmePieces,
                                     size_t              desiredSetSize,
                                     size_t              pieceCount,
@@ -0,0 +1,327 @@
+#include <limits.h> /* INT_MAX */
+#include <stdio.h> /* fprintf */
+#include <stdlib.h> /* qsort */
+#include <string.h> /* memcmp, memset */
+
+#include "transmission.h"
+#include "crypto.h" /* tr_cryptoWeakRandInt */
+#include "picker.h"
+#include "utils.h"
+
+#undef VERBOSE
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+ #define VERBOSE
+ #define PIECE_COUNT 100000
+ #define PEER_COUNT 200
+#else
+ #define PIECE_COUNT 20000
+ #define PEER_COUNT 50
+#endif
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+struct piece_state
+{
+    tr_bool        isWanted;
+    tr_bool        isStarted;
+    tr_priority_t  priority;
+};
+
+static struct piece_state pieces[PIECE_COUNT];
+static tr_bitfield * peers[PEER_COUNT];
+
+/* the order tr_pickerNext() should return pieces in */
+static int
+getRank( const tr_picker * picker, tr_piece_index_t piece )
+{
+    const int availability = tr_pickerGetAvailability( picker, piece );
+    const int tier = ( 1 - pieces[piece].priority ) * 2 + ( pieces[piece].isStarted ? 0 : 1 );
+    return tier * ( PEER_COUNT + 2 ) + ( availability ? availability : PEER_COUNT + 1 );
+}
+
+/* walk the picker, making sure every wanted piece comes out once and in order */
+static int
+checkPicker( tr_picker * picker )
+{
+    int prevRank = -1;
+    int used, expectedUsed = 0;
+    uint32_t histogram[TR_AVAILABILITY_BUCKETS];
+    uint32_t expected[TR_AVAILABILITY_BUCKETS];
+    tr_piece_index_t i, piece;
+    tr_piece_index_t wanted = 0;
+    tr_piece_index_t returned = 0;
+    tr_bitfield * seen = tr_bitfieldNew( PIECE_COUNT );
+
+    memset( expected, 0, sizeof( expected ) );
+
+    for( i=0; i<PIECE_COUNT; ++i )
+    {
+        int j, bucket, availability = 0;
+        for( j=0; j<PEER_COUNT; ++j )
+            if( peers[j] && tr_bitfieldHas( peers[j], i ) )
+                ++availability;
+        check( availability == tr_pickerGetAvailability( picker, i ) );
+        if( pieces[i].isWanted )
+            ++wanted;
+
+        /* 0, 1, 2-3, 4-7, ... */
+        for( bucket=0; availability >= ( 1 << bucket ); )
+            ++bucket;
+        ++expected[bucket];
+        expectedUsed = MAX( expectedUsed, bucket + 1 );
+    }
+
+    used = tr_pickerGetHistogram( picker, histogram, TR_AVAILABILITY_BUCKETS );
+    check( used == expectedUsed );
+    check( !memcmp( histogram, expected, sizeof( expected ) ) );
+
+    tr_pickerRewind( picker );
+    while( tr_pickerNext( picker, &piece ) )
+    {
+        const int rank = getRank( picker, piece );
+        check( pieces[piece].isWanted );
+        check( !tr_bitfieldHas( seen, piece ) );
+        check( rank >= prevRank );
+        tr_bitfieldAdd( seen, piece );
+        prevRank = rank;
+        ++returned;
+    }
+    check( returned == wanted );
+
+    tr_bitfieldFree( seen );
+    return 0;
+}
+
+static void
+setPiece( tr_picker * picker, tr_piece_index_t piece )
+{
+    struct piece_state * p = &pieces[piece];
+    tr_pickerSetPiece( picker, piece, p->isWanted, p->priority, p->isStarted );
+}
+
+/**
+***  The old way: count each piece's peers and sort them all
+**/
+
+struct sort_piece
+{
+    tr_priority_t       priority;
+    tr_piece_index_t    piece;
+    int                 peerCount;
+    int                 random;
+};
+
+static int
+compareSortPiece( const void * va, const void * vb )
+{
+    const struct sort_piece * a = va;
+    const struct sort_piece * b = vb;
+
+    if( a->priority != b->priority )
+        return a->priority > b->priority ? -1 : 1;
+    if( a->peerCount != b->peerCount )
+        return a->peerCount < b->peerCount ? -1 : 1;
+    if( a->random != b->random )
+        return a->random < b->random ? -1 : 1;
+    return 0;
+}
+
+static tr_piece_index_t
+sortPieces( void )
+{
+    tr_piece_index_t i, n = 0;
+    struct sort_piece * p = tr_new( struct sort_piece, PIECE_COUNT );
+
+    for( i=0; i<PIECE_COUNT; ++i )
+    {
+        if( pieces[i].isWanted )
+        {
+            int j;
+            p[n].piece = i;
+            p[n].priority = pieces[i].priority;
+            p[n].random = tr_cryptoWeakRandInt( INT_MAX );
+            p[n].peerCount = 0;
+            for( j=0; j<PEER_COUNT; ++j )
+                if( peers[j] && tr_bitfieldHas( peers[j], i ) )
+                    ++p[n].peerCount;
+            ++n;
+        }
+    }
+
+    qsort( p, n, sizeof( struct sort_piece ), compareSortPiece );
+    tr_free( p );
+    return n;
+}
+
+/**
+***
+**/
+
+static void
+addPeer( tr_picker * picker, int j )
+{
+    tr_piece_index_t i;
+    const int percent = tr_cryptoWeakRandInt( 101 );
+
+    peers[j] = tr_bitfieldNew( PIECE_COUNT );
+    for( i=0; i<PIECE_COUNT; ++i )
+        if( tr_cryptoWeakRandInt( 100 ) < percent )
+            tr_bitfieldAdd( peers[j], i );
+
+    tr_pickerAddBitfield( picker, peers[j] );
+}
+
+static void
+removePeer( tr_picker * picker, int j )
+{
+    tr_pickerRemoveBitfield( picker, peers[j] );
+    tr_bitfieldFree( peers[j] );
+    peers[j] = NULL;
+}
+
+static int
+testPicker( void )
+{
+    int i, j, err;
+    uint64_t start;
+    tr_piece_index_t piece, n;
+    tr_picker * picker = tr_pickerNew( PIECE_COUNT );
+    const int churnCount = PIECE_COUNT;
+
+    /* a swarm where every peer has a different amount of the torrent */
+    for( j=0; j<PEER_COUNT; ++j )
+        addPeer( picker, j );
+
+    for( i=0; i<PIECE_COUNT; ++i ) {
+        pieces[i].isWanted = tr_cryptoWeakRandInt( 10 ) != 0;
+        pieces[i].isStarted = tr_cryptoWeakRandInt( 20 ) == 0;
+        pieces[i].priority = tr_cryptoWeakRandInt( 3 ) - 1;
+        setPiece( picker, i );
+    }
+    if(( err = checkPicker( picker )))
+        return err;
+
+    /* peers come and go, announce pieces, and we finish some */
+    start = tr_date( );
+    for( i=0; i<churnCount; ++i )
+    {
+        switch( tr_cryptoWeakRandInt( 4 ) )
+        {
+            case 0:
+                j = tr_cryptoWeakRandInt( PEER_COUNT );
+                if( peers[j] && !tr_cryptoWeakRandInt( PIECE_COUNT / 10 ) ) {
+                    removePeer( picker, j );
+                    addPeer( picker, j );
+                }
+                break;
+
+            case 1:
+                j = tr_cryptoWeakRandInt( PEER_COUNT );
+                piece = tr_cryptoWeakRandInt( PIECE_COUNT );
+                if( !tr_bitfieldHas( peers[j], piece ) ) {
+                    tr_bitfieldAdd( peers[j], piece );
+                    tr_pickerIncrement( picker, piece );
+                }
+                break;
+
+            case 2:
+                piece = tr_cryptoWeakRandInt( PIECE_COUNT );
+                pieces[piece].isStarted = TRUE;
+                setPiece( picker, piece );
+                break;
+
+            default:
+                piece = tr_cryptoWeakRandInt( PIECE_COUNT );
+                pieces[piece].isWanted = FALSE;
+                setPiece( picker, piece );
+                break;
+        }
+
+        /* pick a few pieces in between, like refillPulse() does */
+        if( !( i % 16 ) ) {
+            tr_pickerRewind( picker );
+            for( j=0; j<8 && tr_pickerNext( picker, &piece ); ++j )
+                ;
+        }
+    }
+    fprintf( stderr, "%d incremental updates and picks: %"PRIu64" ms\n",
+             churnCount, tr_date( ) - start );
+    if(( err = checkPicker( picker )))
+        return err;
+
+    /* compare a full walk of the picker to rebuilding and sorting */
+    start = tr_date( );
+    for( i=0; i<10; ++i ) {
+        tr_pickerRewind( picker );
+        for( n=0; tr_pickerNext( picker, &piece ); ++n )
+            ;
+    }
+    fprintf( stderr, "%d pieces, %d peers: walking the picker: %.1f ms\n",
+             PIECE_COUNT, PEER_COUNT, ( tr_date( ) - start ) / 10.0 );
+
+    start = tr_date( );
+    for( i=0; i<10; ++i )
+        check( sortPieces( ) == n );
+    fprintf( stderr, "%d pieces, %d peers: counting and sorting: %.1f ms\n",
+             PIECE_COUNT, PEER_COUNT, ( tr_date( ) - start ) / 10.0 );
+
+    /* half the peers leave, then the rest */
+    for( j=0; j<PEER_COUNT; ++j )
+        if( j % 2 )
+            removePeer( picker, j );
+    if(( err = checkPicker( picker )))
+        return err;
+    for( j=0; j<PEER_COUNT; ++j )
+        if( peers[j] ) {
+            tr_bitfieldFree( peers[j] );
+            peers[j] = NULL;
+        }
+    tr_pickerClearAvailability( picker );
+    if(( err = checkPicker( picker )))
+        return err;
+
+    /* nothing's wanted */
+    tr_pickerClearPieces( picker );
+    for( i=0; i<PIECE_COUNT; ++i )
+        pieces[i].isWanted = FALSE;
+    if(( err = checkPicker( picker )))
+        return err;
+
+    tr_pickerFree( picker );
+    return 0;
+}
+
+int
+main( void )
+{
+    int i;
+
+    if(( i = testPicker( )))
+        return i;
+
+    return 0;
+}
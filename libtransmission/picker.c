@@ -0,0 +1,422 @@
+/*
+ * This file Copyright (C) 2009 Charles Kerr <charles@transmissionbt.com>
+ *
+ * This file is licensed by the GPL version 2.  Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <string.h> /* memset */
+
+#include "transmission.h"
+#include "crypto.h" /* tr_cryptoWeakRandInt */
+#include "picker.h"
+#include "utils.h"
+
+enum
+{
+    NO_PIECE = -1,
+
+    /* high, normal, and low priority, each split into
+     * the pieces we've started and the ones we haven't */
+    TIER_COUNT = 6,
+
+    MIN_BUCKETS_PER_TIER = 16,
+
+    MAX_AVAILABILITY = UINT16_MAX
+};
+
+struct picker_piece
+{
+    int32_t     prev;          /* neighbors in the bucket, or NO_PIECE */
+    int32_t     next;
+    uint16_t    availability;  /* how many peers have this piece */
+    int8_t      tier;          /* or NO_PIECE if the piece isn't wanted */
+};
+
+struct picker_bucket
+{
+    int32_t     head;
+    int32_t     tail;
+};
+
+struct tr_picker
+{
+    tr_piece_index_t        pieceCount;
+    struct picker_piece   * pieces;
+
+    /* the bucket for a tier and availability is
+     * buckets[tier * bucketsPerTier + availability] */
+    struct picker_bucket  * buckets;
+    int                     bucketsPerTier;
+
+    /* where tr_pickerNext() is */
+    int                     cursorTier;
+    int                     cursorAvailability;
+    int32_t                 cursorNext;
+};
+
+static int
+getTier( tr_priority_t priority, tr_bool isStarted )
+{
+    int tier;
+
+    switch( priority )
+    {
+        case TR_PRI_HIGH: tier = 0; break;
+        case TR_PRI_LOW:  tier = 4; break;
+        default:          tier = 2; break;
+    }
+
+    return isStarted ? tier : tier + 1;
+}
+
+static struct picker_bucket*
+getBucket( tr_picker * picker, int tier, int availability )
+{
+    assert( 0 <= tier && tier < TIER_COUNT );
+    assert( 0 <= availability && availability < picker->bucketsPerTier );
+
+    return &picker->buckets[tier * picker->bucketsPerTier + availability];
+}
+
+static void
+setBucketsPerTier( tr_picker * picker, int n )
+{
+    int tier, i;
+    struct picker_bucket * buckets = tr_new( struct picker_bucket, TIER_COUNT * n );
+
+    for( tier=0; tier<TIER_COUNT; ++tier ) {
+        for( i=0; i<n; ++i ) {
+            struct picker_bucket * b = &buckets[tier * n + i];
+            if( i < picker->bucketsPerTier )
+                *b = *getBucket( picker, tier, i );
+            else
+                b->head = b->tail = NO_PIECE;
+        }
+    }
+
+    tr_free( picker->buckets );
+    picker->buckets = buckets;
+    picker->bucketsPerTier = n;
+}
+
+static void
+unlinkPiece( tr_picker * picker, tr_piece_index_t piece )
+{
+    struct picker_piece * p = &picker->pieces[piece];
+    struct picker_bucket * b = getBucket( picker, p->tier, p->availability );
+
+    assert( p->tier != NO_PIECE );
+
+    /* don't leave the cursor pointing at a piece that's moving */
+    if( picker->cursorNext == (int32_t)piece )
+        picker->cursorNext = p->next;
+
+    if( p->prev == NO_PIECE )
+        b->head = p->next;
+    else
+        picker->pieces[p->prev].next = p->next;
+
+    if( p->next == NO_PIECE )
+        b->tail = p->prev;
+    else
+        picker->pieces[p->next].prev = p->prev;
+
+    p->prev = p->next = NO_PIECE;
+}
+
+/* pieces are added to a random end of their bucket
+ * so that peers don't all ask for pieces in the same order */
+static void
+linkPiece( tr_picker * picker, tr_piece_index_t piece )
+{
+    struct picker_piece * p = &picker->pieces[piece];
+    struct picker_bucket * b;
+
+    assert( p->tier != NO_PIECE );
+
+    if( p->availability >= picker->bucketsPerTier )
+        setBucketsPerTier( picker, MAX( p->availability + 1, picker->bucketsPerTier * 2 ) );
+
+    b = getBucket( picker, p->tier, p->availability );
+
+    if( b->head == NO_PIECE )
+    {
+        p->prev = p->next = NO_PIECE;
+        b->head = b->tail = piece;
+    }
+    else if( tr_cryptoWeakRandInt( 2 ) )
+    {
+        p->prev = NO_PIECE;
+        p->next = b->head;
+        picker->pieces[b->head].prev = piece;
+        b->head = piece;
+    }
+    else
+    {
+        p->prev = b->tail;
+        p->next = NO_PIECE;
+        picker->pieces[b->tail].next = piece;
+        b->tail = piece;
+    }
+}
+
+/**
+***
+**/
+
+tr_picker*
+tr_pickerNew( tr_piece_index_t pieceCount )
+{
+    tr_picker * picker = tr_new0( tr_picker, 1 );
+
+    picker->pieceCount = pieceCount;
+    picker->pieces = tr_new0( struct picker_piece, pieceCount );
+    setBucketsPerTier( picker, MIN_BUCKETS_PER_TIER );
+    tr_pickerClearPieces( picker );
+
+    return picker;
+}
+
+void
+tr_pickerFree( tr_picker * picker )
+{
+    if( picker != NULL )
+    {
+        tr_free( picker->buckets );
+        tr_free( picker->pieces );
+        tr_free( picker );
+    }
+}
+
+void
+tr_pickerClearPieces( tr_picker * picker )
+{
+    int i;
+    tr_piece_index_t piece;
+
+    for( piece=0; piece<picker->pieceCount; ++piece ) {
+        struct picker_piece * p = &picker->pieces[piece];
+        p->prev = p->next = NO_PIECE;
+        p->tier = NO_PIECE;
+    }
+
+    for( i=0; i<TIER_COUNT*picker->bucketsPerTier; ++i )
+        picker->buckets[i].head = picker->buckets[i].tail = NO_PIECE;
+
+    picker->cursorTier = TIER_COUNT;
+    picker->cursorNext = NO_PIECE;
+}
+
+void
+tr_pickerSetPiece( tr_picker        * picker,
+                   tr_piece_index_t   piece,
+                   tr_bool            isWanted,
+                   tr_priority_t      priority,
+                   tr_bool            isStarted )
+{
+    struct picker_piece * p = &picker->pieces[piece];
+    const int tier = isWanted ? getTier( priority, isStarted ) : NO_PIECE;
+
+    assert( piece < picker->pieceCount );
+
+    if( p->tier != tier )
+    {
+        if( p->tier != NO_PIECE )
+            unlinkPiece( picker, piece );
+
+        p->tier = tier;
+
+        if( p->tier != NO_PIECE )
+            linkPiece( picker, piece );
+    }
+}
+
+void
+tr_pickerIncrement( tr_picker * picker, tr_piece_index_t piece )
+{
+    struct picker_piece * p = &picker->pieces[piece];
+
+    assert( piece < picker->pieceCount );
+
+    if( p->availability < MAX_AVAILABILITY )
+    {
+        if( p->tier != NO_PIECE )
+            unlinkPiece( picker, piece );
+
+        ++p->availability;
+
+        if( p->tier != NO_PIECE )
+            linkPiece( picker, piece );
+    }
+}
+
+void
+tr_pickerDecrement( tr_picker * picker, tr_piece_index_t piece )
+{
+    struct picker_piece * p = &picker->pieces[piece];
+
+    assert( piece < picker->pieceCount );
+    assert( p->availability > 0 );
+
+    if( p->availability > 0 )
+    {
+        if( p->tier != NO_PIECE )
+            unlinkPiece( picker, piece );
+
+        --p->availability;
+
+        if( p->tier != NO_PIECE )
+            linkPiece( picker, piece );
+    }
+}
+
+void
+tr_pickerClearAvailability( tr_picker * picker )
+{
+    tr_piece_index_t piece;
+
+    for( piece=0; piece<picker->pieceCount; ++piece )
+    {
+        struct picker_piece * p = &picker->pieces[piece];
+
+        if( p->availability > 0 )
+        {
+            if( p->tier != NO_PIECE )
+                unlinkPiece( picker, piece );
+
+            p->availability = 0;
+
+            if( p->tier != NO_PIECE )
+                linkPiece( picker, piece );
+        }
+    }
+}
+
+/* the bits past pieceCount are ignored, since peers can send junk there */
+static void
+walkBitfield( tr_picker          * picker,
+              const tr_bitfield  * have,
+              void              (* func)( tr_picker*, tr_piece_index_t ) )
+{
+    size_t i;
+    const size_t byteCount = MIN( have->byteCount, ( picker->pieceCount + 7u ) / 8u );
+
+    for( i=0; i<byteCount; ++i )
+    {
+        const uint8_t byte = have->bits[i];
+
+        if( byte )
+        {
+            int bit;
+            for( bit=0; bit<8; ++bit )
+            {
+                const tr_piece_index_t piece = i * 8 + bit;
+                if( ( piece < picker->pieceCount ) && ( byte & ( 0x80 >> bit ) ) )
+                    func( picker, piece );
+            }
+        }
+    }
+}
+
+void
+tr_pickerAddBitfield( tr_picker * picker, const tr_bitfield * have )
+{
+    walkBitfield( picker, have, tr_pickerIncrement );
+}
+
+void
+tr_pickerRemoveBitfield( tr_picker * picker, const tr_bitfield * have )
+{
+    walkBitfield( picker, have, tr_pickerDecrement );
+}
+
+int
+tr_pickerGetAvailability( const tr_picker * picker, tr_piece_index_t piece )
+{
+    assert( piece < picker->pieceCount );
+
+    return picker->pieces[piece].availability;
+}
+
+int
+tr_pickerGetHistogram( const tr_picker * picker,
+                       uint32_t        * setme,
+                       int               bucketCount )
+{
+    int used = 0;
+    tr_piece_index_t piece;
+
+    assert( bucketCount > 0 );
+
+    memset( setme, 0, sizeof( uint32_t ) * bucketCount );
+
+    for( piece=0; piece<picker->pieceCount; ++piece )
+    {
+        int bucket = 0;
+        int availability = picker->pieces[piece].availability;
+
+        while( availability ) {
+            ++bucket;
+            availability >>= 1;
+        }
+
+        bucket = MIN( bucket, bucketCount - 1 );
+        ++setme[bucket];
+        used = MAX( used, bucket + 1 );
+    }
+
+    return used;
+}
+
+/**
+***
+**/
+
+void
+tr_pickerRewind( tr_picker * picker )
+{
+    picker->cursorTier = 0;
+    picker->cursorAvailability = 1;
+    picker->cursorNext = getBucket( picker, 0, 1 )->head;
+}
+
+/* buckets are walked from one peer up to the most peers,
+ * then the pieces that nobody has, then on to the next tier */
+static tr_bool
+nextBucket( tr_picker * picker )
+{
+    if( picker->cursorTier >= TIER_COUNT )
+        return FALSE;
+
+    if( picker->cursorAvailability == 0 ) {
+        if( ++picker->cursorTier == TIER_COUNT )
+            return FALSE;
+        picker->cursorAvailability = 1;
+    }
+    else if( ++picker->cursorAvailability == picker->bucketsPerTier ) {
+        picker->cursorAvailability = 0;
+    }
+
+    picker->cursorNext = getBucket( picker, picker->cursorTier,
+                                            picker->cursorAvailability )->head;
+    return TRUE;
+}
+
+tr_bool
+tr_pickerNext( tr_picker * picker, tr_piece_index_t * setme )
+{
+    while( picker->cursorNext == NO_PIECE )
+        if( !nextBucket( picker ) )
+            return FALSE;
+
+    *setme = picker->cursorNext;
+    picker->cursorNext = picker->pieces[*setme].next;
+    return TRUE;
+}
@@ -0,0 +1,89 @@
+/*
+ * This file Copyright (C) 2009 Charles Kerr <charles@transmissionbt.com>
+ *
+ * This file is licensed by the GPL version 2.  Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_PICKER_H
+#define TR_PICKER_H 1
+
+struct tr_bitfield;
+
+/**
+ * Decides which pieces to request next.
+ *
+ * The picker keeps a count of how many connected peers have each piece,
+ * and files each wanted piece into a bucket by priority, by whether any
+ * of it has been downloaded yet, and by that count.  Walking the buckets
+ * in order gives the pieces best-first: highest priority, then pieces
+ * we've already started, then the rarest.  Pieces nobody has come last.
+ * Everything is updated in place, so nothing's ever rescanned or sorted.
+ */
+typedef struct tr_picker tr_picker;
+
+tr_picker*  tr_pickerNew( tr_piece_index_t pieceCount );
+
+void        tr_pickerFree( tr_picker * picker );
+
+/**
+ * Files a piece under its current state.
+ * Pieces that aren't wanted are never returned by tr_pickerNext().
+ */
+void        tr_pickerSetPiece( tr_picker        * picker,
+                               tr_piece_index_t   piece,
+                               tr_bool            isWanted,
+                               tr_priority_t      priority,
+                               tr_bool            isStarted );
+
+/** @brief Forget every piece's state, but not their availability */
+void        tr_pickerClearPieces( tr_picker * picker );
+
+/** @brief A peer told us it has this piece */
+void        tr_pickerIncrement( tr_picker * picker, tr_piece_index_t piece );
+
+/** @brief A peer that had this piece went away */
+void        tr_pickerDecrement( tr_picker * picker, tr_piece_index_t piece );
+
+/** @brief tr_pickerIncrement() every piece in a peer's bitfield */
+void        tr_pickerAddBitfield( tr_picker * picker, const struct tr_bitfield * have );
+
+/** @brief tr_pickerDecrement() every piece in a peer's bitfield */
+void        tr_pickerRemoveBitfield( tr_picker * picker, const struct tr_bitfield * have );
+
+/** @brief All the peers went away */
+void        tr_pickerClearAvailability( tr_picker * picker );
+
+/** @return the number of connected peers that have the piece */
+int         tr_pickerGetAvailability( const tr_picker * picker, tr_piece_index_t piece );
+
+/**
+ * Counts the pieces by how many peers have them, in buckets that double
+ * in size: see tr_torrentAvailabilityHistogram().  The last bucket
+ * counts everything too big for the ones before it.
+ * @return how many buckets are used.  the ones past that are all zero
+ */
+int         tr_pickerGetHistogram( const tr_picker * picker,
+                                   uint32_t        * setme,
+                                   int               bucketCount );
+
+/** @brief Start over from the best piece */
+void        tr_pickerRewind( tr_picker * picker );
+
+/**
+ * Gets the next wanted piece.  Pieces that get refiled ahead of the
+ * current position won't be seen until the next tr_pickerRewind().
+ * @return false when there are no more pieces.
+ */
+tr_bool     tr_pickerNext( tr_picker * picker, tr_piece_index_t * setme );
+
+#endif
@@ -31,6 +31,7 @@
 #define MAX_STACK_ARRAY_SIZE 7168
 
 typedef struct tr_lock   tr_lock;
+typedef struct tr_cond   tr_cond;
 typedef struct tr_thread tr_thread;
 
 void                tr_setConfigDir( tr_session * session,
@@ -58,6 +59,21 @@ void                tr_lockUnlock( tr_lock * );
 
 int                 tr_lockHave( const tr_lock * );
 
+tr_cond *           tr_condNew( void );
+
+void                tr_condFree( tr_cond * );
+
+/** @brief wait for the condition to be signalled.  `lock' must be
+           held exactly once; it's released while waiting. */
+void                tr_condWait( tr_cond * , tr_lock * lock );
+
+void                tr_condSignal( tr_cond * );
+
+void                tr_condBroadcast( tr_cond * );
+
+/** @return the number of processors online, or 1 if it can't be found */
+int                 tr_getProcessorCount( void );
+
 tr_lockfile_state_t tr_lockfile( const char * filename );
 
 #ifdef WIN32
@@ -159,7 +159,7 @@ tr_ptrArrayErase( tr_ptrArray * t,
 ***
 **/
 
-static int
+int
 tr_ptrArrayLowerBound( const tr_ptrArray *                t,
                        const void *                       ptr,
                        int                 compare( const void *,
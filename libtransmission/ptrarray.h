@@ -98,6 +98,13 @@ static TR_INLINE tr_bool tr_ptrArrayEmpty( const tr_ptrArray * a )
     return tr_ptrArraySize(a) == 0;
 }
 
+/** @brief find the position of `key', or where it would be inserted
+ *  @param exact_match if not NULL, set to nonzero if `key' was found */
+int           tr_ptrArrayLowerBound( const tr_ptrArray * array,
+                                     const void        * key,
+                                     int compare(const void*, const void*),
+                                     int               * exact_match );
+
 int           tr_ptrArrayInsertSorted( tr_ptrArray * array,
                                        void        * value,
                                        int compare(const void*, const void*) );
@@ -1,8 +1,26 @@
 #include <stdio.h>
+#include <string.h> /* memmove */
+
+#include <sys/time.h> /* gettimeofday */
+
 #include "transmission.h"
+#include "crypto.h" /* tr_cryptoWeakRandInt */
 #include "request-list.h"
+#include "utils.h"
 
 #undef VERBOSE
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+ #define VERBOSE
+ #define BENCH_ROUNDS 2000000
+#else
+ #define BENCH_ROUNDS 100000
+#endif
+
+#define MODEL_ROUNDS 100000
+#define MODEL_MAX 300
+#define PIPELINE_DEPTH 500 /* requests outstanding to a fast peer */
 
 static int test = 0;
 
@@ -28,6 +46,24 @@ static int test = 0;
     }
 #endif
 
+/* true if popping a copy of the list gives the requests with these indices */
+static tr_bool
+isInOrder( const struct request_list * list, const uint32_t * indices, size_t n )
+{
+    size_t i;
+    tr_bool ok = TRUE;
+    struct peer_request req;
+    struct request_list tmp;
+
+    reqListCopy( &tmp, list );
+    for( i=0; ok && i<n; ++i )
+        ok = reqListPop( &tmp, &req ) && ( req.index == indices[i] );
+    ok = ok && !reqListPop( &tmp, &req );
+    reqListClear( &tmp );
+
+    return ok;
+}
+
 static int
 testFoo( void )
 {
@@ -38,6 +74,9 @@ testFoo( void )
     a.index = a.offset = a.length = 10;
     b.index = b.offset = b.length = 20;
     c.index = c.offset = c.length = 30;
+    a.time_requested = 1;
+    b.time_requested = 2;
+    c.time_requested = 3;
 
     check( list.len == 0 );
 
@@ -46,18 +85,27 @@ testFoo( void )
     reqListAppend( &list, &c );
 
     check( list.len == 3 );
-    check( list.fifo[0].index == 10 );
-    check( list.fifo[1].index == 20 );
-    check( list.fifo[2].index == 30 );
+    {
+        const uint32_t order[] = { 10, 20, 30 };
+        check( isInOrder( &list, order, 3 ) );
+    }
     check( reqListHas( &list, &a ) );
     check( reqListHas( &list, &b ) );
     check( reqListHas( &list, &c ) );
 
+    /* the stored request is returned, not the key */
+    tmp = b;
+    tmp.time_requested = 0;
+    check( reqListGet( &list, &tmp, &tmp ) );
+    check( tmp.time_requested == 2 );
+
     success = reqListRemove( &list, &b );
     check( success );
     check( list.len == 2 );
-    check( list.fifo[0].index == 10 );
-    check( list.fifo[1].index == 30 );
+    {
+        const uint32_t order[] = { 10, 30 };
+        check( isInOrder( &list, order, 2 ) );
+    }
     check( reqListHas( &list, &a ) );
     check( !reqListHas( &list, &b ) );
     check( reqListHas( &list, &c ) );
@@ -66,7 +114,8 @@ testFoo( void )
     check( success );
     check( list.len == 1 );
     check( tmp.index == 10 );
-    check( list.fifo[0].index == 30 );
+    check( reqListPeek( &list, &tmp ) );
+    check( tmp.index == 30 );
     check( !reqListHas( &list, &a ) );
     check( !reqListHas( &list, &b ) );
     check( reqListHas( &list, &c ) );
@@ -113,6 +162,137 @@ testFoo( void )
     check( !reqListHas( &list, &b ) );
     check( !reqListHas( &list, &c ) );
 
+    /* a request only matches if its length matches too */
+    reqListAppend( &list, &a );
+    tmp = a;
+    tmp.length = 5;
+    check( !reqListHas( &list, &tmp ) );
+    check( !reqListRemove( &list, &tmp ) );
+    check( reqListHas( &list, &a ) );
+
+    reqListClear( &list );
+    return 0;
+}
+
+/* run random appends, pops, and removes on a list and on a plain
+ * array, and check that they always agree */
+static int
+testModel( void )
+{
+    int i;
+    size_t j;
+    size_t modelLen = 0;
+    struct peer_request model[MODEL_MAX];
+    struct request_list list = REQUEST_LIST_INIT;
+
+    for( i=0; i<MODEL_ROUNDS; ++i )
+    {
+        struct peer_request req;
+        const int op = tr_cryptoWeakRandInt( 3 );
+
+        if( ( op == 0 ) && ( modelLen < MODEL_MAX ) )
+        {
+            req.index = tr_cryptoWeakRandInt( 1000 );
+            req.offset = tr_cryptoWeakRandInt( 4 ) * 16384;
+            req.length = 16384;
+            req.time_requested = i;
+            if( !reqListHas( &list, &req ) ) {
+                reqListAppend( &list, &req );
+                model[modelLen++] = req;
+            }
+        }
+        else if( op == 1 )
+        {
+            const tr_bool popped = reqListPop( &list, &req );
+            check( popped == ( modelLen != 0 ) );
+            if( popped ) {
+                check( req.time_requested == model[0].time_requested );
+                memmove( model, model + 1, --modelLen * sizeof( req ) );
+            }
+        }
+        else if( modelLen > 0 )
+        {
+            const size_t pos = tr_cryptoWeakRandInt( modelLen );
+            check( reqListRemove( &list, &model[pos] ) );
+            check( !reqListHas( &list, &model[pos] ) );
+            memmove( model + pos, model + pos + 1, ( --modelLen - pos ) * sizeof( req ) );
+        }
+
+        check( list.len == modelLen );
+    }
+
+    for( j=0; j<modelLen; ++j )
+        check( reqListHas( &list, &model[j] ) );
+
+    reqListClear( &list );
+    return 0;
+}
+
+#ifdef VERBOSE
+static uint64_t
+usecNow( void )
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+#endif
+
+/* a fast peer with a deep pipeline: each round, a block arrives and is
+ * removed, the oldest request is popped to be sent, and a new one is
+ * queued.  every so often one is cancelled, like in endgame */
+static int
+testThroughput( void )
+{
+    int i;
+    uint32_t next = 0;
+    struct peer_request req;
+    struct request_list list = REQUEST_LIST_INIT;
+#ifdef VERBOSE
+    const uint64_t start = usecNow( );
+#endif
+
+    for( i=0; i<PIPELINE_DEPTH; ++i, ++next ) {
+        req.index = next / 16;
+        req.offset = ( next % 16 ) * 16384;
+        req.length = 16384;
+        req.time_requested = 0;
+        reqListAppend( &list, &req );
+    }
+
+    for( i=0; i<BENCH_ROUNDS; ++i )
+    {
+        /* a block arrives from somewhere in the middle of the pipeline */
+        const uint32_t n = next - 1 - tr_cryptoWeakRandInt( PIPELINE_DEPTH / 2 );
+        req.index = n / 16;
+        req.offset = ( n % 16 ) * 16384;
+        req.length = 16384;
+        if( reqListRemove( &list, &req ) )
+            check( !reqListHas( &list, &req ) );
+
+        if( !( i % 8 ) ) {
+            req.offset = 0;
+            reqListRemove( &list, &req );
+        }
+
+        reqListPop( &list, &req );
+
+        while( list.len < PIPELINE_DEPTH ) {
+            req.index = next / 16;
+            req.offset = ( next % 16 ) * 16384;
+            req.length = 16384;
+            reqListAppend( &list, &req );
+            ++next;
+        }
+    }
+
+#ifdef VERBOSE
+    fprintf( stderr, "%d rounds with %d requests queued: %.1f nsec per round\n",
+             BENCH_ROUNDS, PIPELINE_DEPTH, ( ( usecNow( ) - start ) * 1000.0 ) / BENCH_ROUNDS );
+#endif
+    check( list.len == PIPELINE_DEPTH );
+    check( list.max <= PIPELINE_DEPTH * 4 );
+
     reqListClear( &list );
     return 0;
 }
@@ -125,6 +305,12 @@ main( void )
     if(( i = testFoo( )))
         return i;
 
+    if(( i = testModel( )))
+        return i;
+
+    if(( i = testThroughput( )))
+        return i;
+
     return 0;
 }
 
@@ -11,151 +11,294 @@
  */
 
 #include <assert.h>
+#include <string.h> /* memset */
+
 #include "transmission.h"
 #include "request-list.h"
 #include "utils.h"
 
+const struct request_list REQUEST_LIST_INIT = { 0, 0, 0, 0, NULL, NULL, 0 };
+
+enum
+{
+    MIN_SIZE = 8
+};
+
+/* requests never have a zero length, so that marks a hole in the ring */
+static TR_INLINE tr_bool
+isHole( const struct peer_request * req )
+{
+    return req->length == 0;
+}
+
+static TR_INLINE tr_bool
+isSameRequest( const struct peer_request * a,
+               const struct peer_request * b )
+{
+    return ( a->index == b->index )
+        && ( a->offset == b->offset )
+        && ( a->length == b->length );
+}
+
+static TR_INLINE size_t
+slotAt( const struct request_list * list, size_t n )
+{
+    return ( list->head + n ) & ( list->max - 1 );
+}
+
+/***
+****  The hash index
+***/
+
+static uint32_t
+hashRequest( const struct peer_request * req )
+{
+    uint32_t h = req->index * 0x9E3779B1u;
+    h = ( h ^ req->offset ) * 0x85EBCA6Bu;
+    h = ( h ^ req->length ) * 0xC2B2AE35u;
+    return h ^ ( h >> 16 );
+}
+
+/* the hash slot that holds the fifo slot of a request matching `key',
+ * or -1 if there isn't one */
 static int
-compareRequests( const struct peer_request * a,
-                 const struct peer_request * b )
+hashFind( const struct request_list * list,
+          const struct peer_request * key )
+{
+    size_t i;
+
+    if( !list->len )
+        return -1;
+
+    for( i = hashRequest( key ) & list->hashMask; list->hash[i]; i = ( i + 1 ) & list->hashMask )
+        if( isSameRequest( &list->fifo[list->hash[i] - 1], key ) )
+            return i;
+
+    return -1;
+}
+
+/* the hash slot that holds fifo slot `slot' */
+static size_t
+hashFindSlot( const struct request_list * list, size_t slot )
 {
-    if( a->index != b->index )
-        return a->index < b->index ? -1 : 1;
+    size_t i = hashRequest( &list->fifo[slot] ) & list->hashMask;
 
-    if( a->offset != b->offset )
-        return a->offset < b->offset ? -1 : 1;
+    while( list->hash[i] != slot + 1 )
+        i = ( i + 1 ) & list->hashMask;
 
-    return 0;
+    return i;
 }
 
-const struct request_list REQUEST_LIST_INIT = { 0, 0, NULL, NULL };
+static void
+hashInsert( struct request_list * list, size_t slot )
+{
+    size_t i = hashRequest( &list->fifo[slot] ) & list->hashMask;
 
-static const int GROW = 8;
+    while( list->hash[i] )
+        i = ( i + 1 ) & list->hashMask;
 
+    list->hash[i] = slot + 1;
+}
+
+/* empty hash slot `i', and shift back any entries after it that would
+ * otherwise be cut off from their home slots */
 static void
-reqListReserve( struct request_list * list, size_t max )
+hashRemoveAt( struct request_list * list, size_t i )
 {
-    if( list->max < max )
+    size_t j = i;
+
+    for( ;; )
     {
-        list->max = max + GROW;
-        list->fifo = tr_renew( struct peer_request, list->fifo, list->max );
-        list->sort = tr_renew( struct peer_request, list->sort, list->max );
+        size_t home;
+
+        j = ( j + 1 ) & list->hashMask;
+        if( !list->hash[j] )
+            break;
+
+        home = hashRequest( &list->fifo[list->hash[j] - 1] ) & list->hashMask;
+        if( ( i <= j ) ? ( ( i < home ) && ( home <= j ) )
+                       : ( ( i < home ) || ( home <= j ) ) )
+            continue;
+
+        list->hash[i] = list->hash[j];
+        i = j;
+    }
+
+    list->hash[i] = 0;
+}
+
+/***
+****
+***/
+
+/* copy the requests, oldest first and without the holes, into `setme' */
+static size_t
+getRequests( const struct request_list * list, struct peer_request * setme )
+{
+    size_t i;
+    size_t n = 0;
+
+    for( i=0; i<list->span; ++i ) {
+        const struct peer_request * req = &list->fifo[slotAt( list, i )];
+        if( !isHole( req ) )
+            setme[n++] = *req;
+    }
+
+    assert( n == list->len );
+    return n;
+}
+
+static void
+buildHash( struct request_list * list )
+{
+    size_t i;
+
+    /* keep it at least half empty */
+    tr_free( list->hash );
+    list->hashMask = list->max * 2 - 1;
+    list->hash = tr_new0( uint32_t, list->max * 2 );
+
+    for( i=0; i<list->span; ++i )
+        hashInsert( list, slotAt( list, i ) );
+}
+
+/* move the requests into a ring of `max' slots, squeezing out the holes */
+static void
+reqListResize( struct request_list * list, size_t max )
+{
+    struct peer_request * fifo = tr_new( struct peer_request, max );
+
+    assert( max >= list->len );
+
+    list->span = getRequests( list, fifo );
+    list->head = 0;
+    list->max = max;
+    tr_free( list->fifo );
+    list->fifo = fifo;
+    buildHash( list );
+}
+
+/* drop the holes from the front and back of the ring */
+static void
+reqListTrim( struct request_list * list )
+{
+    while( list->span && isHole( &list->fifo[list->head] ) ) {
+        list->head = ( list->head + 1 ) & ( list->max - 1 );
+        --list->span;
     }
+
+    while( list->span && isHole( &list->fifo[slotAt( list, list->span - 1 )] ) )
+        --list->span;
 }
 
 void
 reqListClear( struct request_list * list )
 {
     tr_free( list->fifo );
-    tr_free( list->sort );
+    tr_free( list->hash );
     *list = REQUEST_LIST_INIT;
 }
 
 void
 reqListCopy( struct request_list * dest, const struct request_list * src )
 {
-    dest->len = dest->max = src->len;
-    dest->fifo = tr_memdup( src->fifo, dest->len * sizeof( struct peer_request ) );
-    dest->sort = tr_memdup( src->sort, dest->len * sizeof( struct peer_request ) );
-}
-
-typedef int (*compareFunc)(const void * a, const void * b );
+    *dest = REQUEST_LIST_INIT;
+    dest->max = MIN_SIZE;
+    while( dest->max < src->len )
+        dest->max *= 2;
 
-static int
-reqListSortPos( const struct request_list * list,
-                const struct peer_request * req,
-                tr_bool                   * exactMatch )
-{
-    return tr_lowerBound( req,
-                          list->sort,
-                          list->len,
-                          sizeof( struct peer_request ), 
-                          (compareFunc)compareRequests,
-                          exactMatch );
+    dest->fifo = tr_new( struct peer_request, dest->max );
+    dest->len = dest->span = getRequests( src, dest->fifo );
+    buildHash( dest );
 }
 
 void
 reqListAppend( struct request_list *       list,
                const struct peer_request * req )
 {
-    int low;
+    size_t slot;
 
-    reqListReserve( list, list->len + 8 );
+    assert( !isHole( req ) );
 
-    /* append into list->fifo */
-    list->fifo[list->len] = *req;
-
-    /* insert into list->sort */
-    low = reqListSortPos( list, req, NULL );
-    memmove( &list->sort[low+1], &list->sort[low], (list->len-low)*sizeof(struct peer_request) );
-    list->sort[low] = *req;
+    if( list->span == list->max )
+    {
+        /* grow if it's more than half full, otherwise just squeeze out
+         * the holes.  either way it's at most half full afterwards, so
+         * the copy costs O(1) per append */
+        size_t max = list->max ? list->max : MIN_SIZE;
+        if( list->len * 2 > max )
+            max *= 2;
+        reqListResize( list, max );
+    }
 
+    slot = slotAt( list, list->span++ );
+    list->fifo[slot] = *req;
+    hashInsert( list, slot );
     ++list->len;
 }
 
-static tr_bool
-reqListRemoveFromSorted( struct request_list * list, const struct peer_request * key )
+tr_bool
+reqListPeek( const struct request_list * list,
+             struct peer_request       * setme )
 {
-    tr_bool found;
-    const int low = reqListSortPos( list, key, &found );
-    if( found )
-        memmove( &list->sort[low], &list->sort[low+1], (list->len-low-1)*sizeof(struct peer_request));
-    return found;
-}
+    if( !list->len )
+        return FALSE;
 
-static void
-reqListRemoveNthFromFifo( struct request_list * list, int n )
-{
-    memmove( &list->fifo[n], &list->fifo[n+1], (list->len-n-1)*sizeof(struct peer_request));
+    /* reqListTrim() keeps a request at the head */
+    *setme = list->fifo[list->head];
+    return TRUE;
 }
 
 tr_bool
 reqListPop( struct request_list * list,
             struct peer_request * setme )
 {
-    tr_bool success;
-
     if( !list->len )
-    {
-        success = FALSE;
-    }
-    else
-    {
-        *setme = list->fifo[0];
-        reqListRemoveNthFromFifo( list, 0 );
-        reqListRemoveFromSorted( list, setme );
-        --list->len;
-        success = TRUE;
-    }
+        return FALSE;
 
-    return success;
+    *setme = list->fifo[list->head];
+    hashRemoveAt( list, hashFindSlot( list, list->head ) );
+    list->fifo[list->head].length = 0;
+    --list->len;
+    reqListTrim( list );
+    return TRUE;
 }
 
 tr_bool
 reqListHas( const struct request_list * list,
             const struct peer_request * key )
 {
-    tr_bool exactMatch;
-    reqListSortPos( list, key, &exactMatch );
-    return exactMatch;
+    return hashFind( list, key ) >= 0;
+}
+
+tr_bool
+reqListGet( const struct request_list * list,
+            const struct peer_request * key,
+            struct peer_request       * setme )
+{
+    const int i = hashFind( list, key );
+
+    if( i < 0 )
+        return FALSE;
+
+    *setme = list->fifo[list->hash[i] - 1];
+    return TRUE;
 }
 
 tr_bool
 reqListRemove( struct request_list       * list,
                const struct peer_request * key )
 {
-    tr_bool found = reqListRemoveFromSorted( list, key );
+    size_t slot;
+    const int i = hashFind( list, key );
 
-    if( found )
-    {
-        size_t i;
-        for( i=0; i<list->len; ++i )
-            if( !compareRequests( &list->fifo[i], key ) )
-                break;
-        assert( i < list->len );
-        reqListRemoveNthFromFifo( list, i );
-        --list->len;
-    }
+    if( i < 0 )
+        return FALSE;
 
-    return found;
+    slot = list->hash[i] - 1;
+    hashRemoveAt( list, i );
+    list->fifo[slot].length = 0;
+    --list->len;
+    reqListTrim( list );
+    return TRUE;
 }
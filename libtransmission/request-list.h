@@ -24,33 +24,52 @@ struct peer_request
     uint32_t    index;
     uint32_t    offset;
     uint32_t    length;
-    time_t      time_requested;
+    uint64_t    time_requested; /* tr_date() when it was queued or sent */
 };
 
+/**
+ * A FIFO of requests with a hash index beside it, so that
+ * every operation but reqListCopy() is O(1).
+ *
+ * The FIFO is a ring.  Removing a request from the middle leaves a
+ * hole in the ring, which is skipped when it reaches the front, and
+ * squeezed out the next time the ring is resized.  Walk the list with
+ * reqListPop(), not by indexing `fifo'.
+ */
 struct request_list
 {
-    size_t                 len;
-    size_t                 max;
+    size_t                 len;      /* how many requests are in the list */
+    size_t                 max;      /* the size of `fifo', a power of two */
+    size_t                 head;     /* where the oldest request is in `fifo' */
+    size_t                 span;     /* slots from `head' to the newest, holes included */
     struct peer_request  * fifo;
-    struct peer_request  * sort;
+    uint32_t             * hash;     /* 1 + each request's slot in `fifo', or 0 */
+    size_t                 hashMask;
 };
 
 extern const struct request_list REQUEST_LIST_INIT;
 
 void reqListClear( struct request_list * list );
 
+/* O(N) */
 void reqListCopy( struct request_list * dest, const struct request_list * src );
 
-/* O(log(N)) */
+/* O(1).  matches on the index, offset, and length */
 tr_bool reqListHas( const struct request_list * list, const struct peer_request * key );
 
-/* O(log(N) + 1) */
+/* O(1) amortized */
 void reqListAppend( struct request_list * list, const struct peer_request * req );
 
-/* O(log(N) + 1) */
+/* O(1) amortized.  removes the oldest request */
 tr_bool reqListPop( struct request_list * list, struct peer_request * setme );
 
-/* O(N + log(N)) */
+/* O(1).  looks at the oldest request without removing it */
+tr_bool reqListPeek( const struct request_list * list, struct peer_request * setme );
+
+/* O(1).  copies the request that matches `key' into `setme' */
+tr_bool reqListGet( const struct request_list * list, const struct peer_request * key, struct peer_request * setme );
+
+/* O(1) */
 tr_bool reqListRemove( struct request_list * list, const struct peer_request * key );
 
 
@@ -10,6 +10,7 @@
  * $Id$
  */
 
+#include <errno.h> /* ECANCELED */
 #include <unistd.h> /* unlink */
 
 #include <string.h>
@@ -18,11 +19,14 @@
 #include "session.h"
 #include "bencode.h"
 #include "completion.h"
+#include "disk-pool.h"
 #include "fastresume.h"
+#include "fdlimit.h" /* tr_fdTorrentSync */
 #include "peer-mgr.h" /* pex */
 #include "platform.h" /* tr_getResumeDir */
 #include "resume.h"
 #include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread */
 #include "utils.h" /* tr_buildPath */
 
 #define KEY_ACTIVITY_DATE   "activity-date"
@@ -43,6 +47,7 @@
 #define KEY_SPEEDLIMIT_DOWN "speed-limit-down"
 #define KEY_RATIOLIMIT      "ratio-limit"
 #define KEY_UPLOADED        "uploaded"
+#define KEY_WASTED          "wasted"
 
 #define KEY_SPEED                  "speed"
 #define KEY_USE_GLOBAL_SPEED_LIMIT "use-global-speed-limit"
@@ -475,16 +480,13 @@ loadProgress( tr_benc *    dict,
 ****
 ***/
 
-void
-tr_torrentSaveResume( const tr_torrent * tor )
+static void
+saveResumeFile( const tr_torrent * tor )
 {
     tr_benc top;
     char *  filename;
 
-    if( !tor )
-        return;
-
-    tr_bencInitDict( &top, 14 );
+    tr_bencInitDict( &top, 15 );
     tr_bencDictAddInt( &top, KEY_ACTIVITY_DATE,
                        tor->activityDate );
     tr_bencDictAddInt( &top, KEY_ADDED_DATE,
@@ -499,6 +501,8 @@ tr_torrentSaveResume( const tr_torrent * tor )
                        tor->downloadedPrev + tor->downloadedCur );
     tr_bencDictAddInt( &top, KEY_UPLOADED,
                        tor->uploadedPrev + tor->uploadedCur );
+    tr_bencDictAddInt( &top, KEY_WASTED,
+                       tor->wastedPrev + tor->wastedCur );
     tr_bencDictAddInt( &top, KEY_MAX_PEERS,
                        tor->maxConnectedPeers );
     tr_bencDictAddInt( &top, KEY_PAUSED,
@@ -517,6 +521,47 @@ tr_torrentSaveResume( const tr_torrent * tor )
     tr_bencFree( &top );
 }
 
+/* runs in a disk thread */
+static int
+syncTorrentFiles( void * vtor )
+{
+    const tr_torrent * tor = vtor;
+
+    return tr_fdTorrentSync( tor->uniqueId );
+}
+
+static void
+syncedTorrentFiles( int err, void * vtor )
+{
+    /* stopping a torrent waits for its jobs, so it's still here */
+    if( err != ECANCELED )
+        saveResumeFile( vtor );
+}
+
+static void
+queueTorrentSync( void * vtor )
+{
+    tr_torrent * tor = vtor;
+
+    tr_diskPoolAdd( tor->session->diskPool, tor->downloadDir, tor,
+                    syncTorrentFiles, syncedTorrentFiles, tor );
+}
+
+void
+tr_torrentSaveResume( const tr_torrent * tor )
+{
+    if( !tor )
+        return;
+
+    /* don't let the resume file claim data that's not on disk yet.
+     * syncing can take a while, so it's done in the disk pool and
+     * the resume file is saved once it's done */
+    if( tr_fdGetSyncMode( ) == TR_SYNC_PIECE )
+        tr_runInEventThread( tor->session, queueTorrentSync, (void*)tor );
+    else
+        saveResumeFile( tor );
+}
+
 static uint64_t
 loadFromFile( tr_torrent * tor,
               uint64_t     fieldsToLoad )
@@ -524,12 +569,13 @@ loadFromFile( tr_torrent * tor,
     int64_t      i;
     const char * str;
     uint64_t     fieldsLoaded = 0;
-    char *       filename;
-    tr_benc      top;
+    char *          filename;
+    tr_benc         top;
+    tr_benc_arena * arena;
 
     filename = getResumeFilename( tor );
 
-    if( tr_bencLoadFile( filename, &top ) )
+    if( tr_bencLoadFileArena( filename, &top, &arena ) )
     {
         tr_tordbg( tor, "Couldn't read \"%s\"; trying old format.",
                    filename );
@@ -578,6 +624,13 @@ loadFromFile( tr_torrent * tor,
         fieldsLoaded |= TR_FR_UPLOADED;
     }
 
+    if( ( fieldsToLoad & TR_FR_WASTED )
+      && tr_bencDictFindInt( &top, KEY_WASTED, &i ) )
+    {
+        tor->wastedPrev = i;
+        fieldsLoaded |= TR_FR_WASTED;
+    }
+
     if( ( fieldsToLoad & TR_FR_MAX_PEERS )
       && tr_bencDictFindInt( &top, KEY_MAX_PEERS, &i ) )
     {
@@ -632,6 +685,7 @@ loadFromFile( tr_torrent * tor,
         fieldsLoaded |= loadRatioLimits( &top, tor );
 
     tr_bencFree( &top );
+    tr_bencArenaFree( arena );
     tr_free( filename );
     return fieldsLoaded;
 }
@@ -33,7 +33,8 @@ enum
     TR_FR_ADDED_DATE     = ( 1 << 11 ),
     TR_FR_DONE_DATE      = ( 1 << 12 ),
     TR_FR_ACTIVITY_DATE  = ( 1 << 13 ),
-    TR_FR_RATIOLIMIT     = ( 1 << 14 )
+    TR_FR_RATIOLIMIT     = ( 1 << 14 ),
+    TR_FR_WASTED         = ( 1 << 15 )
 };
 
 /**
@@ -43,6 +44,9 @@ uint64_t tr_torrentLoadResume( tr_torrent *    tor,
                                uint64_t        fieldsToLoad,
                                const tr_ctor * ctor );
 
+/** In TR_SYNC_PIECE mode, the torrent's files are synced in the disk
+    pool first, and the resume file is saved from the event thread
+    once that's done. */
 void     tr_torrentSaveResume( const tr_torrent * tor );
 
 void     tr_torrentRemoveResume( const tr_torrent * tor );
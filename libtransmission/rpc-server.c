@@ -26,6 +26,9 @@
 
 #include <libevent/event.h>
 #include <libevent/evhttp.h>
+#include <sys/socket.h> /* struct sockaddr, for http-internal.h */
+#include <sys/queue.h> /* TAILQ_ENTRY, for http-internal.h */
+#include <libevent/http-internal.h> /* evhttp_connection's output_buffer */
 
 #include "transmission.h"
 #include "bencode.h"
@@ -34,6 +37,7 @@
 #include "platform.h"
 #include "rpcimpl.h"
 #include "rpc-server.h"
+#include "session.h"
 #include "trevent.h"
 #include "utils.h"
 #include "web.h"
@@ -58,10 +62,8 @@ struct tr_rpc_server
     char *             password;
     char *             whitelistStr;
     tr_list *          whitelist;
-
-#ifdef HAVE_ZLIB
-    z_stream           stream;
-#endif
+    tr_list *          listeners;
+    tr_timer *         speedTimer;
 };
 
 #define dbgmsg( ... ) \
@@ -225,76 +227,99 @@ mimetype_guess( const char * path )
     return "application/octet-stream";
 }
 
+/* A response body that's compressed as it's added,
+ * if the client says it can take gzip or deflate */
+struct response
+{
+    struct evhttp_request * req;
+    struct evbuffer       * out;
+#ifdef HAVE_ZLIB
+    tr_bool                 isCompressed;
+    z_stream                stream;
+#endif
+};
+
+static void
+responseInit( struct response * r, struct evhttp_request * req )
+{
+#ifdef HAVE_ZLIB
+    int windowBits = 0;
+    const char * name = NULL;
+    const char * encoding = evhttp_find_header( req->input_headers, "Accept-Encoding" );
+#endif
+
+    r->req = req;
+    r->out = tr_getBuffer( );
+
+#ifdef HAVE_ZLIB
+    if( encoding && strstr( encoding, "gzip" ) ) {
+        name = "gzip";
+        windowBits = MAX_WBITS + 16;
+    } else if( encoding && strstr( encoding, "deflate" ) ) {
+        /* http://carsten.codimi.de/gzip.yaws/
+           It turns out that some browsers expect deflated data without
+           the first two bytes (a kind of header) and and the last four
+           bytes (an ADLER32 checksum), so send a raw deflate stream. */
+        name = "deflate";
+        windowBits = -MAX_WBITS;
+    }
+
+    memset( &r->stream, 0, sizeof( r->stream ) );
+    r->isCompressed = ( name != NULL )
+        && ( deflateInit2( &r->stream, Z_BEST_COMPRESSION, Z_DEFLATED,
+                           windowBits, 8, Z_DEFAULT_STRATEGY ) == Z_OK );
+    if( r->isCompressed )
+        evhttp_add_header( req->output_headers, "Content-Encoding", name );
+#endif
+}
+
 static void
-add_response( struct evhttp_request * req,
-              struct tr_rpc_server *  server,
-              struct evbuffer *       out,
-              const void *            content,
-              size_t                  content_len )
+responseAdd( struct response * r,
+             const void      * content,
+             size_t            content_len,
+             tr_bool           isDone )
 {
 #ifndef HAVE_ZLIB
-    evbuffer_add( out, content, content_len );
+    evbuffer_add( r->out, content, content_len );
 #else
-    const char * key = "Accept-Encoding";
-    const char * encoding = evhttp_find_header( req->input_headers, key );
-    const int do_deflate = encoding && strstr( encoding, "deflate" );
-
-    if( !do_deflate )
+    if( !r->isCompressed )
     {
-        evbuffer_add( out, content, content_len );
+        evbuffer_add( r->out, content, content_len );
     }
     else
     {
-        int state;
-
-        server->stream.next_in = (Bytef*) content;
-        server->stream.avail_in = content_len;
-
-        /* allocate space for the raw data and call deflate() just once --
-         * we won't use the deflated data if it's longer than the raw data,
-         * so it's okay to let deflate() run out of output buffer space */
-        evbuffer_expand( out, content_len );
-        server->stream.next_out = EVBUFFER_DATA( out );
-        server->stream.avail_out = content_len;
-
-        state = deflate( &server->stream, Z_FINISH );
-
-        if( state == Z_STREAM_END )
-        {
-            EVBUFFER_LENGTH( out ) = content_len - server->stream.avail_out;
-
-            /* http://carsten.codimi.de/gzip.yaws/
-               It turns out that some browsers expect deflated data without
-               the first two bytes (a kind of header) and and the last four
-               bytes (an ADLER32 checksum). This format can of course
-               be produced by simply stripping these off. */
-            if( EVBUFFER_LENGTH( out ) >= 6 ) {
-                EVBUFFER_LENGTH( out ) -= 4;
-                evbuffer_drain( out, 2 );
-            }
-
-#if 0
-            tr_ninf( MY_NAME, _( "Deflated response from %zu bytes to %zu" ),
-                              content_len,
-                              EVBUFFER_LENGTH( out ) );
-#endif
-            evhttp_add_header( req->output_headers,
-                               "Content-Encoding", "deflate" );
-        }
-        else
-        {
-            evbuffer_drain( out, EVBUFFER_LENGTH( out ) );
-            evbuffer_add( out, content, content_len );
+        const size_t chunk = 16 * 1024;
+
+        r->stream.next_in = (Bytef*) content;
+        r->stream.avail_in = content_len;
+
+        /* deflate straight into the end of the output buffer */
+        do {
+            evbuffer_expand( r->out, chunk );
+            r->stream.next_out = EVBUFFER_DATA( r->out ) + EVBUFFER_LENGTH( r->out );
+            r->stream.avail_out = chunk;
+            deflate( &r->stream, isDone ? Z_FINISH : Z_NO_FLUSH );
+            EVBUFFER_LENGTH( r->out ) += chunk - r->stream.avail_out;
         }
-
-        deflateReset( &server->stream );
+        while( r->stream.avail_out == 0 );
     }
 #endif
 }
 
+static void
+responseSend( struct response * r )
+{
+#ifdef HAVE_ZLIB
+    if( r->isCompressed )
+        deflateEnd( &r->stream );
+#endif
+
+    evhttp_send_reply( r->req, HTTP_OK, "OK", r->out );
+    tr_releaseBuffer( r->out );
+}
+
 static void
 serve_file( struct evhttp_request * req,
-            struct tr_rpc_server *  server,
             const char *            filename )
 {
     if( req->type != EVHTTP_REQ_GET )
@@ -318,16 +343,15 @@ serve_file( struct evhttp_request * req,
         }
         else
         {
-            struct evbuffer * out;
+            struct response r;
 
             errno = error;
-            out = tr_getBuffer( );
             evhttp_add_header( req->output_headers, "Content-Type",
                                mimetype_guess( filename ) );
-            add_response( req, server, out, content, content_len );
-            evhttp_send_reply( req, HTTP_OK, "OK", out );
+            responseInit( &r, req );
+            responseAdd( &r, content, content_len, TRUE );
+            responseSend( &r );
 
-            tr_releaseBuffer( out );
             tr_free( content );
         }
     }
@@ -368,63 +392,202 @@ handle_clutch( struct evhttp_request * req,
                        TR_PATH_DELIMITER_STR,
                        subpath && *subpath ? subpath : "index.html" );
 
-        serve_file( req, server, filename );
+        serve_file( req, filename );
 
         tr_free( filename );
         tr_free( subpath );
     }
 }
 
-struct rpc_response_data
-{
-    struct evhttp_request * req;
-    struct tr_rpc_server  * server;
-};
-
+/* the response is compressed a chunk at a time as it's written,
+ * so the uncompressed JSON is never held in memory all at once */
 static void
 rpc_response_func( tr_session      * session UNUSED,
-                   const char      * response,
-                   size_t            response_len,
+                   const void      * chunk,
+                   size_t            chunk_len,
+                   tr_bool           isDone,
                    void            * user_data )
 {
-    struct rpc_response_data * data = user_data;
-    struct evbuffer * buf = tr_getBuffer( );
+    struct response * r = user_data;
 
-    add_response( data->req, data->server, buf, response, response_len );
-    evhttp_add_header( data->req->output_headers,
-                           "Content-Type", "application/json; charset=UTF-8" );
-    evhttp_send_reply( data->req, HTTP_OK, "OK", buf );
+    responseAdd( r, chunk, chunk_len, isDone );
 
-    tr_releaseBuffer( buf );
-    tr_free( data );
+    if( isDone )
+    {
+        responseSend( r );
+        tr_free( r );
+    }
 }
 
+static struct response*
+rpc_response_new( struct evhttp_request * req )
+{
+    struct response * r = tr_new0( struct response, 1 );
+
+    evhttp_add_header( req->output_headers,
+                       "Content-Type", "application/json; charset=UTF-8" );
+    responseInit( r, req );
+    return r;
+}
 
 static void
 handle_rpc( struct evhttp_request * req,
             struct tr_rpc_server  * server )
 {
-    struct rpc_response_data * data = tr_new0( struct rpc_response_data, 1 );
+    const char * q;
 
-    data->req = req;
-    data->server = server;
-    
-    if( req->type == EVHTTP_REQ_GET )
+    if( ( req->type == EVHTTP_REQ_GET ) && ( ( q = strchr( req->uri, '?' ) ) ) )
     {
-        const char * q;
-        if( ( q = strchr( req->uri, '?' ) ) )
-            tr_rpc_request_exec_uri( server->session, q+1, -1, rpc_response_func, data );
+        tr_rpc_request_exec_uri_chunked( server->session, q+1, -1,
+                                         rpc_response_func,
+                                         rpc_response_new( req ) );
     }
     else if( req->type == EVHTTP_REQ_POST )
     {
-        tr_rpc_request_exec_json( server->session,
-                                  EVBUFFER_DATA( req->input_buffer ),
-                                  EVBUFFER_LENGTH( req->input_buffer ),
-                                  rpc_response_func, data );
+        tr_rpc_request_exec_json_chunked( server->session,
+                                          EVBUFFER_DATA( req->input_buffer ),
+                                          EVBUFFER_LENGTH( req->input_buffer ),
+                                          rpc_response_func,
+                                          rpc_response_new( req ) );
+    }
+    else
+    {
+        /* always answer, or a kept-alive connection would hang */
+        send_simple_response( req, HTTP_BADREQUEST, NULL );
+    }
+}
+
+/***
+****  EVENTS
+***/
+
+/* how often listeners get a speed sample.  It doubles as a heartbeat,
+ * since a listener that's gone away isn't noticed until a write fails */
+#define SPEED_SAMPLE_MSEC 1000
+
+/* drop listeners that fall this far behind instead of buffering forever */
+#define MAX_LISTENER_BACKLOG ( 256 * 1024 )
+
+struct listener
+{
+    tr_rpc_server          * server;
+    struct evhttp_request  * req;
+};
+
+/* the listener list belongs to the libtransmission thread, so other
+ * threads see just this count.  it's only written from that thread */
+static void
+changeListenerCount( tr_rpc_server * server, int delta )
+{
+    tr_session * session = server->session;
+
+    assert( tr_amInEventThread( session ) );
+
+#ifdef __GNUC__
+    __atomic_store_n( &session->rpcListenerCount,
+                      session->rpcListenerCount + delta, __ATOMIC_RELEASE );
+#else
+    session->rpcListenerCount += delta;
+#endif
+}
+
+static void
+onListenerClosed( struct evhttp_connection * evcon UNUSED,
+                  void                     * vlistener )
+{
+    struct listener * l = vlistener;
+    tr_rpc_server * server = l->server;
+
+    dbgmsg( "event listener %s left", l->req->remote_host );
+    tr_list_remove_data( &server->listeners, l );
+    changeListenerCount( server, -1 );
+    tr_free( l );
+
+    if( server->listeners == NULL )
+        tr_timerFree( &server->speedTimer );
+}
+
+static int
+onSpeedTimer( void * vserver )
+{
+    tr_rpc_server * server = vserver;
+
+    tr_rpc_publish_speed( server->session );
+    return TRUE;
+}
+
+static void
+handle_events( struct evhttp_request * req,
+               struct tr_rpc_server  * server )
+{
+    struct listener * l = tr_new( struct listener, 1 );
+
+    l->server = server;
+    l->req = req;
+    tr_list_append( &server->listeners, l );
+    changeListenerCount( server, +1 );
+    evhttp_connection_set_closecb( req->evcon, onListenerClosed, l );
+    dbgmsg( "event listener %s joined", req->remote_host );
+
+    /* the request is never finished; each event is sent as a chunk */
+    evhttp_add_header( req->output_headers, "Content-Type", "text/event-stream" );
+    evhttp_add_header( req->output_headers, "Cache-Control", "no-cache" );
+    evhttp_send_reply_start( req, HTTP_OK, "OK" );
+
+    if( server->speedTimer == NULL )
+        server->speedTimer = tr_timerNew( server->session, onSpeedTimer,
+                                          server, SPEED_SAMPLE_MSEC );
+}
+
+tr_bool
+tr_rpcHasListeners( const tr_session * session )
+{
+#ifdef __GNUC__
+    return __atomic_load_n( &session->rpcListenerCount, __ATOMIC_ACQUIRE ) > 0;
+#else
+    return session->rpcListenerCount > 0;
+#endif
+}
+
+void
+tr_rpcPublishEvent( tr_rpc_server * server,
+                    const void    * event,
+                    size_t          len )
+{
+    tr_list * l;
+    tr_list * next;
+    struct evbuffer * buf = tr_getBuffer( );
+
+    assert( tr_amInEventThread( server->session ) );
+
+    for( l=server->listeners; l!=NULL; l=next )
+    {
+        struct listener * listener = l->data;
+        struct evhttp_connection * evcon = listener->req->evcon;
+
+        /* freeing the connection removes the listener from the list */
+        next = l->next;
+
+        if( EVBUFFER_LENGTH( evcon->output_buffer ) > MAX_LISTENER_BACKLOG )
+        {
+            tr_ninf( MY_NAME, _( "Dropping event listener %s; it's not keeping up" ),
+                     listener->req->remote_host );
+            evhttp_connection_free( evcon );
+        }
+        else
+        {
+            evbuffer_add( buf, event, len );
+            evhttp_send_reply_chunk( listener->req, buf );
+        }
     }
 
+    tr_releaseBuffer( buf );
 }
 
+/***
+****
+***/
+
 static tr_bool
 isAddressAllowed( const tr_rpc_server * server,
                   const char *          address )
@@ -502,6 +665,10 @@ handle_request( struct evhttp_request * req,
         {
             handle_rpc( req, server );
         }
+        else if( !strcmp( req->uri, "/transmission/events" ) )
+        {
+            handle_events( req, server );
+        }
         else if( !strncmp( req->uri, "/transmission/upload", 20 ) )
         {
             handle_upload( req, server );
@@ -534,6 +701,7 @@ stopServer( tr_rpc_server * server )
 {
     if( server->httpd )
     {
+        /* this closes the listeners' connections too */
         evhttp_free( server->httpd );
         server->httpd = NULL;
     }
@@ -706,11 +874,9 @@ closeServer( void * vserver )
     tr_rpc_server * s = vserver;
 
     stopServer( s );
+    tr_timerFree( &s->speedTimer );
     while(( tmp = tr_list_pop_front( &s->whitelist )))
         tr_free( tmp );
-#ifdef HAVE_ZLIB
-    deflateEnd( &s->stream );
-#endif
     tr_free( s->whitelistStr );
     tr_free( s->username );
     tr_free( s->password );
@@ -764,13 +930,6 @@ tr_rpcInit( tr_session  * session,
     assert( found );
     s->password = tr_strdup( str );
 
-#ifdef HAVE_ZLIB
-    s->stream.zalloc = (alloc_func) Z_NULL;
-    s->stream.zfree = (free_func) Z_NULL;
-    s->stream.opaque = (voidpf) Z_NULL;
-    deflateInit( &s->stream, Z_BEST_COMPRESSION );
-#endif
-
     if( s->isEnabled )
     {
         tr_ninf( MY_NAME, _( "Serving RPC and Web requests on port %d" ), (int) s->port );
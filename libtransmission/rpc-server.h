@@ -63,5 +63,19 @@ void            tr_rpcSetPasswordEnabled( tr_rpc_server * server,
 
 tr_bool         tr_rpcIsPasswordEnabled( const tr_rpc_server * session );
 
+/**
+ * @brief true if anyone's watching the /transmission/events stream.
+ * Unlike the rest of this API, it's safe to call from any thread
+ */
+tr_bool         tr_rpcHasListeners( const tr_session * session );
+
+/**
+ * @brief sends a server-sent event to everyone watching the event stream.
+ * Must be called from the libtransmission thread; see tr_rpc_publish_event()
+ */
+void            tr_rpcPublishEvent( tr_rpc_server * server,
+                                    const void    * event,
+                                    size_t          len );
+
 
 #endif
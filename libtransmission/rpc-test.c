@@ -1,11 +1,34 @@
 #include <stdio.h> /* fprintf */
+#include <stdlib.h> /* mkdtemp */
 #include <string.h> /* strcmp */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h> /* struct timeval */
+#include <netinet/in.h>
+#include <dirent.h>
+#include <unistd.h> /* rmdir */
+
+#include <event.h> /* evbuffer */
+
 #include "transmission.h"
 #include "bencode.h"
+#include "json.h"
 #include "rpcimpl.h"
+#include "rpc-server.h"
+#include "session.h"
+#include "torrent.h"
 #include "utils.h"
 
 #undef VERBOSE
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+ #define VERBOSE
+ #define TORRENT_COUNT 15000
+#else
+ #define TORRENT_COUNT 2000
+#endif
 
 static int test = 0;
 
@@ -81,6 +104,735 @@ test_list( void )
     return 0;
 }
 
+/***
+****
+***/
+
+static void
+removeTree( const char * path )
+{
+    DIR * odir = opendir( path );
+
+    if( odir != NULL )
+    {
+        struct dirent * d;
+        while(( d = readdir( odir ))) {
+            if( strcmp( d->d_name, "." ) && strcmp( d->d_name, ".." ) ) {
+                char * child = tr_buildPath( path, d->d_name, NULL );
+                removeTree( child );
+                tr_free( child );
+            }
+        }
+        closedir( odir );
+        rmdir( path );
+    }
+    else
+    {
+        remove( path );
+    }
+}
+
+/* a one-piece torrent whose name makes its info hash unique */
+static tr_torrent*
+addTorrent( tr_session * session, int i )
+{
+    int len;
+    char * metainfo;
+    char name[32];
+    uint8_t pieces[SHA_DIGEST_LENGTH];
+    tr_benc top, * info;
+    tr_torrent * tor;
+    tr_ctor * ctor = tr_ctorNew( session );
+
+    memset( pieces, 0, sizeof( pieces ) );
+    tr_snprintf( name, sizeof( name ), "torrent-%d", i );
+
+    tr_bencInitDict( &top, 2 );
+    tr_bencDictAddStr( &top, "announce", "http://127.0.0.1:1/announce" );
+    info = tr_bencDictAddDict( &top, "info", 4 );
+    tr_bencDictAddInt( info, "length", 1 );
+    tr_bencDictAddStr( info, "name", name );
+    tr_bencDictAddInt( info, "piece length", 16384 );
+    tr_bencDictAddRaw( info, "pieces", pieces, sizeof( pieces ) );
+    metainfo = tr_bencSave( &top, &len );
+
+    tr_ctorSetMetainfo( ctor, (const uint8_t*)metainfo, len );
+    tr_ctorSetPaused( ctor, TR_FORCE, TRUE );
+    tor = tr_torrentNew( session, ctor, NULL );
+
+    tr_ctorFree( ctor );
+    tr_free( metainfo );
+    tr_bencFree( &top );
+    return tor;
+}
+
+static int
+checkLookups( tr_session * session, tr_torrent ** torrents, tr_bool * isRemoved )
+{
+    int i;
+
+    for( i=0; i<TORRENT_COUNT; ++i )
+    {
+        tr_torrent * tor = torrents[i];
+        tr_torrent * expected = isRemoved[i] ? NULL : tor;
+
+        check( tr_torrentFindFromId( session, i + 1 ) == expected );
+
+        if( expected ) {
+            check( tr_torrentFindFromHash( session, tor->info.hash ) == expected );
+            check( tr_torrentFindFromHashString( session, tor->info.hashString ) == expected );
+            check( tr_torrentFindFromObfuscatedHash( session, tor->obfuscatedHash ) == expected );
+        }
+    }
+
+    check( tr_torrentFindFromId( session, 0 ) == NULL );
+    check( tr_torrentFindFromHashString( session, "not a hash" ) == NULL );
+
+    return 0;
+}
+
+static char * response = NULL;
+
+static void
+onResponse( tr_session  * session UNUSED,
+            const char  * json,
+            size_t        len,
+            void        * user_data UNUSED )
+{
+    response = tr_strndup( json, len );
+}
+
+/* the fields a client would poll for to fill in its torrent list */
+#define POLL_FIELDS "\"id\", \"name\", \"status\", \"error\", \"errorString\", " \
+                    "\"rateDownload\", \"rateUpload\", \"leftUntilDone\", \"sizeWhenDone\", " \
+                    "\"eta\", \"uploadRatio\", \"peersConnected\", \"recheckProgress\""
+
+/* poll with the given cursor, returning the response's size */
+static size_t
+pollTorrents( tr_session * session, int64_t since, tr_benc * setme, uint64_t * setmeMsec )
+{
+    size_t len;
+    uint64_t start;
+    char request[512];
+
+    tr_snprintf( request, sizeof( request ),
+                 "{ \"method\": \"torrent-get\", \"arguments\": { \"fields\": [ %s ], \"since\": %"PRId64" } }",
+                 POLL_FIELDS, since );
+    start = tr_date( );
+    tr_rpc_request_exec_json( session, request, strlen( request ), onResponse, NULL );
+    *setmeMsec = tr_date( ) - start;
+
+    len = strlen( response );
+    if( tr_jsonParse( response, len, setme, NULL ) )
+        tr_bencInitDict( setme, 0 );
+    tr_free( response );
+    response = NULL;
+    return len;
+}
+
+static tr_bool
+listHasInt( tr_benc * list, int64_t i )
+{
+    size_t j;
+    int64_t val;
+
+    for( j=0; j<tr_bencListSize( list ); ++j ) {
+        tr_benc * child = tr_bencListChild( list, j );
+        if( tr_bencDictFindInt( child, "id", &val ) || tr_bencGetInt( child, &val ) )
+            if( val == i )
+                return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int
+test_since( tr_session * session, tr_torrent ** torrents, tr_bool * isRemoved, int64_t since )
+{
+    int i, n;
+    size_t fullLen, deltaLen;
+    uint64_t fullMsec, deltaMsec;
+    int64_t cursor, id, isFull;
+    tr_benc top, * args, * list, * removed;
+    const int touchCount = 10;
+
+    for( i=n=0; i<TORRENT_COUNT; ++i )
+        n += isRemoved[i];
+
+    /* everything removed after `since' is listed, and nothing else is.
+     * if the session's forgotten some of them, it's a full refresh instead */
+    pollTorrents( session, since, &top, &deltaMsec );
+    check( tr_bencDictFindDict( &top, "arguments", &args ) );
+    check( tr_bencDictFindList( args, "removed", &removed ) );
+    check( tr_bencDictFindList( args, "torrents", &list ) );
+    check( tr_bencDictFindInt( args, "cursor", &cursor ) );
+    check( tr_bencDictFindInt( args, "full-refresh", &isFull ) );
+    check( cursor > since );
+    check( isFull == ( n > TR_MAX_REMOVED_TORRENTS ) );
+    for( i=0; i<TORRENT_COUNT; ++i ) {
+        check( listHasInt( removed, i + 1 ) == ( isRemoved[i] && !isFull ) );
+        check( !isRemoved[i] || !listHasInt( list, i + 1 ) );
+        check( isRemoved[i] || !isFull || listHasInt( list, i + 1 ) );
+    }
+    check( (int)tr_bencListSize( removed ) == ( isFull ? 0 : n ) );
+    tr_bencFree( &top );
+
+    /* change a few torrents */
+    for( i=0; i<touchCount; ++i ) {
+        tr_torrent * tor = torrents[3*i + 1];
+        tr_torrentSetPeerLimit( tor, tr_torrentGetPeerLimit( tor ) + 1 );
+    }
+
+    /* a full listing, for comparison */
+    fullLen = pollTorrents( session, 0, &top, &fullMsec );
+    check( tr_bencDictFindDict( &top, "arguments", &args ) );
+    check( tr_bencDictFindList( args, "torrents", &list ) );
+    check( (int)tr_bencListSize( list ) == tr_sessionCountTorrents( session ) );
+    tr_bencFree( &top );
+
+    /* only the torrents changed since the cursor are sent.
+     * others may have heard back from their tracker meanwhile */
+    deltaLen = pollTorrents( session, cursor, &top, &deltaMsec );
+    check( tr_bencDictFindDict( &top, "arguments", &args ) );
+    check( tr_bencDictFindList( args, "torrents", &list ) );
+    check( tr_bencDictFindList( args, "removed", &removed ) );
+    check( tr_bencListSize( removed ) == 0 );
+    check( tr_bencDictFindInt( args, "full-refresh", &isFull ) );
+    check( !isFull );
+    for( i=0; i<touchCount; ++i )
+        check( listHasInt( list, 3*i + 2 ) );
+    n = tr_bencListSize( list );
+    check( n < tr_sessionCountTorrents( session ) );
+    for( i=0; i<n; ++i ) {
+        check( tr_bencDictFindInt( tr_bencListChild( list, i ), "id", &id ) );
+        check( torrents[id - 1]->changeGeneration > cursor );
+    }
+    tr_bencFree( &top );
+
+    fprintf( stderr, "polling %d torrents: full %zu bytes in %"PRIu64" ms; "
+                     "%d changed: %zu bytes in %"PRIu64" ms\n",
+             tr_sessionCountTorrents( session ), fullLen, fullMsec,
+             n, deltaLen, deltaMsec );
+
+    return 0;
+}
+
+static size_t chunkMax = 0;
+static size_t chunkTotal = 0;
+static int chunkCount = 0;
+static tr_bool chunksDone = FALSE;
+
+static void
+onChunk( tr_session  * session UNUSED,
+         const void  * chunk UNUSED,
+         size_t        len,
+         tr_bool       isDone,
+         void        * user_data UNUSED )
+{
+    chunkMax = MAX( chunkMax, len );
+    chunkTotal += len;
+    ++chunkCount;
+    chunksDone = isDone;
+}
+
+/* a big response is handed over in small pieces */
+static int
+test_chunked( tr_session * session )
+{
+    uint64_t start;
+    size_t wholeLen;
+    const char * request = "{ \"method\": \"torrent-get\", \"arguments\": { \"fields\": [ " POLL_FIELDS " ] } }";
+
+    start = tr_date( );
+    tr_rpc_request_exec_json( session, request, strlen( request ), onResponse, NULL );
+    check( response != NULL );
+    wholeLen = strlen( response );
+    tr_free( response );
+    response = NULL;
+    fprintf( stderr, "torrent-get of %d torrents, whole: %"PRIu64" ms\n",
+             tr_sessionCountTorrents( session ), tr_date( ) - start );
+
+    start = tr_date( );
+    tr_rpc_request_exec_json_chunked( session, request, strlen( request ), onChunk, NULL );
+    fprintf( stderr, "torrent-get of %d torrents, chunked: %"PRIu64" ms; "
+                     "%zu bytes in %d chunks of at most %zu bytes\n",
+             tr_sessionCountTorrents( session ), tr_date( ) - start,
+             chunkTotal, chunkCount, chunkMax );
+
+    check( chunksDone );
+    check( chunkTotal == wholeLen );
+    check( chunkCount > 1 );
+    check( chunkMax < 64 * 1024 );
+
+    return 0;
+}
+
+/* cursors from an older session and from a newer one get a full refresh.
+ * the newer one is far enough ahead that this session's own changes,
+ * like tracker responses arriving meanwhile, can't catch up to it */
+static int
+test_stale_cursor( tr_session * session )
+{
+    int i;
+    int64_t isFull;
+    uint64_t msec;
+    tr_benc top, * args, * list, * removed;
+    const int64_t cursors[] = { 1, session->torrentChangeGeneration + ( 1 << 20 ) };
+
+    for( i=0; i<2; ++i ) {
+        pollTorrents( session, cursors[i], &top, &msec );
+        check( tr_bencDictFindDict( &top, "arguments", &args ) );
+        check( tr_bencDictFindList( args, "removed", &removed ) );
+        check( tr_bencDictFindList( args, "torrents", &list ) );
+        check( tr_bencDictFindInt( args, "full-refresh", &isFull ) );
+        check( isFull );
+        check( tr_bencListSize( removed ) == 0 );
+        check( (int)tr_bencListSize( list ) == tr_sessionCountTorrents( session ) );
+        tr_bencFree( &top );
+    }
+
+    return 0;
+}
+
+static int
+test_torrent_get( void )
+{
+    int i, n, err;
+    int64_t id, cursor, isFull;
+    uint64_t start;
+    char dir[] = "/tmp/transmission-rpc-test-XXXXXX";
+    tr_benc settings, top, * args, * list;
+    tr_session * session;
+    struct evbuffer * request;
+    tr_torrent ** torrents = tr_new0( tr_torrent*, TORRENT_COUNT );
+    tr_bool * isRemoved = tr_new0( tr_bool, TORRENT_COUNT );
+
+    if( mkdtemp( dir ) == NULL )
+        return 1;
+
+    tr_bencInitDict( &settings, 0 );
+    tr_sessionGetDefaultSettings( &settings );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PEER_PORT_RANDOM_ENABLED, 1 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PORT_FORWARDING, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_RPC_ENABLED, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_MSGLEVEL, 0 );
+    session = tr_sessionInit( "rpc-test", dir, FALSE, &settings );
+
+    start = tr_date( );
+    for( i=0; i<TORRENT_COUNT; ++i ) {
+        torrents[i] = addTorrent( session, i );
+        check( torrents[i] != NULL );
+        check( tr_torrentId( torrents[i] ) == i + 1 );
+    }
+    fprintf( stderr, "added %d torrents: %"PRIu64" ms\n", TORRENT_COUNT, tr_date( ) - start );
+    if(( err = checkLookups( session, torrents, isRemoved )))
+        return err;
+
+    /* ask for every torrent by id */
+    request = evbuffer_new( );
+    evbuffer_add_printf( request, "{ \"method\": \"torrent-get\", \"arguments\": { \"fields\": [ \"id\" ], \"ids\": [ " );
+    for( i=TORRENT_COUNT; i>0; --i )
+        evbuffer_add_printf( request, "%d%s", i, ( i > 1 ? ", " : "" ) );
+    evbuffer_add_printf( request, " ] } }" );
+    start = tr_date( );
+    tr_rpc_request_exec_json( session, EVBUFFER_DATA( request ), EVBUFFER_LENGTH( request ), onResponse, NULL );
+    fprintf( stderr, "torrent-get with %d ids: %"PRIu64" ms\n", TORRENT_COUNT, tr_date( ) - start );
+    evbuffer_free( request );
+
+    check( response != NULL );
+    check( !tr_jsonParse( response, strlen( response ), &top, NULL ) );
+    check( tr_bencDictFindDict( &top, "arguments", &args ) );
+    check( tr_bencDictFindList( args, "torrents", &list ) );
+    check( tr_bencListSize( list ) == TORRENT_COUNT );
+    for( i=0; i<TORRENT_COUNT; ++i ) {
+        check( tr_bencDictFindInt( tr_bencListChild( list, i ), "id", &id ) );
+        check( id == TORRENT_COUNT - i );
+    }
+    tr_bencFree( &top );
+    tr_free( response );
+
+    /* start polling */
+    pollTorrents( session, 0, &top, &start );
+    check( tr_bencDictFindDict( &top, "arguments", &args ) );
+    check( tr_bencDictFindInt( args, "cursor", &cursor ) );
+    check( tr_bencDictFindInt( args, "full-refresh", &isFull ) );
+    check( isFull );
+    check( tr_bencDictFindList( args, "torrents", &list ) );
+    check( tr_bencListSize( list ) == TORRENT_COUNT );
+    tr_bencFree( &top );
+
+    /* remove every third torrent */
+    for( i=0; i<TORRENT_COUNT; i+=3 ) {
+        tr_torrentRemove( torrents[i] );
+        isRemoved[i] = TRUE;
+    }
+    while( tr_sessionCountTorrents( session ) > TORRENT_COUNT - ( TORRENT_COUNT + 2 ) / 3 )
+        tr_wait( 10 );
+    if(( err = checkLookups( session, torrents, isRemoved )))
+        return err;
+    if(( err = test_since( session, torrents, isRemoved, cursor )))
+        return err;
+    if(( err = test_chunked( session )))
+        return err;
+    if(( err = test_stale_cursor( session )))
+        return err;
+
+    /* remove enough more, from the end, to overflow the removed torrents log */
+    for( i=n=0; i<TORRENT_COUNT; ++i )
+        n += isRemoved[i];
+    for( i=TORRENT_COUNT-1; n<=TR_MAX_REMOVED_TORRENTS; --i ) {
+        if( !isRemoved[i] ) {
+            tr_torrentRemove( torrents[i] );
+            isRemoved[i] = TRUE;
+            ++n;
+        }
+    }
+    while( tr_sessionCountTorrents( session ) > TORRENT_COUNT - n )
+        tr_wait( 10 );
+    if(( err = test_since( session, torrents, isRemoved, cursor )))
+        return err;
+
+    tr_sessionClose( session );
+    tr_bencFree( &settings );
+    removeTree( dir );
+    tr_free( isRemoved );
+    tr_free( torrents );
+    return 0;
+}
+
+/***
+****  Batches, and the HTTP server
+***/
+
+static int64_t
+getTag( tr_benc * response )
+{
+    int64_t tag = -1;
+    tr_bencDictFindInt( response, "tag", &tag );
+    return tag;
+}
+
+static tr_bool
+isSuccess( tr_benc * response )
+{
+    const char * result;
+    return tr_bencDictFindStr( response, "result", &result )
+        && !strcmp( result, "success" );
+}
+
+static int
+test_batch( tr_session * session )
+{
+    tr_benc top;
+    const char * batch = "[ { \"method\": \"session-get\", \"tag\": 1 },"
+                         "  { \"method\": \"no-such-method\", \"tag\": 2 },"
+                         "  { \"method\": \"torrent-add\", \"arguments\": { \"filename\": \"/no/such/file\" }, \"tag\": 3 },"
+                         "  { \"method\": \"torrent-get\", \"arguments\": { \"fields\": [ \"id\" ] }, \"tag\": 4 } ]";
+
+    /* the responses come back in order, including the one
+     * from torrent-add, which doesn't answer immediately */
+    tr_rpc_request_exec_json( session, batch, -1, onResponse, NULL );
+    check( response != NULL );
+    check( !tr_jsonParse( response, strlen( response ), &top, NULL ) );
+    check( tr_bencListSize( &top ) == 4 );
+    check( getTag( tr_bencListChild( &top, 0 ) ) == 1 );
+    check( isSuccess( tr_bencListChild( &top, 0 ) ) );
+    check( getTag( tr_bencListChild( &top, 1 ) ) == 2 );
+    check( !isSuccess( tr_bencListChild( &top, 1 ) ) );
+    check( getTag( tr_bencListChild( &top, 2 ) ) == 3 );
+    check( !isSuccess( tr_bencListChild( &top, 2 ) ) );
+    check( getTag( tr_bencListChild( &top, 3 ) ) == 4 );
+    check( isSuccess( tr_bencListChild( &top, 3 ) ) );
+    tr_bencFree( &top );
+    tr_free( response );
+    response = NULL;
+
+    tr_rpc_request_exec_json( session, "[]", -1, onResponse, NULL );
+    check( response != NULL );
+    check( !strcmp( response, "[]" ) );
+    tr_free( response );
+    response = NULL;
+
+    return 0;
+}
+
+static int
+connectToServer( int port )
+{
+    int i;
+    int fd = -1;
+    struct sockaddr_in sin;
+    struct timeval tv;
+
+    memset( &sin, 0, sizeof( sin ) );
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons( port );
+    sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    /* the server's started in the event thread, so it may not be up yet */
+    for( i=0; i<100 && fd<0; ++i ) {
+        fd = socket( AF_INET, SOCK_STREAM, 0 );
+        if( connect( fd, (struct sockaddr*)&sin, sizeof( sin ) ) ) {
+            close( fd );
+            fd = -1;
+            tr_wait( 50 );
+        }
+    }
+
+    /* don't wait forever on a response that isn't coming */
+    tv.tv_sec = 5;
+    tv.tv_usec = 0;
+    if( fd >= 0 )
+        setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+
+    return fd;
+}
+
+static void
+writeRequest( int fd, const char * json, tr_bool keepAlive )
+{
+    char * req = tr_strdup_printf( "POST /transmission/rpc HTTP/1.1\r\n"
+                                   "Host: localhost\r\n"
+                                   "%s"
+                                   "Content-Length: %d\r\n"
+                                   "\r\n"
+                                   "%s",
+                                   keepAlive ? "" : "Connection: close\r\n",
+                                   (int)strlen( json ), json );
+    const ssize_t len = strlen( req );
+
+    if( write( fd, req, len ) != len )
+        fprintf( stderr, "couldn't write the request\n" );
+    tr_free( req );
+}
+
+/* read one response off the socket, leaving anything after it in `in' */
+static char*
+readResponse( int fd, struct evbuffer * in )
+{
+    for( ;; )
+    {
+        const u_char * end = evbuffer_find( in, (const u_char*)"\r\n\r\n", 4 );
+
+        if( end != NULL )
+        {
+            const size_t headerLen = end + 4 - EVBUFFER_DATA( in );
+            char * headers = tr_strndup( EVBUFFER_DATA( in ), headerLen );
+            const char * pch = strstr( headers, "Content-Length: " );
+            const size_t bodyLen = pch ? strtoul( pch + 16, NULL, 10 ) : 0;
+            const tr_bool isOk = !strncmp( headers, "HTTP/1.1 200", 12 );
+            tr_free( headers );
+
+            if( EVBUFFER_LENGTH( in ) >= headerLen + bodyLen )
+            {
+                char * body = isOk ? tr_strndup( EVBUFFER_DATA( in ) + headerLen, bodyLen ) : NULL;
+                evbuffer_drain( in, headerLen + bodyLen );
+                return body;
+            }
+        }
+
+        if( evbuffer_read( in, fd, -1 ) <= 0 )
+            return NULL;
+    }
+}
+
+static int
+checkResponse( int fd, struct evbuffer * in, tr_bool isBatch, int64_t firstTag )
+{
+    tr_benc top;
+    char * body = readResponse( fd, in );
+
+    check( body != NULL );
+    check( !tr_jsonParse( body, strlen( body ), &top, NULL ) );
+    if( !isBatch ) {
+        check( getTag( &top ) == firstTag );
+    } else {
+        check( tr_bencListSize( &top ) == 2 );
+        check( getTag( tr_bencListChild( &top, 0 ) ) == firstTag );
+        check( getTag( tr_bencListChild( &top, 1 ) ) == firstTag + 1 );
+    }
+    tr_bencFree( &top );
+    tr_free( body );
+    return 0;
+}
+
+static int
+test_http( int port )
+{
+    int i;
+    int fd;
+    int err;
+    uint64_t start;
+    struct evbuffer * in = evbuffer_new( );
+    const char * get = "{ \"method\": \"session-get\", \"tag\": 1 }";
+    const char * batch = "[ { \"method\": \"session-stats\", \"tag\": 2 },"
+                         "  { \"method\": \"session-get\", \"tag\": 3 } ]";
+    const int n = 200;
+
+    fd = connectToServer( port );
+    check( fd >= 0 );
+
+    /* two requests pipelined in one write are both answered, in order */
+    writeRequest( fd, get, TRUE );
+    writeRequest( fd, batch, TRUE );
+    if(( err = checkResponse( fd, in, FALSE, 1 )))
+        return err;
+    if(( err = checkResponse( fd, in, TRUE, 2 )))
+        return err;
+
+    /* and the connection's still open for more */
+    start = tr_date( );
+    for( i=0; i<n; ++i ) {
+        writeRequest( fd, get, TRUE );
+        if(( err = checkResponse( fd, in, FALSE, 1 )))
+            return err;
+    }
+    fprintf( stderr, "%d requests on one connection: %"PRIu64" ms\n", n, tr_date( ) - start );
+    close( fd );
+
+    start = tr_date( );
+    for( i=0; i<n; ++i ) {
+        fd = connectToServer( port );
+        check( fd >= 0 );
+        writeRequest( fd, get, FALSE );
+        if(( err = checkResponse( fd, in, FALSE, 1 )))
+            return err;
+        close( fd );
+    }
+    fprintf( stderr, "%d requests on their own connections: %"PRIu64" ms\n", n, tr_date( ) - start );
+
+    evbuffer_free( in );
+    return 0;
+}
+
+/* read the event stream until `needle' turns up in it */
+static tr_bool
+waitForEvent( int fd, struct evbuffer * in, const char * needle )
+{
+    while( !evbuffer_find( in, (const u_char*)needle, strlen( needle ) ) )
+        if( evbuffer_read( in, fd, -1 ) <= 0 )
+            return FALSE;
+
+    return TRUE;
+}
+
+static int
+openEventStream( int port, struct evbuffer * in )
+{
+    int fd = connectToServer( port );
+    const char * req = "GET /transmission/events HTTP/1.1\r\n"
+                       "Host: localhost\r\n"
+                       "\r\n";
+
+    if( fd >= 0 )
+        if( write( fd, req, strlen( req ) ) != (ssize_t)strlen( req ) )
+            fprintf( stderr, "couldn't write the request\n" );
+
+    if( !waitForEvent( fd, in, "\r\n\r\n" ) ) {
+        close( fd );
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+test_events( tr_session * session, int port )
+{
+    int i;
+    int fds[2];
+    char * json;
+    char needle[128];
+    struct evbuffer * ins[2];
+    tr_torrent * tor;
+    uint64_t start;
+
+    for( i=0; i<2; ++i ) {
+        ins[i] = evbuffer_new( );
+        fds[i] = openEventStream( port, ins[i] );
+        check( fds[i] >= 0 );
+        check( !strncmp( (const char*)EVBUFFER_DATA( ins[i] ), "HTTP/1.1 200", 12 ) );
+        check( evbuffer_find( ins[i], (const u_char*)"Content-Type: text/event-stream", 31 ) );
+        check( evbuffer_find( ins[i], (const u_char*)"Transfer-Encoding: chunked", 26 ) );
+    }
+
+    /* verification's pushed to everyone, from the verify thread */
+    tor = addTorrent( session, 1000 );
+    check( tor != NULL );
+    tr_torrentVerify( tor );
+    tr_snprintf( needle, sizeof( needle ),
+                 "event: verify-started\ndata: {\"id\":%d,\"hashString\":\"%s\"}\n\n",
+                 tr_torrentId( tor ), tor->info.hashString );
+    for( i=0; i<2; ++i )
+        check( waitForEvent( fds[i], ins[i], needle ) );
+    tr_snprintf( needle, sizeof( needle ), "event: verify-finished\ndata: {\"id\":%d,",
+                 tr_torrentId( tor ) );
+    for( i=0; i<2; ++i )
+        check( waitForEvent( fds[i], ins[i], needle ) );
+
+    /* so are the changes made through RPC */
+    json = tr_strdup_printf( "{ \"method\": \"torrent-start\", \"arguments\": { \"ids\": [ %d ] } }",
+                             tr_torrentId( tor ) );
+    tr_rpc_request_exec_json( session, json, strlen( json ), NULL, NULL );
+    tr_free( json );
+    tr_snprintf( needle, sizeof( needle ), "event: torrent-started\ndata: {\"id\":%d,",
+                 tr_torrentId( tor ) );
+    for( i=0; i<2; ++i )
+        check( waitForEvent( fds[i], ins[i], needle ) );
+
+    /* and a speed sample comes along every so often */
+    start = tr_date( );
+    for( i=0; i<2; ++i )
+        check( waitForEvent( fds[i], ins[i], "event: speed\ndata: {\"activeTorrentCount\":1," ) );
+    fprintf( stderr, "waited %"PRIu64" ms for a speed sample\n", tr_date( ) - start );
+
+    /* a listener that hangs up is noticed when the next event can't be sent */
+    close( fds[0] );
+    close( fds[1] );
+    for( i=0; i<100 && tr_rpcHasListeners( session ); ++i )
+        tr_wait( 100 );
+    check( !tr_rpcHasListeners( session ) );
+
+    tr_torrentRemove( tor );
+    evbuffer_free( ins[0] );
+    evbuffer_free( ins[1] );
+    return 0;
+}
+
+static int
+test_rpc_server( void )
+{
+    int err;
+    char dir[] = "/tmp/transmission-rpc-test-XXXXXX";
+    tr_benc settings;
+    tr_session * session;
+    const int port = 30000 + ( getpid( ) % 20000 );
+
+    if( mkdtemp( dir ) == NULL )
+        return 1;
+
+    tr_bencInitDict( &settings, 0 );
+    tr_sessionGetDefaultSettings( &settings );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PEER_PORT_RANDOM_ENABLED, 1 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PORT_FORWARDING, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_RPC_ENABLED, 1 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_RPC_PORT, port );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_MSGLEVEL, 0 );
+    session = tr_sessionInit( "rpc-test", dir, FALSE, &settings );
+
+    if(( err = test_batch( session )))
+        return err;
+    if(( err = test_http( port )))
+        return err;
+    if(( err = test_events( session, port )))
+        return err;
+
+    tr_sessionClose( session );
+    tr_bencFree( &settings );
+    removeTree( dir );
+    return 0;
+}
+
 int
 main( void )
 {
@@ -89,6 +841,12 @@ main( void )
     if( ( i = test_list( ) ) )
         return i;
 
+    if( ( i = test_torrent_get( ) ) )
+        return i;
+
+    if( ( i = test_rpc_server( ) ) )
+        return i;
+
     return 0;
 }
 
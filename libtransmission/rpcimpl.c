@@ -20,11 +20,17 @@
 
 #include "transmission.h"
 #include "bencode.h"
+#include "cache.h"
+#include "disk-pool.h" /* tr_diskPoolGetStats() */
+#include "fdlimit.h" /* tr_fdGetSyncStats() */
 #include "rpcimpl.h"
+#include "rpc-server.h"
 #include "json.h"
+#include "peer-msgs.h" /* tr_peerMsgsGetHaveStats() */
 #include "session.h"
 #include "stats.h"
 #include "torrent.h"
+#include "trevent.h" /* tr_timerGetStats() */
 #include "completion.h"
 #include "utils.h"
 #include "web.h"
@@ -51,6 +57,20 @@
 ****
 ***/
 
+static const char*
+getNotifyEventName( int type )
+{
+    switch( type )
+    {
+        case TR_RPC_TORRENT_ADDED:    return "torrent-added";
+        case TR_RPC_TORRENT_STARTED:  return "torrent-started";
+        case TR_RPC_TORRENT_STOPPED:  return "torrent-stopped";
+        case TR_RPC_TORRENT_REMOVING: return "torrent-removing";
+        case TR_RPC_TORRENT_CHANGED:  return "torrent-changed";
+        default:                      return "session-changed";
+    }
+}
+
 static tr_rpc_callback_status
 notify( tr_session * session,
         int          type,
@@ -58,6 +78,8 @@ notify( tr_session * session,
 {
     tr_rpc_callback_status status = 0;
 
+    tr_rpc_publish_event( session, getNotifyEventName( type ), tor, NULL );
+
     if( session->rpc_func )
         status = session->rpc_func( session, type, tor,
                                     session->rpc_func_user_data );
@@ -65,36 +87,202 @@ notify( tr_session * session,
     return status;
 }
 
+/***
+****  Events
+***/
+
+struct event_data
+{
+    tr_session       * session;
+    struct evbuffer  * text;
+};
+
+static void
+onEventChunk( struct evbuffer * buf, tr_bool isDone UNUSED, void * vtext )
+{
+    evbuffer_add( vtext, EVBUFFER_DATA( buf ), EVBUFFER_LENGTH( buf ) );
+}
+
+static void
+deliverEvent( void * vdata )
+{
+    struct event_data * data = vdata;
+    tr_rpc_server * server = data->session->rpcServer;
+
+    /* the server may have been closed since the event was queued */
+    if( server != NULL )
+        tr_rpcPublishEvent( server, EVBUFFER_DATA( data->text ),
+                                    EVBUFFER_LENGTH( data->text ) );
+
+    evbuffer_free( data->text );
+    tr_free( data );
+}
+
+void
+tr_rpc_publish_event( tr_session       * session,
+                      const char       * name,
+                      const tr_torrent * tor,
+                      const tr_benc    * args )
+{
+    size_t i;
+    const char * key;
+    const tr_benc * val;
+    tr_json_writer * w;
+    struct event_data * data;
+
+    assert( tr_isSession( session ) );
+
+    /* this can be called from the verify and hashing threads,
+     * so it only looks at the listener count.  deliverEvent()
+     * checks on the server itself in the libtransmission thread */
+    if( !tr_rpcHasListeners( session ) )
+        return;
+
+    data = tr_new( struct event_data, 1 );
+    data->session = session;
+    data->text = evbuffer_new( );
+
+    /* the JSON is written without whitespace, so it fits on one data line */
+    evbuffer_add_printf( data->text, "event: %s\ndata: ", name );
+    w = tr_jsonWriterNew( onEventChunk, data->text );
+    tr_jsonWriteDictBegin( w );
+    if( tor != NULL ) {
+        tr_jsonWriteStr( w, "id" );
+        tr_jsonWriteInt( w, tor->uniqueId );
+        tr_jsonWriteStr( w, "hashString" );
+        tr_jsonWriteStr( w, tor->info.hashString );
+    }
+    for( i=0; args && tr_bencDictChild( args, i, &key, &val ); ++i ) {
+        tr_jsonWriteStr( w, key );
+        tr_jsonWriteBenc( w, val );
+    }
+    tr_jsonWriteEnd( w );
+    tr_jsonWriterFree( w );
+    evbuffer_add( data->text, "\n\n", 2 );
+
+    tr_runInEventThread( session, deliverEvent, data );
+}
+
+void
+tr_rpc_publish_speed( tr_session * session )
+{
+    int running = 0;
+    tr_benc args;
+    tr_torrent * tor = NULL;
+
+    while(( tor = tr_torrentNext( session, tor )))
+        if( tor->isRunning )
+            ++running;
+
+    tr_bencInitDict( &args, 3 );
+    tr_bencDictAddInt( &args, "activeTorrentCount", running );
+    tr_bencDictAddInt( &args, "downloadSpeed", (int)( tr_sessionGetPieceSpeed( session, TR_DOWN ) * 1024 ) );
+    tr_bencDictAddInt( &args, "uploadSpeed", (int)( tr_sessionGetPieceSpeed( session, TR_UP ) * 1024 ) );
+    tr_rpc_publish_event( session, "speed", NULL, &args );
+    tr_bencFree( &args );
+}
+
 /***
 ****
 ***/
 
+/* Methods whose responses can get big, like torrentGet, can write
+ * part of their arguments straight into the response as it's sent
+ * instead of building it all in the args_out dict first */
+typedef void ( *streamer )( tr_session*, tr_benc*, tr_json_writer* );
+
+struct chunk_data
+{
+    tr_session                  * session;
+    tr_rpc_response_chunk_func    callback;
+    void                        * callback_user_data;
+};
+
+static void
+onResponseChunk( struct evbuffer * buf, tr_bool isDone, void * vdata )
+{
+    struct chunk_data * data = vdata;
+
+    (*data->callback)( data->session, EVBUFFER_DATA( buf ),
+                       EVBUFFER_LENGTH( buf ), isDone,
+                       data->callback_user_data );
+}
+
+/* send a response dict of "arguments", "result", and maybe "tag",
+ * letting streamFunc append to the arguments as they're written */
+static void
+sendResponse( tr_session                  * session,
+              const tr_benc               * response,
+              streamer                      streamFunc,
+              tr_benc                     * args_in,
+              tr_rpc_response_chunk_func    callback,
+              void                        * callback_user_data )
+{
+    struct chunk_data data;
+    tr_json_writer * w;
+
+    data.session = session;
+    data.callback = callback;
+    data.callback_user_data = callback_user_data;
+    w = tr_jsonWriterNew( onResponseChunk, &data );
+
+    if( streamFunc == NULL )
+    {
+        tr_jsonWriteBenc( w, response );
+    }
+    else
+    {
+        size_t i, j;
+        const char * key;
+        const tr_benc * val;
+
+        tr_jsonWriteDictBegin( w );
+        for( i=0; tr_bencDictChild( response, i, &key, &val ); ++i )
+        {
+            tr_jsonWriteStr( w, key );
+
+            if( strcmp( key, "arguments" ) )
+                tr_jsonWriteBenc( w, val );
+            else {
+                const char * argKey;
+                const tr_benc * argVal;
+                tr_jsonWriteDictBegin( w );
+                for( j=0; tr_bencDictChild( val, j, &argKey, &argVal ); ++j ) {
+                    tr_jsonWriteStr( w, argKey );
+                    tr_jsonWriteBenc( w, argVal );
+                }
+                (*streamFunc)( session, args_in, w );
+                tr_jsonWriteEnd( w );
+            }
+        }
+        tr_jsonWriteEnd( w );
+    }
+
+    tr_jsonWriterFree( w );
+}
+
 /* For functions that can't be immediately executed, like torrentAdd,
  * this is the callback data used to pass a response to the caller
  * when the task is complete */
 struct tr_rpc_idle_data
 {
-    tr_session            * session;
-    tr_benc               * response;
-    tr_benc               * args_out;
-    tr_rpc_response_func    callback;
-    void                  * callback_user_data;
+    tr_session                  * session;
+    tr_benc                     * response;
+    tr_benc                     * args_out;
+    tr_rpc_response_chunk_func    callback;
+    void                        * callback_user_data;
 };
 
 static void
 tr_idle_function_done( struct tr_rpc_idle_data * data, const char * result )
 {
-    struct evbuffer * buf = tr_getBuffer( );
-
     if( result == NULL )
         result = "success";
     tr_bencDictAddStr( data->response, "result", result );
 
-    tr_bencSaveAsJSON( data->response, buf );
-    (*data->callback)( data->session, (const char*)EVBUFFER_DATA(buf),
-                       EVBUFFER_LENGTH(buf), data->callback_user_data );
+    sendResponse( data->session, data->response, NULL, NULL,
+                  data->callback, data->callback_user_data );
 
-    tr_releaseBuffer( buf );
     tr_bencFree( data->response );
     tr_free( data->response );
     tr_free( data );
@@ -309,7 +497,7 @@ addPeers( const tr_torrent * tor,
 
     for( i = 0; i < peerCount; ++i )
     {
-        tr_benc *            d = tr_bencListAddDict( list, 14 );
+        tr_benc *            d = tr_bencListAddDict( list, 15 );
         const tr_peer_stat * peer = peers + i;
         tr_bencDictAddStr( d, "address", peer->addr );
         tr_bencDictAddStr( d, "clientName", peer->client );
@@ -323,6 +511,7 @@ addPeers( const tr_torrent * tor,
         tr_bencDictAddInt( d, "isUploadingTo", peer->isUploadingTo );
         tr_bencDictAddInt( d, "peerIsChoked", peer->peerIsChoked );
         tr_bencDictAddInt( d, "peerIsInterested", peer->peerIsInterested );
+        tr_bencDictAddInt( d, "pipelineDepth", peer->pipelineDepth );
         tr_bencDictAddInt( d, "port", peer->port );
         tr_bencDictAddDouble( d, "progress", peer->progress );
         tr_bencDictAddInt( d, "rateToClient",
@@ -350,6 +539,15 @@ addField( const tr_torrent * tor,
         tr_bencDictAddStr( d, key, st->announceResponse );
     else if( !strcmp( key, "announceURL" ) )
         tr_bencDictAddStr( d, key, st->announceURL );
+    else if( !strcmp( key, "availability" ) )
+    {
+        int i;
+        uint32_t histogram[TR_AVAILABILITY_BUCKETS];
+        const int n = tr_torrentAvailabilityHistogram( tor, histogram, TR_AVAILABILITY_BUCKETS );
+        tr_benc * list = tr_bencDictAddList( d, key, n );
+        for( i=0; i<n; ++i )
+            tr_bencListAddInt( list, histogram[i] );
+    }
     else if( !strcmp( key, "comment" ) )
         tr_bencDictAddStr( d, key, inf->comment ? inf->comment : "" );
     else if( !strcmp( key, "corruptEver" ) )
@@ -484,6 +682,8 @@ addField( const tr_torrent * tor,
         tr_bencDictAddDouble( d, key,
                              tr_getRatio( st->uploadedEver,
                                           st->downloadedEver ) );
+    else if( !strcmp( key, "wastedEver" ) )
+        tr_bencDictAddInt( d, key, st->wastedEver );
     else if( !strcmp( key, "wanted" ) )
     {
         tr_file_index_t i;
@@ -519,23 +719,77 @@ torrentGet( tr_session               * session,
             tr_benc                  * args_out,
             struct tr_rpc_idle_data  * idle_data )
 {
-    int           i, torrentCount;
-    tr_torrent ** torrents = getTorrents( session, args_in, &torrentCount );
-    tr_benc *     list = tr_bencDictAddList( args_out, "torrents", torrentCount );
+    int64_t       since;
     tr_benc *     fields;
     const char *  msg = NULL;
 
     assert( idle_data == NULL );
 
+    /* if the client gave us a cursor from an earlier response,
+     * tell it which torrents have been removed since then.
+     * if we can't, tell it to start over */
+    if( tr_bencDictFindInt( args_in, "since", &since ) )
+    {
+        int i, n = 0;
+        int * removed = NULL;
+        const tr_bool isFull = !tr_sessionIsCursorValid( session, since );
+        tr_benc * removedList;
+
+        if( !isFull )
+            removed = tr_sessionGetRemovedTorrents( session, since, &n );
+
+        removedList = tr_bencDictAddList( args_out, "removed", n );
+        for( i=0; i<n; ++i )
+            tr_bencListAddInt( removedList, removed[i] );
+        tr_bencDictAddInt( args_out, "cursor", session->torrentChangeGeneration );
+        tr_bencDictAddInt( args_out, "full-refresh", isFull );
+
+        tr_free( removed );
+    }
+
     if( !tr_bencDictFindList( args_in, "fields", &fields ) )
         msg = "no fields specified";
-    else for( i = 0; i < torrentCount; ++i )
-            addInfo( torrents[i], tr_bencListAdd( list ), fields );
 
-    tr_free( torrents );
     return msg;
 }
 
+/* the "torrents" list is written one torrent at a time,
+ * so the memory it takes doesn't grow with the number of torrents */
+static void
+torrentGetStream( tr_session     * session,
+                  tr_benc        * args_in,
+                  tr_json_writer * w )
+{
+    int           i, torrentCount;
+    int64_t       since;
+    tr_benc *     fields;
+    tr_torrent ** torrents = getTorrents( session, args_in, &torrentCount );
+    const tr_bool hasSince = tr_bencDictFindInt( args_in, "since", &since )
+                          && tr_sessionIsCursorValid( session, since );
+
+    tr_jsonWriteStr( w, "torrents" );
+    tr_jsonWriteListBegin( w );
+
+    if( tr_bencDictFindList( args_in, "fields", &fields ) )
+    {
+        for( i = 0; i < torrentCount; ++i )
+        {
+            tr_benc d;
+
+            /* only send the torrents that changed since the cursor */
+            if( hasSince && torrents[i]->changeGeneration <= since )
+                continue;
+
+            addInfo( torrents[i], &d, fields );
+            tr_jsonWriteBenc( w, &d );
+            tr_bencFree( &d );
+        }
+    }
+
+    tr_jsonWriteEnd( w );
+    tr_free( torrents );
+}
+
 /***
 ****
 ***/
@@ -897,6 +1151,12 @@ sessionStats( tr_session               * session,
     tr_benc * d;  
     tr_session_stats currentStats = { 0.0f, 0, 0, 0, 0, 0 }; 
     tr_session_stats cumulativeStats = { 0.0f, 0, 0, 0, 0, 0 }; 
+    tr_cache_stats cacheStats;
+    tr_timer_stats timerStats;
+    tr_sync_stats syncStats;
+    tr_have_stats haveStats;
+    tr_disk_stats diskStats[TR_DISK_MAX_DEVICES];
+    int i, j, diskCount;
     tr_torrent * tor = NULL;
 
     assert( idle_data == NULL );
@@ -909,6 +1169,11 @@ sessionStats( tr_session               * session,
 
     tr_sessionGetStats( session, &currentStats ); 
     tr_sessionGetCumulativeStats( session, &cumulativeStats ); 
+    tr_cacheGetStats( session->cache, &cacheStats );
+    tr_timerGetStats( session, &timerStats );
+    tr_fdGetSyncStats( &syncStats );
+    tr_peerMsgsGetHaveStats( &haveStats );
+    diskCount = tr_diskPoolGetStats( session->diskPool, diskStats, TR_DISK_MAX_DEVICES );
 
     tr_bencDictAddInt( args_out, "activeTorrentCount", running );
     tr_bencDictAddInt( args_out, "downloadSpeed", (int)( tr_sessionGetPieceSpeed( session, TR_DOWN ) * 1024 ) );
@@ -916,6 +1181,13 @@ sessionStats( tr_session               * session,
     tr_bencDictAddInt( args_out, "torrentCount", total );
     tr_bencDictAddInt( args_out, "uploadSpeed", (int)( tr_sessionGetPieceSpeed( session, TR_UP ) * 1024 ) );
 
+    d = tr_bencDictAddDict( args_out, "cache-stats", 5 );
+    tr_bencDictAddInt( d, "cachedBytes", cacheStats.cachedBytes );
+    tr_bencDictAddInt( d, "flushedBytes", cacheStats.flushedBytes );
+    tr_bencDictAddInt( d, "flushes", cacheStats.flushes );
+    tr_bencDictAddInt( d, "hits", cacheStats.hits );
+    tr_bencDictAddInt( d, "misses", cacheStats.misses );
+
     d = tr_bencDictAddDict( args_out, "cumulative-stats", 5 );  
     tr_bencDictAddInt( d, "downloadedBytes", cumulativeStats.downloadedBytes ); 
     tr_bencDictAddInt( d, "filesAdded", cumulativeStats.filesAdded ); 
@@ -930,6 +1202,43 @@ sessionStats( tr_session               * session,
     tr_bencDictAddInt( d, "sessionCount", currentStats.sessionCount ); 
     tr_bencDictAddInt( d, "uploadedBytes", currentStats.uploadedBytes ); 
 
+    d = tr_bencDictAddDict( args_out, "have-stats", 4 );
+    tr_bencDictAddInt( d, "batches", haveStats.batches );
+    tr_bencDictAddInt( d, "queued", haveStats.queued );
+    tr_bencDictAddInt( d, "sent", haveStats.sent );
+    tr_bencDictAddInt( d, "suppressed", haveStats.suppressed );
+
+    d = tr_bencDictAddDict( args_out, "sync-stats", 5 );
+    tr_bencDictAddInt( d, "droppedBytes", syncStats.droppedBytes );
+    tr_bencDictAddInt( d, "flushedBytes", syncStats.flushedBytes );
+    tr_bencDictAddInt( d, "syncs", syncStats.syncs );
+    tr_bencDictAddInt( d, "usec", syncStats.usec );
+    tr_bencDictAddInt( d, "writebacks", syncStats.writebacks );
+
+    d = tr_bencDictAddDict( args_out, "timer-stats", 6 );
+    tr_bencDictAddInt( d, "callbackUsec", timerStats.callbackUsec );
+    tr_bencDictAddInt( d, "fired", timerStats.fired );
+    tr_bencDictAddInt( d, "lateMsec", timerStats.lateMsec );
+    tr_bencDictAddInt( d, "maxLateMsec", timerStats.maxLateMsec );
+    tr_bencDictAddInt( d, "pendingCount", timerStats.pendingCount );
+    tr_bencDictAddInt( d, "wakeups", timerStats.wakeups );
+
+    d = tr_bencDictAddList( args_out, "disk-stats", diskCount );
+    for( i=0; i<diskCount; ++i )
+    {
+        const tr_disk_stats * st = &diskStats[i];
+        tr_benc * disk = tr_bencListAddDict( d, 6 );
+        tr_benc * latency;
+        tr_bencDictAddInt( disk, "completed", st->completed );
+        tr_bencDictAddStr( disk, "path", st->path );
+        tr_bencDictAddInt( disk, "queued", st->queued );
+        tr_bencDictAddInt( disk, "running", st->running );
+        tr_bencDictAddInt( disk, "stolen", st->stolen );
+        latency = tr_bencDictAddList( disk, "latency", TR_DISK_LATENCY_BUCKETS );
+        for( j=0; j<TR_DISK_LATENCY_BUCKETS; ++j )
+            tr_bencListAddInt( latency, st->latency[j] );
+    }
+
     return NULL;
 }
 
@@ -949,7 +1258,7 @@ sessionGet( tr_session               * session,
     tr_bencDictAddInt( d, "pex-allowed", tr_sessionIsPexEnabled( session ) );
     tr_bencDictAddInt( d, "port", tr_sessionGetPeerPort( session ) );
     tr_bencDictAddInt( d, "port-forwarding-enabled", tr_sessionIsPortForwardingEnabled( session ) );
-    tr_bencDictAddInt( d, "rpc-version", 4 );
+    tr_bencDictAddInt( d, "rpc-version", 6 );
     tr_bencDictAddInt( d, "rpc-version-minimum", 1 );
     tr_bencDictAddInt( d, "speed-limit-up", tr_sessionGetSpeedLimit( session, TR_UP ) );
     tr_bencDictAddInt( d, "speed-limit-up-enabled", tr_sessionIsSpeedLimitEnabled( session, TR_UP ) );
@@ -979,34 +1288,36 @@ static struct method
     const char *  name;
     tr_bool       immediate;
     handler       func;
+    streamer      streamFunc;
 }
 methods[] =
 {
-    { "session-get",    TRUE,  sessionGet          },
-    { "session-set",    TRUE,  sessionSet          },
-    { "session-stats",  TRUE,  sessionStats        },
-    { "torrent-add",    FALSE, torrentAdd          },
-    { "torrent-get",    TRUE,  torrentGet          },
-    { "torrent-remove", TRUE,  torrentRemove       },
-    { "torrent-set",    TRUE,  torrentSet          },
-    { "torrent-start",  TRUE,  torrentStart        },
-    { "torrent-stop",   TRUE,  torrentStop         },
-    { "torrent-verify", TRUE,  torrentVerify       }
+    { "session-get",    TRUE,  sessionGet,    NULL             },
+    { "session-set",    TRUE,  sessionSet,    NULL             },
+    { "session-stats",  TRUE,  sessionStats,  NULL             },
+    { "torrent-add",    FALSE, torrentAdd,    NULL             },
+    { "torrent-get",    TRUE,  torrentGet,    torrentGetStream },
+    { "torrent-remove", TRUE,  torrentRemove, NULL             },
+    { "torrent-set",    TRUE,  torrentSet,    NULL             },
+    { "torrent-start",  TRUE,  torrentStart,  NULL             },
+    { "torrent-stop",   TRUE,  torrentStop,   NULL             },
+    { "torrent-verify", TRUE,  torrentVerify, NULL             }
 };
 
 static void
 noop_response_callback( tr_session * session UNUSED,
-                        const char * response UNUSED,
-                        size_t       response_len UNUSED,
+                        const void * chunk UNUSED,
+                        size_t       chunk_len UNUSED,
+                        tr_bool      isDone UNUSED,
                         void       * user_data UNUSED )
 {
 }
 
 static void
-request_exec( tr_session             * session,
-              tr_benc                * request,
-              tr_rpc_response_func     callback,
-              void                   * callback_user_data )
+request_exec( tr_session                  * session,
+              tr_benc                     * request,
+              tr_rpc_response_chunk_func    callback,
+              void                        * callback_user_data )
 {
     int i;
     const char * str;
@@ -1033,18 +1344,15 @@ request_exec( tr_session             * session,
     {
         int64_t tag;
         tr_benc response;
-        struct evbuffer * buf = tr_getBuffer( );
 
         tr_bencInitDict( &response, 3 );
         tr_bencDictAddDict( &response, "arguments", 0 );
         tr_bencDictAddStr( &response, "result", result );
         if( tr_bencDictFindInt( request, "tag", &tag ) )
             tr_bencDictAddInt( &response, "tag", tag );
-        tr_bencSaveAsJSON( &response, buf );
-        (*callback)( session, (const char*)EVBUFFER_DATA(buf),
-                     EVBUFFER_LENGTH( buf ), callback_user_data );
+        sendResponse( session, &response, NULL, NULL,
+                      callback, callback_user_data );
 
-        tr_releaseBuffer( buf );
         tr_bencFree( &response );
     }
     else if( methods[i].immediate )
@@ -1052,7 +1360,6 @@ request_exec( tr_session             * session,
         int64_t tag;
         tr_benc response;
         tr_benc * args_out;
-        struct evbuffer * buf = tr_getBuffer( );
 
         tr_bencInitDict( &response, 3 );
         args_out = tr_bencDictAddDict( &response, "arguments", 0 );
@@ -1062,11 +1369,9 @@ request_exec( tr_session             * session,
         tr_bencDictAddStr( &response, "result", result );
         if( tr_bencDictFindInt( request, "tag", &tag ) )
             tr_bencDictAddInt( &response, "tag", tag );
-        tr_bencSaveAsJSON( &response, buf );
-        (*callback)( session, (const char*)EVBUFFER_DATA(buf),
-                     EVBUFFER_LENGTH(buf), callback_user_data );
+        sendResponse( session, &response, methods[i].streamFunc, args_in,
+                      callback, callback_user_data );
 
-        tr_releaseBuffer( buf );
         tr_bencFree( &response );
     }
     else
@@ -1085,12 +1390,134 @@ request_exec( tr_session             * session,
     }
 }
 
+/* for callers that want the whole response at once,
+ * collect the chunks until it's done */
+struct whole_response
+{
+    struct evbuffer       * buf;
+    tr_rpc_response_func    callback;
+    void                  * callback_user_data;
+};
+
+static void
+onWholeResponseChunk( tr_session * session,
+                      const void * chunk,
+                      size_t       chunk_len,
+                      tr_bool      isDone,
+                      void       * vdata )
+{
+    struct whole_response * data = vdata;
+
+    evbuffer_add( data->buf, chunk, chunk_len );
+
+    if( isDone )
+    {
+        if( data->callback != NULL )
+            (*data->callback)( session, (const char*)EVBUFFER_DATA( data->buf ),
+                               EVBUFFER_LENGTH( data->buf ),
+                               data->callback_user_data );
+        evbuffer_free( data->buf );
+        tr_free( data );
+    }
+}
+
+static struct whole_response*
+wholeResponseNew( tr_rpc_response_func callback, void * callback_user_data )
+{
+    struct whole_response * data = tr_new0( struct whole_response, 1 );
+    data->buf = evbuffer_new( );
+    data->callback = callback;
+    data->callback_user_data = callback_user_data;
+    return data;
+}
+
 void
 tr_rpc_request_exec_json( tr_session            * session,
                           const void            * request_json,
                           int                     request_len,
                           tr_rpc_response_func    callback,
                           void                  * callback_user_data )
+{
+    tr_rpc_request_exec_json_chunked( session, request_json, request_len,
+                                      onWholeResponseChunk,
+                                      wholeResponseNew( callback, callback_user_data ) );
+}
+
+/**
+ * A batch is a list of requests, answered with a list of their responses
+ * in the same order.  The requests are run one at a time, each one after
+ * the last has finished, so that a request like torrent-add that answers
+ * later doesn't let the ones after it jump ahead.
+ */
+struct batch
+{
+    tr_session                 * session;
+    tr_benc                      requests;
+    size_t                       next;
+    tr_bool                      isRunning;
+    tr_bool                      isWaiting;
+    tr_rpc_response_chunk_func   callback;
+    void                       * callback_user_data;
+};
+
+static void batchRun( struct batch * batch );
+
+static void
+onBatchChunk( tr_session * session,
+              const void * chunk,
+              size_t       chunk_len,
+              tr_bool      isDone,
+              void       * vbatch )
+{
+    struct batch * batch = vbatch;
+
+    (*batch->callback)( session, chunk, chunk_len, FALSE, batch->callback_user_data );
+
+    if( isDone )
+    {
+        batch->isWaiting = FALSE;
+
+        /* if this response came later, start on the next request.
+         * otherwise batchRun() is still on the stack and will do it */
+        if( !batch->isRunning )
+            batchRun( batch );
+    }
+}
+
+static void
+batchRun( struct batch * batch )
+{
+    const size_t n = tr_bencListSize( &batch->requests );
+
+    batch->isRunning = TRUE;
+
+    while( !batch->isWaiting && ( batch->next < n ) )
+    {
+        const char * delimiter = batch->next ? "," : "[";
+        tr_benc * request = tr_bencListChild( &batch->requests, batch->next++ );
+
+        (*batch->callback)( batch->session, delimiter, 1, FALSE, batch->callback_user_data );
+        batch->isWaiting = TRUE;
+        request_exec( batch->session, request, onBatchChunk, batch );
+    }
+
+    batch->isRunning = FALSE;
+
+    if( !batch->isWaiting )
+    {
+        const char * end = n ? "]" : "[]";
+        (*batch->callback)( batch->session, end, strlen( end ), TRUE, batch->callback_user_data );
+        tr_bencFree( &batch->requests );
+        tr_free( batch );
+    }
+}
+
+void
+tr_rpc_request_exec_json_chunked( tr_session                 * session,
+                                  const void                 * request_json,
+                                  int                          request_len,
+                                  tr_rpc_response_chunk_func   callback,
+                                  void                       * callback_user_data )
 {
     tr_benc top;
     int have_content;
@@ -1098,7 +1525,22 @@ tr_rpc_request_exec_json( tr_session            * session,
     if( request_len < 0 )
         request_len = strlen( request_json );
 
+    if( callback == NULL )
+        callback = noop_response_callback;
+
     have_content = !tr_jsonParse( request_json, request_len, &top, NULL );
+
+    if( have_content && tr_bencIsList( &top ) )
+    {
+        struct batch * batch = tr_new0( struct batch, 1 );
+        batch->session = session;
+        batch->requests = top;
+        batch->callback = callback;
+        batch->callback_user_data = callback_user_data;
+        batchRun( batch );
+        return;
+    }
+
     request_exec( session, have_content ? &top : NULL, callback, callback_user_data );
 
     if( have_content )
@@ -1143,6 +1585,18 @@ tr_rpc_request_exec_uri( tr_session           * session,
                          int                    request_len,
                          tr_rpc_response_func   callback,
                          void                 * callback_user_data )
+{
+    tr_rpc_request_exec_uri_chunked( session, request_uri, request_len,
+                                     onWholeResponseChunk,
+                                     wholeResponseNew( callback, callback_user_data ) );
+}
+
+void
+tr_rpc_request_exec_uri_chunked( tr_session                 * session,
+                                 const void                 * request_uri,
+                                 int                          request_len,
+                                 tr_rpc_response_chunk_func   callback,
+                                 void                       * callback_user_data )
 {
     tr_benc      top, * args;
     char *       request = tr_strndup( request_uri, request_len );
@@ -23,7 +23,10 @@ typedef void( *tr_rpc_response_func )( tr_session      * session,
                                        const char      * response,
                                        size_t            response_len,
                                        void            * user_data );
-/* http://www.json.org/ */
+/* http://www.json.org/
+ * the request can also be a list of requests, which are run in order
+ * and answered with a list of their responses.  See the RPC spec's
+ * "Batches" section */
 void tr_rpc_request_exec_json( tr_session            * session,
                                const void            * request_json,
                                int                     request_len,
@@ -37,6 +40,48 @@ void tr_rpc_request_exec_uri( tr_session           * session,
                               tr_rpc_response_func   callback,
                               void                 * callback_user_data );
 
+/**
+ * Like tr_rpc_response_func, but the response is passed along a chunk
+ * at a time as it's written, so that a large one is never held in memory
+ * all at once.  The last chunk has isDone set.
+ */
+typedef void( *tr_rpc_response_chunk_func )( tr_session      * session,
+                                             const void      * chunk,
+                                             size_t            chunk_len,
+                                             tr_bool           isDone,
+                                             void            * user_data );
+
+void tr_rpc_request_exec_json_chunked( tr_session                 * session,
+                                       const void                 * request_json,
+                                       int                          request_len,
+                                       tr_rpc_response_chunk_func   callback,
+                                       void                       * callback_user_data );
+
+void tr_rpc_request_exec_uri_chunked( tr_session                 * session,
+                                      const void                 * request_uri,
+                                      int                          request_len,
+                                      tr_rpc_response_chunk_func   callback,
+                                      void                       * callback_user_data );
+
+/***
+****  Events
+***/
+
+/**
+ * Pushes an event to the clients watching the RPC server's event stream.
+ * Its data is `args', which may be NULL, plus the torrent's "id" and
+ * "hashString" if `tor' is given.  This can be called from any thread,
+ * and returns right away if no one's watching.
+ * See the RPC spec's "Events" section.
+ */
+void tr_rpc_publish_event( tr_session            * session,
+                           const char            * name,
+                           const tr_torrent      * tor,
+                           const struct tr_benc  * args );
+
+/* pushes a "speed" event with the session's current speeds */
+void tr_rpc_publish_speed( tr_session * session );
+
 void tr_rpc_parse_list_str( struct tr_benc * setme,
                             const char     * list_str,
                             int              list_str_len );
@@ -25,6 +25,8 @@
 #include "bandwidth.h"
 #include "bencode.h"
 #include "blocklist.h"
+#include "cache.h"
+#include "disk-pool.h"
 #include "fdlimit.h"
 #include "list.h"
 #include "metainfo.h" /* tr_metainfoFree */
@@ -221,10 +223,12 @@ tr_sessionGetDefaultSettings( tr_benc * d )
 
     tr_bencDictReserve( d, 30 );
     tr_bencDictAddInt( d, TR_PREFS_KEY_BLOCKLIST_ENABLED,        FALSE );
+    tr_bencDictAddInt( d, TR_PREFS_KEY_CACHE_SIZE_MB,            atoi( TR_DEFAULT_CACHE_SIZE_MB_STR ) );
     tr_bencDictAddStr( d, TR_PREFS_KEY_DOWNLOAD_DIR,             tr_getDefaultDownloadDir( ) );
     tr_bencDictAddInt( d, TR_PREFS_KEY_DSPEED,                   100 );
     tr_bencDictAddInt( d, TR_PREFS_KEY_DSPEED_ENABLED,           0 );
     tr_bencDictAddInt( d, TR_PREFS_KEY_ENCRYPTION,               TR_DEFAULT_ENCRYPTION );
+    tr_bencDictAddInt( d, TR_PREFS_KEY_ENDGAME_BUDGET_MB,        atoi( TR_DEFAULT_ENDGAME_BUDGET_MB_STR ) );
     tr_bencDictAddInt( d, TR_PREFS_KEY_LAZY_BITFIELD,            TRUE );
     tr_bencDictAddInt( d, TR_PREFS_KEY_MSGLEVEL,                 TR_MSG_INF );
     tr_bencDictAddInt( d, TR_PREFS_KEY_OPEN_FILE_LIMIT,          atoi( TR_DEFAULT_OPEN_FILE_LIMIT_STR ) );
@@ -254,9 +258,12 @@ tr_sessionGetDefaultSettings( tr_benc * d )
     tr_bencDictAddStr( d, TR_PREFS_KEY_RPC_WHITELIST,            TR_DEFAULT_RPC_WHITELIST );
     tr_bencDictAddInt( d, TR_PREFS_KEY_RPC_WHITELIST_ENABLED,    TRUE );
     tr_bencDictAddInt( d, TR_PREFS_KEY_RPC_PORT,                 atoi( TR_DEFAULT_RPC_PORT_STR ) );
+    tr_bencDictAddInt( d, TR_PREFS_KEY_SYNC_DROP_CACHE,          TRUE );
+    tr_bencDictAddInt( d, TR_PREFS_KEY_SYNC_MODE,                TR_SYNC_WRITEBACK );
     tr_bencDictAddInt( d, TR_PREFS_KEY_USPEED,                   100 );
     tr_bencDictAddInt( d, TR_PREFS_KEY_USPEED_ENABLED,           0 );
     tr_bencDictAddInt( d, TR_PREFS_KEY_UPLOAD_SLOTS_PER_TORRENT, 14 );
+    tr_bencDictAddInt( d, TR_PREFS_KEY_VERIFY_BUDGET_MB,         atoi( TR_DEFAULT_VERIFY_BUDGET_MB_STR ) );
 }
 
 void
@@ -269,10 +276,12 @@ tr_sessionGetSettings( tr_session * s, struct tr_benc * d )
 
     tr_bencDictReserve( d, 30 );
     tr_bencDictAddInt( d, TR_PREFS_KEY_BLOCKLIST_ENABLED,        tr_blocklistIsEnabled( s ) );
+    tr_bencDictAddInt( d, TR_PREFS_KEY_CACHE_SIZE_MB,            tr_sessionGetCacheLimit( s ) );
     tr_bencDictAddStr( d, TR_PREFS_KEY_DOWNLOAD_DIR,             s->downloadDir );
     tr_bencDictAddInt( d, TR_PREFS_KEY_DSPEED,                   tr_sessionGetSpeedLimit( s, TR_DOWN ) );
     tr_bencDictAddInt( d, TR_PREFS_KEY_DSPEED_ENABLED,           tr_sessionIsSpeedLimitEnabled( s, TR_DOWN ) );
     tr_bencDictAddInt( d, TR_PREFS_KEY_ENCRYPTION,               s->encryptionMode );
+    tr_bencDictAddInt( d, TR_PREFS_KEY_ENDGAME_BUDGET_MB,        s->endgameBudgetMB );
     tr_bencDictAddInt( d, TR_PREFS_KEY_LAZY_BITFIELD,            s->useLazyBitfield );
     tr_bencDictAddInt( d, TR_PREFS_KEY_MSGLEVEL,                 tr_getMessageLevel( ) );
     tr_bencDictAddInt( d, TR_PREFS_KEY_OPEN_FILE_LIMIT,          s->openFileLimit );
@@ -301,9 +310,12 @@ tr_sessionGetSettings( tr_session * s, struct tr_benc * d )
     tr_bencDictAddStr( d, TR_PREFS_KEY_RPC_USERNAME,             freeme[n++] = tr_sessionGetRPCUsername( s ) );
     tr_bencDictAddStr( d, TR_PREFS_KEY_RPC_WHITELIST,            freeme[n++] = tr_sessionGetRPCWhitelist( s ) );
     tr_bencDictAddInt( d, TR_PREFS_KEY_RPC_WHITELIST_ENABLED,    tr_sessionGetRPCWhitelistEnabled( s ) );
+    tr_bencDictAddInt( d, TR_PREFS_KEY_SYNC_DROP_CACHE,          s->isSyncDropCacheEnabled );
+    tr_bencDictAddInt( d, TR_PREFS_KEY_SYNC_MODE,                tr_fdGetSyncMode( ) );
     tr_bencDictAddInt( d, TR_PREFS_KEY_USPEED,                   tr_sessionGetSpeedLimit( s, TR_UP ) );
     tr_bencDictAddInt( d, TR_PREFS_KEY_USPEED_ENABLED,           tr_sessionIsSpeedLimitEnabled( s, TR_UP ) );
     tr_bencDictAddInt( d, TR_PREFS_KEY_UPLOAD_SLOTS_PER_TORRENT, s->uploadSlotsPerTorrent );
+    tr_bencDictAddInt( d, TR_PREFS_KEY_VERIFY_BUDGET_MB,         s->verifyBudgetMB );
 
     for( i=0; i<n; ++i )
         tr_free( freeme[i] );
@@ -395,6 +407,13 @@ tr_sessionInit( const char  * tag,
     session->tag = tr_strdup( tag );
     session->magicNumber = SESSION_MAGIC_NUMBER;
 
+    /* start the change generations at the session's start time so that
+     * cursors from another session can be told apart.  no session makes
+     * 2^21 changes per second, and this stays below 2^53, which is as
+     * high as JavaScript clients can count exactly */
+    session->torrentChangeGeneration = (int64_t)time( NULL ) << 21;
+    session->oldestCursor = session->torrentChangeGeneration;
+
     /* start the libtransmission thread */
     tr_netInit( ); /* must go before tr_eventInit */
     tr_eventInit( session );
@@ -524,6 +543,20 @@ tr_sessionInitImpl( void * vdata )
     assert( found );
     tr_fdInit( session->openFileLimit, j );
 
+    found = tr_bencDictFindInt( &settings, TR_PREFS_KEY_SYNC_MODE, &i );
+    assert( found );
+    assert( tr_isSyncMode( i ) );
+    tr_fdSetSyncMode( i );
+
+    found = tr_bencDictFindInt( &settings, TR_PREFS_KEY_SYNC_DROP_CACHE, &i );
+    assert( found );
+    session->isSyncDropCacheEnabled = i != 0;
+
+    found = tr_bencDictFindInt( &settings, TR_PREFS_KEY_CACHE_SIZE_MB, &i );
+    assert( found );
+    session->cache = tr_cacheNew( MAX( i, 0 ) * 1024 * 1024 );
+    session->diskPool = tr_diskPoolNew( session );
+
     /**
     *** random port
     **/
@@ -554,6 +587,14 @@ tr_sessionInitImpl( void * vdata )
     assert( found );
     session->uploadSlotsPerTorrent = i;
 
+    found = tr_bencDictFindInt( &settings, TR_PREFS_KEY_VERIFY_BUDGET_MB, &i );
+    assert( found );
+    session->verifyBudgetMB = i;
+
+    found = tr_bencDictFindInt( &settings, TR_PREFS_KEY_ENDGAME_BUDGET_MB, &i );
+    assert( found );
+    session->endgameBudgetMB = i;
+
     found = tr_bencDictFindInt( &settings, TR_PREFS_KEY_USPEED, &i )
          && tr_bencDictFindInt( &settings, TR_PREFS_KEY_USPEED_ENABLED, &j );
     assert( found );
@@ -867,6 +908,22 @@ tr_sessionGetPeerLimitPerTorrent( const tr_session * session )
     return session->peerLimitPerTorrent;
 }
 
+void
+tr_sessionSetCacheLimit( tr_session * session, int megabytes )
+{
+    assert( tr_isSession( session ) );
+
+    tr_cacheSetLimit( session->cache, MAX( megabytes, 0 ) * 1024 * 1024 );
+}
+
+int
+tr_sessionGetCacheLimit( const tr_session * session )
+{
+    assert( tr_isSession( session ) );
+
+    return tr_cacheGetLimit( session->cache ) / ( 1024 * 1024 );
+}
+
 /***
 ****
 ***/
@@ -930,6 +987,11 @@ tr_closeAllConnections( void * vsession )
         tr_torrentFree( torrents[i] );
     tr_free( torrents );
 
+    tr_diskPoolFree( session->diskPool );
+    session->diskPool = NULL;
+    tr_cacheFree( session->cache );
+    session->cache = NULL;
+
     tr_peerMgrFree( session->peerMgr );
 
     tr_trackerSessionClose( session );
@@ -996,6 +1058,10 @@ tr_sessionClose( tr_session * session )
     for( i = 0; i < session->metainfoLookupCount; ++i )
         tr_free( session->metainfoLookup[i].filename );
     tr_free( session->metainfoLookup );
+    tr_free( session->torrentsById );
+    tr_free( session->torrentsByHash );
+    tr_free( session->torrentsByObfuscatedHash );
+    tr_free( session->removedTorrents );
     tr_free( session->tag );
     tr_free( session->configDir );
     tr_free( session->resumeDir );
@@ -55,6 +55,14 @@ struct tr_metainfo_lookup
 struct tr_address;
 struct tr_bandwidth;
 
+/* a torrent that's been removed, remembered for RPC clients
+ * that are polling for changes. see tr_torrentMarkChanged() */
+struct tr_removed_torrent
+{
+    int        id;
+    int64_t    changeGeneration;
+};
+
 struct tr_session
 {
     tr_bool                      isPortSet;
@@ -67,6 +75,7 @@ struct tr_session
     tr_bool                      isWaiting;
     tr_bool                      useLazyBitfield;
     tr_bool                      isRatioLimited;
+    tr_bool                      isSyncDropCacheEnabled;
 
     tr_bool                      isSpeedLimited[2];
     int                          speedLimit[2];
@@ -93,6 +102,22 @@ struct tr_session
     int                          torrentCount;
     tr_torrent *                 torrentList;
 
+    /* torrentList, hashed by id, info hash, and obfuscated info hash */
+    tr_torrent **                torrentsById;
+    tr_torrent **                torrentsByHash;
+    tr_torrent **                torrentsByObfuscatedHash;
+    unsigned int                 torrentBucketMask;
+
+    /* bumped each time a torrent changes. see tr_torrentMarkChanged() */
+    int64_t                      torrentChangeGeneration;
+
+    /* torrents that have been removed, oldest first.
+     * cursors older than oldestCursor have lost some of theirs */
+    struct tr_removed_torrent *  removedTorrents;
+    int                          removedTorrentCount;
+    int                          removedTorrentAlloc;
+    int64_t                      oldestCursor;
+
     char *                       tag;
     char *                       configDir;
     char *                       downloadDir;
@@ -113,6 +138,11 @@ struct tr_session
     struct tr_web *              web;
 
     struct tr_rpc_server *       rpcServer;
+
+    /* how many are watching the rpc server's event stream.  only the
+     * libtransmission thread changes this, but any thread can read it.
+     * see tr_rpcHasListeners() */
+    int                          rpcListenerCount;
     tr_rpc_func                  rpc_func;
     void *                       rpc_func_user_data;
 
@@ -131,6 +161,21 @@ struct tr_session
     /* monitors the "global pool" speeds */
     struct tr_bandwidth        * bandwidth;
 
+    /* blocks waiting to be written, or recently read, for all torrents */
+    struct tr_cache            * cache;
+
+    /* the threads that do the disk I/O for peers */
+    struct tr_disk_pool        * diskPool;
+
+    /* how many megabytes of pieces can be read ahead of the hashing
+     * threads when verifying local data.  this also decides how many
+     * torrents can be verified at once. */
+    int                          verifyBudgetMB;
+
+    /* how many megabytes of blocks a torrent can ask more than one
+     * peer for, each time it goes into endgame */
+    int                          endgameBudgetMB;
+
     double                       desiredRatio;
 };
 
@@ -0,0 +1,184 @@
+#include <stdio.h> /* fprintf */
+#include <string.h> /* memcmp */
+
+#include <openssl/sha.h>
+
+#include "transmission.h"
+#include "crypto.h" /* tr_cryptoWeakRandInt */
+#include "sha1.h"
+#include "utils.h"
+
+#undef VERBOSE
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+ #define VERBOSE
+ #define PIECES_PER_RUN 32
+#else
+ #define PIECES_PER_RUN 8
+#endif
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+static const size_t pieceSizes[] = { 256 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024 };
+#define PIECE_SIZE_COUNT ( sizeof( pieceSizes ) / sizeof( pieceSizes[0] ) )
+
+static void
+hashInChunks( uint8_t * setme, const uint8_t * data, size_t len )
+{
+    tr_sha1_ctx ctx;
+
+    tr_sha1Init( &ctx );
+    while( len ) {
+        const size_t chunk = tr_cryptoWeakRandInt( 150 );
+        const size_t n = MIN( len, chunk );
+        tr_sha1Update( &ctx, data, n );
+        data += n;
+        len -= n;
+    }
+    tr_sha1Final( &ctx, setme );
+}
+
+static int
+testKnownAnswers( void )
+{
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    char hex[SHA_DIGEST_LENGTH*2 + 1];
+    const char * abc = "abc";
+    const char * abc448 = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+    tr_sha1( hash, "", 0, NULL );
+    tr_sha1_to_hex( hex, hash );
+    check( !strcmp( hex, "da39a3ee5e6b4b0d3255bfef95601890afd80709" ) );
+
+    tr_sha1( hash, abc, (int)strlen( abc ), NULL );
+    tr_sha1_to_hex( hex, hash );
+    check( !strcmp( hex, "a9993e364706816aba3e25717850c26c9cd0d89d" ) );
+
+    tr_sha1( hash, abc448, 20, abc448 + 20, (int)strlen( abc448 ) - 20, NULL );
+    tr_sha1_to_hex( hex, hash );
+    check( !strcmp( hex, "84983e441c3bd26ebaae4aa1f95129e5e54670f1" ) );
+
+    return 0;
+}
+
+/* compare the streaming and batch interfaces to OpenSSL's one-shot SHA1() */
+static int
+testHashes( const uint8_t * data, size_t dataLen )
+{
+    int i;
+    size_t len;
+    uint8_t expected[SHA_DIGEST_LENGTH];
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    uint8_t hashes[11][SHA_DIGEST_LENGTH];
+    const void * bufs[11];
+    size_t lens[11];
+
+    if(( i = testKnownAnswers( )))
+        return i;
+
+    /* every length across the padding boundaries */
+    for( len=0; len<300; ++len ) {
+        SHA1( data, len, expected );
+        hashInChunks( hash, data, len );
+        check( !memcmp( hash, expected, SHA_DIGEST_LENGTH ) );
+    }
+
+    /* batches of every size, some the same length and some not */
+    for( i=1; i<=11; ++i )
+    {
+        int j;
+        for( j=0; j<i; ++j ) {
+            lens[j] = j % 3 ? 4096 : (size_t)tr_cryptoWeakRandInt( 5000 );
+            bufs[j] = data + tr_cryptoWeakRandInt( dataLen - lens[j] );
+        }
+        tr_sha1Multi( hashes, bufs, lens, i );
+        for( j=0; j<i; ++j ) {
+            SHA1( bufs[j], lens[j], expected );
+            check( !memcmp( hashes[j], expected, SHA_DIGEST_LENGTH ) );
+        }
+    }
+
+
+    return 0;
+}
+
+/**
+***
+**/
+
+static void
+report( size_t pieceSize, uint64_t startMsec )
+{
+    const double mib = ( (double)pieceSize * PIECES_PER_RUN ) / 1048576.0;
+    const uint64_t msec = MAX( tr_date( ) - startMsec, 1 );
+
+    fprintf( stderr, "%5zu KiB pieces: %7.1f MiB/s\n",
+             pieceSize / 1024, mib / ( msec / 1000.0 ) );
+}
+
+static void
+benchmark( const uint8_t * data )
+{
+    size_t i, j;
+    uint8_t hashes[PIECES_PER_RUN][SHA_DIGEST_LENGTH];
+    const void * bufs[PIECES_PER_RUN];
+    size_t lens[PIECES_PER_RUN];
+
+    for( i=0; i<PIECE_SIZE_COUNT; ++i )
+    {
+        uint64_t start;
+        const size_t pieceSize = pieceSizes[i];
+
+        for( j=0; j<PIECES_PER_RUN; ++j ) {
+            bufs[j] = data;
+            lens[j] = pieceSize;
+        }
+        start = tr_date( );
+        tr_sha1Multi( hashes, bufs, lens, PIECES_PER_RUN );
+        report( pieceSize, start );
+    }
+}
+
+int
+main( void )
+{
+    int err;
+    size_t i;
+    uint8_t * data;
+    const size_t dataLen = pieceSizes[PIECE_SIZE_COUNT - 1];
+
+    data = tr_new( uint8_t, dataLen );
+    for( i=0; i<dataLen; ++i )
+        data[i] = (uint8_t) tr_cryptoWeakRandInt( 256 );
+
+    if(( err = testHashes( data, dataLen )))
+        return err;
+
+    benchmark( data );
+
+    tr_free( data );
+    return 0;
+}
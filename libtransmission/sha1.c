@@ -0,0 +1,54 @@
+/*
+ * This file Copyright (C) 2009 Charles Kerr <charles@transmissionbt.com>
+ *
+ * This file is licensed by the GPL version 2.  Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "transmission.h"
+#include "sha1.h"
+
+void
+tr_sha1Init( tr_sha1_ctx * ctx )
+{
+    ctx->evp = EVP_MD_CTX_create( );
+    EVP_DigestInit_ex( ctx->evp, EVP_sha1( ), NULL );
+}
+
+void
+tr_sha1Update( tr_sha1_ctx * ctx, const void * data, size_t len )
+{
+    EVP_DigestUpdate( ctx->evp, data, len );
+}
+
+void
+tr_sha1Final( tr_sha1_ctx * ctx, uint8_t * setme )
+{
+    EVP_DigestFinal_ex( ctx->evp, setme, NULL );
+    EVP_MD_CTX_destroy( ctx->evp );
+    ctx->evp = NULL;
+}
+
+void
+tr_sha1Multi( uint8_t             (* setme)[SHA_DIGEST_LENGTH],
+              const void * const   * bufs,
+              const size_t         * lens,
+              int                    count )
+{
+    int i;
+
+    for( i=0; i<count; ++i ) {
+        tr_sha1_ctx ctx;
+        tr_sha1Init( &ctx );
+        tr_sha1Update( &ctx, bufs[i], lens[i] );
+        tr_sha1Final( &ctx, setme[i] );
+    }
+}
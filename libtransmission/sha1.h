@@ -0,0 +1,48 @@
+/*
+ * This file Copyright (C) 2009 Charles Kerr <charles@transmissionbt.com>
+ *
+ * This file is licensed by the GPL version 2.  Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_SHA1_H
+#define TR_SHA1_H 1
+
+#include <inttypes.h>
+#include <stddef.h> /* size_t */
+
+/**
+ * SHA1 through OpenSSL's EVP interface, which picks
+ * the fastest code this CPU can run, SHA extensions included.
+ */
+
+typedef struct tr_sha1_ctx
+{
+    void * evp;     /* OpenSSL's context */
+}
+tr_sha1_ctx;
+
+/** Every tr_sha1Init() must be followed by a tr_sha1Final(),
+    which frees OpenSSL's context */
+void         tr_sha1Init( tr_sha1_ctx * ctx );
+
+void         tr_sha1Update( tr_sha1_ctx * ctx, const void * data, size_t len );
+
+void         tr_sha1Final( tr_sha1_ctx * ctx, uint8_t * setme );
+
+/** Hashes `count' buffers, filling in setme[0..count-1] */
+void         tr_sha1Multi( uint8_t            (* setme)[SHA_DIGEST_LENGTH],
+                           const void * const  * bufs,
+                           const size_t        * lens,
+                           int                   count );
+
+#endif
@@ -40,6 +40,7 @@ struct tr_ctor
     tr_bool                 isSet_metainfo;
     tr_bool                 isSet_delete;
     tr_benc                 metainfo;
+    tr_benc_arena *         metainfoArena;
     char *                  sourceFile;
 
     struct optional_args    optionalArgs[2];
@@ -64,6 +65,8 @@ clearMetainfo( tr_ctor * ctor )
     {
         ctor->isSet_metainfo = 0;
         tr_bencFree( &ctor->metainfo );
+        tr_bencArenaFree( ctor->metainfoArena );
+        ctor->metainfoArena = NULL;
     }
 
     setSourceFile( ctor, NULL );
@@ -77,7 +80,7 @@ tr_ctorSetMetainfo( tr_ctor *       ctor,
     int err;
 
     clearMetainfo( ctor );
-    err = tr_bencLoad( metainfo, len, &ctor->metainfo, NULL );
+    err = tr_bencLoadArena( metainfo, len, &ctor->metainfo, &ctor->metainfoArena );
     ctor->isSet_metainfo = !err;
     return err;
 }
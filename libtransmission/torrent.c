@@ -26,9 +26,11 @@
 #include "session.h"
 #include "bandwidth.h"
 #include "bencode.h"
+#include "cache.h"
 #include "completion.h"
 #include "crypto.h" /* for tr_sha1 */
 #include "resume.h"
+#include "rpcimpl.h" /* tr_rpc_publish_event */
 #include "fdlimit.h" /* tr_fdFileClose */
 #include "metainfo.h"
 #include "peer-mgr.h"
@@ -53,28 +55,122 @@ tr_torrentId( const tr_torrent * tor )
     return tor->uniqueId;
 }
 
+/***
+****  The session's indexes of its torrents
+***/
+
+static unsigned int
+getIdBucket( const tr_session * session, int id )
+{
+    return ( (unsigned int)id * 2654435761u ) & session->torrentBucketMask;
+}
+
+/* the digests are already well-mixed, so any four bytes will do */
+static unsigned int
+getDigestBucket( const tr_session * session, const uint8_t * digest )
+{
+    uint32_t hash;
+    memcpy( &hash, digest, sizeof( hash ) );
+    return hash & session->torrentBucketMask;
+}
+
+static void
+indexAdd( tr_torrent * tor )
+{
+    tr_session * session = tor->session;
+    tr_torrent ** bucket;
+
+    bucket = &session->torrentsById[getIdBucket( session, tor->uniqueId )];
+    tor->idNext = *bucket;
+    *bucket = tor;
+
+    bucket = &session->torrentsByHash[getDigestBucket( session, tor->info.hash )];
+    tor->hashNext = *bucket;
+    *bucket = tor;
+
+    bucket = &session->torrentsByObfuscatedHash[getDigestBucket( session, tor->obfuscatedHash )];
+    tor->obfuscatedHashNext = *bucket;
+    *bucket = tor;
+}
+
+static void
+indexRemove( tr_torrent * tor )
+{
+    tr_session * session = tor->session;
+    tr_torrent ** walk;
+
+    for( walk=&session->torrentsById[getIdBucket( session, tor->uniqueId )]; *walk!=tor; walk=&(*walk)->idNext )
+        assert( *walk != NULL );
+    *walk = tor->idNext;
+
+    for( walk=&session->torrentsByHash[getDigestBucket( session, tor->info.hash )]; *walk!=tor; walk=&(*walk)->hashNext )
+        assert( *walk != NULL );
+    *walk = tor->hashNext;
+
+    for( walk=&session->torrentsByObfuscatedHash[getDigestBucket( session, tor->obfuscatedHash )]; *walk!=tor; walk=&(*walk)->obfuscatedHashNext )
+        assert( *walk != NULL );
+    *walk = tor->obfuscatedHashNext;
+}
+
+/* keep the indexes at least half empty, rebuilding them as they grow */
+static void
+indexReserve( tr_session * session, int torrentCount )
+{
+    tr_torrent * tor = NULL;
+    unsigned int mask = session->torrentBucketMask ? session->torrentBucketMask : 63;
+
+    while( mask < (unsigned int)torrentCount * 2 )
+        mask = ( mask << 1 ) | 1;
+
+    if( mask == session->torrentBucketMask )
+        return;
+
+    tr_free( session->torrentsById );
+    tr_free( session->torrentsByHash );
+    tr_free( session->torrentsByObfuscatedHash );
+    session->torrentBucketMask = mask;
+    session->torrentsById = tr_new0( tr_torrent*, mask + 1 );
+    session->torrentsByHash = tr_new0( tr_torrent*, mask + 1 );
+    session->torrentsByObfuscatedHash = tr_new0( tr_torrent*, mask + 1 );
+
+    while(( tor = tr_torrentNext( session, tor )))
+        indexAdd( tor );
+}
+
 tr_torrent*
 tr_torrentFindFromId( tr_session * session, int id )
 {
     tr_torrent * tor = NULL;
 
-    while(( tor = tr_torrentNext( session, tor )))
-        if( tor->uniqueId == id )
-            return tor;
+    if( session->torrentBucketMask )
+        for( tor=session->torrentsById[getIdBucket( session, id )]; tor!=NULL; tor=tor->idNext )
+            if( tor->uniqueId == id )
+                break;
 
-    return NULL;
+    return tor;
 }
 
 tr_torrent*
 tr_torrentFindFromHashString( tr_session *  session, const char * str )
 {
-    tr_torrent * tor = NULL;
+    int i;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    static const char * hex = "0123456789abcdef";
 
-    while(( tor = tr_torrentNext( session, tor )))
-        if( !strcmp( str, tor->info.hashString ) )
-            return tor;
+    /* hashString is always lowercase hex */
+    if( strlen( str ) != SHA_DIGEST_LENGTH * 2 )
+        return NULL;
+
+    for( i=0; i<SHA_DIGEST_LENGTH; ++i )
+    {
+        const char * hi = strchr( hex, str[i*2] );
+        const char * lo = strchr( hex, str[i*2+1] );
+        if( !hi || !lo )
+            return NULL;
+        hash[i] = ( ( hi - hex ) << 4 ) | ( lo - hex );
+    }
 
-    return NULL;
+    return tr_torrentFindFromHash( session, hash );
 }
 
 tr_torrent*
@@ -82,12 +178,12 @@ tr_torrentFindFromHash( tr_session * session, const uint8_t * torrentHash )
 {
     tr_torrent * tor = NULL;
 
-    while(( tor = tr_torrentNext( session, tor )))
-        if( *tor->info.hash == *torrentHash )
+    if( session->torrentBucketMask )
+        for( tor=session->torrentsByHash[getDigestBucket( session, torrentHash )]; tor!=NULL; tor=tor->hashNext )
             if( !memcmp( tor->info.hash, torrentHash, SHA_DIGEST_LENGTH ) )
-                return tor;
+                break;
 
-    return NULL;
+    return tor;
 }
 
 tr_torrent*
@@ -96,12 +192,104 @@ tr_torrentFindFromObfuscatedHash( tr_session * session,
 {
     tr_torrent * tor = NULL;
 
-    while(( tor = tr_torrentNext( session, tor )))
-        if( !memcmp( tor->obfuscatedHash, obfuscatedTorrentHash,
-                     SHA_DIGEST_LENGTH ) )
-            return tor;
+    if( session->torrentBucketMask )
+        for( tor=session->torrentsByObfuscatedHash[getDigestBucket( session, obfuscatedTorrentHash )]; tor!=NULL; tor=tor->obfuscatedHashNext )
+            if( !memcmp( tor->obfuscatedHash, obfuscatedTorrentHash, SHA_DIGEST_LENGTH ) )
+                break;
+
+    return tor;
+}
+
+/***
+****  CHANGE TRACKING
+***/
+
+void
+tr_torrentMarkChanged( tr_torrent * tor )
+{
+    assert( tr_isTorrent( tor ) );
 
-    return NULL;
+    tor->changeGeneration = ++tor->session->torrentChangeGeneration;
+}
+
+void
+tr_torrentMarkChangedIfActive( tr_torrent * tor, uint64_t now )
+{
+    tr_bool isActive;
+
+    assert( tr_isTorrent( tor ) );
+
+    isActive = ( tor->verifyState != TR_VERIFY_NONE )
+            || ( tr_bandwidthGetRawSpeed( tor->bandwidth, now, TR_UP ) > 0.0 )
+            || ( tr_bandwidthGetRawSpeed( tor->bandwidth, now, TR_DOWN ) > 0.0 );
+
+    /* mark it once more when it goes idle, so that clients see its speeds drop to 0 */
+    if( isActive || tor->wasActive )
+        tr_torrentMarkChanged( tor );
+
+    tor->wasActive = isActive;
+}
+
+static void
+rememberRemovedTorrent( tr_torrent * tor )
+{
+    tr_session * session = tor->session;
+    struct tr_removed_torrent * r;
+
+    /* forget the oldest one when the log is full.
+     * clients whose cursors are older than it will need a full refresh */
+    if( session->removedTorrentCount == TR_MAX_REMOVED_TORRENTS )
+    {
+        session->oldestCursor = session->removedTorrents[0].changeGeneration;
+        memmove( session->removedTorrents, session->removedTorrents + 1,
+                 sizeof( struct tr_removed_torrent ) * --session->removedTorrentCount );
+    }
+
+    if( session->removedTorrentCount == session->removedTorrentAlloc )
+    {
+        session->removedTorrentAlloc = MIN( TR_MAX_REMOVED_TORRENTS,
+                                            MAX( 16, session->removedTorrentAlloc * 2 ) );
+        session->removedTorrents = tr_renew( struct tr_removed_torrent,
+                                             session->removedTorrents,
+                                             session->removedTorrentAlloc );
+    }
+
+    r = &session->removedTorrents[session->removedTorrentCount++];
+    r->id = tor->uniqueId;
+    r->changeGeneration = ++session->torrentChangeGeneration;
+}
+
+tr_bool
+tr_sessionIsCursorValid( const tr_session * session, int64_t cursor )
+{
+    /* older than the removed torrents log, or from another session */
+    return ( session->oldestCursor <= cursor )
+        && ( cursor <= session->torrentChangeGeneration );
+}
+
+int*
+tr_sessionGetRemovedTorrents( tr_session * session, int64_t since, int * setmeCount )
+{
+    int lo = 0;
+    int hi = session->removedTorrentCount;
+    int * ids;
+
+    assert( tr_sessionIsCursorValid( session, since ) );
+
+    /* the log is in generation order, so binary search for the first one after `since' */
+    while( lo < hi ) {
+        const int mid = lo + ( hi - lo ) / 2;
+        if( session->removedTorrents[mid].changeGeneration <= since )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *setmeCount = session->removedTorrentCount - lo;
+    ids = tr_new( int, *setmeCount );
+    for( hi=0; hi<*setmeCount; ++hi )
+        ids[hi] = session->removedTorrents[lo + hi].id;
+    return ids;
 }
 
 /***
@@ -115,6 +303,7 @@ tr_torrentSetSpeedLimit( tr_torrent * tor, tr_direction dir, int KiB_sec )
     assert( tr_isDirection( dir ) );
 
     tr_bandwidthSetDesiredSpeed( tor->bandwidth, dir, KiB_sec );
+    tr_torrentMarkChanged( tor );
 }
 
 int
@@ -133,6 +322,7 @@ tr_torrentUseSpeedLimit( tr_torrent * tor, tr_direction dir, tr_bool do_use )
     assert( tr_isDirection( dir ) );
 
     tr_bandwidthSetLimited( tor->bandwidth, dir, do_use );
+    tr_torrentMarkChanged( tor );
 }
 
 tr_bool
@@ -151,6 +341,7 @@ tr_torrentUseGlobalSpeedLimit( tr_torrent * tor, tr_direction dir, tr_bool do_us
     assert( tr_isDirection( dir ) );
 
     tr_bandwidthHonorParentLimits( tor->bandwidth, dir, do_use );
+    tr_torrentMarkChanged( tor );
 }
 
 tr_bool
@@ -173,6 +364,7 @@ tr_torrentSetRatioMode( tr_torrent *  tor, tr_ratiolimit mode )
     assert( mode==TR_RATIOLIMIT_GLOBAL || mode==TR_RATIOLIMIT_SINGLE || mode==TR_RATIOLIMIT_UNLIMITED  );
 
     tor->ratioLimitMode = mode;
+    tr_torrentMarkChanged( tor );
 
     tr_torrentCheckSeedRatio( tor );
 }
@@ -192,6 +384,7 @@ tr_torrentSetRatioLimit( tr_torrent * tor,
     assert( tr_isTorrent( tor ) );
 
     tor->desiredRatio = desiredRatio;
+    tr_torrentMarkChanged( tor );
 
     tr_torrentCheckSeedRatio( tor );
 }
@@ -289,18 +482,28 @@ onTrackerResponse( void * tracker UNUSED,
             tor->error = -1;
             tr_strlcpy( tor->errorString, event->text,
                        sizeof( tor->errorString ) );
+            tr_torrentMarkChanged( tor );
             break;
 
         case TR_TRACKER_ERROR:
+        {
+            tr_benc args;
             tr_torerr( tor, _( "Tracker error: \"%s\"" ), event->text );
             tor->error = -2;
             tr_strlcpy( tor->errorString, event->text,
                        sizeof( tor->errorString ) );
+            tr_torrentMarkChanged( tor );
+            tr_bencInitDict( &args, 1 );
+            tr_bencDictAddStr( &args, "errorString", tor->errorString );
+            tr_rpc_publish_event( tor->session, "tracker-error", tor, &args );
+            tr_bencFree( &args );
             break;
+        }
 
         case TR_TRACKER_ERROR_CLEAR:
             tor->error = 0;
             tor->errorString[0] = '\0';
+            tr_torrentMarkChanged( tor );
             break;
     }
 }
@@ -616,6 +819,11 @@ torrentRealInit( tr_session      * session,
     {
         tr_torrent * it = NULL;
         tr_torrent * last = NULL;
+
+        indexReserve( session, session->torrentCount + 1 );
+        indexAdd( tor );
+        tr_torrentMarkChanged( tor );
+
         while( ( it = tr_torrentNext( session, it ) ) )
             last = it;
 
@@ -707,6 +915,8 @@ tr_torrentNew( tr_session     * session,
 ***
 **/
 
+static void tr_torrentCloseLocalFiles( const tr_torrent * tor );
+
 void
 tr_torrentSetDownloadDir( tr_torrent * tor,
                           const char * path )
@@ -715,8 +925,13 @@ tr_torrentSetDownloadDir( tr_torrent * tor,
 
     if( !path || !tor->downloadDir || strcmp( path, tor->downloadDir ) )
     {
+        /* open files are looked up by torrent and file number,
+         * so close the ones that live in the old folder */
+        tr_torrentCloseLocalFiles( tor );
+
         tr_free( tor->downloadDir );
         tor->downloadDir = tr_strdup( path );
+        tr_torrentMarkChanged( tor );
         tr_torrentSaveResume( tor );
     }
 }
@@ -873,6 +1088,7 @@ tr_torrentStat( tr_torrent * tor )
     s->startDate    = tor->startDate;
 
     s->corruptEver     = tor->corruptCur    + tor->corruptPrev;
+    s->wastedEver      = tor->wastedCur     + tor->wastedPrev;
     s->downloadedEver  = tor->downloadedCur + tor->downloadedPrev;
     s->uploadedEver    = tor->uploadedCur   + tor->uploadedPrev;
     s->haveValid       = tr_cpHaveValid( &tor->completion );
@@ -1068,6 +1284,14 @@ tr_torrentAvailability( const tr_torrent * tor,
     tr_peerMgrTorrentAvailability( tor, tab, size );
 }
 
+int
+tr_torrentAvailabilityHistogram( const tr_torrent * tor,
+                                 uint32_t         * setme,
+                                 int                size )
+{
+    return tr_peerMgrTorrentAvailabilityHistogram( tor, setme, size );
+}
+
 void
 tr_torrentAmountFinished( const tr_torrent * tor,
                           float *            tab,
@@ -1093,6 +1317,9 @@ tr_torrentResetTransferStats( tr_torrent * tor )
     tor->uploadedCur     = 0;
     tor->corruptPrev    += tor->corruptCur;
     tor->corruptCur      = 0;
+    tor->wastedPrev     += tor->wastedCur;
+    tor->wastedCur       = 0;
+    tr_torrentMarkChanged( tor );
 
     tr_torrentUnlock( tor );
 }
@@ -1142,6 +1369,9 @@ freeTorrent( tr_torrent * tor )
     tr_free( tor->downloadDir );
     tr_free( tor->peer_id );
 
+    indexRemove( tor );
+    rememberRemovedTorrent( tor );
+
     if( tor == session->torrentList )
         session->torrentList = tor->next;
     else for( t = session->torrentList; t != NULL; t = t->next ) {
@@ -1184,6 +1414,7 @@ checkAndStartImpl( void * vtor )
     tr_trackerStart( tor->tracker );
     tr_peerMgrStartTorrent( tor );
     tr_torrentCheckSeedRatio( tor );
+    tr_torrentMarkChanged( tor );
 
     tr_globalUnlock( tor->session );
 }
@@ -1213,6 +1444,7 @@ torrentStart( tr_torrent * tor,
             tr_torrentLoadResume( tor, TR_FR_PROGRESS, NULL );
 
         tor->isRunning = 1;
+        tr_torrentMarkChanged( tor );
 
         if( !isVerifying )
             tr_verifyAdd( tor, checkAndStartCB );
@@ -1234,7 +1466,9 @@ torrentRecheckDoneImpl( void * vtor )
     tr_torrent * tor = vtor;
 
     assert( tr_isTorrent( tor ) );
+    tr_peerMgrRebuildRequests( tor );
     tr_torrentRecheckCompleteness( tor );
+    tr_torrentMarkChanged( tor );
 }
 
 static void
@@ -1256,6 +1490,7 @@ tr_torrentVerify( tr_torrent * tor )
 
     tr_torrentUncheck( tor );
     tr_verifyAdd( tor, torrentRecheckDoneCB );
+    tr_torrentMarkChanged( tor );
 
     tr_globalUnlock( tor->session );
 }
@@ -1264,19 +1499,18 @@ static void
 tr_torrentCloseLocalFiles( const tr_torrent * tor )
 {
     tr_file_index_t i;
-    struct evbuffer * buf = evbuffer_new( );
 
     assert( tr_isTorrent( tor ) );
 
-    for( i=0; i<tor->info.fileCount; ++i )
-    {
-        const tr_file * file = &tor->info.files[i];
-        evbuffer_drain( buf, EVBUFFER_LENGTH( buf ) );
-        evbuffer_add_printf( buf, "%s%s%s", tor->downloadDir, TR_PATH_DELIMITER_STR, file->name );
-        tr_fdFileClose( (const char*) EVBUFFER_DATA( buf ) );
-    }
+    /* get any blocks that are still in memory out to disk first */
+    tr_cacheFlushTorrent( tor->session->cache, tor );
 
-    evbuffer_free( buf );
+    /* the files may be moved or deleted once they're closed,
+     * so forget that we've seen them */
+    for( i=0; i<tor->info.fileCount; ++i ) {
+        tr_fdFileClose( tor->uniqueId, i );
+        tor->info.files[i].exists = FALSE;
+    }
 }
 
 
@@ -1292,6 +1526,7 @@ stopTorrent( void * vtor )
     tr_trackerStop( tor->tracker );
 
     tr_torrentCloseLocalFiles( tor );
+    tr_torrentMarkChanged( tor );
 }
 
 void
@@ -1302,6 +1537,7 @@ tr_torrentStop( tr_torrent * tor )
         tr_globalLock( tor->session );
 
         tor->isRunning = 0;
+        tr_torrentMarkChanged( tor );
         if( !tor->isDeleting )
             tr_torrentSaveResume( tor );
         tr_runInEventThread( tor->session, stopTorrent, tor );
@@ -1378,10 +1614,24 @@ getCompletionString( int type )
     }
 }
 
+/* the name used for the RPC event stream's "completeness" events */
+static const char*
+getCompletenessName( tr_completeness status )
+{
+    switch( status )
+    {
+        case TR_PARTIAL_SEED: return "partial-seed";
+        case TR_SEED:         return "seed";
+        default:              return "leech";
+    }
+}
+
 static void
 fireCompletenessChange( tr_torrent       * tor,
                         tr_completeness    status )
 {
+    tr_benc args;
+
     assert( tr_isTorrent( tor ) );
     assert( ( status == TR_LEECH )
          || ( status == TR_SEED )
@@ -1389,6 +1639,11 @@ fireCompletenessChange( tr_torrent       * tor,
 
     if( tor->completeness_func )
         tor->completeness_func( tor, status, tor->completeness_func_user_data );
+
+    tr_bencInitDict( &args, 1 );
+    tr_bencDictAddStr( &args, "completeness", getCompletenessName( status ) );
+    tr_rpc_publish_event( tor->session, "completeness", tor, &args );
+    tr_bencFree( &args );
 }
 
 void
@@ -1448,6 +1703,7 @@ tr_torrentRecheckCompleteness( tr_torrent * tor )
         }
 
         tor->completeness = completeness;
+        tr_torrentMarkChanged( tor );
         tr_torrentCloseLocalFiles( tor );
         fireCompletenessChange( tor, completeness );
 
@@ -1503,6 +1759,8 @@ tr_torrentSetFilePriorities( tr_torrent *      tor,
     for( i = 0; i < fileCount; ++i )
         tr_torrentInitFilePriority( tor, files[i], priority );
 
+    tr_torrentMarkChanged( tor );
+    tr_peerMgrRebuildRequests( tor );
     tr_torrentSaveResume( tor );
     tr_torrentUnlock( tor );
 }
@@ -1647,6 +1905,8 @@ tr_torrentSetFileDLs( tr_torrent *      tor,
 
     tr_torrentLock( tor );
     tr_torrentInitFileDLs( tor, files, fileCount, doDownload );
+    tr_torrentMarkChanged( tor );
+    tr_peerMgrRebuildRequests( tor );
     tr_torrentSaveResume( tor );
     tr_torrentUnlock( tor );
 }
@@ -1662,6 +1922,7 @@ tr_torrentSetPeerLimit( tr_torrent * tor,
     assert( tr_isTorrent( tor ) );
 
     tor->maxConnectedPeers = maxConnectedPeers;
+    tr_torrentMarkChanged( tor );
 }
 
 uint16_t
@@ -1888,6 +2149,7 @@ tr_torrentSetAnnounceList( tr_torrent *            tor,
 
             tr_metainfoFree( &tmpInfo );
             tr_bencSaveFile( tor->info.torrent, &metainfo );
+            tr_torrentMarkChanged( tor );
         }
 
         /* cleanup */
@@ -2147,6 +2409,7 @@ tr_torrentCheckSeedRatio( tr_torrent * tor )
         const uint64_t up = tor->uploadedCur + tor->uploadedPrev;
         uint64_t down = tor->downloadedCur + tor->downloadedPrev;
         double ratio;
+        tr_benc args;
 
         /* maybe we're the initial seeder and never downloaded anything... */
         if( down == 0 )
@@ -2164,6 +2427,12 @@ tr_torrentCheckSeedRatio( tr_torrent * tor )
             /* maybe notify the client */
             if( tor->ratio_limit_hit_func != NULL )
                 tor->ratio_limit_hit_func( tor, tor->ratio_limit_hit_func_user_data );
+
+            tr_bencInitDict( &args, 2 );
+            tr_bencDictAddDouble( &args, "uploadRatio", ratio );
+            tr_bencDictAddDouble( &args, "seedRatioLimit", seedRatio );
+            tr_rpc_publish_event( tor->session, "ratio-limit", tor, &args );
+            tr_bencFree( &args );
         }
     }
 }
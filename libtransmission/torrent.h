@@ -117,6 +117,41 @@ tr_torrent*      tr_torrentNext( tr_session  * session,
 
 void             tr_torrentCheckSeedRatio( tr_torrent * tor );
 
+/**
+ * Notes that the torrent's stats, files, or peers have changed,
+ * so that RPC clients asking for what's changed since their last
+ * poll will be sent this torrent.
+ */
+void             tr_torrentMarkChanged( tr_torrent * tor );
+
+/**
+ * Marks the torrent as changed if it's transferring or verifying,
+ * or if it just stopped doing so.  Its speeds and progress change
+ * with every pulse then, without any one event to hook.
+ */
+void             tr_torrentMarkChangedIfActive( tr_torrent * tor,
+                                                uint64_t     now );
+
+/** how many removed torrents a session remembers for polling clients */
+#define TR_MAX_REMOVED_TORRENTS 1024
+
+/**
+ * Checks a cursor given by an RPC client.  It's invalid if it came
+ * from another session, or if it's so old that some of the torrents
+ * removed since then have been forgotten.  Either way, the client
+ * needs to start over with a full refresh.
+ */
+tr_bool          tr_sessionIsCursorValid( const tr_session * session,
+                                          int64_t            cursor );
+
+/**
+ * Gets the IDs of torrents removed since the given change generation,
+ * which must be a valid cursor.
+ * @return a newly-allocated array of setmeCount IDs.
+ */
+int*             tr_sessionGetRemovedTorrents( tr_session  * session,
+                                               int64_t       since,
+                                               int         * setmeCount );
 
 
 typedef enum
@@ -177,6 +212,8 @@ struct tr_torrent
     uint64_t                   uploadedPrev;
     uint64_t                   corruptCur;
     uint64_t                   corruptPrev;
+    uint64_t                   wastedCur;
+    uint64_t                   wastedPrev;
 
     time_t                     addedDate;
     time_t                     activityDate;
@@ -201,8 +238,18 @@ struct tr_torrent
 
     tr_torrent *               next;
 
+    /* the next torrent in the same bucket of the session's indexes.
+     * see tr_torrentFindFromId() and friends */
+    tr_torrent *               idNext;
+    tr_torrent *               hashNext;
+    tr_torrent *               obfuscatedHashNext;
+
     int                        uniqueId;
 
+    /* the session's torrentChangeGeneration when this torrent last changed */
+    int64_t                    changeGeneration;
+    tr_bool                    wasActive;
+
     struct tr_bandwidth      * bandwidth;
 
     struct tr_torrent_peers  * torrentPeers;
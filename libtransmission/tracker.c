@@ -182,6 +182,16 @@ findTracker( tr_session * session, int torrentId )
     return torrent ? torrent->tracker : NULL;
 }
 
+/* the announce and scrape times and results are part of the torrent's stats */
+static void
+markTorrentChanged( tr_tracker * t )
+{
+    tr_torrent * torrent = tr_torrentFindFromId( t->session, t->torrentId );
+
+    if( torrent != NULL )
+        tr_torrentMarkChanged( torrent );
+}
+
 /***
 ****  PUBLISH
 ***/
@@ -417,6 +427,7 @@ onTrackerResponse( tr_session * session,
     t = findTracker( session, tr_ptr2int( torrentId ) );
     if( !t ) /* tracker's been closed */
         return;
+    markTorrentChanged( t );
 
     dbgmsg( t->name, "tracker response: %ld", responseCode );
     tr_ndbg( t->name, "tracker response: %ld", responseCode );
@@ -424,9 +435,10 @@ onTrackerResponse( tr_session * session,
 
     if( responseCode == HTTP_OK )
     {
-        tr_benc   benc;
-        const int bencLoaded = !tr_bencLoad( response, responseLen,
-                                             &benc, NULL );
+        tr_benc         benc;
+        tr_benc_arena * arena;
+        const int       bencLoaded = !tr_bencLoadArena( response, responseLen,
+                                                        &benc, &arena );
         publishErrorClear( t );
         if( bencLoaded && tr_bencIsDict( &benc ) )
         {
@@ -510,8 +522,10 @@ onTrackerResponse( tr_session * session,
             }
         }
 
-        if( bencLoaded )
+        if( bencLoaded ) {
             tr_bencFree( &benc );
+            tr_bencArenaFree( arena );
+        }
     }
     else if( responseCode )
     {
@@ -614,6 +628,7 @@ onScrapeResponse( tr_session * session,
     t = findTracker( session, tr_ptr2int( torrentId ) );
     if( !t ) /* tracker's been closed... */
         return;
+    markTorrentChanged( t );
 
     dbgmsg( t->name, "scrape response: %ld\n", responseCode );
     tr_ndbg( t->name, "scrape response: %ld", responseCode );
@@ -621,9 +636,10 @@ onScrapeResponse( tr_session * session,
 
     if( responseCode == HTTP_OK )
     {
-        tr_benc   benc, *files;
-        const int bencLoaded = !tr_bencLoad( response, responseLen,
-                                             &benc, NULL );
+        tr_benc         benc, *files;
+        tr_benc_arena * arena;
+        const int       bencLoaded = !tr_bencLoadArena( response, responseLen,
+                                                        &benc, &arena );
         if( bencLoaded && tr_bencDictFindDict( &benc, "files", &files ) )
         {
             size_t i;
@@ -669,8 +685,10 @@ onScrapeResponse( tr_session * session,
             }
         }
 
-        if( bencLoaded )
+        if( bencLoaded ) {
             tr_bencFree( &benc );
+            tr_bencArenaFree( arena );
+        }
     }
 
     retry = updateAddresses( t, success );
@@ -897,6 +915,8 @@ invokeRequest( void * vreq )
     {
         const time_t now = time( NULL );
 
+        markTorrentChanged( t );
+
         if( req->reqtype == TR_REQ_SCRAPE )
         {
             t->lastScrapeTime = now;
@@ -119,6 +119,25 @@ static TR_INLINE tr_bool tr_isPreallocationMode( tr_preallocation_mode m  )
         || ( m == TR_PREALLOCATE_FULL );
 }
 
+typedef enum
+{
+    TR_SYNC_NONE      = 0, /* leave it to the OS to write our files out */
+    TR_SYNC_WRITEBACK = 1, /* start writing files out in the background
+                              as they're written */
+    TR_SYNC_PIECE     = 2  /* like TR_SYNC_WRITEBACK, plus wait for each
+                              piece to reach the disk when it's complete,
+                              and for all of a torrent's files before its
+                              resume file is saved */
+}
+tr_sync_mode;
+
+static TR_INLINE tr_bool tr_isSyncMode( tr_sync_mode m )
+{
+    return ( m == TR_SYNC_NONE )
+        || ( m == TR_SYNC_WRITEBACK )
+        || ( m == TR_SYNC_PIECE );
+}
+
 typedef enum
 {
     TR_PROXY_HTTP,
@@ -143,6 +162,7 @@ static TR_INLINE tr_bool tr_isEncryptionMode( tr_encryption_mode m )
 }
 
 
+#define TR_DEFAULT_CACHE_SIZE_MB_STR "2"
 #define TR_DEFAULT_OPEN_FILE_LIMIT_STR "32"
 #define TR_DEFAULT_RPC_WHITELIST "127.0.0.1"
 #define TR_DEFAULT_RPC_PORT_STR "9091"
@@ -150,12 +170,16 @@ static TR_INLINE tr_bool tr_isEncryptionMode( tr_encryption_mode m )
 #define TR_DEFAULT_PEER_SOCKET_TOS_STR "0"
 #define TR_DEFAULT_PEER_LIMIT_GLOBAL_STR "240"
 #define TR_DEFAULT_PEER_LIMIT_TORRENT_STR "60"
+#define TR_DEFAULT_VERIFY_BUDGET_MB_STR "16"
+#define TR_DEFAULT_ENDGAME_BUDGET_MB_STR "16"
 
 #define TR_PREFS_KEY_BLOCKLIST_ENABLED          "blocklist-enabled"
+#define TR_PREFS_KEY_CACHE_SIZE_MB              "cache-size-mb"
 #define TR_PREFS_KEY_DOWNLOAD_DIR               "download-dir"
 #define TR_PREFS_KEY_DSPEED                     "download-limit"
 #define TR_PREFS_KEY_DSPEED_ENABLED             "download-limit-enabled"
 #define TR_PREFS_KEY_ENCRYPTION                 "encryption"
+#define TR_PREFS_KEY_ENDGAME_BUDGET_MB          "endgame-budget-mb"
 #define TR_PREFS_KEY_LAZY_BITFIELD              "lazy-bitfield-enabled"
 #define TR_PREFS_KEY_MSGLEVEL                   "message-level"
 #define TR_PREFS_KEY_OPEN_FILE_LIMIT            "open-file-limit"
@@ -185,6 +209,9 @@ static TR_INLINE tr_bool tr_isEncryptionMode( tr_encryption_mode m )
 #define TR_PREFS_KEY_RPC_USERNAME               "rpc-username"
 #define TR_PREFS_KEY_RPC_WHITELIST_ENABLED      "rpc-whitelist-enabled"
 #define TR_PREFS_KEY_RPC_WHITELIST              "rpc-whitelist"
+#define TR_PREFS_KEY_SYNC_DROP_CACHE            "sync-drop-cache-enabled"
+#define TR_PREFS_KEY_SYNC_MODE                  "sync-mode"
+#define TR_PREFS_KEY_VERIFY_BUDGET_MB           "verify-budget-mb"
 #define TR_PREFS_KEY_USPEED_ENABLED             "upload-limit-enabled"
 #define TR_PREFS_KEY_USPEED                     "upload-limit"
 #define TR_PREFS_KEY_UPLOAD_SLOTS_PER_TORRENT   "upload-slots-per-torrent"
@@ -585,6 +612,15 @@ void       tr_sessionSetPeerLimitPerTorrent( tr_session  * session,
 
 uint16_t   tr_sessionGetPeerLimitPerTorrent( const tr_session * session );
 
+/**
+ * Set how many megabytes of torrent data can be held in memory
+ * before being written to disk.  Zero disables the cache.
+ */
+void       tr_sessionSetCacheLimit( tr_session * session,
+                                    int          megabytes );
+
+int        tr_sessionGetCacheLimit( const tr_session * session );
+
 
 /**
  *  Load all the torrents in tr_getTorrentDir().
@@ -1097,6 +1133,10 @@ typedef struct tr_peer_stat
     float        progress;
     float        rateToPeer;
     float        rateToClient;
+
+    /* how many block requests we keep sent to this peer.
+       it follows the peer's speed and round-trip time */
+    int          pipelineDepth;
 }
 tr_peer_stat;
 
@@ -1144,6 +1184,21 @@ void tr_torrentAvailability( const tr_torrent  * torrent,
                              int8_t            * tab,
                              int                  size );
 
+/* room for every piece availability, up to 65535 peers */
+enum { TR_AVAILABILITY_BUCKETS = 17 };
+
+/**
+ * Counts the torrent's pieces by how many connected peers have them.
+ * setme[0] is the number of pieces that no peer has, setme[1] the
+ * number that one peer has, setme[2] two or three peers, setme[3]
+ * four to seven peers, and so on.
+ *
+ * @return how many buckets are used.  the ones past that are all zero
+ */
+int  tr_torrentAvailabilityHistogram( const tr_torrent * torrent,
+                                      uint32_t         * setme,
+                                      int                size );
+
 void tr_torrentAmountFinished( const tr_torrent  * torrent,
                                float *             tab,
                                int                 size );
@@ -1164,6 +1219,7 @@ typedef struct tr_file
     tr_piece_index_t    firstPiece; /* We need pieces [firstPiece... */
     tr_piece_index_t    lastPiece; /* ...lastPiece] to dl this file */
     uint64_t            offset;    /* file begins at the torrent's nth byte */
+    tr_bool             exists;    /* (private) we've seen the file on disk */
 }
 tr_file;
 
@@ -1382,6 +1438,12 @@ typedef struct tr_stat
         grow very large. */
     uint64_t    corruptEver;
 
+    /** Byte count of all the blocks you've downloaded for this torrent
+        after you already had them, such as the slower peer's copy of a
+        block that was asked for twice in endgame.  These bytes aren't
+        counted in downloadedEver, so downloadedEver is the useful data. */
+    uint64_t    wastedEver;
+
     /** Byte count of all data you've ever uploaded for this torrent. */
     uint64_t    uploadedEver;
 
@@ -0,0 +1,504 @@
+#include <stdio.h> /* fprintf */
+#include <stdlib.h> /* mkdtemp */
+#include <string.h> /* memset */
+
+#include <sys/time.h> /* gettimeofday */
+#include <unistd.h> /* rmdir */
+
+#include <event.h>
+
+#include "transmission.h"
+#include "bencode.h"
+#include "crypto.h" /* tr_cryptoWeakRandInt */
+#include "platform.h" /* tr_threadNew */
+#include "trevent.h"
+#include "utils.h"
+
+#undef VERBOSE
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+ #define VERBOSE
+ #define CHURN_COUNT 1000000
+ #define COMMAND_COUNT 1000000
+#else
+ #define CHURN_COUNT 100000
+ #define COMMAND_COUNT 100000
+#endif
+
+#define ACCURACY_COUNT 200
+#define ACCURACY_MAX_MSEC 1500 /* past the first level of the wheel */
+#define CHURN_ROUNDS 4
+#define PRODUCER_COUNT 8
+#define BACKLOG_COUNT 20000 /* more than the pipe used to hold */
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+static tr_session * session = NULL;
+
+static uint64_t
+usecNow( void )
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+
+/* run func in the event thread and wait for it to finish */
+static volatile tr_bool isDone;
+
+struct run_data
+{
+    void ( *func )( void * );
+    void * arg;
+};
+
+static void
+runAndSignal( void * vdata )
+{
+    struct run_data * data = vdata;
+    ( *data->func )( data->arg );
+    isDone = TRUE;
+}
+
+static void
+runInEventThread( void func( void * ), void * arg )
+{
+    struct run_data data;
+    data.func = func;
+    data.arg = arg;
+    isDone = FALSE;
+    tr_runInEventThread( session, runAndSignal, &data );
+    while( !isDone )
+        tr_wait( 1 );
+}
+
+/***
+****  Timers fire on time, and never early
+***/
+
+struct accuracy_timer
+{
+    tr_timer    timer;
+    uint64_t    intervalMsec;
+    uint64_t    startedAt;
+    uint64_t    firedAt;
+};
+
+static struct accuracy_timer accuracy[ACCURACY_COUNT];
+static volatile int firedCount = 0;
+
+static int
+onAccuracyTimer( void * vt )
+{
+    struct accuracy_timer * t = vt;
+    t->firedAt = tr_date( );
+    ++firedCount;
+    return FALSE;
+}
+
+static void
+startAccuracyTimers( void * unused UNUSED )
+{
+    int i;
+
+    for( i=0; i<ACCURACY_COUNT; ++i )
+    {
+        struct accuracy_timer * t = &accuracy[i];
+        t->intervalMsec = tr_cryptoWeakRandInt( ACCURACY_MAX_MSEC );
+        t->startedAt = tr_date( );
+        tr_timerInit( &t->timer, session, onAccuracyTimer, t );
+        tr_timerStart( &t->timer, t->intervalMsec );
+    }
+}
+
+static int
+testAccuracy( void )
+{
+    int i;
+    uint64_t lateSum = 0;
+    uint64_t lateMax = 0;
+
+    runInEventThread( startAccuracyTimers, NULL );
+    while( firedCount < ACCURACY_COUNT )
+        tr_wait( 10 );
+
+    for( i=0; i<ACCURACY_COUNT; ++i )
+    {
+        const struct accuracy_timer * t = &accuracy[i];
+        const uint64_t due = t->startedAt + t->intervalMsec;
+        check( t->firedAt >= due );
+        check( !tr_timerIsPending( &t->timer ) );
+        lateSum += t->firedAt - due;
+        lateMax = MAX( lateMax, t->firedAt - due );
+    }
+
+    fprintf( stderr, "%d timers of up to %d msec were late by %.1f msec on average, %d at most\n",
+             ACCURACY_COUNT, ACCURACY_MAX_MSEC, (double)lateSum / ACCURACY_COUNT, (int)lateMax );
+    check( lateSum / ACCURACY_COUNT < 50 );
+    return 0;
+}
+
+/***
+****  What callbacks can do to their own timers and others
+***/
+
+struct semantics
+{
+    tr_timer     repeating;
+    int          repeatCount;
+    tr_timer     stopsItself;
+    int          stopsItselfCount;
+    tr_timer     restartsItself;
+    int          restartsItselfCount;
+    tr_timer     stopsOther;
+    tr_timer     stopped;
+    int          stoppedCount;
+    tr_timer   * allocated;
+    int          allocatedCount;
+};
+
+static int
+onRepeating( void * vs )
+{
+    struct semantics * s = vs;
+    return ++s->repeatCount < 5;
+}
+
+static int
+onStopsItself( void * vs )
+{
+    struct semantics * s = vs;
+    ++s->stopsItselfCount;
+    tr_timerStop( &s->stopsItself );
+    return TRUE;
+}
+
+static int
+onRestartsItself( void * vs )
+{
+    struct semantics * s = vs;
+    if( ++s->restartsItselfCount == 1 )
+        tr_timerStart( &s->restartsItself, 200 );
+    return FALSE;
+}
+
+static int
+onStopsOther( void * vs )
+{
+    struct semantics * s = vs;
+    tr_timerStop( &s->stopped );
+    return FALSE;
+}
+
+static int
+onStopped( void * vs )
+{
+    struct semantics * s = vs;
+    ++s->stoppedCount;
+    return FALSE;
+}
+
+static int
+onAllocated( void * vs )
+{
+    struct semantics * s = vs;
+    ++s->allocatedCount;
+    tr_timerFree( &s->allocated );
+    return TRUE;
+}
+
+static void
+startSemantics( void * vs )
+{
+    struct semantics * s = vs;
+
+    tr_timerInit( &s->repeating, session, onRepeating, s );
+    tr_timerStart( &s->repeating, 20 );
+    tr_timerInit( &s->stopsItself, session, onStopsItself, s );
+    tr_timerStart( &s->stopsItself, 20 );
+    tr_timerInit( &s->restartsItself, session, onRestartsItself, s );
+    tr_timerStart( &s->restartsItself, 20 );
+
+    /* these two are due on the same tick */
+    tr_timerInit( &s->stopsOther, session, onStopsOther, s );
+    tr_timerStart( &s->stopsOther, 50 );
+    tr_timerInit( &s->stopped, session, onStopped, s );
+    tr_timerStart( &s->stopped, 50 );
+
+    s->allocated = tr_timerNew( session, onAllocated, s, 20 );
+}
+
+static void
+checkPending( void * vs )
+{
+    struct semantics * s = vs;
+
+    s->repeatCount = tr_timerIsPending( &s->repeating )
+                  || tr_timerIsPending( &s->stopsItself )
+                  || tr_timerIsPending( &s->restartsItself )
+                  || tr_timerIsPending( &s->stopsOther )
+                  || tr_timerIsPending( &s->stopped ) ? -1 : s->repeatCount;
+}
+
+static int
+testSemantics( void )
+{
+    struct semantics s;
+
+    memset( &s, 0, sizeof( s ) );
+    runInEventThread( startSemantics, &s );
+    tr_wait( 500 );
+    runInEventThread( checkPending, &s );
+
+    check( s.repeatCount == 5 );
+    check( s.stopsItselfCount == 1 );
+    check( s.restartsItselfCount == 2 );
+    check( s.stoppedCount == 0 );
+    check( s.allocatedCount == 1 );
+    check( s.allocated == NULL );
+    return 0;
+}
+
+/***
+****  Starting and stopping lots of timers
+***/
+
+static int
+neverCalled( void * unused UNUSED )
+{
+    return FALSE;
+}
+
+static void
+neverCalledEvent( int fd UNUSED, short event UNUSED, void * unused UNUSED )
+{
+}
+
+static tr_timer * timers = NULL;
+static struct event * events = NULL;
+static uint64_t * intervals = NULL;
+static uint64_t wheelUsec = 0;
+static uint64_t heapUsec = 0;
+
+/* the pattern peers and handshakes make: each timer is started,
+ * restarted a few times, and stopped */
+static void
+churn( void * unused UNUSED )
+{
+    int i, j;
+    uint64_t start;
+
+    start = usecNow( );
+    for( i=0; i<CHURN_COUNT; ++i )
+        tr_timerInit( &timers[i], session, neverCalled, NULL );
+    for( j=0; j<CHURN_ROUNDS; ++j )
+        for( i=0; i<CHURN_COUNT; ++i )
+            tr_timerStart( &timers[i], intervals[i] );
+    for( i=0; i<CHURN_COUNT; ++i )
+        tr_timerStop( &timers[i] );
+    wheelUsec = usecNow( ) - start;
+
+    /* the same with libevent's own timers, which is what tr_timer used to be */
+    start = usecNow( );
+    for( i=0; i<CHURN_COUNT; ++i )
+        evtimer_set( &events[i], neverCalledEvent, NULL );
+    for( j=0; j<CHURN_ROUNDS; ++j )
+        for( i=0; i<CHURN_COUNT; ++i ) {
+            struct timeval tv;
+            tr_timevalMsec( intervals[i], &tv );
+            evtimer_add( &events[i], &tv );
+        }
+    for( i=0; i<CHURN_COUNT; ++i )
+        evtimer_del( &events[i] );
+    heapUsec = usecNow( ) - start;
+}
+
+static int
+testChurn( void )
+{
+    int i;
+    tr_timer_stats stats;
+    const int ops = CHURN_COUNT * ( CHURN_ROUNDS + 1 );
+
+    timers = tr_new( tr_timer, CHURN_COUNT );
+    events = tr_new( struct event, CHURN_COUNT );
+    intervals = tr_new( uint64_t, CHURN_COUNT );
+    for( i=0; i<CHURN_COUNT; ++i )
+        intervals[i] = 1000 + tr_cryptoWeakRandInt( 120 * 1000 );
+
+    runInEventThread( churn, NULL );
+
+    fprintf( stderr, "%d timers started %d times and stopped: wheel %.1f nsec per call, libevent %.1f nsec\n",
+             CHURN_COUNT, CHURN_ROUNDS, wheelUsec * 1000.0 / ops, heapUsec * 1000.0 / ops );
+
+    tr_timerGetStats( session, &stats );
+    fprintf( stderr, "stats: %d pending, %"PRIu64" wakeups, %"PRIu64" fired, "
+                     "%"PRIu64" msec late in all, %"PRIu64" at most, %"PRIu64" usec in callbacks\n",
+             stats.pendingCount, stats.wakeups, stats.fired,
+             stats.lateMsec, stats.maxLateMsec, stats.callbackUsec );
+    check( stats.fired >= ACCURACY_COUNT );
+    check( stats.wakeups > 0 );
+
+    tr_free( intervals );
+    tr_free( events );
+    tr_free( timers );
+    return 0;
+}
+
+/***
+****  Commands from other threads
+***/
+
+static volatile int received = 0;
+static volatile int outOfOrder = 0;
+static int lastSeq[PRODUCER_COUNT];
+
+/* user_data is the producer's index and its count so far */
+static void
+onCommand( void * vcmd )
+{
+    const intptr_t cmd = (intptr_t) vcmd;
+    const int producer = cmd / COMMAND_COUNT;
+    const int seq = cmd % COMMAND_COUNT;
+
+    if( seq != lastSeq[producer] + 1 )
+        ++outOfOrder;
+    lastSeq[producer] = seq;
+    ++received;
+}
+
+static volatile int producersDone = 0;
+
+static void
+producerFunc( void * vproducer )
+{
+    int i;
+    const intptr_t producer = (intptr_t) vproducer;
+
+    for( i=0; i<COMMAND_COUNT; ++i )
+        tr_runInEventThread( session, onCommand, (void*)( producer * COMMAND_COUNT + i ) );
+
+    __sync_add_and_fetch( &producersDone, 1 );
+}
+
+static void
+resetCommands( void )
+{
+    int i;
+
+    for( i=0; i<PRODUCER_COUNT; ++i )
+        lastSeq[i] = -1;
+    received = 0;
+    outOfOrder = 0;
+}
+
+static int
+testProducers( void )
+{
+    intptr_t i;
+    uint64_t usec;
+    const int total = PRODUCER_COUNT * COMMAND_COUNT;
+    const uint64_t start = usecNow( );
+
+    resetCommands( );
+    for( i=0; i<PRODUCER_COUNT; ++i )
+        tr_threadNew( producerFunc, (void*) i );
+    while( received < total )
+        tr_wait( 1 );
+    usec = usecNow( ) - start;
+
+    fprintf( stderr, "%d threads queued %d commands each: %.1f nsec per command, %.0f commands per second\n",
+             PRODUCER_COUNT, COMMAND_COUNT, usec * 1000.0 / total, total * 1000000.0 / usec );
+    check( received == total );
+    check( outOfOrder == 0 );
+    while( producersDone < PRODUCER_COUNT )
+        tr_wait( 1 );
+    return 0;
+}
+
+/* hold up the event thread while a backlog builds */
+static volatile int blockerState = 0;
+
+static void
+blocker( void * unused UNUSED )
+{
+    blockerState = 1;
+    while( blockerState == 1 )
+        tr_wait( 1 );
+}
+
+static int
+testBacklog( void )
+{
+    int i;
+
+    resetCommands( );
+    tr_runInEventThread( session, blocker, NULL );
+    while( blockerState == 0 )
+        tr_wait( 1 );
+
+    /* the old pipe filled up here and the producer stalled for good */
+    for( i=0; i<BACKLOG_COUNT; ++i )
+        tr_runInEventThread( session, onCommand, (void*)(intptr_t) i );
+    check( received == 0 );
+
+    blockerState = 2;
+    while( received < BACKLOG_COUNT )
+        tr_wait( 1 );
+    check( outOfOrder == 0 );
+    check( lastSeq[0] == BACKLOG_COUNT - 1 );
+    return 0;
+}
+
+int
+main( void )
+{
+    int          i;
+    char         dir[] = "/tmp/transmission-trevent-test-XXXXXX";
+    tr_benc      settings;
+
+    if( mkdtemp( dir ) == NULL )
+        return 1;
+
+    tr_bencInitDict( &settings, 0 );
+    tr_sessionGetDefaultSettings( &settings );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PEER_PORT_RANDOM_ENABLED, 1 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_PORT_FORWARDING, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_RPC_ENABLED, 0 );
+    tr_bencDictAddInt( &settings, TR_PREFS_KEY_MSGLEVEL, 0 );
+    session = tr_sessionInit( "trevent-test", dir, FALSE, &settings );
+
+    if( !( i = testAccuracy( ) ) )
+        if( !( i = testSemantics( ) ) )
+            if( !( i = testChurn( ) ) )
+                if( !( i = testProducers( ) ) )
+                    i = testBacklog( );
+
+    tr_sessionClose( session );
+    tr_bencFree( &settings );
+    rmdir( dir );
+    return i;
+}
@@ -17,6 +17,18 @@
 #include <stdio.h>
 
 #include <signal.h>
+#include <sys/time.h> /* gettimeofday */
+#ifdef HAVE_SYS_EVENTFD_H
+ #include <sys/eventfd.h>
+#endif
+#ifdef HAVE_CLOCK_GETTIME
+ #include <time.h>
+ #ifdef CLOCK_MONOTONIC_COARSE
+  #define WHEEL_CLOCK CLOCK_MONOTONIC_COARSE /* cheaper, and fine for our ticks */
+ #else
+  #define WHEEL_CLOCK CLOCK_MONOTONIC
+ #endif
+#endif
 
 #include "transmission.h"
 #include "session.h"
@@ -119,6 +131,78 @@ piperead( int s, char *buf, int len )
 ****
 ***/
 
+/* the timing wheel.  Each level has WHEEL_SIZE slots; a slot on level 0
+ * holds the timers due on one tick, a slot on level 1 the ones due in a
+ * span of WHEEL_SIZE ticks, and so on.  When level 0 comes back around
+ * to its first slot, the next slot of level 1 is cascaded down into it */
+#define TICK_MSEC 10
+#define WHEEL_BITS 6
+#define WHEEL_SIZE ( 1 << WHEEL_BITS )
+#define WHEEL_MASK ( WHEEL_SIZE - 1 )
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_TICKS ( ( (uint64_t)1 << ( WHEEL_BITS * WHEEL_LEVELS ) ) - 1 )
+
+struct timer_wheel
+{
+    tr_bool             isTurning;
+    uint64_t            baseMsec;     /* getClockMsec() at tick zero */
+    uint64_t            clockResMsec; /* how far behind getClockMsec() can be */
+    uint64_t            now;          /* the last tick that was run */
+    uint64_t            armedTick;    /* when tickEvent is due, or zero */
+    uint64_t            occupied[WHEEL_LEVELS]; /* a bit per nonempty slot */
+    struct __tr_list    slots[WHEEL_LEVELS][WHEEL_SIZE];
+    tr_timer          * running;      /* cleared if the callback touches it */
+    tr_timer_stats      stats;
+    struct event        tickEvent;
+};
+
+/* commands from other threads for the event thread to run.
+ * Producers claim a cell in a bounded ring with a compare-and-swap and
+ * the event thread drains it, so neither side takes a lock.  Each cell's
+ * sequence number says whether it's free for the producer whose turn
+ * it is, or published for the consumer.  (This is Dmitry Vyukov's
+ * bounded MPMC queue, with only one consumer.)
+ *
+ * If the ring fills up, commands spill into a locked list until the
+ * event thread has caught up; while that list is in use, every new
+ * command goes there too so that each thread's commands keep their
+ * order. */
+#define QUEUE_SIZE 1024 /* must be a power of two */
+#define QUEUE_MASK ( QUEUE_SIZE - 1 )
+#define MAX_COMMANDS_PER_WAKEUP 128
+#define CACHE_LINE_SIZE 64
+
+struct tr_run_data
+{
+    volatile size_t  seq;
+    void          ( *func )( void * );
+    void           * user_data;
+};
+
+struct command_queue
+{
+    struct tr_run_data  cells[QUEUE_SIZE];
+
+    /* producers contend for the tail; keep it off the consumer's line */
+    char                pad0[CACHE_LINE_SIZE];
+    volatile size_t     tail;
+    char                pad1[CACHE_LINE_SIZE];
+    size_t              head;          /* only the event thread reads this */
+    char                pad2[CACHE_LINE_SIZE];
+
+    volatile int        isSignalled;   /* a wakeup is already on its way */
+    volatile int        isOverflowing; /* new commands go to `overflow' */
+    struct __tr_list    overflow;      /* guarded by the event handle's lock */
+    struct __tr_list    spilled;       /* taken from `overflow' by the event thread */
+};
+
+struct spilled_command
+{
+    struct __tr_list    head;
+    void             ( *func )( void * );
+    void              * user_data;
+};
+
 typedef struct tr_event_handle
 {
     uint8_t      die;
@@ -128,82 +212,186 @@ typedef struct tr_event_handle
     tr_thread *  thread;
     struct event_base * base;
     struct event pipeEvent;
+    struct timer_wheel wheel;
+    struct command_queue queue;
 }
 tr_event_handle;
 
-typedef int timer_func ( void* );
-
-struct tr_timer
-{
-    tr_bool                   inCallback;
-    timer_func *              func;
-    void *                    user_data;
-    struct tr_event_handle *  eh;
-    struct timeval            tv;
-    struct event              event;
-};
-
-struct tr_run_data
-{
-    void    ( *func )( void * );
-    void *  user_data;
-};
-
 #define dbgmsg( ... ) \
     do { \
         if( tr_deepLoggingIsActive( ) ) \
             tr_deepLog( __FILE__, __LINE__, "event", __VA_ARGS__ ); \
     } while( 0 )
 
+/***
+****  The command queue
+***/
+
+static void
+queueInit( struct command_queue * q )
+{
+    size_t i;
+
+    for( i=0; i<QUEUE_SIZE; ++i )
+        q->cells[i].seq = i;
+    q->tail = 0;
+    q->head = 0;
+    __tr_list_init( &q->overflow );
+    __tr_list_init( &q->spilled );
+}
+
+static void
+freeSpilled( struct command_queue * q )
+{
+    __tr_list_destroy( &q->overflow, tr_free );
+    __tr_list_destroy( &q->spilled, tr_free );
+}
+
+/* returns FALSE if the ring is full */
+static tr_bool
+queuePush( struct command_queue * q, void func( void* ), void * user_data )
+{
+    struct tr_run_data * cell;
+    size_t pos = q->tail;
+
+    for( ;; )
+    {
+        intptr_t diff;
+
+        cell = &q->cells[pos & QUEUE_MASK];
+        diff = (intptr_t)cell->seq - (intptr_t)pos;
+        __sync_synchronize( );
+
+        if( !diff ) {
+            if( __sync_bool_compare_and_swap( &q->tail, pos, pos + 1 ) )
+                break;
+            pos = q->tail;
+        }
+        else if( diff < 0 ) /* the consumer hasn't freed this cell yet */
+            return FALSE;
+        else /* another producer got here first */
+            pos = q->tail;
+    }
+
+    cell->func = func;
+    cell->user_data = user_data;
+    __sync_synchronize( );
+    cell->seq = pos + 1;
+    return TRUE;
+}
+
+/* returns FALSE if nothing's been published at the head yet */
+static tr_bool
+queuePop( struct command_queue * q, struct tr_run_data * setme )
+{
+    struct tr_run_data * cell = &q->cells[q->head & QUEUE_MASK];
+
+    if( cell->seq != q->head + 1 )
+        return FALSE;
+
+    __sync_synchronize( );
+    setme->func = cell->func;
+    setme->user_data = cell->user_data;
+    __sync_synchronize( );
+    cell->seq = q->head + QUEUE_SIZE;
+    ++q->head;
+    return TRUE;
+}
+
+/* wake the event thread, unless a wakeup's already pending */
+static void
+signalEventThread( tr_event_handle * eh )
+{
+    __sync_synchronize( );
+
+    if( __sync_bool_compare_and_swap( &eh->queue.isSignalled, 0, 1 ) )
+    {
+#ifdef HAVE_SYS_EVENTFD_H
+        const uint64_t one = 1;
+        write( eh->fds[1], &one, sizeof( one ) );
+#else
+        const char ch = 'r';
+        pipewrite( eh->fds[1], &ch, 1 );
+#endif
+    }
+}
+
 static void
 readFromPipe( int    fd,
               short  eventType,
               void * veh )
 {
-    char              ch;
-    int               ret;
-    tr_event_handle * eh = veh;
+    int                  n;
+    struct tr_run_data   data;
+    tr_event_handle    * eh = veh;
+    struct command_queue * q = &eh->queue;
 
     dbgmsg( "readFromPipe: eventType is %hd", eventType );
 
-    /* read the command type */
-    ch = '\0';
-    do
+    /* clear the wakeup before draining, so that anything
+     * queued after the drain starts gets a wakeup of its own */
     {
-        ret = piperead( fd, &ch, 1 );
+#ifdef HAVE_SYS_EVENTFD_H
+        uint64_t count;
+        read( fd, &count, sizeof( count ) );
+#else
+        char buf[64];
+        piperead( fd, buf, sizeof( buf ) );
+#endif
     }
-    while( !eh->die && ret < 0 && errno == EAGAIN );
+    q->isSignalled = 0;
+    __sync_synchronize( );
 
-    dbgmsg( "command is [%c], ret is %d, errno is %d", ch, ret, (int)errno );
+    if( eh->die )
+    {
+        dbgmsg( "closing... removing event listener" );
+        event_del( &eh->pipeEvent );
+        return;
+    }
 
-    switch( ch )
+    for( n=0; n<MAX_COMMANDS_PER_WAKEUP && !eh->die; )
     {
-        case 'r': /* run in libevent thread */
+        if( queuePop( q, &data ) )
         {
-            struct tr_run_data data;
-            const size_t       nwant = sizeof( data );
-            const ssize_t      ngot = piperead( fd, &data, nwant );
-            if( !eh->die && ( ngot == (ssize_t)nwant ) )
-            {
-                dbgmsg( "invoking function in libevent thread" );
-                ( data.func )( data.user_data );
-            }
-            break;
+            ( data.func )( data.user_data );
+            ++n;
         }
-
-        case '\0': /* eof */
+        else if( q->tail != q->head )
         {
-            dbgmsg( "pipe eof reached... removing event listener" );
-            event_del( &eh->pipeEvent );
+            /* a producer's still filling in the next cell.  It'll wake
+             * us when it's done; until then, nothing behind it can run */
             break;
         }
-
-        default:
+        else if( q->spilled.next != &q->spilled )
         {
-            assert( 0 && "unhandled command type!" );
-            break;
+            struct __tr_list * node = q->spilled.next;
+            struct spilled_command * cmd = __tr_list_entry( node, struct spilled_command, head );
+            __tr_list_remove( node );
+            ( cmd->func )( cmd->user_data );
+            tr_free( cmd );
+            ++n;
+        }
+        else if( q->isOverflowing )
+        {
+            /* take the whole overflow list, then look at the ring again:
+             * anything a thread pushed there came before what it spilled */
+            tr_lockLock( eh->lock );
+            if( q->overflow.next == &q->overflow )
+                q->isOverflowing = 0;
+            else {
+                __tr_list_insert( &q->spilled, q->overflow.prev, q->overflow.next );
+                __tr_list_init( &q->overflow );
+            }
+            tr_lockUnlock( eh->lock );
         }
+        else break;
     }
+
+    /* give the other events a turn, then come back for the rest */
+    if( n == MAX_COMMANDS_PER_WAKEUP )
+        signalEventThread( eh );
+
+    dbgmsg( "ran %d commands", n );
 }
 
 static void
@@ -215,9 +403,14 @@ logFunc( int severity, const char * message )
         tr_dbg( "%s", message );
 }
 
+static void onTick( int fd, short event, void * veh );
+static uint64_t getClockMsec( void );
+static uint64_t getClockResolutionMsec( void );
+
 static void
 libeventThreadFunc( void * veh )
 {
+    int i, j;
     tr_event_handle * eh = veh;
     tr_dbg( "Starting libevent thread" );
 
@@ -229,6 +422,14 @@ libeventThreadFunc( void * veh )
     eh->base = event_init( );
     eh->session->events = eh;
 
+    /* the timing wheel */
+    for( i=0; i<WHEEL_LEVELS; ++i )
+        for( j=0; j<WHEEL_SIZE; ++j )
+            __tr_list_init( &eh->wheel.slots[i][j] );
+    eh->wheel.baseMsec = getClockMsec( );
+    eh->wheel.clockResMsec = getClockResolutionMsec( );
+    evtimer_set( &eh->wheel.tickEvent, onTick, eh );
+
     /* listen to the pipe's read fd */
     event_set( &eh->pipeEvent, eh->fds[0], EV_READ | EV_PERSIST, readFromPipe, veh );
     event_add( &eh->pipeEvent, NULL );
@@ -238,6 +439,10 @@ libeventThreadFunc( void * veh )
     event_dispatch( );
 
     /* shut down the thread */
+    EVUTIL_CLOSESOCKET( eh->fds[0] );
+    if( eh->fds[1] != eh->fds[0] )
+        EVUTIL_CLOSESOCKET( eh->fds[1] );
+    freeSpilled( &eh->queue );
     tr_lockFree( eh->lock );
     event_base_free( eh->base );
     eh->session->events = NULL;
@@ -254,7 +459,13 @@ tr_eventInit( tr_session * session )
 
     eh = tr_new0( tr_event_handle, 1 );
     eh->lock = tr_lockNew( );
+#ifdef HAVE_SYS_EVENTFD_H
+    eh->fds[0] = eh->fds[1] = eventfd( 0, 0 );
+#else
     pipe( eh->fds );
+#endif
+    evutil_make_socket_nonblocking( eh->fds[0] );
+    queueInit( &eh->queue );
     eh->session = session;
     eh->thread = tr_threadNew( libeventThreadFunc, eh );
 
@@ -270,7 +481,7 @@ tr_eventClose( tr_session * session )
 
     session->events->die = TRUE;
     tr_deepLog( __FILE__, __LINE__, NULL, "closing trevent pipe" );
-    EVUTIL_CLOSESOCKET( session->events->fds[1] );
+    signalEventThread( session->events );
 }
 
 /**
@@ -290,22 +501,304 @@ tr_amInEventThread( tr_session * session )
 ***
 **/
 
+static uint64_t
+usecNow( void )
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+
+/* timers are started far more often than they fire, so they're
+ * timed with a clock that's cheaper to read than tr_date() */
+static uint64_t
+getClockMsec( void )
+{
+#ifdef WHEEL_CLOCK
+    struct timespec ts;
+    clock_gettime( WHEEL_CLOCK, &ts );
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    return tr_date( );
+#endif
+}
+
+static uint64_t
+getClockResolutionMsec( void )
+{
+#ifdef WHEEL_CLOCK
+    struct timespec ts;
+    clock_getres( WHEEL_CLOCK, &ts );
+    return (uint64_t)ts.tv_sec * 1000 + ( ts.tv_nsec + 999999 ) / 1000000;
+#else
+    return 0;
+#endif
+}
+
+/* if the clock's been set back, carry on from where we were */
+static uint64_t
+getWheelMsec( struct timer_wheel * w )
+{
+    const uint64_t msec = getClockMsec( );
+
+    if( msec < w->baseMsec + w->now * TICK_MSEC )
+        w->baseMsec = msec - w->now * TICK_MSEC;
+
+    return msec - w->baseMsec;
+}
+
+static uint64_t
+getCurrentTick( struct timer_wheel * w )
+{
+    return getWheelMsec( w ) / TICK_MSEC;
+}
+
+/* the first tick that's at least `msec' milliseconds from now,
+ * even if the clock's running a little behind.  the readings at
+ * either end of the wait are rounded down to the msec, so add one
+ * for each of them too */
+static uint64_t
+getTickAfter( struct timer_wheel * w, uint64_t msec )
+{
+    msec += w->clockResMsec + 2;
+    return ( getWheelMsec( w ) + msec + TICK_MSEC - 1 ) / TICK_MSEC;
+}
+
 static void
-timerCallback( int    fd UNUSED,
-               short  event UNUSED,
-               void * vtimer )
+armTick( tr_event_handle * eh, uint64_t tick )
 {
-    int               more;
-    struct tr_timer * timer = vtimer;
+    struct timer_wheel * w = &eh->wheel;
 
-    timer->inCallback = 1;
-    more = ( *timer->func )( timer->user_data );
-    timer->inCallback = 0;
+    if( w->isTurning )
+        return; /* onTick() arms it when it's done */
 
-    if( more )
-        evtimer_add( &timer->event, &timer->tv );
-    else
-        tr_timerFree( &timer );
+    if( !w->armedTick || ( tick < w->armedTick ) )
+    {
+        struct timeval tv;
+        const uint64_t now = getWheelMsec( w );
+        const uint64_t due = tick * TICK_MSEC;
+
+        w->armedTick = tick;
+        tr_timevalMsec( due > now ? due - now : 0, &tv );
+        evtimer_add( &w->tickEvent, &tv );
+    }
+}
+
+static void
+wheelAdd( struct timer_wheel * w, tr_timer * timer )
+{
+    int level;
+    uint64_t delta;
+
+    if( timer->expires <= w->now )
+        timer->expires = w->now + 1;
+    delta = timer->expires - w->now;
+    if( delta > WHEEL_MAX_TICKS ) {
+        timer->expires = w->now + WHEEL_MAX_TICKS;
+        delta = WHEEL_MAX_TICKS;
+    }
+
+    for( level=0; delta >= ( (uint64_t)1 << ( WHEEL_BITS * ( level + 1 ) ) ); )
+        ++level;
+
+    timer->level = level;
+    timer->slot = ( timer->expires >> ( WHEEL_BITS * level ) ) & WHEEL_MASK;
+    __tr_list_append( &w->slots[level][timer->slot], &timer->head );
+    w->occupied[level] |= (uint64_t)1 << timer->slot;
+}
+
+static void
+wheelRemove( struct timer_wheel * w, tr_timer * timer )
+{
+    struct __tr_list * slot = &w->slots[timer->level][timer->slot];
+
+    __tr_list_remove( &timer->head );
+    if( slot->next == slot )
+        w->occupied[timer->level] &= ~( (uint64_t)1 << timer->slot );
+}
+
+/* move the timers in one of a level's slots down to the lower levels */
+static void
+cascade( struct timer_wheel * w, int level, int slot )
+{
+    struct __tr_list * head = &w->slots[level][slot];
+
+    while( head->next != head )
+    {
+        tr_timer * timer = __tr_list_entry( head->next, tr_timer, head );
+        wheelRemove( w, timer );
+        wheelAdd( w, timer );
+    }
+}
+
+static void
+runTimers( tr_event_handle * eh, struct __tr_list * batch )
+{
+    struct timer_wheel * w = &eh->wheel;
+
+    /* a callback can stop any of the timers left in the batch,
+     * so take them off one at a time */
+    while( batch->next != batch )
+    {
+        int more;
+        uint64_t start;
+        tr_timer * timer = __tr_list_entry( batch->next, tr_timer, head );
+        const uint64_t dueMsec = timer->expires * TICK_MSEC;
+        const uint64_t now = getWheelMsec( w );
+        const uint64_t late = now > dueMsec ? now - dueMsec : 0;
+
+        __tr_list_remove( &timer->head );
+        w->stats.pendingCount--;
+        w->stats.fired++;
+        w->stats.lateMsec += late;
+        w->stats.maxLateMsec = MAX( w->stats.maxLateMsec, late );
+
+        w->running = timer;
+        start = usecNow( );
+        more = ( *timer->func )( timer->user_data );
+        w->stats.callbackUsec += usecNow( ) - start;
+
+        /* if the callback stopped, restarted, or freed its timer, leave it be */
+        if( w->running == timer )
+        {
+            w->running = NULL;
+
+            if( more )
+            {
+                timer->expires = getTickAfter( w, timer->intervalMsec );
+                wheelAdd( w, timer );
+                w->stats.pendingCount++;
+            }
+            else if( timer->isAllocated )
+            {
+                tr_free( timer );
+            }
+        }
+    }
+}
+
+/* the next tick that might have work to do */
+static uint64_t
+getNextTick( const struct timer_wheel * w )
+{
+    const int index = w->now & WHEEL_MASK;
+    const uint64_t later = index == WHEEL_MASK ? 0 : w->occupied[0] & ( ~(uint64_t)0 << ( index + 1 ) );
+    int i;
+
+    if( !later ) /* nothing before level 0 wraps around and cascades */
+        return ( w->now | WHEEL_MASK ) + 1;
+
+    for( i=index+1; !( later & ( (uint64_t)1 << i ) ); )
+        ++i;
+    return ( w->now & ~(uint64_t)WHEEL_MASK ) + i;
+}
+
+static void
+onTick( int fd UNUSED, short event UNUSED, void * veh )
+{
+    tr_event_handle * eh = veh;
+    struct timer_wheel * w = &eh->wheel;
+    const uint64_t target = getCurrentTick( w );
+
+    w->armedTick = 0;
+    w->isTurning = TRUE;
+    w->stats.wakeups++;
+
+    while( ( w->now < target ) && w->stats.pendingCount )
+    {
+        int level;
+        int index;
+        struct __tr_list batch;
+
+        index = ++w->now & WHEEL_MASK;
+        for( level=1; !index && level<WHEEL_LEVELS; ++level ) {
+            index = ( w->now >> ( WHEEL_BITS * level ) ) & WHEEL_MASK;
+            cascade( w, level, index );
+        }
+
+        /* take the whole slot so that timers restarted by their
+         * callbacks wait for the wheel to come back around */
+        index = w->now & WHEEL_MASK;
+        if( w->occupied[0] & ( (uint64_t)1 << index ) )
+        {
+            struct __tr_list * slot = &w->slots[0][index];
+            __tr_list_insert( &batch, slot->prev, slot->next );
+            __tr_list_init( slot );
+            w->occupied[0] &= ~( (uint64_t)1 << index );
+            runTimers( eh, &batch );
+        }
+    }
+
+    if( w->now < target )
+        w->now = target;
+
+    w->isTurning = FALSE;
+
+    if( w->stats.pendingCount )
+        armTick( eh, getNextTick( w ) );
+}
+
+void
+tr_timerInit( tr_timer       * timer,
+              tr_session     * session,
+              tr_timer_func    func,
+              void           * user_data )
+{
+    memset( timer, 0, sizeof( tr_timer ) );
+    timer->func = func;
+    timer->user_data = user_data;
+    timer->eh = session->events;
+}
+
+tr_bool
+tr_timerIsPending( const tr_timer * timer )
+{
+    return timer->head.next != NULL;
+}
+
+void
+tr_timerStop( tr_timer * timer )
+{
+    struct timer_wheel * w = &timer->eh->wheel;
+
+    if( w->running == timer )
+        w->running = NULL;
+
+    if( tr_timerIsPending( timer ) )
+    {
+        assert( tr_amInEventThread( timer->eh->session ) );
+        wheelRemove( w, timer );
+        w->stats.pendingCount--;
+
+        /* don't keep the event loop alive for an empty wheel */
+        if( !w->stats.pendingCount && w->armedTick && !w->isTurning ) {
+            evtimer_del( &w->tickEvent );
+            w->armedTick = 0;
+        }
+    }
+}
+
+void
+tr_timerStart( tr_timer * timer,
+               uint64_t   interval_milliseconds )
+{
+    tr_event_handle * eh = timer->eh;
+    struct timer_wheel * w = &eh->wheel;
+
+    assert( tr_amInEventThread( eh->session ) );
+
+    tr_timerStop( timer );
+
+    /* an empty wheel can skip ahead instead of turning through idle ticks */
+    if( !w->stats.pendingCount && !w->isTurning )
+        w->now = getCurrentTick( w );
+
+    timer->intervalMsec = interval_milliseconds;
+    timer->expires = getTickAfter( w, interval_milliseconds );
+    wheelAdd( w, timer );
+    w->stats.pendingCount++;
+
+    armTick( eh, timer->expires );
 }
 
 void
@@ -318,37 +811,40 @@ tr_timerFree( tr_timer ** ptimer )
     timer = *ptimer;
     *ptimer = NULL;
 
-    /* destroy the timer directly or via the command queue */
-    if( timer && !timer->inCallback )
+    if( timer )
     {
-        assert( tr_amInEventThread( timer->eh->session ) );
-        event_del( &timer->event );
+        assert( timer->isAllocated );
+        tr_timerStop( timer );
         tr_free( timer );
     }
 }
 
 tr_timer*
-tr_timerNew( tr_session  * session,
-             timer_func    func,
-             void        * user_data,
-             uint64_t      interval_milliseconds )
+tr_timerNew( tr_session    * session,
+             tr_timer_func   func,
+             void          * user_data,
+             uint64_t        interval_milliseconds )
 {
     tr_timer * timer;
 
     assert( tr_amInEventThread( session ) );
 
-    timer = tr_new0( tr_timer, 1 );
-    timer->func = func;
-    timer->user_data = user_data;
-    timer->eh = session->events;
-
-    tr_timevalMsec( interval_milliseconds, &timer->tv );
-    evtimer_set( &timer->event, timerCallback, timer );
-    evtimer_add( &timer->event,  &timer->tv );
+    timer = tr_new( tr_timer, 1 );
+    tr_timerInit( timer, session, func, user_data );
+    timer->isAllocated = TRUE;
+    tr_timerStart( timer, interval_milliseconds );
 
     return timer;
 }
 
+void
+tr_timerGetStats( tr_session * session, tr_timer_stats * setme )
+{
+    assert( tr_isSession( session ) );
+
+    *setme = session->events->wheel.stats;
+}
+
 void
 tr_runInEventThread( tr_session * session,
                      void func( void* ), void * user_data )
@@ -362,17 +858,22 @@ tr_runInEventThread( tr_session * session,
     }
     else
     {
-        const char         ch = 'r';
-        int                fd = session->events->fds[1];
-        tr_lock *          lock = session->events->lock;
-        struct tr_run_data data;
-
-        tr_lockLock( lock );
-        pipewrite( fd, &ch, 1 );
-        data.func = func;
-        data.user_data = user_data;
-        pipewrite( fd, &data, sizeof( data ) );
-        tr_lockUnlock( lock );
+        tr_event_handle * eh = session->events;
+        struct command_queue * q = &eh->queue;
+
+        if( q->isOverflowing || !queuePush( q, func, user_data ) )
+        {
+            struct spilled_command * cmd = tr_new( struct spilled_command, 1 );
+            cmd->func = func;
+            cmd->user_data = user_data;
+
+            tr_lockLock( eh->lock );
+            __tr_list_append( &q->overflow, &cmd->head );
+            q->isOverflowing = 1;
+            tr_lockUnlock( eh->lock );
+        }
+
+        signalEventThread( eh );
     }
 }
 
@@ -20,6 +20,8 @@
 #include <stddef.h> /* size_t */
 #include <inttypes.h> /* uint64_t */
 
+#include "list.h" /* struct __tr_list */
+
 /**
 **/
 
@@ -30,15 +32,68 @@ void      tr_eventClose( tr_session * );
 struct event_base * tr_eventGetBase( tr_session * );
 
 
+/***
+****  Timers
+***/
+
+/**
+ * Timers are kept on a timing wheel that the event thread turns, so
+ * starting and stopping one only moves a list node.  Objects that need
+ * a timer of their own can embed a tr_timer and set it up with
+ * tr_timerInit(), so that it never allocates; tr_timerNew() is for
+ * everyone else.  Timers may only be used from the event thread.
+ */
+
 typedef struct tr_timer  tr_timer;
 
+typedef int tr_timer_func( void * user_data );
+
+struct tr_timer
+{
+    /* these are private to trevent.c */
+    struct __tr_list          head;      /* in a wheel slot, if pending */
+    uint64_t                  expires;   /* in ticks */
+    uint32_t                  intervalMsec;
+    uint8_t                   level;
+    uint8_t                   slot;
+    tr_bool                   isAllocated;
+    tr_timer_func           * func;
+    void                    * user_data;
+    struct tr_event_handle  * eh;
+};
+
+/**
+ * Sets up an embedded timer.  It doesn't run until tr_timerStart().
+ */
+void      tr_timerInit( tr_timer       * timer,
+                        tr_session     * session,
+                        tr_timer_func    func,
+                        void           * user_data );
+
+/**
+ * Calls func(user_data) after the specified interval, and again after
+ * each interval for as long as func returns nonzero.  If the timer
+ * was already pending, it's rescheduled.
+ */
+void      tr_timerStart( tr_timer * timer,
+                         uint64_t   interval_milliseconds );
+
+/**
+ * Keeps a pending timer from firing.  It's safe to call this on a timer
+ * that isn't pending, or from the timer's own callback.
+ * An embedded timer must be stopped before the struct holding it is freed.
+ */
+void      tr_timerStop( tr_timer * timer );
+
+tr_bool   tr_timerIsPending( const tr_timer * timer );
+
 /**
  * Calls timer_func(user_data) after the specified interval.
  * The timer is freed if timer_func returns zero.
  * Otherwise, it's called again after the same interval.
  */
 tr_timer* tr_timerNew( tr_session * handle,
-                       int func( void * user_data ),
+                       tr_timer_func func,
                        void * user_data,
                        uint64_t timeout_milliseconds );
 
@@ -47,6 +102,19 @@ tr_timer* tr_timerNew( tr_session * handle,
  */
 void      tr_timerFree( tr_timer ** timer );
 
+typedef struct tr_timer_stats
+{
+    int         pendingCount;   /* timers waiting to fire */
+    uint64_t    wakeups;        /* how many times the wheel has been turned */
+    uint64_t    fired;          /* how many callbacks have been made */
+    uint64_t    lateMsec;       /* the sum of how late each callback was */
+    uint64_t    maxLateMsec;    /* the latest any callback has been */
+    uint64_t    callbackUsec;   /* time spent in the callbacks */
+}
+tr_timer_stats;
+
+void      tr_timerGetStats( tr_session * session, tr_timer_stats * setme );
+
 
 tr_bool   tr_amInEventThread( tr_session * );
 
@@ -1,5 +1,6 @@
 #include <stdio.h> /* fprintf */
 #include <string.h> /* strcmp */
+#include <sys/time.h> /* gettimeofday */
 #include "transmission.h"
 #include "ConvertUTF.h" /* tr_utf8_validate*/
 #include "platform.h"
@@ -8,14 +9,20 @@
 
 #undef VERBOSE
 #define NUM_LOOPS 1
+#define BENCH_ROUNDS 10
 #define SPEED_TEST 0
 
 #if SPEED_TEST
  #define VERBOSE
  #undef NUM_LOOPS
  #define NUM_LOOPS 200
+ #undef BENCH_ROUNDS
+ #define BENCH_ROUNDS 2000
 #endif
 
+/* a big torrent's worth of pieces */
+#define BENCH_BITS 262144
+
 static int test = 0;
 
 #ifdef VERBOSE
@@ -98,6 +105,148 @@ test_bitfields( void )
     return 0;
 }
 
+/* fill the whole bitfield with noise, even the bits past bitCount */
+static void
+randomizeBitfield( tr_bitfield * b, int oneIn )
+{
+    size_t i;
+    for( i=0; i<b->byteCount; ++i ) {
+        int bit;
+        b->bits[i] = 0;
+        for( bit=0; bit<8; ++bit )
+            if( !tr_cryptoWeakRandInt( oneIn ) )
+                b->bits[i] |= 0x80 >> bit;
+    }
+}
+
+static int
+test_bitfield_ops( void )
+{
+    int k;
+    const size_t sizes[] = { 1, 7, 8, 9, 63, 64, 65, 127, 1000, 100003 };
+
+    for( k=0; k<(int)( sizeof( sizes ) / sizeof( sizes[0] ) ); ++k )
+    {
+        size_t i, n;
+        size_t count = 0;
+        size_t countAndNot = 0;
+        const size_t bitCount = sizes[k];
+        tr_bitfield * a = tr_bitfieldNew( bitCount );
+        tr_bitfield * b = tr_bitfieldNew( bitCount );
+        tr_bitfield * c;
+
+        check( tr_bitfieldIsEmpty( a ) );
+        check( !tr_bitfieldFindAndNot( a, b, 0, &i ) );
+        tr_bitfieldAdd( a, bitCount - 1 );
+        check( !tr_bitfieldIsEmpty( a ) );
+        check( tr_bitfieldFindAndNot( a, b, 0, &i ) );
+        check( i == bitCount - 1 );
+
+        /* `b' is denser, so some stretches of `a and not b' are empty */
+        randomizeBitfield( a, 2 );
+        randomizeBitfield( b, 1 + k % 3 );
+
+        for( i=0; i<bitCount; ++i ) {
+            if( tr_bitfieldHas( a, i ) )
+                ++count;
+            if( tr_bitfieldHas( a, i ) && !tr_bitfieldHas( b, i ) )
+                ++countAndNot;
+        }
+        check( tr_bitfieldCountTrueBits( a ) == count );
+        check( tr_bitfieldCountAndNot( a, b ) == countAndNot );
+
+        /* walking with tr_bitfieldFindAndNot() finds them all, in order */
+        n = 0;
+        for( i=0; tr_bitfieldFindAndNot( a, b, i, &i ); ++i ) {
+            check( tr_bitfieldHas( a, i ) );
+            check( !tr_bitfieldHas( b, i ) );
+            ++n;
+        }
+        check( n == countAndNot );
+        check( !tr_bitfieldFindAndNot( a, b, bitCount, &i ) );
+
+        c = tr_bitfieldDup( a );
+        tr_bitfieldDifference( c, b );
+        for( i=0; i<bitCount; ++i )
+            check( tr_bitfieldHas( c, i ) == ( tr_bitfieldHas( a, i ) && !tr_bitfieldHas( b, i ) ) );
+        tr_bitfieldOr( c, b );
+        for( i=0; i<bitCount; ++i )
+            check( tr_bitfieldHas( c, i ) == ( tr_bitfieldHas( a, i ) || tr_bitfieldHas( b, i ) ) );
+
+        tr_bitfieldFree( c );
+        tr_bitfieldFree( b );
+        tr_bitfieldFree( a );
+    }
+
+    return 0;
+}
+
+#ifdef VERBOSE
+static uint64_t
+usecNow( void )
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+#endif
+
+/* how long it takes to see if a peer has something we don't:
+ * the old way, with a temporary bitfield, and the fused way */
+static int
+test_bitfield_speed( void )
+{
+    int i;
+    size_t n;
+    size_t dupCount = 0;
+    size_t fusedCount = 0;
+    tr_bitfield * have = tr_bitfieldNew( BENCH_BITS );
+    tr_bitfield * peer = tr_bitfieldNew( BENCH_BITS );
+#ifdef VERBOSE
+    uint64_t start;
+#endif
+
+    /* we're nearly done, and the peer's a seed */
+    randomizeBitfield( have, 1 );
+    tr_bitfieldRem( have, BENCH_BITS - 1 );
+    tr_bitfieldAddRange( peer, 0, BENCH_BITS );
+
+#ifdef VERBOSE
+    start = usecNow( );
+#endif
+    for( i=0; i<BENCH_ROUNDS; ++i ) {
+        tr_bitfield * tmp = tr_bitfieldDup( peer );
+        tr_bitfieldDifference( tmp, have );
+        dupCount += tr_bitfieldCountTrueBits( tmp );
+        tr_bitfieldFree( tmp );
+    }
+#ifdef VERBOSE
+    fprintf( stderr, "dup, difference, and count over %d bits: %.1f usec\n",
+             BENCH_BITS, (double)( usecNow( ) - start ) / BENCH_ROUNDS );
+    start = usecNow( );
+#endif
+    for( i=0; i<BENCH_ROUNDS; ++i )
+        fusedCount += tr_bitfieldCountAndNot( peer, have );
+#ifdef VERBOSE
+    fprintf( stderr, "tr_bitfieldCountAndNot() over %d bits: %.1f usec\n",
+             BENCH_BITS, (double)( usecNow( ) - start ) / BENCH_ROUNDS );
+    start = usecNow( );
+#endif
+    for( i=0; i<BENCH_ROUNDS; ++i )
+        check( tr_bitfieldFindAndNot( peer, have, 0, &n ) && ( n == BENCH_BITS - 1 ) );
+#ifdef VERBOSE
+    fprintf( stderr, "tr_bitfieldFindAndNot() over %d bits: %.1f usec\n",
+             BENCH_BITS, (double)( usecNow( ) - start ) / BENCH_ROUNDS );
+#endif
+
+    check( dupCount == (size_t)BENCH_ROUNDS );
+    check( fusedCount == dupCount );
+
+    tr_bitfieldFree( peer );
+    tr_bitfieldFree( have );
+    return 0;
+}
+
 static int
 test_strstrip( void )
 {
@@ -267,6 +416,11 @@ main( void )
         if( ( i = test_bitfields( ) ) )
             return i;
 
+    if( ( i = test_bitfield_ops( ) ) )
+        return i;
+    if( ( i = test_bitfield_speed( ) ) )
+        return i;
+
     return 0;
 }
 
@@ -26,6 +26,12 @@
 
 #include "event.h"
 
+#if defined( __GNUC__ ) && ( ( __GNUC__ >= 5 ) || defined( __clang__ ) ) \
+    && ( defined( __x86_64__ ) || defined( __i386__ ) )
+ #define HAVE_X86_POPCOUNT_DISPATCH 1
+ #include <immintrin.h>
+#endif
+
 #ifdef WIN32
  #include <direct.h> /* _getcwd */
  #include <windows.h> /* Sleep */
@@ -740,6 +746,170 @@ tr_strstrip( char * str )
 *****
 ****/
 
+/* the bulk of a bitfield is handled a word at a time.
+ * the bits past bitCount are left to the byte-at-a-time tail,
+ * where they're masked off -- peers can send junk there */
+
+#define WORD_BYTES sizeof( uint64_t )
+
+static TR_INLINE uint64_t
+loadWord( const uint8_t * bytes )
+{
+    uint64_t word;
+    memcpy( &word, bytes, WORD_BYTES );
+    return word;
+}
+
+static TR_INLINE void
+storeWord( uint8_t * bytes, uint64_t word )
+{
+    memcpy( bytes, &word, WORD_BYTES );
+}
+
+/* how many whole words come before the last byte */
+static TR_INLINE size_t
+getWordCount( const tr_bitfield * b )
+{
+    return b->byteCount ? ( b->byteCount - 1 ) / WORD_BYTES : 0;
+}
+
+/* the bits of byte `i' that are inside the bitfield */
+static TR_INLINE uint8_t
+getByteMask( const tr_bitfield * b, size_t i )
+{
+    const size_t bitsLeft = b->bitCount - i * 8;
+    return bitsLeft >= 8 ? 0xff : (uint8_t)( 0xff << ( 8 - bitsLeft ) );
+}
+
+/* x86 builds without -mpopcnt turn __builtin_popcountll() into a call
+ * to libgcc, so they count the slow way here and let countWords() pick
+ * a faster loop at runtime.  elsewhere the builtin is inlined: on
+ * ARMv8 it becomes NEON's cnt */
+static TR_INLINE int
+popcount( uint64_t x )
+{
+#if defined( __GNUC__ ) && ( defined( __POPCNT__ ) || !defined( HAVE_X86_POPCOUNT_DISPATCH ) )
+    return __builtin_popcountll( x );
+#else
+    x = x - ( ( x >> 1 ) & 0x5555555555555555ull );
+    x = ( x & 0x3333333333333333ull ) + ( ( x >> 2 ) & 0x3333333333333333ull );
+    x = ( x + ( x >> 4 ) ) & 0x0f0f0f0f0f0f0f0full;
+    return (int)( ( x * 0x0101010101010101ull ) >> 56 );
+#endif
+}
+
+/* the number of bits set in the first `wordCount' words of `a',
+ * leaving out the ones set in `b' if it's not NULL */
+static size_t
+countWordsGeneric( const uint8_t * a, const uint8_t * b, size_t wordCount )
+{
+    size_t i;
+    size_t ret = 0;
+
+    if( b == NULL )
+        for( i = 0; i < wordCount; ++i )
+            ret += popcount( loadWord( a + i * WORD_BYTES ) );
+    else
+        for( i = 0; i < wordCount; ++i )
+            ret += popcount( loadWord( a + i * WORD_BYTES ) & ~loadWord( b + i * WORD_BYTES ) );
+
+    return ret;
+}
+
+#ifdef HAVE_X86_POPCOUNT_DISPATCH
+
+__attribute__(( target( "popcnt" ) )) static size_t
+countWordsPOPCNT( const uint8_t * a, const uint8_t * b, size_t wordCount )
+{
+    size_t i;
+    size_t ret = 0;
+
+    if( b == NULL )
+        for( i = 0; i < wordCount; ++i )
+            ret += __builtin_popcountll( loadWord( a + i * WORD_BYTES ) );
+    else
+        for( i = 0; i < wordCount; ++i )
+            ret += __builtin_popcountll( loadWord( a + i * WORD_BYTES ) & ~loadWord( b + i * WORD_BYTES ) );
+
+    return ret;
+}
+
+/* 32 bytes at a time: look up each nibble's count with a shuffle,
+ * then sum the bytes into four 64-bit counters */
+__attribute__(( target( "avx2,popcnt" ) )) static size_t
+countWordsAVX2( const uint8_t * a, const uint8_t * b, size_t wordCount )
+{
+    size_t i;
+    size_t ret;
+    uint64_t sums[4];
+    const __m256i nibbleCounts = _mm256_setr_epi8( 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                   0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 );
+    const __m256i lowNibbles = _mm256_set1_epi8( 0x0f );
+    __m256i total = _mm256_setzero_si256( );
+
+    for( i = 0; i + 4 <= wordCount; i += 4 )
+    {
+        __m256i v = _mm256_loadu_si256( (const __m256i*)( a + i * WORD_BYTES ) );
+        __m256i counts;
+
+        if( b != NULL )
+            v = _mm256_andnot_si256( _mm256_loadu_si256( (const __m256i*)( b + i * WORD_BYTES ) ), v );
+
+        counts = _mm256_add_epi8(
+            _mm256_shuffle_epi8( nibbleCounts, _mm256_and_si256( v, lowNibbles ) ),
+            _mm256_shuffle_epi8( nibbleCounts, _mm256_and_si256( _mm256_srli_epi16( v, 4 ), lowNibbles ) ) );
+        total = _mm256_add_epi64( total, _mm256_sad_epu8( counts, _mm256_setzero_si256( ) ) );
+    }
+
+    _mm256_storeu_si256( (__m256i*)sums, total );
+    ret = sums[0] + sums[1] + sums[2] + sums[3];
+
+    if( i < wordCount )
+        ret += countWordsPOPCNT( a + i * WORD_BYTES,
+                                 b ? b + i * WORD_BYTES : NULL,
+                                 wordCount - i );
+
+    return ret;
+}
+
+#endif
+
+static size_t
+countWordsFirst( const uint8_t * a, const uint8_t * b, size_t wordCount );
+
+/* picked the first time it's called.  threads can race to set it,
+ * but they'll all pick the same one */
+static size_t ( * countWords )( const uint8_t * a,
+                                const uint8_t * b,
+                                size_t          wordCount ) = countWordsFirst;
+
+static size_t
+countWordsFirst( const uint8_t * a, const uint8_t * b, size_t wordCount )
+{
+#ifdef HAVE_X86_POPCOUNT_DISPATCH
+    __builtin_cpu_init( );
+    if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "popcnt" ) )
+        countWords = countWordsAVX2;
+    else if( __builtin_cpu_supports( "popcnt" ) )
+        countWords = countWordsPOPCNT;
+    else
+#endif
+        countWords = countWordsGeneric;
+
+    return countWords( a, b, wordCount );
+}
+
+/* the index of the first set bit, counting from the high bit */
+static TR_INLINE int
+firstBit( uint8_t byte )
+{
+    int i = 0;
+    assert( byte );
+    while( !( byte & ( 0x80 >> i ) ) )
+        ++i;
+    return i;
+}
+
 tr_bitfield*
 tr_bitfieldConstruct( tr_bitfield * b, size_t bitCount )
 {
@@ -778,8 +948,13 @@ int
 tr_bitfieldIsEmpty( const tr_bitfield * bitfield )
 {
     size_t i;
+    const size_t wordCount = getWordCount( bitfield );
+
+    for( i = 0; i < wordCount; ++i )
+        if( loadWord( bitfield->bits + i * WORD_BYTES ) )
+            return 0;
 
-    for( i = 0; i < bitfield->byteCount; ++i )
+    for( i *= WORD_BYTES; i < bitfield->byteCount; ++i )
         if( bitfield->bits[i] )
             return 0;
 
@@ -886,14 +1061,18 @@ tr_bitfield*
 tr_bitfieldOr( tr_bitfield *       a,
                const tr_bitfield * b )
 {
-    uint8_t *      ait;
-    const uint8_t *aend, *bit;
+    size_t i;
+    const size_t wordCount = getWordCount( a );
 
     assert( a->bitCount == b->bitCount );
 
-    for( ait = a->bits, bit = b->bits, aend = ait + a->byteCount;
-         ait != aend; )
-        *ait++ |= *bit++;
+    for( i = 0; i < wordCount; ++i ) {
+        const size_t o = i * WORD_BYTES;
+        storeWord( a->bits + o, loadWord( a->bits + o ) | loadWord( b->bits + o ) );
+    }
+
+    for( i *= WORD_BYTES; i < a->byteCount; ++i )
+        a->bits[i] |= b->bits[i];
 
     return a;
 }
@@ -903,65 +1082,104 @@ void
 tr_bitfieldDifference( tr_bitfield *       a,
                        const tr_bitfield * b )
 {
-    uint8_t *      ait;
-    const uint8_t *aend, *bit;
+    size_t i;
+    const size_t wordCount = getWordCount( a );
 
     assert( a->bitCount == b->bitCount );
 
-    for( ait = a->bits, bit = b->bits, aend = ait + a->byteCount;
-         ait != aend; )
-        *ait++ &= ~( *bit++ );
+    for( i = 0; i < wordCount; ++i ) {
+        const size_t o = i * WORD_BYTES;
+        storeWord( a->bits + o, loadWord( a->bits + o ) & ~loadWord( b->bits + o ) );
+    }
+
+    for( i *= WORD_BYTES; i < a->byteCount; ++i )
+        a->bits[i] &= ~b->bits[i];
 }
 
 size_t
 tr_bitfieldCountTrueBits( const tr_bitfield* b )
 {
-    size_t           ret = 0;
-    const uint8_t *  it, *end;
-    static const int trueBitCount[512] = {
-        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 1, 2, 2, 3, 2, 3, 3,
-        4, 2, 3, 3, 4, 3, 4, 4, 5,
-        1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 2, 3, 3, 4, 3, 4, 4,
-        5, 3, 4, 4, 5, 4, 5, 5, 6,
-        1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 2, 3, 3, 4, 3, 4, 4,
-        5, 3, 4, 4, 5, 4, 5, 5, 6,
-        2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5,
-        6, 4, 5, 5, 6, 5, 6, 6, 7,
-        1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 2, 3, 3, 4, 3, 4, 4,
-        5, 3, 4, 4, 5, 4, 5, 5, 6,
-        2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5,
-        6, 4, 5, 5, 6, 5, 6, 6, 7,
-        2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5,
-        6, 4, 5, 5, 6, 5, 6, 6, 7,
-        3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 4, 5, 5, 6, 5, 6, 6,
-        7, 5, 6, 6, 7, 6, 7, 7, 8,
-        1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 2, 3, 3, 4, 3, 4, 4,
-        5, 3, 4, 4, 5, 4, 5, 5, 6,
-        2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5,
-        6, 4, 5, 5, 6, 5, 6, 6, 7,
-        2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5,
-        6, 4, 5, 5, 6, 5, 6, 6, 7,
-        3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 4, 5, 5, 6, 5, 6, 6,
-        7, 5, 6, 6, 7, 6, 7, 7, 8,
-        2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5,
-        6, 4, 5, 5, 6, 5, 6, 6, 7,
-        3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 4, 5, 5, 6, 5, 6, 6,
-        7, 5, 6, 6, 7, 6, 7, 7, 8,
-        3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 4, 5, 5, 6, 5, 6, 6,
-        7, 5, 6, 6, 7, 6, 7, 7, 8,
-        4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8, 5, 6, 6, 7, 6, 7, 7,
-        8, 6, 7, 7, 8, 7, 8, 8, 9
-    };
+    size_t i;
+    size_t ret;
+    size_t wordCount;
 
     if( !b )
         return 0;
 
-    for( it = b->bits, end = it + b->byteCount; it != end; ++it )
-        ret += trueBitCount[*it];
+    wordCount = getWordCount( b );
+    ret = countWords( b->bits, NULL, wordCount );
+
+    for( i = wordCount * WORD_BYTES; i < b->byteCount; ++i )
+        ret += popcount( b->bits[i] & getByteMask( b, i ) );
+
+    return ret;
+}
+
+size_t
+tr_bitfieldCountAndNot( const tr_bitfield * a,
+                        const tr_bitfield * b )
+{
+    size_t i;
+    size_t ret;
+    const size_t wordCount = getWordCount( a );
+
+    assert( a->bitCount == b->bitCount );
+
+    ret = countWords( a->bits, b->bits, wordCount );
+
+    for( i = wordCount * WORD_BYTES; i < a->byteCount; ++i )
+        ret += popcount( a->bits[i] & ~b->bits[i] & getByteMask( a, i ) );
 
     return ret;
 }
 
+tr_bool
+tr_bitfieldFindAndNot( const tr_bitfield * a,
+                       const tr_bitfield * b,
+                       size_t              begin,
+                       size_t            * setme )
+{
+    size_t i;
+    size_t byte = begin >> 3u;
+    const size_t wordCount = getWordCount( a );
+
+    assert( a->bitCount == b->bitCount );
+
+    if( begin >= a->bitCount )
+        return FALSE;
+
+    /* finish the byte that `begin' is in */
+    {
+        const uint8_t val = a->bits[byte] & ~b->bits[byte]
+                          & getByteMask( a, byte )
+                          & ( 0xff >> ( begin & 7u ) );
+        if( val ) {
+            *setme = byte * 8 + firstBit( val );
+            return TRUE;
+        }
+    }
+
+    /* then the bytes up to the next word, the words, and the last bytes */
+    for( i = byte + 1; ( i % WORD_BYTES ) && ( i < a->byteCount ); ++i )
+        if( a->bits[i] & ~b->bits[i] & getByteMask( a, i ) )
+            break;
+
+    if( !( i % WORD_BYTES ) )
+        for( ; ( i < wordCount * WORD_BYTES )
+            && !( loadWord( a->bits + i ) & ~loadWord( b->bits + i ) ); )
+            i += WORD_BYTES;
+
+    for( ; i < a->byteCount; ++i ) {
+        const uint8_t val = a->bits[i] & ~b->bits[i] & getByteMask( a, i );
+        if( val ) {
+            *setme = i * 8 + firstBit( val );
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
 /***
 ****
 ***/
@@ -426,6 +426,16 @@ size_t       tr_bitfieldCountTrueBits( const tr_bitfield* );
 
 tr_bitfield* tr_bitfieldOr( tr_bitfield*, const tr_bitfield* );
 
+/** @return the number of bits that are set in `a' but not in `b' */
+size_t       tr_bitfieldCountAndNot( const tr_bitfield * a, const tr_bitfield * b );
+
+/** @brief finds the first bit at or after `begin' that's set in `a' but not in `b'
+    @return false if there isn't one */
+tr_bool      tr_bitfieldFindAndNot( const tr_bitfield * a,
+                                    const tr_bitfield * b,
+                                    size_t              begin,
+                                    size_t            * setme );
+
 /** A stripped-down version of bitfieldHas to be used
     for speed when you're looping quickly.  This version
     has none of tr_bitfieldHas()'s safety checks, so you
@@ -10,27 +10,65 @@
  * $Id$
  */
 
-#include <unistd.h> /* S_ISREG */
+#include <string.h> /* memcmp */
 #include <sys/stat.h>
 
 #include "transmission.h"
 #include "completion.h"
+#include "crypto.h" /* tr_sha1 */
 #include "resume.h" /* tr_torrentSaveResume() */
 #include "inout.h"
 #include "list.h"
 #include "platform.h"
+#include "rpcimpl.h" /* tr_rpc_publish_event() */
+#include "session.h"
 #include "torrent.h"
 #include "utils.h" /* tr_buildPath */
 #include "verify.h"
 
 /**
-***
+*** Verification runs as a pipeline.  Each torrent being verified gets
+*** a reader thread that reads its pieces into memory, hinting to the
+*** OS about the pieces coming up next, while a shared pool of hashing
+*** threads checks the pieces that have already been read.  Several
+*** torrents can be verified at once, as long as the memory they have
+*** read but not yet hashed fits in the session's verify budget.
 **/
 
+enum
+{
+    /* how far ahead of the hashing threads a torrent's reader can get */
+    MAX_READ_AHEAD_BYTES = ( 8 * 1024 * 1024 ),
+
+    /* how many pieces past the current one to ask the OS to prefetch */
+    PREFETCH_PIECES = 4,
+
+    /* upper bound on the hashing pool's size */
+    MAX_HASH_THREADS = 16
+};
+
 struct verify_node
 {
     tr_torrent *         torrent;
     tr_verify_done_cb    verify_done_cb;
+
+    /* these are only used once the torrent's reader is started,
+       and only while holding the verify lock */
+    tr_bool              stop;
+    tr_bool              changed;
+    int                  piecesInFlight;
+    size_t               bytesInFlight;
+    size_t               maxBytesInFlight;
+};
+
+/* a piece that's been read and is waiting to be hashed */
+struct verify_job
+{
+    struct verify_node * node;
+    tr_piece_index_t     piece;
+    uint8_t *            buf;
+    size_t               buflen;
+    struct __tr_list     head;
 };
 
 static void
@@ -42,10 +80,13 @@ fireCheckDone( tr_torrent * tor, tr_verify_done_cb verify_done_cb )
         verify_done_cb( tor );
 }
 
-static struct verify_node currentNode;
-static tr_list * verifyList = NULL;
-static tr_thread * verifyThread = NULL;
-static int stopCurrent = FALSE;
+static tr_list * verifyList = NULL;   /* torrents waiting to be verified */
+static tr_list * activeList = NULL;   /* torrents being verified */
+static size_t activeBytes = 0;        /* sum of activeList's maxBytesInFlight */
+static struct __tr_list jobQueue;     /* pieces waiting to be hashed */
+static int hashThreadCount = 0;
+static tr_cond * jobQueued = NULL;    /* signalled when jobQueue or activeList changes */
+static tr_cond * jobDone = NULL;      /* signalled when a node's counts drop or it's stopped */
 
 static tr_lock*
 getVerifyLock( void )
@@ -53,114 +94,271 @@ getVerifyLock( void )
     static tr_lock * lock = NULL;
 
     if( lock == NULL )
+    {
         lock = tr_lockNew( );
+        jobQueued = tr_condNew( );
+        jobDone = tr_condNew( );
+        __tr_list_init( &jobQueue );
+    }
     return lock;
 }
 
 static int
-checkFile( tr_torrent      * tor,
-           void            * buffer,
-           size_t            buflen,
-           tr_file_index_t   fileIndex,
-           int             * abortFlag )
-{
-    tr_piece_index_t i;
-    int              changed = FALSE;
-    int              nofile;
-    struct stat      sb;
-    char           * path;
-    const tr_file  * file = &tor->info.files[fileIndex];
-
-    path = tr_buildPath( tor->downloadDir, file->name, NULL );
-    nofile = stat( path, &sb ) || !S_ISREG( sb.st_mode );
-
-    for( i = file->firstPiece;
-         i <= file->lastPiece && i < tor->info.pieceCount && ( !*abortFlag );
-         ++i )
+getHashThreadLimit( void )
+{
+    return MIN( tr_getProcessorCount( ), MAX_HASH_THREADS );
+}
+
+/**
+***
+**/
+
+/* the verify lock must be held */
+static void
+setPieceIsGood( struct verify_node * node,
+                tr_piece_index_t     piece,
+                tr_bool              isGood )
+{
+    tr_torrent * tor = node->torrent;
+    const tr_bool wasComplete = tr_cpPieceIsComplete( &tor->completion, piece );
+
+    if( isGood )
     {
-        if( nofile )
+        tr_torrentSetHasPiece( tor, piece, TRUE );
+        if( !wasComplete )
+            node->changed = TRUE;
+    }
+    else if( wasComplete )
+    {
+        /* if we were wrong about it being complete,
+         * reset and start again.  if we were right about
+         * it being incomplete, do nothing -- we don't
+         * want to lose blocks in those incomplete pieces */
+        tr_torrentSetHasPiece( tor, piece, FALSE );
+        node->changed = TRUE;
+    }
+
+    tr_torrentSetPieceChecked( tor, piece, TRUE );
+}
+
+static void
+hashJob( struct verify_job * job )
+{
+    tr_bool stop;
+    tr_bool isGood = FALSE;
+    struct verify_node * node = job->node;
+
+    tr_lockLock( getVerifyLock( ) );
+    stop = node->stop;
+    tr_lockUnlock( getVerifyLock( ) );
+
+    if( !stop )
+    {
+        uint8_t hash[SHA_DIGEST_LENGTH];
+        tr_sha1( hash, job->buf, (int)job->buflen, NULL );
+        isGood = !memcmp( hash, node->torrent->info.pieces[job->piece].hash, SHA_DIGEST_LENGTH );
+    }
+
+    tr_lockLock( getVerifyLock( ) );
+    if( !node->stop )
+        setPieceIsGood( node, job->piece, isGood );
+    node->piecesInFlight--;
+    node->bytesInFlight -= job->buflen;
+    /* each torrent's reader waits on its own node */
+    tr_condBroadcast( jobDone );
+    tr_lockUnlock( getVerifyLock( ) );
+
+    tr_free( job->buf );
+    tr_free( job );
+}
+
+static void
+hashThreadFunc( void * unused UNUSED )
+{
+    for( ;; )
+    {
+        struct verify_job * job = NULL;
+
+        tr_lockLock( getVerifyLock( ) );
+        while( ( jobQueue.next == &jobQueue ) && ( activeList != NULL ) )
+            tr_condWait( jobQueued, getVerifyLock( ) );
+        if( jobQueue.next != &jobQueue )
         {
-            tr_torrentSetHasPiece( tor, i, 0 );
+            job = __tr_list_entry( jobQueue.next, struct verify_job, head );
+            __tr_list_remove( &job->head );
         }
-        else if( !tr_torrentIsPieceChecked( tor, i ) )
+        else
         {
-            const int wasComplete = tr_cpPieceIsComplete( &tor->completion, i );
-
-            if( tr_ioTestPiece( tor, i, buffer, buflen ) ) /* yay */
-            {
-                tr_torrentSetHasPiece( tor, i, TRUE );
-                if( !wasComplete )
-                    changed = TRUE;
-            }
-            else
-            {
-                /* if we were wrong about it being complete,
-                 * reset and start again.  if we were right about
-                 * it being incomplete, do nothing -- we don't
-                 * want to lose blocks in those incomplete pieces */
-
-                if( wasComplete )
-                {
-                    tr_torrentSetHasPiece( tor, i, FALSE );
-                    changed = TRUE;
-                }
-            }
+            --hashThreadCount;
+            tr_lockUnlock( getVerifyLock( ) );
+            break;
         }
+        tr_lockUnlock( getVerifyLock( ) );
 
-        tr_torrentSetPieceChecked( tor, i, TRUE );
+        hashJob( job );
     }
+}
 
-    tr_free( path );
+/* pieces that touch a missing file can't be complete.
+ * this also refreshes inout.c's idea of which files exist */
+static tr_bitfield*
+getMissingPieces( const tr_torrent * tor )
+{
+    tr_file_index_t i;
+    tr_bitfield * missing = tr_bitfieldNew( tor->info.pieceCount );
+
+    for( i=0; i<tor->info.fileCount; ++i )
+    {
+        struct stat     sb;
+        tr_file       * file = &tor->info.files[i];
+        char          * path = tr_buildPath( tor->downloadDir, file->name, NULL );
+
+        file->exists = !stat( path, &sb ) && S_ISREG( sb.st_mode );
+        if( !file->exists )
+            tr_bitfieldAddRange( missing, file->firstPiece, file->lastPiece + 1 );
+
+        tr_free( path );
+    }
 
-    return changed;
+    return missing;
 }
 
+static void startReaders( void );
+
 static void
-verifyThreadFunc( void * unused UNUSED )
+readerThreadFunc( void * vnode )
 {
-    for( ;; )
+    tr_piece_index_t     i;
+    tr_piece_index_t     prefetched = 0;
+    tr_bool              stop = FALSE;
+    struct verify_node * node = vnode;
+    tr_torrent         * tor = node->torrent;
+    tr_bitfield        * missing;
+
+    assert( tr_isTorrent( tor ) );
+
+    tr_torinf( tor, _( "Verifying torrent" ) );
+    missing = getMissingPieces( tor );
+
+    for( i=0; i<tor->info.pieceCount; ++i )
     {
-        int                  changed = 0;
-        tr_file_index_t      i;
-        tr_torrent         * tor;
-        struct verify_node * node;
-        void               * buffer;
+        int err;
+        uint8_t * buf;
+        struct verify_job * job;
+        const size_t len = tr_torPieceCountBytes( tor, i );
 
-        tr_lockLock( getVerifyLock( ) );
-        stopCurrent = FALSE;
-        node = (struct verify_node*) verifyList ? verifyList->data : NULL;
-        if( node == NULL )
+        if( tr_bitfieldHas( missing, i ) )
         {
-            currentNode.torrent = NULL;
+            tr_lockLock( getVerifyLock( ) );
+            tr_torrentSetHasPiece( tor, i, FALSE );
+            tr_torrentSetPieceChecked( tor, i, TRUE );
+            tr_lockUnlock( getVerifyLock( ) );
+            continue;
+        }
+
+        if( tr_torrentIsPieceChecked( tor, i ) )
+            continue;
+
+        /* ask the OS to start reading the next few pieces */
+        for( ; prefetched<tor->info.pieceCount && prefetched<=i+PREFETCH_PIECES; ++prefetched )
+            if( !tr_bitfieldHas( missing, prefetched ) && !tr_torrentIsPieceChecked( tor, prefetched ) )
+                tr_ioPrefetch( tor, prefetched, 0, tr_torPieceCountBytes( tor, prefetched ) );
+
+        /* wait for the hashing threads to catch up */
+        tr_lockLock( getVerifyLock( ) );
+        while( !node->stop && node->piecesInFlight
+               && ( node->bytesInFlight + len > node->maxBytesInFlight ) )
+            tr_condWait( jobDone, getVerifyLock( ) );
+        stop = node->stop;
+        tr_lockUnlock( getVerifyLock( ) );
+        if( stop )
             break;
+
+        buf = tr_new( uint8_t, len );
+        if(( err = tr_ioRead( tor, i, 0, len, buf )))
+        {
+            tr_lockLock( getVerifyLock( ) );
+            setPieceIsGood( node, i, FALSE );
+            tr_lockUnlock( getVerifyLock( ) );
+            tr_free( buf );
+            continue;
         }
 
-        currentNode = *node;
-        tor = currentNode.torrent;
-        tr_list_remove_data( &verifyList, node );
-        tr_free( node );
+        job = tr_new0( struct verify_job, 1 );
+        job->node = node;
+        job->piece = i;
+        job->buf = buf;
+        job->buflen = len;
+
+        tr_lockLock( getVerifyLock( ) );
+        node->piecesInFlight++;
+        node->bytesInFlight += len;
+        __tr_list_append( &jobQueue, &job->head );
+        tr_condSignal( jobQueued );
         tr_lockUnlock( getVerifyLock( ) );
+    }
+
+    tr_bitfieldFree( missing );
+
+    /* wait for the hashing threads to finish our pieces */
+    tr_lockLock( getVerifyLock( ) );
+    while( node->piecesInFlight )
+        tr_condWait( jobDone, getVerifyLock( ) );
+    stop = node->stop;
+    tr_lockUnlock( getVerifyLock( ) );
+
+    tor->verifyState = TR_VERIFY_NONE;
+    assert( tr_isTorrent( tor ) );
+
+    if( !stop )
+    {
+        if( node->changed )
+            tr_torrentSaveResume( tor );
+        tr_rpc_publish_event( tor->session, "verify-finished", tor, NULL );
+        fireCheckDone( tor, node->verify_done_cb );
+    }
+
+    tr_lockLock( getVerifyLock( ) );
+    tr_list_remove_data( &activeList, node );
+    activeBytes -= node->maxBytesInFlight;
+    tr_free( node );
+    startReaders( );
+    /* wake tr_verifyRemove(), and let idle hashing threads exit
+       if that was the last torrent */
+    tr_condBroadcast( jobDone );
+    tr_condBroadcast( jobQueued );
+    tr_lockUnlock( getVerifyLock( ) );
+}
 
-        tr_torinf( tor, _( "Verifying torrent" ) );
-        assert( tr_isTorrent( tor ) );
+/* start verifying queued torrents while they fit in the budget.
+ * the verify lock must be held. */
+static void
+startReaders( void )
+{
+    while( verifyList != NULL )
+    {
+        struct verify_node * node = verifyList->data;
+        tr_torrent * tor = node->torrent;
+        const size_t budget = (size_t)MAX( 1, tor->session->verifyBudgetMB ) * 1024 * 1024;
+        const size_t window = MAX( tor->info.pieceSize, MIN( budget, (size_t)MAX_READ_AHEAD_BYTES ) );
+
+        if( ( activeList != NULL ) && ( activeBytes + window > budget ) )
+            break;
+
+        tr_list_pop_front( &verifyList );
+        node->maxBytesInFlight = window;
+        activeBytes += window;
+        tr_list_append( &activeList, node );
         tor->verifyState = TR_VERIFY_NOW;
-        buffer = tr_new( uint8_t, tor->info.pieceSize );
-        for( i = 0; i < tor->info.fileCount && !stopCurrent; ++i )
-            changed |= checkFile( tor, buffer, tor->info.pieceSize, i, &stopCurrent );
-        tr_free( buffer );
-        tor->verifyState = TR_VERIFY_NONE;
-        assert( tr_isTorrent( tor ) );
+        tr_rpc_publish_event( tor->session, "verify-started", tor, NULL );
+        tr_threadNew( readerThreadFunc, node );
 
-        if( !stopCurrent )
+        while( hashThreadCount < getHashThreadLimit( ) )
         {
-            if( changed )
-                tr_torrentSaveResume( tor );
-            fireCheckDone( tor, currentNode.verify_done_cb );
+            ++hashThreadCount;
+            tr_threadNew( hashThreadFunc, NULL );
         }
     }
-
-    verifyThread = NULL;
-    tr_lockUnlock( getVerifyLock( ) );
 }
 
 void
@@ -182,15 +380,14 @@ tr_verifyAdd( tr_torrent *      tor,
 
         tr_torinf( tor, _( "Queued for verification" ) );
 
-        node = tr_new( struct verify_node, 1 );
+        node = tr_new0( struct verify_node, 1 );
         node->torrent = tor;
         node->verify_done_cb = verify_done_cb;
 
         tr_lockLock( getVerifyLock( ) );
-        tor->verifyState = verifyList ? TR_VERIFY_WAIT : TR_VERIFY_NOW;
+        tor->verifyState = TR_VERIFY_WAIT;
         tr_list_append( &verifyList, node );
-        if( verifyThread == NULL )
-            verifyThread = tr_threadNew( verifyThreadFunc, NULL );
+        startReaders( );
         tr_lockUnlock( getVerifyLock( ) );
     }
 }
@@ -214,7 +411,7 @@ tr_verifyInProgress( const tr_torrent * tor )
 
     assert( tr_isTorrent( tor ) );
 
-    found = ( tor == currentNode.torrent )
+    found = ( tr_list_find( activeList, tor, compareVerifyByTorrent ) != NULL )
          || ( tr_list_find( verifyList, tor, compareVerifyByTorrent ) != NULL );
 
     tr_lockUnlock( lock );
@@ -224,20 +421,19 @@ tr_verifyInProgress( const tr_torrent * tor )
 void
 tr_verifyRemove( tr_torrent * tor )
 {
+    tr_list * l;
     tr_lock * lock = getVerifyLock( );
     tr_lockLock( lock );
 
     assert( tr_isTorrent( tor ) );
 
-    if( tor == currentNode.torrent )
+    if(( l = tr_list_find( activeList, tor, compareVerifyByTorrent )))
     {
-        stopCurrent = TRUE;
-        while( stopCurrent )
-        {
-            tr_lockUnlock( lock );
-            tr_wait( 100 );
-            tr_lockLock( lock );
-        }
+        struct verify_node * node = l->data;
+        node->stop = TRUE;
+        tr_condBroadcast( jobDone );
+        while( tr_list_find( activeList, tor, compareVerifyByTorrent ) )
+            tr_condWait( jobDone, lock );
     }
     else
     {
@@ -247,4 +443,3 @@ tr_verifyRemove( tr_torrent * tor )
 
     tr_lockUnlock( lock );
 }
-
@@ -448,11 +448,12 @@ multi_timer_cb( CURLM *multi UNUSED, long timer_ms, void * vg )
 {
     tr_web * g = vg;
 
-    if( timer_ms < 1 ) {
-        if( timer_ms == 0 ) /* call it immediately */
-            timer_cb( 0, 0, g );
+    /* newer libcurls refuse to be called back into from here,
+     * so "immediately" has to mean "on the next pass of the event loop" */
+    if( timer_ms == 0 )
+        timer_ms = 1;
+    else if( timer_ms < 0 )
         timer_ms = DEFAULT_TIMER_MSEC;
-    }
 
     g->timer_ms = timer_ms;
     restart_timer( g );
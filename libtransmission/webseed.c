@@ -16,7 +16,9 @@
 #include <event.h>
 
 #include "transmission.h"
+#include "cache.h"
 #include "inout.h"
+#include "session.h"
 #include "list.h"
 #include "ratecontrol.h"
 #include "torrent.h"
@@ -175,7 +177,7 @@ webResponseFunc( tr_session    * session,
         if( EVBUFFER_LENGTH( w->content ) < w->byteCount )
             requestNextChunk( w );
         else {
-            tr_ioWrite( tor, w->pieceIndex, w->pieceOffset, w->byteCount, EVBUFFER_DATA(w->content) );
+            tr_cacheWriteBlock( w->session->cache, tor, w->pieceIndex, w->pieceOffset, w->byteCount, EVBUFFER_DATA(w->content) );
             evbuffer_drain( w->content, EVBUFFER_LENGTH( w->content ) );
             w->busy = 0;
             if( w->dead )
@@ -251,6 +253,19 @@ tr_webseedIsActive( const tr_webseed * w )
     return w->busy != 0;
 }
 
+tr_bool
+tr_webseedIsRequested( const tr_webseed * w,
+                       uint32_t           index,
+                       uint32_t           offset,
+                       uint32_t           length )
+{
+    return w->busy
+        && !w->dead
+        && ( w->pieceIndex == index )
+        && ( w->pieceOffset == offset )
+        && ( w->byteCount == length );
+}
+
 int
 tr_webseedGetSpeed( const tr_webseed * w, uint64_t now, float * setme_KiBs )
 {
@@ -42,5 +42,11 @@ int         tr_webseedGetSpeed( const tr_webseed * w,
 /** @return true if a request is being processed, or false if idle */
 int         tr_webseedIsActive( const tr_webseed * w );
 
+/** @return true if this block is the one being downloaded */
+tr_bool     tr_webseedIsRequested( const tr_webseed * w,
+                                   uint32_t           index,
+                                   uint32_t           offset,
+                                   uint32_t           length );
+
 
 #endif
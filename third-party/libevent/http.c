@@ -2544,6 +2544,14 @@ evhttp_associate_new_request_with_connection(struct evhttp_connection *evcon)
 	req->remote_port = evcon->port;
 
 	evhttp_start_read(evcon);
+
+	/*
+	 * a client pipelining its requests may have sent this one along
+	 * with the last, so it could already be waiting in the buffer
+	 * instead of on the socket.
+	 */
+	if (EVBUFFER_LENGTH(evcon->input_buffer))
+		evhttp_read_firstline(evcon, req);
 	
 	return (0);
 }